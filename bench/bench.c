@@ -0,0 +1,437 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#define _GNU_SOURCE
+#include "../src/build.h"
+#include "../src/hashmap.h"
+#include "../src/html.h"
+#include "../src/interpreter.h"
+#include "../src/lipsum.h"
+#include "../src/module.h"
+#include "../src/parser.h"
+#include "../src/reader.h"
+#include "../src/value.h"
+
+#include <alloca.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Each benchmark is repeated until it has run for at least this long
+#define MIN_BENCHMARK_TIME 200000000
+
+typedef void (* BenchmarkFunc)(void *context);
+
+typedef struct {
+  const char *source;
+  Path *file_name;
+} SourceContext;
+
+typedef struct {
+  Module *module;
+  ModuleMap *modules;
+  SymbolMap *symbol_map;
+} ModuleContext;
+
+typedef struct {
+  size_t size;
+  char *keys;
+} HashMapContext;
+
+typedef struct {
+  Env *env;
+  Value value;
+  Value func;
+} ValueContext;
+
+static FILE *results;
+static int result_count = 0;
+
+static const char *script =
+  "fib = n => do\n"
+  "  if n < 2\n"
+  "    return n\n"
+  "  end if\n"
+  "  return fib(n - 1) + fib(n - 2)\n"
+  "end do\n"
+  "items = []\n"
+  "for x in [1, 2, 3, 4, 5, 6, 7, 8, 9, 10]\n"
+  "  for y in [1, 2, 3, 4, 5, 6, 7, 8, 9, 10]\n"
+  "    items = items | push({name: \"item{x}-{y}\", value: x * y % 13})\n"
+  "  end for\n"
+  "end for\n"
+  "sorted = items | sort_by(.value) | map(item => item.name) | filter(name => length(name) > 7)\n"
+  "\"{fib(15)} {length(sorted)}\"\n";
+
+static int64_t get_time(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void write_result(const char *name, int64_t iterations, int64_t elapsed, size_t allocated) {
+  fprintf(results, "%s\n    {\"name\": \"%s\", \"iterations\": %" PRId64 ", \"ns_per_op\": %.1f, "
+      "\"allocated_per_op\": %.1f}", result_count ? "," : "", name, iterations, (double) elapsed / iterations,
+      (double) allocated / iterations);
+  result_count++;
+  fprintf(stderr, "  %-28s %12.1f ns/op %12.1f B/op %10" PRId64 " iterations\n", name,
+      (double) elapsed / iterations, (double) allocated / iterations, iterations);
+}
+
+static void run_benchmark(const char *name, BenchmarkFunc func, void *context) {
+  // Warm-up
+  func(context);
+  int64_t iterations = 1;
+  while (1) {
+    size_t allocated = get_arena_stats().allocated;
+    int64_t start = get_time();
+    for (int64_t i = 0; i < iterations; i++) {
+      func(context);
+    }
+    int64_t elapsed = get_time() - start;
+    if (elapsed >= MIN_BENCHMARK_TIME || iterations >= (INT64_C(1) << 40)) {
+      write_result(name, iterations, elapsed, get_arena_stats().allocated - allocated);
+      return;
+    }
+    iterations *= elapsed > 0 && MIN_BENCHMARK_TIME / elapsed < 10 ? 2 : 10;
+  }
+}
+
+static Reader *open_source(SourceContext *context, SymbolMap *symbol_map, FILE **file) {
+  *file = fmemopen((void *) context->source, strlen(context->source), "r");
+  if (!*file) {
+    fprintf(stderr, ERROR_LABEL "fmemopen failed: %s" SGR_RESET "\n", strerror(errno));
+    exit(1);
+  }
+  return open_reader(*file, context->file_name, symbol_map);
+}
+
+static void benchmark_reader(void *p) {
+  SourceContext *context = p;
+  SymbolMap *symbol_map = create_symbol_map();
+  FILE *file;
+  Reader *reader = open_source(context, symbol_map, &file);
+  TokenStream tokens = read_all(reader, 0);
+  while (pop_token(tokens)->type != T_EOF) {
+  }
+  close_reader(reader);
+  fclose(file);
+  delete_symbol_map(symbol_map);
+}
+
+static void benchmark_parser(void *p) {
+  SourceContext *context = p;
+  SymbolMap *symbol_map = create_symbol_map();
+  FILE *file;
+  Reader *reader = open_source(context, symbol_map, &file);
+  Module *module = parse(read_all(reader, 0), context->file_name);
+  close_reader(reader);
+  fclose(file);
+  delete_module(module);
+  delete_symbol_map(symbol_map);
+}
+
+static void benchmark_interpreter(void *p) {
+  ModuleContext *context = p;
+  Env *env = create_user_env(context->module, context->modules, context->symbol_map);
+  eval_module(context->module, env);
+  delete_arena(env->arena);
+}
+
+static Hash key_hash(const void *p) {
+  const char *key = *(const char **) p;
+  return hash_bytes(key, strlen(key), INIT_HASH);
+}
+
+static int key_equals(const void *a, const void *b) {
+  return strcmp(*(const char **) a, *(const char **) b) == 0;
+}
+
+static void benchmark_hash_map(void *p) {
+  HashMapContext *context = p;
+  GenericHashMap map;
+  init_generic_hash_map(&map, sizeof(char *), 0, key_hash, key_equals, NULL);
+  for (size_t i = 0; i < context->size; i++) {
+    char *key = context->keys + i * 16;
+    generic_hash_map_add(&map, &key);
+  }
+  for (size_t i = 0; i < context->size; i++) {
+    char *key = context->keys + i * 16;
+    char *result;
+    if (!generic_hash_map_get(&map, &key, &result)) {
+      fprintf(stderr, ERROR_LABEL "key not found: %s" SGR_RESET "\n", key);
+      exit(1);
+    }
+  }
+  delete_generic_hash_map(&map);
+}
+
+#ifdef WITH_GUMBO
+static void benchmark_html_parse(void *p) {
+  ValueContext *context = p;
+  Arena *arena = context->env->arena;
+  context->env->arena = create_arena();
+  html_parse(context->value.string_value, context->env);
+  delete_arena(context->env->arena);
+  context->env->arena = arena;
+}
+#endif
+
+static void benchmark_html_to_string(void *p) {
+  ValueContext *context = p;
+  Arena *arena = context->env->arena;
+  context->env->arena = create_arena();
+  Tuple *args = alloca(sizeof(Tuple) + sizeof(Value));
+  args->size = 1;
+  args->values[0] = context->value;
+  Value output;
+  apply(context->func, args, &output, context->env);
+  delete_arena(context->env->arena);
+  context->env->arena = arena;
+}
+
+static void benchmark_copy_value(void *p) {
+  ValueContext *context = p;
+  Arena *arena = context->env->arena;
+  context->env->arena = create_arena();
+  copy_value(context->value, context->env);
+  delete_arena(context->env->arena);
+  context->env->arena = arena;
+}
+
+static char *create_script_source(int copies) {
+  Buffer buffer = create_buffer(0);
+  for (int i = 0; i < copies; i++) {
+    buffer_printf(&buffer, "%s", script);
+  }
+  buffer_put(&buffer, '\0');
+  return (char *) buffer.data;
+}
+
+static Value create_document(int sections, Env *env) {
+  Value root = html_create_element("div", 0, env);
+  for (int i = 0; i < sections; i++) {
+    Value section = html_create_element("section", 0, env);
+    html_set_attribute(section, "class", copy_c_string("section", env->arena).string_value, env);
+    Value heading = html_create_element("h2", 0, env);
+    html_append_child(heading, copy_c_string("Lorem ipsum dolor sit amet", env->arena), env->arena);
+    html_append_child(section, heading, env->arena);
+    for (int j = 0; j < 5; j++) {
+      Value paragraph = html_create_element("p", 0, env);
+      html_append_child(paragraph, copy_c_string("Consectetur adipiscing elit, sed do eiusmod tempor "
+            "incididunt ut labore & dolore magna aliqua.", env->arena), env->arena);
+      Value link = html_create_element("a", 0, env);
+      html_set_attribute(link, "href", copy_c_string("../posts/post1/index.html", env->arena).string_value, env);
+      html_append_child(link, copy_c_string("Read more", env->arena), env->arena);
+      html_append_child(paragraph, link, env->arena);
+      html_append_child(section, paragraph, env->arena);
+    }
+    html_append_child(root, section, env->arena);
+  }
+  return root;
+}
+
+static void run_microbenchmarks(void) {
+  fprintf(stderr, INFO_LABEL "microbenchmarks" SGR_RESET "\n");
+  SourceContext source = {create_script_source(50), create_path("bench.plet", -1)};
+  run_benchmark("reader", benchmark_reader, &source);
+  run_benchmark("parser", benchmark_parser, &source);
+  free((char *) source.source);
+
+  ModuleContext module_context;
+  module_context.symbol_map = create_symbol_map();
+  module_context.modules = create_module_map();
+  add_system_modules(module_context.modules);
+  source.source = script;
+  FILE *file;
+  Reader *reader = open_source(&source, module_context.symbol_map, &file);
+  module_context.module = parse(read_all(reader, 0), source.file_name);
+  close_reader(reader);
+  fclose(file);
+  add_module(module_context.module, module_context.modules);
+  run_benchmark("interpreter_bytecode", benchmark_interpreter, &module_context);
+  set_bytecode_enabled(0);
+  run_benchmark("interpreter_ast", benchmark_interpreter, &module_context);
+  set_bytecode_enabled(1);
+
+  HashMapContext hash_map_context = {10000, allocate(10000 * 16)};
+  for (size_t i = 0; i < hash_map_context.size; i++) {
+    snprintf(hash_map_context.keys + i * 16, 16, "key%zd", i);
+  }
+  run_benchmark("hash_map_add_get_10k", benchmark_hash_map, &hash_map_context);
+  free(hash_map_context.keys);
+
+  Env *env = create_env(create_arena(), module_context.modules, module_context.symbol_map);
+  import_html(env);
+  ValueContext value_context = {env, create_document(100, env), nil_value};
+  env_get_symbol("html", &value_context.func, env);
+  run_benchmark("html_to_string", benchmark_html_to_string, &value_context);
+#ifdef WITH_GUMBO
+  Tuple *args = alloca(sizeof(Tuple) + sizeof(Value));
+  args->size = 1;
+  args->values[0] = value_context.value;
+  apply(value_context.func, args, &value_context.value, env);
+  run_benchmark("html_parse", benchmark_html_parse, &value_context);
+#endif
+  value_context.value = create_document(100, env);
+  run_benchmark("copy_value", benchmark_copy_value, &value_context);
+
+  delete_arena(env->arena);
+  delete_module_map(module_context.modules);
+  delete_symbol_map(module_context.symbol_map);
+  delete_path(source.file_name);
+}
+
+static void run_site_benchmark(const char *name, Path *site_dir, int cold, int jobs) {
+  char *cwd = getcwd(NULL, 0);
+  if (!cwd || chdir(site_dir->path) != 0) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", site_dir->path, strerror(errno));
+    exit(1);
+  }
+  if (cold) {
+    Path *dist = create_path("dist", -1);
+    if (is_dir(dist->path)) {
+      delete_dir(dist);
+    }
+    delete_path(dist);
+  }
+  GlobalArgs args = {0};
+  args.program_name = "plet";
+  args.command_name = "build";
+  args.jobs = jobs;
+  size_t allocated = get_arena_stats().allocated;
+  int64_t start = get_time();
+  build(args);
+  int64_t elapsed = get_time() - start;
+  if (chdir(cwd) != 0) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", cwd, strerror(errno));
+    exit(1);
+  }
+  free(cwd);
+  write_result(name, 1, elapsed, get_arena_stats().allocated - allocated);
+}
+
+static void print_usage(const char *program_name) {
+  printf("usage: %s [options]\n", program_name);
+  puts("options:");
+  puts("  -o <file>   Write results as JSON to <file> instead of stdout");
+  puts("  -d <dir>    Directory for the generated site (default: bench-site)");
+  puts("  -g          Only generate the site");
+  puts("  -s          Skip the microbenchmarks");
+  puts("  -j <jobs>   Number of jobs for the site builds (default: 1)");
+  puts("  -n <pages>  Number of content files (default: 500)");
+  puts("  -p <n>      Maximum number of paragraphs per content file (default: 8)");
+  puts("  -l <depth>  Number of nested layouts (default: 3)");
+  puts("  -i <n>      Number of images (default: 20)");
+  puts("  -t <n>      Number of tags (default: 10)");
+}
+
+static int parse_count(const char *arg, int *count) {
+  char *end;
+  long value = strtol(arg, &end, 10);
+  if (*end || value < 0 || value > INT32_MAX) {
+    fprintf(stderr, ERROR_LABEL "invalid number: %s" SGR_RESET "\n", arg);
+    return 0;
+  }
+  *count = value;
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  LipsumSite site = {.pages = 500, .paragraphs = 8, .layout_depth = 3, .images = 20, .tags = 10, .seed = 1};
+  const char *output_path = NULL;
+  const char *site_path = "bench-site";
+  int generate_only = 0;
+  int skip_micro = 0;
+  int jobs = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "ho:d:gsj:n:p:l:i:t:")) != -1) {
+    int status = 1;
+    switch (opt) {
+      case 'o':
+        output_path = optarg;
+        break;
+      case 'd':
+        site_path = optarg;
+        break;
+      case 'g':
+        generate_only = 1;
+        break;
+      case 's':
+        skip_micro = 1;
+        break;
+      case 'j':
+        status = parse_count(optarg, &jobs) && jobs > 0;
+        break;
+      case 'n':
+        status = parse_count(optarg, &site.pages);
+        break;
+      case 'p':
+        status = parse_count(optarg, &site.paragraphs);
+        break;
+      case 'l':
+        status = parse_count(optarg, &site.layout_depth);
+        break;
+      case 'i':
+        status = parse_count(optarg, &site.images);
+        break;
+      case 't':
+        status = parse_count(optarg, &site.tags);
+        break;
+      case 'h':
+        print_usage(argv[0]);
+        return 0;
+      default:
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (!status) {
+      return 1;
+    }
+  }
+  Path *site_dir = create_path(site_path, -1);
+  if (is_dir(site_dir->path)) {
+    delete_dir(site_dir);
+  }
+  fprintf(stderr, INFO_LABEL "generating site in %s" SGR_RESET "\n", site_dir->path);
+  if (!lipsum_site(site_dir, site)) {
+    delete_path(site_dir);
+    return 1;
+  }
+  if (generate_only) {
+    delete_path(site_dir);
+    return 0;
+  }
+  results = stdout;
+  if (output_path) {
+    results = fopen(output_path, "w");
+    if (!results) {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", output_path, strerror(errno));
+      delete_path(site_dir);
+      return 1;
+    }
+  }
+  fprintf(results, "{\n  \"site\": {\"pages\": %d, \"paragraphs\": %d, \"layout_depth\": %d, \"images\": %d, "
+      "\"tags\": %d, \"jobs\": %d},\n  \"results\": [", site.pages, site.paragraphs, site.layout_depth, site.images,
+      site.tags, jobs);
+  if (!skip_micro) {
+    run_microbenchmarks();
+  }
+  fprintf(stderr, INFO_LABEL "site builds" SGR_RESET "\n");
+  run_site_benchmark("site_build_cold", site_dir, 1, jobs);
+  run_site_benchmark("site_build_unchanged", site_dir, 0, jobs);
+  fprintf(results, "\n  ]\n}\n");
+  if (results != stdout) {
+    fclose(results);
+  }
+  delete_path(site_dir);
+  return 0;
+}
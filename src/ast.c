@@ -11,118 +11,13 @@
 #include <stdlib.h>
 #include <string.h>
 
-void delete_node(Node node) {
-  switch (node.type) {
-    case N_NAME:
-    case N_INT:
-    case N_FLOAT:
-      break;
-    case N_STRING:
-      free(node.string_value.bytes);
-      break;
-    case N_LIST:
-      LL_DELETE(NodeList, node.list_value, delete_node);
-      break;
-    case N_OBJECT: {
-      PropertyList *list = node.object_value;
-      while (list) {
-        PropertyList *head = list;
-        delete_node(head->key);
-        delete_node(head->value);
-        list = head->tail;
-        free(head);
-      }
-      break;
-    }
-    case N_APPLY:
-      DELETE_NODE(node.apply_value.callee);
-      LL_DELETE(NodeList, node.apply_value.args, delete_node);
-      break;
-    case N_SUBSCRIPT:
-      DELETE_NODE(node.subscript_value.list);
-      DELETE_NODE(node.subscript_value.index);
-      break;
-    case N_DOT:
-      DELETE_NODE(node.dot_value.object);
-      break;
-    case N_PREFIX:
-      DELETE_NODE(node.prefix_value.operand);
-      break;
-    case N_INFIX:
-      DELETE_NODE(node.infix_value.left);
-      DELETE_NODE(node.infix_value.right);
-      break;
-    case N_TUPLE:
-      delete_name_list(node.tuple_value);
-      break;
-    case N_FN:
-      delete_name_list(node.fn_value.params);
-      delete_name_list(node.fn_value.free_variables);
-      DELETE_NODE(node.fn_value.body);
-      break;
-    case N_IF:
-      DELETE_NODE(node.if_value.cond);
-      DELETE_NODE(node.if_value.cons);
-      DELETE_NODE(node.if_value.alt);
-      break;
-    case N_FOR:
-      DELETE_NODE(node.for_value.collection);
-      DELETE_NODE(node.for_value.body);
-      DELETE_NODE(node.for_value.alt);
-      break;
-    case N_SWITCH: {
-      DELETE_NODE(node.switch_value.expr);
-      DELETE_NODE(node.switch_value.default_case);
-      PropertyList *list = node.switch_value.cases;
-      while (list) {
-        PropertyList *head = list;
-        delete_node(head->key);
-        delete_node(head->value);
-        list = head->tail;
-        free(head);
-      }
-      break;
-    }
-    case N_EXPORT:
-      DELETE_NODE(node.export_value.right);
-      break;
-    case N_ASSIGN:
-      DELETE_NODE(node.assign_value.left);
-      DELETE_NODE(node.assign_value.right);
-      break;
-    case N_BLOCK:
-      LL_DELETE(NodeList, node.block_value, delete_node);
-      break;
-    case N_SUPPRESS:
-      DELETE_NODE(node.suppress_value);
-      break;
-    case N_RETURN:
-      DELETE_NODE(node.return_value);
-      break;
-    case N_BREAK:
-    case N_CONTINUE:
-      break;
-  }
-}
-
-NameList *copy_name_list(NameList *list) {
-  if (!list) {
-    return NULL;
-  }
-  NameList *copy = allocate(sizeof(NameList));
-  copy->size = list->size;
-  copy->tail = copy_name_list(list->tail);
-  copy->head = list->head;
-  return copy;
-}
-
-NameList *name_list_put(Symbol name, NameList *list) {
+NameList *name_list_put(Symbol name, NameList *list, Arena *arena) {
   for (NameList *elem = list; elem; elem = elem->tail) {
     if (strcmp(elem->head, name) == 0) {
       return list;
     }
   }
-  NameList *new = allocate(sizeof(NameList));
+  NameList *new = arena_allocate(sizeof(NameList), arena);
   new->tail = list;
   new->head = name;
   new->size = list ? list->size + 1 : 0;
@@ -138,24 +33,13 @@ NameList *name_list_remove(Symbol name, NameList *list) {
     if (tail) {
       tail->size = list->size - 1;
     }
-    free(list);
     return tail;
   }
   for (NameList *elem = list; elem && elem->tail; elem = elem->tail) {
     if (strcmp(elem->tail->head, name) == 0) {
-      NameList *delete = elem->tail;
-      elem->tail = delete->tail;
-      free(delete);
+      elem->tail = elem->tail->tail;
       list->size--;
     }
   }
   return list;
 }
-
-void delete_name_list(NameList *list) {
-  while (list) {
-    NameList *tail = list->tail;
-    free(list);
-    list = tail;
-  }
-}
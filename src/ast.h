@@ -15,9 +15,9 @@
 
 #define LL_SIZE(HEAD) ((HEAD) ? (HEAD)->size : 0)
 
-#define LL_APPEND(TYPE, HEAD, LAST, ELEM) \
+#define LL_APPEND(TYPE, HEAD, LAST, ELEM, ARENA) \
   do {\
-    TYPE *_node = allocate(sizeof(TYPE));\
+    TYPE *_node = arena_allocate(sizeof(TYPE), ARENA);\
     _node->tail = NULL;\
     _node->head = (ELEM);\
     if (LAST) {\
@@ -30,23 +30,6 @@
     }\
   } while (0);
 
-#define LL_DELETE(TYPE, HEAD, DELETE_ELEM) \
-  do {\
-    TYPE *_list = HEAD;\
-    while (_list) {\
-      TYPE *_head = _list;\
-      DELETE_ELEM(_head->head);\
-      _list = _head->tail;\
-      free(_head);\
-    }\
-  } while (0);
-
-#define DELETE_NODE(VALUE) \
-  if (VALUE) {\
-    delete_node(*(VALUE));\
-    free(VALUE);\
-  }
-
 typedef enum {
   N_NAME,
   N_INT,
@@ -197,12 +180,8 @@ struct NameList {
   Symbol head;
 };
 
-void delete_node(Node node);
-
-NameList *copy_name_list(NameList *list);
-NameList *name_list_put(Symbol name, NameList *list);
+NameList *name_list_put(Symbol name, NameList *list, Arena *arena);
 NameList *name_list_remove(Symbol name, NameList *list);
-void delete_name_list(NameList *list);
 
 #endif
 
@@ -7,26 +7,38 @@
 #define _GNU_SOURCE
 #include "build.h"
 
+#include "buildcache.h"
 #include "collections.h"
 #include "contentmap.h"
 #include "core.h"
 #include "datetime.h"
+#include "exec.h"
 #include "html.h"
 #include "images.h"
 #include "interpreter.h"
+#include "manifest.h"
 #include "markdown.h"
+#include "module.h"
+#include "output.h"
+#include "parsecache.h"
 #include "parser.h"
+#include "profile.h"
 #include "reader.h"
+#include "search.h"
 #include "sitemap.h"
 #include "strings.h"
 #include "template.h"
+#include "watcher.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 typedef struct {
   Path *src_root;
@@ -36,13 +48,14 @@ typedef struct {
 } BuildInfo;
 
 static void import_build_info(BuildInfo *build_info, Env *env) {
-  env_def("SRC_ROOT", path_to_string(build_info->src_root, env->arena), env);
-  env_def("DIST_ROOT", path_to_string(build_info->dist_root, env->arena), env);
+  env_def_known(SRC_ROOT, path_to_string(build_info->src_root, env->arena), env);
+  env_def_known(DIST_ROOT, path_to_string(build_info->dist_root, env->arena), env);
   env_export("SRC_ROOT", env);
   env_export("DIST_ROOT", env);
 }
 
 Module *get_template(const Path *name, Env *env) {
+  add_dependency(name, env);
   Module *m = get_module(name, env->modules);
   if (m && !m->dirty) {
     if (m->type != M_USER) {
@@ -50,32 +63,33 @@ Module *get_template(const Path *name, Env *env) {
     }
     return m;
   }
-  FILE *file = fopen(name->path, "r");
-  if (!file) {
+  m = read_parse_cache(name, PC_TEMPLATE, env->symbol_map);
+  if (m) {
+    add_module(m, env->modules);
+    return m;
+  }
+  Reader *reader = open_file_reader(name, env->symbol_map);
+  if (!reader) {
     fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", name->path, strerror(errno));
     return NULL;
   }
-  Reader *reader = open_reader(file, name, env->symbol_map);
   TokenStream tokens = read_all(reader, 1);
   if (reader_errors(reader)) {
     close_reader(reader);
-    fclose(file);
     return NULL;
   }
   m = parse(tokens, name);
   close_reader(reader);
-  fclose(file);
   if (m->user_value.parse_error) {
     delete_module(m);
     return NULL;
   }
+  write_parse_cache(m, PC_TEMPLATE);
   add_module(m, env->modules);
   return m;
 }
 
-Env *create_template_env(Value data, Env *parent) {
-  Arena *arena = create_arena();
-  Env *env = create_env(arena, parent->modules, parent->symbol_map);
+static void import_template_builtins(Env *env) {
   import_core(env);
   import_strings(env);
   import_collections(env);
@@ -84,14 +98,26 @@ Env *create_template_env(Value data, Env *parent) {
   import_template(env);
   import_html(env);
   import_images(env);
+  import_search(env);
+}
+
+Env *create_template_env(Value data, Env *parent) {
+  Arena *arena = create_arena();
+  Env *env = create_env(arena, parent->modules, parent->symbol_map);
+  env->parent_env = get_builtins_env(import_template_builtins, parent->modules, parent->symbol_map);
+  // Defines CONTENT_HANDLERS which must not be shared between pages
   import_markdown(env);
   Env *export_env = create_env(env->arena, env->modules, env->symbol_map);
+  // Values from the parent are shared instead of copied, changes made by the template are undone when the
+  // environment is deleted
+  open_thaw_log(arena);
   if (data.type == V_OBJECT) {
     ObjectIterator it = iterate_object(data.object_value);
     Value entry_key, entry_value;
     while (object_iterator_next(&it, &entry_key, &entry_value)) {
       if (entry_key.type == V_SYMBOL) {
-        env_put(entry_key.symbol_value, copy_value(entry_value, export_env), env);
+        freeze_value(entry_value);
+        env_put(entry_key.symbol_value, share_value(entry_value, export_env), env);
       }
     }
   }
@@ -100,7 +126,8 @@ Env *create_template_env(Value data, Env *parent) {
       Symbol symbol = parent->exports->cells[i].symbol_value;
       Value value;
       if (env_get(symbol, &value, parent)) {
-        env_put(symbol, copy_value(value, export_env), env);
+        freeze_value(value);
+        env_put(symbol, share_value(value, export_env), env);
       }
     }
   }
@@ -108,32 +135,56 @@ Env *create_template_env(Value data, Env *parent) {
 }
 
 void delete_template_env(Env *env) {
+  close_thaw_log(env->arena);
   delete_arena(env->arena);
 }
 
-Value eval_template(Module *module, Env *env) {
+int eval_template_to_buffer(Module *module, Env *env, Buffer *buffer, Value *output) {
+  *output = nil_value;
   if (module->type != M_USER) {
-    return nil_value;
+    return 0;
   }
-  env_def("FILE", path_to_string(module->file_name, env->arena), env);
+  env_def_known(FILE, path_to_string(module->file_name, env->arena), env);
   Path *dir = path_get_parent(module->file_name);
-  env_def("DIR", path_to_string(dir, env->arena), env);
-  Value content = interpret(*module->user_value.root, env).value;
+  env_def_known(DIR, path_to_string(dir, env->arena), env);
+  size_t start = buffer->size;
+  ProfileTimer timer = profile_start();
+  InterpreterResult result = eval_module_to_buffer(module, env, buffer);
+  profile_end(timer, PROFILE_TEMPLATE, module->file_name->path);
+  int streamed = result.type != IR_RETURN;
+  if (!streamed) {
+    *output = result.value;
+  }
   Value layout;
-  if (env_get_symbol("LAYOUT", &layout, env) && layout.type == V_STRING) {
-    env_def("CONTENT", content, env);
-    env_def("LAYOUT", nil_value, env);
+  if (env_get_known(LAYOUT, &layout, env) && layout.type == V_STRING) {
+    if (streamed) {
+      env_def_known(CONTENT, create_string(buffer->data + start, buffer->size - start, env->arena), env);
+    } else {
+      env_def_known(CONTENT, *output, env);
+    }
+    env_def_known(LAYOUT, nil_value, env);
     Path *layout_name = string_to_path(layout.string_value);
     Path *layout_path = path_join(dir, layout_name, 0);
     Module *layout_module = get_template(layout_path, env);
     if (layout_module) {
-      content = eval_template(layout_module, env);
+      buffer->size = start;
+      streamed = eval_template_to_buffer(layout_module, env, buffer, output);
     }
     delete_path(layout_path);
     delete_path(layout_name);
   }
   delete_path(dir);
-  return content;
+  return streamed;
+}
+
+Value eval_template(Module *module, Env *env) {
+  Buffer buffer = create_buffer(0);
+  Value output;
+  if (eval_template_to_buffer(module, env, &buffer, &output)) {
+    output = create_string(buffer.data, buffer.size, env->arena);
+  }
+  delete_buffer(buffer);
+  return output;
 }
 
 static Env *eval_script(FILE *file, const Path *file_name, BuildInfo *build_info) {
@@ -156,7 +207,7 @@ static Env *eval_script(FILE *file, const Path *file_name, BuildInfo *build_info
   import_contentmap(env);
   import_markdown(env);
   import_build_info(build_info, env);
-  interpret(*module->user_value.root, env);
+  eval_module(module, env);
   return env;
 }
 
@@ -217,10 +268,10 @@ Value get_web_path(const Path *path, int absolute, Env *env) {
   Value root_value;
   String *root = NULL;
   if (absolute) {
-    if (env_get(get_symbol("ROOT_URL", env->symbol_map), &root_value, env) && root_value.type == V_STRING) {
+    if (env_get_known(ROOT_URL, &root_value, env) && root_value.type == V_STRING) {
       root = root_value.string_value;
     }
-  } else if (env_get(get_symbol("ROOT_PATH", env->symbol_map), &root_value, env) && root_value.type == V_STRING) {
+  } else if (env_get_known(ROOT_PATH, &root_value, env) && root_value.type == V_STRING) {
     root = root_value.string_value;
   }
   if (web_path->size) {
@@ -261,7 +312,11 @@ Path *get_dist_root(Env *env) {
 }
 
 int asset_has_changed(const Path *src, const Path *dest) {
-  return !file_exists(dest->path) || get_mtime(src->path) != get_mtime(dest->path);
+  struct stat src_stat, dest_stat;
+  if (stat(dest->path, &dest_stat) != 0 || stat(src->path, &src_stat) != 0) {
+    return 1;
+  }
+  return src_stat.st_size != dest_stat.st_size || src_stat.st_mtime != dest_stat.st_mtime;
 }
 
 int copy_asset(const Path *src, const Path *dest) {
@@ -270,13 +325,87 @@ int copy_asset(const Path *src, const Path *dest) {
     return 1;
   }
   Path *dest_dir = path_get_parent(dest);
-  if (mkdir_rec(dest_dir->path)) {
+  if (create_output_dir(dest_dir)) {
     result = copy_file(src->path, dest->path);
   }
   delete_path(dest_dir);
   return result;
 }
 
+typedef struct {
+  Path *src;
+  time_t mtime;
+  off_t size;
+  uint64_t fingerprint;
+} FingerprintEntry;
+
+static GenericHashMap fingerprints;
+static int fingerprints_initialized = 0;
+
+static Hash fingerprint_entry_hash(const void *p) {
+  const FingerprintEntry *entry = p;
+  return hash_bytes(entry->src->path, entry->src->size, INIT_HASH);
+}
+
+static int fingerprint_entry_equals(const void *a, const void *b) {
+  return strcmp(((const FingerprintEntry *) a)->src->path, ((const FingerprintEntry *) b)->src->path) == 0;
+}
+
+int asset_fingerprinting_enabled(Env *env) {
+  Value fingerprint_assets;
+  return env_get_symbol("FINGERPRINT_ASSETS", &fingerprint_assets, env) && is_truthy(fingerprint_assets);
+}
+
+// The contents of each file are only hashed again if its size or modification time changes
+static int get_fingerprint(const Path *src, uint64_t *fingerprint) {
+  struct stat src_stat;
+  if (stat(src->path, &src_stat) != 0) {
+    return 0;
+  }
+  if (!fingerprints_initialized) {
+    init_generic_hash_map(&fingerprints, sizeof(FingerprintEntry), 0, fingerprint_entry_hash,
+        fingerprint_entry_equals, NULL);
+    fingerprints_initialized = 1;
+  }
+  FingerprintEntry entry = { .src = (Path *) src };
+  int exists = generic_hash_map_get(&fingerprints, &entry, &entry);
+  if (exists && entry.mtime == src_stat.st_mtime && entry.size == src_stat.st_size) {
+    *fingerprint = entry.fingerprint;
+    return 1;
+  }
+  CacheKey key = create_cache_key("fingerprint");
+  if (!cache_key_add_file(&key, src)) {
+    return 0;
+  }
+  if (!exists) {
+    entry.src = copy_path(src);
+  }
+  entry.mtime = src_stat.st_mtime;
+  entry.size = src_stat.st_size;
+  entry.fingerprint = key.low & 0xffffffffffffULL;
+  generic_hash_map_set(&fingerprints, &entry, NULL, NULL);
+  *fingerprint = entry.fingerprint;
+  return 1;
+}
+
+Path *get_fingerprinted_path(const Path *src, const Path *path) {
+  uint64_t fingerprint;
+  if (!get_fingerprint(src, &fingerprint)) {
+    return NULL;
+  }
+  const char *name = path_get_name(path);
+  const char *extension = strrchr(name, '.');
+  if (!extension || extension == name) {
+    extension = path->path + path->size;
+  }
+  Buffer buffer = create_buffer(0);
+  buffer_printf(&buffer, "%.*s.%012" PRIx64 "%s", (int) (extension - path->path), path->path, fingerprint,
+      extension);
+  Path *result = create_path((char *) buffer.data, buffer.size);
+  delete_buffer(buffer);
+  return result;
+}
+
 Path *find_project_root(void) {
   Path *cwd = get_cwd_path();
   Path *index_path = path_append(cwd, "index.plet");
@@ -330,56 +459,215 @@ Env *eval_index(Path *src_root, ModuleMap *modules, SymbolMap *symbol_map) {
   return env;
 }
 
+static void init_parse_cache(GlobalArgs args, const Path *src_root) {
+  if (args.parse_cache) {
+    Path *cache_dir = path_append(src_root, ".plet-cache");
+    set_parse_cache_dir(cache_dir);
+    delete_path(cache_dir);
+  }
+}
+
 int build(GlobalArgs args) {
   Path *src_root = find_project_root();
   if (src_root) {
+    if (args.profile) {
+      enable_profiling(args.trace_path);
+      set_profile_root(src_root);
+    }
+    init_parse_cache(args, src_root);
+    set_build_cache(args.build_cache);
+    set_content_jobs(args.jobs);
+    set_content_memory_limit(args.memory_limit);
+    set_exec_jobs(args.jobs);
+    set_shard(args.shard, args.shards);
     ModuleMap *modules = create_module_map();
     SymbolMap *symbol_map = create_symbol_map();
     add_system_modules(modules);
     Env *env = eval_index(src_root, modules, symbol_map);
     if (env) {
-      compile_pages(env);
+      compile_pages(env, args.jobs, NULL);
       delete_arena(env->arena);
     }
     delete_module_map(modules);
     delete_symbol_map(symbol_map);
+    set_parse_cache_dir(NULL);
     delete_path(src_root);
+#ifdef DEBUG
+    ArenaStats stats = get_arena_stats();
+    fprintf(stderr, INFO_LABEL "arenas: peak %zu bytes, %zu chunk allocations, %zu chunks pooled" SGR_RESET "\n",
+        stats.peak_bytes, stats.mallocs, stats.pooled_chunks);
+#endif
+    print_profile();
+    clear_arena_pool();
   } else {
     fprintf(stderr, ERROR_LABEL "index.plet not found" SGR_RESET "\n");
   }
   return 0;
 }
 
+static Env *eval_watched_index(Path *src_root, ModuleMap *modules, SymbolMap *symbol_map,
+    ManifestPage *dependencies, ModuleMap *watched_modules) {
+  Path *index_path = path_append(src_root, "index.plet");
+  manifest_page_add_dependency(dependencies, index_path);
+  delete_path(index_path);
+  track_dependencies(dependencies, modules);
+  Env *env = eval_index(src_root, modules, symbol_map);
+  track_dependencies(NULL, modules);
+  Dependency dependency;
+  HashMapIterator it = generic_hash_map_iterate(&dependencies->dependencies);
+  while (generic_hash_map_next(&it, &dependency)) {
+    if (!get_module(dependency.path, modules) && !get_module(dependency.path, watched_modules)) {
+      add_module(create_module(dependency.path, M_ASSET), watched_modules);
+    }
+  }
+  return env;
+}
+
+static int index_has_changed(ManifestPage *dependencies, ModuleMap *modules, ModuleMap *watched_modules) {
+  Dependency dependency;
+  HashMapIterator it = generic_hash_map_iterate(&dependencies->dependencies);
+  while (generic_hash_map_next(&it, &dependency)) {
+    Module *module = get_module(dependency.path, modules);
+    if (!module) {
+      module = get_module(dependency.path, watched_modules);
+    }
+    if (!module || module->dirty) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 int watch(GlobalArgs args) {
   Path *src_root = find_project_root();
   if (src_root) {
+    if (args.profile) {
+      enable_profiling(args.trace_path);
+      set_profile_root(src_root);
+    }
+    init_parse_cache(args, src_root);
+    set_build_cache(args.build_cache);
+    set_content_jobs(args.jobs);
+    set_content_memory_limit(args.memory_limit);
+    set_exec_jobs(args.jobs);
     ModuleMap *modules = create_module_map();
     SymbolMap *symbol_map = create_symbol_map();
     add_system_modules(modules);
-    Env *env = eval_index(src_root, modules, symbol_map);
+    ModuleMap *watched_modules = create_module_map();
+    ManifestPage *index_dependencies = create_manifest_page(src_root, 0);
+    Env *env = eval_watched_index(src_root, modules, symbol_map, index_dependencies, watched_modules);
     if (env) {
-      compile_pages(env);
-      delete_arena(env->arena);
+      compile_pages(env, args.jobs, watched_modules);
     }
+    reset_changes(modules);
+    Watcher *watcher = create_watcher();
     while (1) {
-      struct timespec delay;
-      delay.tv_sec = 0;
-      delay.tv_nsec = 100000000L;
-      nanosleep(&delay, NULL);
-      if (detect_changes(modules)) {
-        fprintf(stderr, INFO_LABEL "changes detected" SGR_RESET "\n");
-        env = eval_index(src_root, modules, symbol_map);
+      if (!wait_for_changes(watcher, (ModuleMap *[]) { modules, watched_modules }, 2, -1)) {
+        continue;
+      }
+      fprintf(stderr, INFO_LABEL "changes detected" SGR_RESET "\n");
+      if (env && !index_has_changed(index_dependencies, modules, watched_modules)) {
+        compile_changed_pages(env, args.jobs, watched_modules);
+        reset_changes(watched_modules);
+      } else {
         if (env) {
-          compile_pages(env);
           delete_arena(env->arena);
         }
+        delete_manifest_page(index_dependencies);
+        index_dependencies = create_manifest_page(src_root, 0);
+        delete_module_map(watched_modules);
+        watched_modules = create_module_map();
+        env = eval_watched_index(src_root, modules, symbol_map, index_dependencies, watched_modules);
+        if (env) {
+          compile_pages(env, args.jobs, watched_modules);
+        }
       }
+      reset_changes(modules);
     }
+    delete_watcher(watcher);
+    if (env) {
+      delete_arena(env->arena);
+    }
+    delete_manifest_page(index_dependencies);
+    delete_module_map(watched_modules);
     delete_module_map(modules);
     delete_symbol_map(symbol_map);
+    set_parse_cache_dir(NULL);
     delete_path(src_root);
   } else {
     fprintf(stderr, ERROR_LABEL "index.plet not found" SGR_RESET "\n");
   }
   return 0;
 }
+
+static int merge_manifest_file(Manifest **merged, const Path *path) {
+  Manifest *manifest = read_any_manifest(path);
+  if (!manifest) {
+    return 0;
+  }
+  int status = 1;
+  if (!*merged) {
+    *merged = create_manifest(manifest->globals_hash);
+  } else if ((*merged)->globals_hash != manifest->globals_hash) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "built with different global values than the other shards"
+        SGR_RESET "\n", path->path);
+    status = 0;
+  }
+  if (status) {
+    status = merge_manifest(*merged, manifest);
+  }
+  delete_manifest(manifest);
+  return status;
+}
+
+int merge(GlobalArgs args) {
+  Path *src_root = find_project_root();
+  if (!src_root) {
+    fprintf(stderr, ERROR_LABEL "index.plet not found" SGR_RESET "\n");
+    return 1;
+  }
+  Path *dist_root = path_append(src_root, "dist");
+  Manifest *merged = NULL;
+  int status = 1;
+  int found = 0;
+  if (args.argc) {
+    for (int i = 0; i < args.argc; i++) {
+      Path *path = create_path(args.argv[i], -1);
+      status &= merge_manifest_file(&merged, path);
+      delete_path(path);
+      found++;
+    }
+  } else {
+    // Without arguments the manifests written by build --shard in dist are merged
+    DIR *dir = opendir(dist_root->path);
+    if (dir) {
+      struct dirent *file;
+      while ((file = readdir(dir))) {
+        if (strncmp(file->d_name, ".plet-cache.", 12) == 0 && !strstr(file->d_name, ".tmp")) {
+          Path *path = path_append(dist_root, file->d_name);
+          status &= merge_manifest_file(&merged, path);
+          delete_path(path);
+          found++;
+        }
+      }
+      closedir(dir);
+    }
+  }
+  if (!found) {
+    fprintf(stderr, ERROR_LABEL "no shard manifests found" SGR_RESET "\n");
+    status = 0;
+  } else if (status) {
+    Path *manifest_path = path_append(dist_root, ".plet-cache");
+    status = mkdir_rec(dist_root->path) && write_manifest(merged, manifest_path);
+    if (status) {
+      fprintf(stderr, INFO_LABEL "merged %d manifests into %s" SGR_RESET "\n", found, manifest_path->path);
+    }
+    delete_path(manifest_path);
+  }
+  if (merged) {
+    delete_manifest(merged);
+  }
+  delete_path(dist_root);
+  delete_path(src_root);
+  return !status;
+}
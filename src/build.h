@@ -16,17 +16,30 @@ typedef struct {
   char **argv;
   int parse_as_template;
   char *port;
+  int jobs;
+  int parse_cache;
+  // Directory or http(s) URL of the build cache
+  char *build_cache;
+  size_t page_cache_size;
+  size_t memory_limit;
+  // Index (0-based) and number of shards for build --shard
+  int shard;
+  int shards;
+  int profile;
+  char *trace_path;
 } GlobalArgs;
 
 Module *get_template(const Path *name, Env *env);
 Env *create_template_env(Value data, Env *parent);
 void delete_template_env(Env *env);
+int eval_template_to_buffer(Module *module, Env *env, Buffer *buffer, Value *output);
 Value eval_template(Module *module, Env *env);
 
 Path *find_project_root(void);
 Env *eval_index(Path *src_root, ModuleMap *modules, SymbolMap *symbol_map);
 int build(GlobalArgs args);
 int watch(GlobalArgs args);
+int merge(GlobalArgs args);
 
 Path *get_dist_path(const Path *path, Env *env);
 Path *string_to_src_path(const String *string, Env *env);
@@ -38,5 +51,9 @@ Path *get_dist_root(Env *env);
 
 int asset_has_changed(const Path *src, const Path *dest);
 int copy_asset(const Path *src, const Path *dest);
+int asset_fingerprinting_enabled(Env *env);
+// Inserts a hash of the contents of src into path before its extension, e.g. "style.css" becomes
+// "style.0123456789ab.css", returns NULL if src can't be read
+Path *get_fingerprinted_path(const Path *src, const Path *path);
 
 #endif
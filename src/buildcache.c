@@ -0,0 +1,323 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#define _GNU_SOURCE
+#include "buildcache.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BUILD_CACHE_VERSION "plet-build-cache 1"
+
+#define FNV_PRIME 0x100000001b3ULL
+#define FNV_OFFSET_LOW 0xcbf29ce484222325ULL
+#define FNV_OFFSET_HIGH 0x84222325cbf29ce4ULL
+
+typedef enum {
+  BC_NONE,
+  BC_DIR,
+  BC_HTTP
+} BuildCacheBackend;
+
+static BuildCacheBackend backend = BC_NONE;
+static char *cache_location = NULL;
+static int put_failed = 0;
+
+void set_build_cache(const char *location) {
+  if (cache_location) {
+    free(cache_location);
+    cache_location = NULL;
+  }
+  backend = BC_NONE;
+  put_failed = 0;
+  if (!location || !*location) {
+    return;
+  }
+  if (strncmp(location, "http://", 7) == 0 || strncmp(location, "https://", 8) == 0) {
+    backend = BC_HTTP;
+    size_t length = strlen(location);
+    while (length > 0 && location[length - 1] == '/') {
+      length--;
+    }
+    cache_location = allocate(length + 1);
+    memcpy(cache_location, location, length);
+    cache_location[length] = '\0';
+  } else {
+    backend = BC_DIR;
+    cache_location = copy_string(location);
+  }
+}
+
+int build_cache_is_enabled(void) {
+  return backend != BC_NONE;
+}
+
+CacheKey create_cache_key(const char *kind) {
+  CacheKey key = { .low = FNV_OFFSET_LOW, .high = FNV_OFFSET_HIGH };
+  cache_key_add_bytes(&key, BUILD_CACHE_VERSION, sizeof(BUILD_CACHE_VERSION));
+  cache_key_add_bytes(&key, kind, strlen(kind) + 1);
+  return key;
+}
+
+// Two FNV-1a hashes with different offsets, the high one sees every byte inverted
+void cache_key_add_bytes(CacheKey *key, const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  uint64_t low = key->low, high = key->high;
+  for (size_t i = 0; i < size; i++) {
+    low = (low ^ bytes[i]) * FNV_PRIME;
+    high = (high ^ (uint8_t) ~bytes[i]) * FNV_PRIME;
+  }
+  key->low = low;
+  key->high = high;
+}
+
+void cache_key_add_int(CacheKey *key, int64_t value) {
+  uint8_t bytes[8];
+  for (int i = 0; i < 8; i++) {
+    bytes[i] = (uint64_t) value >> (i * 8);
+  }
+  cache_key_add_bytes(key, bytes, sizeof(bytes));
+}
+
+void cache_key_add_key(CacheKey *key, CacheKey other) {
+  cache_key_add_int(key, other.low);
+  cache_key_add_int(key, other.high);
+}
+
+void cache_key_add_path(CacheKey *key, const Path *path) {
+  cache_key_add_bytes(key, path->path, path->size + 1);
+}
+
+int cache_key_add_file(CacheKey *key, const Path *path) {
+  FILE *file = fopen(path->path, "rb");
+  if (!file) {
+    return 0;
+  }
+  uint8_t buffer[8192];
+  size_t n;
+  int64_t size = 0;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    cache_key_add_bytes(key, buffer, n);
+    size += n;
+  }
+  int status = !ferror(file);
+  fclose(file);
+  cache_key_add_int(key, size);
+  return status;
+}
+
+static void format_key(CacheKey key, char *hex) {
+  snprintf(hex, 33, "%016" PRIx64 "%016" PRIx64, key.high, key.low);
+}
+
+static Path *get_entry_path(const char *hex) {
+  Buffer buffer = create_buffer(0);
+  buffer_printf(&buffer, "%s%c%.2s%c%s", cache_location, PATH_SEP, hex, PATH_SEP, hex);
+  Path *path = create_path((char *) buffer.data, buffer.size);
+  delete_buffer(buffer);
+  return path;
+}
+
+static int read_file_to_buffer(const char *path, Buffer *data) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return 0;
+  }
+  size_t start = data->size;
+  uint8_t buffer[8192];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    buffer_append_bytes(data, buffer, n);
+  }
+  int status = !ferror(file);
+  fclose(file);
+  if (!status) {
+    data->size = start;
+  }
+  return status;
+}
+
+// Sends a request for the entry using curl, output and input are optional
+static int run_curl(const char *hex, const char *method, Buffer *output, const void *input, size_t input_size) {
+  Buffer url = create_buffer(0);
+  buffer_printf(&url, "%s/%s", cache_location, hex);
+  buffer_put(&url, '\0');
+  const char *argv[12];
+  int argc = 0;
+  argv[argc++] = "curl";
+  argv[argc++] = "-sfL";
+  argv[argc++] = "-X";
+  argv[argc++] = method;
+  const char *user = getenv("PLET_BUILD_CACHE_USER");
+  if (user && *user) {
+    argv[argc++] = "--user";
+    argv[argc++] = user;
+  }
+  const char *sigv4 = getenv("PLET_BUILD_CACHE_AWS_SIGV4");
+  if (sigv4 && *sigv4) {
+    argv[argc++] = "--aws-sigv4";
+    argv[argc++] = sigv4;
+  }
+  if (input) {
+    argv[argc++] = "--data-binary";
+    argv[argc++] = "@-";
+  }
+  argv[argc++] = (char *) url.data;
+  argv[argc] = NULL;
+  int out_fds[2] = {-1, -1}, in_fds[2] = {-1, -1};
+  if (pipe(out_fds) != 0 || (input && pipe(in_fds) != 0)) {
+    fprintf(stderr, ERROR_LABEL "unable to create pipe: %s" SGR_RESET "\n", strerror(errno));
+    close(out_fds[0]);
+    close(out_fds[1]);
+    delete_buffer(url);
+    return 0;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, ERROR_LABEL "unable to fork: %s" SGR_RESET "\n", strerror(errno));
+    close(out_fds[0]);
+    close(out_fds[1]);
+    if (input) {
+      close(in_fds[0]);
+      close(in_fds[1]);
+    }
+    delete_buffer(url);
+    return 0;
+  }
+  if (pid == 0) {
+    close(out_fds[0]);
+    if (dup2(out_fds[1], STDOUT_FILENO) < 0) {
+      _exit(127);
+    }
+    close(out_fds[1]);
+    if (input) {
+      close(in_fds[1]);
+      if (dup2(in_fds[0], STDIN_FILENO) < 0) {
+        _exit(127);
+      }
+      close(in_fds[0]);
+    }
+    execvp("curl", (char * const *) argv);
+    _exit(127);
+  }
+  delete_buffer(url);
+  close(out_fds[1]);
+  if (input) {
+    close(in_fds[0]);
+    // curl may exit before it has read everything, e.g. when the server rejects the request
+    void (*previous_handler)(int) = signal(SIGPIPE, SIG_IGN);
+    const uint8_t *p = input;
+    size_t remaining = input_size;
+    while (remaining > 0) {
+      ssize_t n = write(in_fds[1], p, remaining);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        break;
+      }
+      p += n;
+      remaining -= n;
+    }
+    close(in_fds[1]);
+    signal(SIGPIPE, previous_handler);
+  }
+  size_t start = output ? output->size : 0;
+  uint8_t buffer[8192];
+  ssize_t n;
+  while ((n = read(out_fds[0], buffer, sizeof(buffer))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (output) {
+      buffer_append_bytes(output, buffer, n);
+    }
+  }
+  close(out_fds[0]);
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      return 0;
+    }
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    if (output) {
+      output->size = start;
+    }
+    return 0;
+  }
+  return 1;
+}
+
+int build_cache_get(CacheKey key, Buffer *data) {
+  char hex[33];
+  format_key(key, hex);
+  switch (backend) {
+    case BC_NONE:
+      return 0;
+    case BC_DIR: {
+      Path *path = get_entry_path(hex);
+      int result = read_file_to_buffer(path->path, data);
+      delete_path(path);
+      return result;
+    }
+    case BC_HTTP:
+      return run_curl(hex, "GET", data, NULL, 0);
+  }
+  return 0;
+}
+
+void build_cache_put(CacheKey key, const void *data, size_t size) {
+  char hex[33];
+  format_key(key, hex);
+  int result = 1;
+  switch (backend) {
+    case BC_NONE:
+      return;
+    case BC_DIR: {
+      Path *path = get_entry_path(hex);
+      Path *dir = path_get_parent(path);
+      result = mkdir_rec(dir->path) && write_file_if_changed(path->path, data, size) != WRITE_ERROR;
+      delete_path(dir);
+      delete_path(path);
+      break;
+    }
+    case BC_HTTP:
+      result = run_curl(hex, "PUT", NULL, data ? data : "", size);
+      break;
+  }
+  if (!result && !put_failed) {
+    // Only reported once since the build itself is unaffected
+    fprintf(stderr, WARN_LABEL "unable to store entries in build cache: %s" SGR_RESET "\n", cache_location);
+    put_failed = 1;
+  }
+}
+
+int build_cache_get_file(CacheKey key, const Path *dest) {
+  Buffer data = create_buffer(0);
+  int result = 0;
+  if (build_cache_get(key, &data)) {
+    result = write_file_if_changed(dest->path, data.data, data.size) != WRITE_ERROR;
+  }
+  delete_buffer(data);
+  return result;
+}
+
+void build_cache_put_file(CacheKey key, const Path *src) {
+  Buffer data = create_buffer(0);
+  if (read_file_to_buffer(src->path, &data)) {
+    build_cache_put(key, data.data, data.size);
+  }
+  delete_buffer(data);
+}
@@ -0,0 +1,37 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef BUILDCACHE_H
+#define BUILDCACHE_H
+
+#include "util.h"
+
+// A 128-bit key derived from the inputs of a cache entry
+typedef struct {
+  uint64_t low;
+  uint64_t high;
+} CacheKey;
+
+// Location is either a local directory or an http(s) URL, NULL disables the build cache
+void set_build_cache(const char *location);
+int build_cache_is_enabled(void);
+
+CacheKey create_cache_key(const char *kind);
+void cache_key_add_bytes(CacheKey *key, const void *data, size_t size);
+void cache_key_add_int(CacheKey *key, int64_t value);
+void cache_key_add_key(CacheKey *key, CacheKey other);
+void cache_key_add_path(CacheKey *key, const Path *path);
+// Adds the contents of a file, returns 0 if it couldn't be read
+int cache_key_add_file(CacheKey *key, const Path *path);
+
+// Appends the entry to data, returns 0 if there is no such entry
+int build_cache_get(CacheKey key, Buffer *data);
+void build_cache_put(CacheKey key, const void *data, size_t size);
+// Writes the entry to a file, returns 0 if there is no such entry
+int build_cache_get_file(CacheKey key, const Path *dest);
+void build_cache_put_file(CacheKey key, const Path *src);
+
+#endif
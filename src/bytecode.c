@@ -0,0 +1,1078 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#include "bytecode.h"
+
+#include "collections.h"
+
+#include <alloca.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  Bytecode *bytecode;
+  size_t stack_size;
+  size_t frames;
+} Compiler;
+
+typedef struct {
+  size_t handler;
+  size_t stack_size;
+  Buffer buffer;
+  Buffer *out;
+  Node *node;
+  Value collection;
+  size_t index;
+  ObjectIterator it;
+  int64_t loops;
+} Frame;
+
+static void compile_node(Node *node, Compiler *compiler);
+static void compile_append(Node *node, Compiler *compiler);
+static Bytecode *compile_function(Node *node, Compiler *parent);
+
+static Bytecode *create_bytecode(void) {
+  Bytecode *bytecode = allocate(sizeof(Bytecode));
+  memset(bytecode, 0, sizeof(Bytecode));
+  return bytecode;
+}
+
+void delete_bytecode(Bytecode *bytecode) {
+  for (size_t i = 0; i < bytecode->functions_size; i++) {
+    delete_bytecode(bytecode->functions[i]);
+  }
+  if (bytecode->functions) {
+    free(bytecode->functions);
+  }
+  if (bytecode->nodes) {
+    free(bytecode->nodes);
+  }
+  if (bytecode->constants) {
+    free(bytecode->constants);
+  }
+  if (bytecode->locals) {
+    free(bytecode->locals);
+  }
+  if (bytecode->code) {
+    free(bytecode->code);
+  }
+  free(bytecode);
+}
+
+static size_t emit(OpCode op, uint32_t a, uint32_t b, Compiler *compiler) {
+  Bytecode *bytecode = compiler->bytecode;
+  if (bytecode->size >= bytecode->capacity) {
+    bytecode->capacity = bytecode->capacity ? bytecode->capacity << 1 : 32;
+    bytecode->code = reallocate(bytecode->code, bytecode->capacity * sizeof(Instruction));
+  }
+  bytecode->code[bytecode->size] = (Instruction) { .op = op, .a = a, .b = b };
+  return bytecode->size++;
+}
+
+static size_t emit_local(OpCode op, uint32_t a, uint32_t slot, uint16_t depth, Compiler *compiler) {
+  size_t instruction = emit(op, a, slot, compiler);
+  compiler->bytecode->code[instruction].depth = depth;
+  return instruction;
+}
+
+static void patch(size_t instruction, Compiler *compiler) {
+  compiler->bytecode->code[instruction].a = compiler->bytecode->size;
+}
+
+static uint32_t add_node(Node *node, Compiler *compiler) {
+  Bytecode *bytecode = compiler->bytecode;
+  if (bytecode->nodes_size >= bytecode->nodes_capacity) {
+    bytecode->nodes_capacity = bytecode->nodes_capacity ? bytecode->nodes_capacity << 1 : 16;
+    bytecode->nodes = reallocate(bytecode->nodes, bytecode->nodes_capacity * sizeof(Node *));
+  }
+  bytecode->nodes[bytecode->nodes_size] = node;
+  return bytecode->nodes_size++;
+}
+
+static uint32_t add_constant(Value value, Compiler *compiler) {
+  Bytecode *bytecode = compiler->bytecode;
+  if (bytecode->constants_size >= bytecode->constants_capacity) {
+    bytecode->constants_capacity = bytecode->constants_capacity ? bytecode->constants_capacity << 1 : 16;
+    bytecode->constants = reallocate(bytecode->constants, bytecode->constants_capacity * sizeof(Value));
+  }
+  bytecode->constants[bytecode->constants_size] = value;
+  return bytecode->constants_size++;
+}
+
+static uint32_t add_function(Bytecode *function, Compiler *compiler) {
+  Bytecode *bytecode = compiler->bytecode;
+  if (bytecode->functions_size >= bytecode->functions_capacity) {
+    bytecode->functions_capacity = bytecode->functions_capacity ? bytecode->functions_capacity << 1 : 4;
+    bytecode->functions = reallocate(bytecode->functions, bytecode->functions_capacity * sizeof(Bytecode *));
+  }
+  bytecode->functions[bytecode->functions_size] = function;
+  return bytecode->functions_size++;
+}
+
+static int find_local(Symbol name, Bytecode *bytecode, uint32_t *slot) {
+  for (size_t i = 0; i < bytecode->locals_size; i++) {
+    if (bytecode->locals[i] == name) {
+      *slot = i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void add_local(Symbol name, Bytecode *bytecode) {
+  uint32_t slot;
+  if (find_local(name, bytecode, &slot)) {
+    return;
+  }
+  if (bytecode->locals_size >= bytecode->locals_capacity) {
+    bytecode->locals_capacity = bytecode->locals_capacity ? bytecode->locals_capacity << 1 : 8;
+    bytecode->locals = reallocate(bytecode->locals, bytecode->locals_capacity * sizeof(Symbol));
+  }
+  bytecode->locals[bytecode->locals_size++] = name;
+}
+
+static void remove_local(Symbol name, Bytecode *bytecode) {
+  uint32_t slot;
+  if (find_local(name, bytecode, &slot)) {
+    bytecode->locals_size--;
+    memmove(bytecode->locals + slot, bytecode->locals + slot + 1,
+        (bytecode->locals_size - slot) * sizeof(Symbol));
+  }
+}
+
+static int resolve_local(Symbol name, Compiler *compiler, uint32_t *slot, uint16_t *depth) {
+  uint16_t d = 0;
+  for (Bytecode *bytecode = compiler->bytecode; bytecode; bytecode = bytecode->parent, d++) {
+    if (find_local(name, bytecode, slot)) {
+      *depth = d;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+typedef void (*NodeVisitor)(Node *, Bytecode *);
+
+static void visit_children(Node *node, NodeVisitor visitor, Bytecode *bytecode) {
+  switch (node->type) {
+    case N_NAME:
+    case N_INT:
+    case N_FLOAT:
+    case N_STRING:
+    case N_TUPLE:
+    case N_FN:
+    case N_BREAK:
+    case N_CONTINUE:
+      break;
+    case N_LIST:
+      for (NodeList *item = node->list_value; item; item = item->tail) {
+        visitor(&item->head, bytecode);
+      }
+      break;
+    case N_BLOCK:
+      for (NodeList *item = node->block_value; item; item = item->tail) {
+        visitor(&item->head, bytecode);
+      }
+      break;
+    case N_OBJECT:
+      for (PropertyList *property = node->object_value; property; property = property->tail) {
+        visitor(&property->key, bytecode);
+        visitor(&property->value, bytecode);
+      }
+      break;
+    case N_APPLY:
+      visitor(node->apply_value.callee, bytecode);
+      for (NodeList *arg = node->apply_value.args; arg; arg = arg->tail) {
+        visitor(&arg->head, bytecode);
+      }
+      break;
+    case N_SUBSCRIPT:
+      visitor(node->subscript_value.list, bytecode);
+      visitor(node->subscript_value.index, bytecode);
+      break;
+    case N_DOT:
+      visitor(node->dot_value.object, bytecode);
+      break;
+    case N_PREFIX:
+      visitor(node->prefix_value.operand, bytecode);
+      break;
+    case N_INFIX:
+      visitor(node->infix_value.left, bytecode);
+      visitor(node->infix_value.right, bytecode);
+      break;
+    case N_IF:
+      visitor(node->if_value.cond, bytecode);
+      visitor(node->if_value.cons, bytecode);
+      if (node->if_value.alt) {
+        visitor(node->if_value.alt, bytecode);
+      }
+      break;
+    case N_FOR:
+      visitor(node->for_value.collection, bytecode);
+      visitor(node->for_value.body, bytecode);
+      if (node->for_value.alt) {
+        visitor(node->for_value.alt, bytecode);
+      }
+      break;
+    case N_SWITCH:
+      visitor(node->switch_value.expr, bytecode);
+      for (PropertyList *c = node->switch_value.cases; c; c = c->tail) {
+        visitor(&c->key, bytecode);
+        visitor(&c->value, bytecode);
+      }
+      if (node->switch_value.default_case) {
+        visitor(node->switch_value.default_case, bytecode);
+      }
+      break;
+    case N_EXPORT:
+      if (node->export_value.right) {
+        visitor(node->export_value.right, bytecode);
+      }
+      break;
+    case N_ASSIGN:
+      visitor(node->assign_value.left, bytecode);
+      visitor(node->assign_value.right, bytecode);
+      break;
+    case N_SUPPRESS:
+      visitor(node->suppress_value, bytecode);
+      break;
+    case N_RETURN:
+      if (node->return_value) {
+        visitor(node->return_value, bytecode);
+      }
+      break;
+  }
+}
+
+static void collect_locals(Node *node, Bytecode *bytecode) {
+  if (node->type == N_ASSIGN && node->assign_value.left->type == N_NAME) {
+    add_local(node->assign_value.left->name_value, bytecode);
+  } else if (node->type == N_FOR) {
+    if (node->for_value.key) {
+      add_local(node->for_value.key, bytecode);
+    }
+    add_local(node->for_value.value, bytecode);
+  }
+  visit_children(node, collect_locals, bytecode);
+}
+
+static void remove_exports(Node *node, Bytecode *bytecode) {
+  if (node->type == N_EXPORT) {
+    remove_local(node->export_value.left, bytecode);
+  }
+  visit_children(node, remove_exports, bytecode);
+}
+
+static void push(size_t n, Compiler *compiler) {
+  compiler->stack_size += n;
+  if (compiler->stack_size > compiler->bytecode->max_stack) {
+    compiler->bytecode->max_stack = compiler->stack_size;
+  }
+}
+
+static void pop(size_t n, Compiler *compiler) {
+  compiler->stack_size -= n;
+}
+
+static void push_frame(Compiler *compiler) {
+  compiler->frames++;
+  if (compiler->frames > compiler->bytecode->max_frames) {
+    compiler->bytecode->max_frames = compiler->frames;
+  }
+}
+
+// If sequence_call is set, the result is passed directly to a collection function and may be a lazy sequence
+static void compile_apply(Node *node, int sequence_call, Compiler *compiler) {
+  size_t argc = LL_SIZE(node->apply_value.args);
+  if (argc > compiler->bytecode->max_args) {
+    compiler->bytecode->max_args = argc;
+  }
+  for (NodeList *arg = node->apply_value.args; arg; arg = arg->tail) {
+    if (arg == node->apply_value.args && arg->head.type == N_APPLY && node->apply_value.callee->type == N_NAME
+        && is_sequence_function(node->apply_value.callee->name_value)) {
+      compile_apply(&arg->head, 1, compiler);
+    } else {
+      compile_node(&arg->head, compiler);
+    }
+  }
+  if (node->apply_value.callee->type == N_NAME) {
+    emit(OP_CALL_NAME, add_node(node, compiler), sequence_call, compiler);
+  } else {
+    compile_node(node->apply_value.callee, compiler);
+    emit(OP_CALL, add_node(node, compiler), sequence_call, compiler);
+    pop(1, compiler);
+  }
+  pop(argc, compiler);
+  push(1, compiler);
+}
+
+static void compile_infix(Node *node, Compiler *compiler) {
+  compile_node(node->infix_value.left, compiler);
+  if (node->infix_value.operator == I_AND) {
+    size_t jump_nil = emit(OP_JUMP_IF_FALSE, 0, 0, compiler);
+    pop(1, compiler);
+    compile_node(node->infix_value.right, compiler);
+    size_t jump_end = emit(OP_JUMP, 0, 0, compiler);
+    pop(1, compiler);
+    patch(jump_nil, compiler);
+    emit(OP_NIL, 0, 0, compiler);
+    push(1, compiler);
+    patch(jump_end, compiler);
+  } else if (node->infix_value.operator == I_OR) {
+    size_t jump_end = emit(OP_JUMP_IF_TRUE, 0, 0, compiler);
+    pop(1, compiler);
+    compile_node(node->infix_value.right, compiler);
+    patch(jump_end, compiler);
+  } else {
+    compile_node(node->infix_value.right, compiler);
+    emit(OP_INFIX, add_node(node, compiler), 0, compiler);
+    pop(1, compiler);
+  }
+}
+
+static void compile_optional(Node *node, Compiler *compiler) {
+  if (node) {
+    compile_node(node, compiler);
+  } else {
+    emit(OP_NIL, 0, 0, compiler);
+    push(1, compiler);
+  }
+}
+
+static void compile_if(Node *node, Compiler *compiler) {
+  compile_node(node->if_value.cond, compiler);
+  size_t jump_alt = emit(OP_JUMP_IF_FALSE, 0, 0, compiler);
+  pop(1, compiler);
+  compile_node(node->if_value.cons, compiler);
+  size_t jump_end = emit(OP_JUMP, 0, 0, compiler);
+  pop(1, compiler);
+  patch(jump_alt, compiler);
+  compile_optional(node->if_value.alt, compiler);
+  patch(jump_end, compiler);
+}
+
+static void compile_store(Symbol name, Compiler *compiler) {
+  uint32_t slot;
+  if (find_local(name, compiler->bytecode, &slot)) {
+    emit(OP_STORE_LOCAL, 0, slot, compiler);
+  } else {
+    emit(OP_STORE_NAME, add_constant(create_symbol(name), compiler), 0, compiler);
+  }
+  pop(1, compiler);
+}
+
+/* The loop frame is pushed by OP_FOR_BEGIN, which jumps to the instruction
+ * following OP_FOR_CATCH on a non-empty collection and otherwise falls
+ * through to the alternative. OP_FOR_CATCH is the frame's handler and falls
+ * through to OP_FOR_NEXT on continue. An inline loop (depth 1) appends
+ * directly to the output of the enclosing frame instead of producing a
+ * string. */
+static void compile_for(Node *node, int inline_loop, Compiler *compiler) {
+  compile_node(node->for_value.collection, compiler);
+  size_t begin = emit_local(OP_FOR_BEGIN, 0, add_node(node, compiler), inline_loop, compiler);
+  pop(1, compiler);
+  if (inline_loop) {
+    if (node->for_value.alt) {
+      compile_append(node->for_value.alt, compiler);
+    }
+  } else {
+    compile_optional(node->for_value.alt, compiler);
+    pop(1, compiler);
+  }
+  size_t jump_end = emit(OP_JUMP, 0, 0, compiler);
+  patch(begin, compiler);
+  size_t catch = emit(OP_FOR_CATCH, 0, 0, compiler);
+  size_t next = emit(OP_FOR_NEXT, 0, 0, compiler);
+  push_frame(compiler);
+  push(1, compiler);
+  if (node->for_value.key) {
+    push(1, compiler);
+    compile_store(node->for_value.key, compiler);
+  }
+  compile_store(node->for_value.value, compiler);
+  if (node->for_value.body->type == N_BLOCK) {
+    compile_append(node->for_value.body, compiler);
+    emit(OP_FOR_APPEND, next, 0, compiler);
+  } else {
+    compile_node(node->for_value.body, compiler);
+    emit(OP_FOR_APPEND, next, 1, compiler);
+    pop(1, compiler);
+  }
+  patch(catch, compiler);
+  patch(next, compiler);
+  emit(OP_FOR_END, 0, 0, compiler);
+  compiler->frames--;
+  if (!inline_loop) {
+    push(1, compiler);
+  }
+  patch(jump_end, compiler);
+}
+
+static void compile_switch(Node *node, Compiler *compiler) {
+  size_t cases = 0;
+  for (PropertyList *c = node->switch_value.cases; c; c = c->tail) {
+    cases++;
+  }
+  size_t *jumps = allocate((cases + 1) * sizeof(size_t));
+  size_t i = 0;
+  compile_node(node->switch_value.expr, compiler);
+  for (PropertyList *c = node->switch_value.cases; c; c = c->tail) {
+    compile_node(&c->key, compiler);
+    size_t jump_next = emit(OP_CASE, 0, 0, compiler);
+    pop(2, compiler);
+    compile_node(&c->value, compiler);
+    jumps[i++] = emit(OP_JUMP, 0, 0, compiler);
+    patch(jump_next, compiler);
+  }
+  emit(OP_POP, 0, 0, compiler);
+  pop(1, compiler);
+  compile_optional(node->switch_value.default_case, compiler);
+  while (i > 0) {
+    patch(jumps[--i], compiler);
+  }
+  free(jumps);
+}
+
+static void compile_assign(Node *node, Compiler *compiler) {
+  compile_node(node->assign_value.right, compiler);
+  Node *left = node->assign_value.left;
+  uint32_t slot;
+  switch (left->type) {
+    case N_NAME:
+      if (find_local(left->name_value, compiler->bytecode, &slot)) {
+        emit(OP_ASSIGN_LOCAL, add_node(node, compiler), slot, compiler);
+      } else {
+        emit(OP_ASSIGN_NAME, add_node(node, compiler), 0, compiler);
+      }
+      break;
+    case N_SUBSCRIPT:
+      compile_node(left->subscript_value.list, compiler);
+      compile_node(left->subscript_value.index, compiler);
+      emit(OP_ASSIGN_SUBSCRIPT, add_node(node, compiler), 0, compiler);
+      pop(2, compiler);
+      break;
+    case N_DOT:
+      compile_node(left->dot_value.object, compiler);
+      emit(OP_ASSIGN_DOT, add_node(node, compiler), 0, compiler);
+      pop(1, compiler);
+      break;
+    default:
+      emit(OP_ASSIGN_INVALID, add_node(node, compiler), 0, compiler);
+      break;
+  }
+}
+
+/* Appends the output of a node to the output of the current frame. Nested
+ * blocks and loops write to the same buffer instead of building
+ * intermediate strings. */
+static void compile_append(Node *node, Compiler *compiler) {
+  switch (node->type) {
+    case N_STRING:
+      emit(OP_APPEND_STRING, add_node(node, compiler), 0, compiler);
+      break;
+    case N_BLOCK:
+      for (NodeList *child = node->block_value; child; child = child->tail) {
+        compile_append(&child->head, compiler);
+      }
+      break;
+    case N_FOR:
+      compile_for(node, 1, compiler);
+      break;
+    default:
+      compile_node(node, compiler);
+      emit(OP_APPEND, 0, 0, compiler);
+      pop(1, compiler);
+      break;
+  }
+}
+
+static void compile_block(Node *node, Compiler *compiler) {
+  size_t begin = emit(OP_BLOCK_BEGIN, 0, 0, compiler);
+  push_frame(compiler);
+  for (NodeList *child = node->block_value; child; child = child->tail) {
+    compile_append(&child->head, compiler);
+  }
+  emit(OP_BLOCK_END, 0, 0, compiler);
+  compiler->frames--;
+  push(1, compiler);
+  size_t jump_end = emit(OP_JUMP, 0, 0, compiler);
+  patch(begin, compiler);
+  emit(OP_BLOCK_UNWIND, 0, 0, compiler);
+  patch(jump_end, compiler);
+}
+
+static void compile_suppress(Node *node, Compiler *compiler) {
+  Node *operand = node->suppress_value;
+  uint32_t slot;
+  uint16_t depth;
+  switch (operand->type) {
+    case N_NAME:
+      if (resolve_local(operand->name_value, compiler, &slot, &depth)) {
+        emit_local(OP_LOAD_LOCAL, add_node(node, compiler), slot, depth, compiler);
+      } else {
+        emit(OP_LOAD_NAME, add_node(operand, compiler), 1, compiler);
+      }
+      push(1, compiler);
+      break;
+    case N_SUBSCRIPT:
+      compile_node(operand->subscript_value.list, compiler);
+      compile_node(operand->subscript_value.index, compiler);
+      emit(OP_SUBSCRIPT, add_node(operand, compiler), 1, compiler);
+      pop(1, compiler);
+      break;
+    case N_DOT:
+      compile_node(operand->dot_value.object, compiler);
+      emit(OP_DOT, add_node(operand, compiler), 1, compiler);
+      break;
+    default:
+      compile_node(operand, compiler);
+      break;
+  }
+}
+
+static void compile_node(Node *node, Compiler *compiler) {
+  uint32_t slot;
+  uint16_t depth;
+  switch (node->type) {
+    case N_NAME:
+      if (resolve_local(node->name_value, compiler, &slot, &depth)) {
+        emit_local(OP_LOAD_LOCAL, add_node(node, compiler), slot, depth, compiler);
+      } else {
+        emit(OP_LOAD_NAME, add_node(node, compiler), 0, compiler);
+      }
+      push(1, compiler);
+      break;
+    case N_INT:
+      emit(OP_CONST, add_constant(create_int(node->int_value), compiler), 0, compiler);
+      push(1, compiler);
+      break;
+    case N_FLOAT:
+      emit(OP_CONST, add_constant(create_float(node->float_value), compiler), 0, compiler);
+      push(1, compiler);
+      break;
+    case N_STRING:
+      emit(OP_STRING, add_node(node, compiler), 0, compiler);
+      push(1, compiler);
+      break;
+    case N_LIST: {
+      size_t size = 0;
+      for (NodeList *item = node->list_value; item; item = item->tail) {
+        compile_node(&item->head, compiler);
+        size++;
+      }
+      emit(OP_LIST, size, 0, compiler);
+      pop(size, compiler);
+      push(1, compiler);
+      break;
+    }
+    case N_OBJECT: {
+      size_t size = 0;
+      for (PropertyList *property = node->object_value; property; property = property->tail, size++) {
+        if (property->key.type == N_NAME) {
+          emit(OP_CONST, add_constant(create_symbol(property->key.name_value), compiler), 0, compiler);
+          push(1, compiler);
+        } else {
+          compile_node(&property->key, compiler);
+        }
+        compile_node(&property->value, compiler);
+      }
+      emit(OP_OBJECT, size, 0, compiler);
+      pop(2 * size, compiler);
+      push(1, compiler);
+      break;
+    }
+    case N_APPLY:
+      compile_apply(node, 0, compiler);
+      break;
+    case N_SUBSCRIPT:
+      compile_node(node->subscript_value.list, compiler);
+      compile_node(node->subscript_value.index, compiler);
+      emit(OP_SUBSCRIPT, add_node(node, compiler), 0, compiler);
+      pop(1, compiler);
+      break;
+    case N_DOT:
+      compile_node(node->dot_value.object, compiler);
+      emit(OP_DOT, add_node(node, compiler), 0, compiler);
+      break;
+    case N_PREFIX:
+      compile_node(node->prefix_value.operand, compiler);
+      emit(OP_PREFIX, add_node(node, compiler), 0, compiler);
+      break;
+    case N_INFIX:
+      compile_infix(node, compiler);
+      break;
+    case N_TUPLE:
+      emit(OP_TUPLE, add_node(node, compiler), 0, compiler);
+      push(1, compiler);
+      break;
+    case N_FN: {
+      uint32_t function = add_function(compile_function(node, compiler), compiler);
+      emit(OP_CLOSURE, add_node(node, compiler), function, compiler);
+      push(1, compiler);
+      break;
+    }
+    case N_IF:
+      compile_if(node, compiler);
+      break;
+    case N_FOR:
+      compile_for(node, 0, compiler);
+      break;
+    case N_SWITCH:
+      compile_switch(node, compiler);
+      break;
+    case N_EXPORT:
+      if (node->export_value.right) {
+        compile_node(node->export_value.right, compiler);
+        emit(OP_EXPORT, add_node(node, compiler), 1, compiler);
+        pop(1, compiler);
+      } else {
+        emit(OP_EXPORT, add_node(node, compiler), 0, compiler);
+      }
+      push(1, compiler);
+      break;
+    case N_ASSIGN:
+      compile_assign(node, compiler);
+      break;
+    case N_BLOCK:
+      compile_block(node, compiler);
+      break;
+    case N_SUPPRESS:
+      compile_suppress(node, compiler);
+      break;
+    case N_RETURN:
+      compile_optional(node->return_value, compiler);
+      emit(OP_RETURN, 0, 0, compiler);
+      break;
+    case N_BREAK:
+    case N_CONTINUE:
+      emit(OP_BREAK, add_node(node, compiler), 0, compiler);
+      push(1, compiler);
+      break;
+  }
+}
+
+static Bytecode *compile_function(Node *node, Compiler *parent) {
+  Compiler compiler = { .bytecode = create_bytecode(), .stack_size = 0, .frames = 0 };
+  compiler.bytecode->parent = parent->bytecode;
+  for (NameList *param = node->fn_value.params; param; param = param->tail) {
+    add_local(param->head, compiler.bytecode);
+  }
+  collect_locals(node->fn_value.body, compiler.bytecode);
+  remove_exports(node->fn_value.body, compiler.bytecode);
+  compile_node(node->fn_value.body, &compiler);
+  emit(OP_HALT, 0, 0, &compiler);
+  return compiler.bytecode;
+}
+
+Bytecode *compile(Node *node) {
+  Compiler compiler = { .bytecode = create_bytecode(), .stack_size = 0, .frames = 0 };
+  compile_node(node, &compiler);
+  emit(OP_HALT, 0, 0, &compiler);
+  return compiler.bytecode;
+}
+
+void init_locals(Bytecode *bytecode, Env *env) {
+  env->function = bytecode;
+  env->locals_size = bytecode->locals_size;
+  if (!bytecode->locals_size) {
+    return;
+  }
+  env->locals = arena_allocate(bytecode->locals_size * sizeof(Local), env->arena);
+  for (size_t i = 0; i < bytecode->locals_size; i++) {
+    env->locals[i] = (Local) { .name = bytecode->locals[i], .defined = 0, .value = nil_value };
+  }
+}
+
+static Local *get_local(Bytecode *bytecode, Env *env, uint16_t depth, uint32_t slot) {
+  while (depth-- > 0 && env) {
+    env = env->parent_env;
+    bytecode = bytecode->parent;
+  }
+  if (env && bytecode && env->function == bytecode) {
+    return &env->locals[slot];
+  }
+  return NULL;
+}
+
+static Value frame_to_string(Frame *frame, Env *env) {
+  Value string = create_string(frame->buffer.data, frame->buffer.size, env->arena);
+  delete_buffer(frame->buffer);
+  return string;
+}
+
+static int frame_next(Frame *frame, Value *key, Value *value) {
+  switch (frame->collection.type) {
+    case V_ARRAY:
+      if (frame->index >= frame->collection.array_value->size) {
+        return 0;
+      }
+      *key = create_int(frame->index);
+      *value = frame->collection.array_value->cells[frame->index++];
+      return 1;
+    case V_OBJECT:
+      return object_iterator_next(&frame->it, key, value);
+    case V_STRING:
+      if (frame->index >= frame->collection.string_value->size) {
+        return 0;
+      }
+      *key = create_int(frame->index);
+      *value = create_int(frame->collection.string_value->bytes[frame->index++]);
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static int is_empty_collection(Node *node, Value collection) {
+  switch (collection.type) {
+    case V_ARRAY:
+      return collection.array_value->size == 0;
+    case V_OBJECT:
+      return !object_size(collection.object_value);
+    case V_STRING:
+      return collection.string_value->size == 0;
+    default:
+      eval_error(*node->for_value.collection, "value of type %s is not iterable", value_name(collection.type));
+      return 1;
+  }
+}
+
+#define RAISE() \
+  if (!fp) {\
+    return signal;\
+  }\
+  sp = frames[fp - 1].stack_size;\
+  ip = code + frames[fp - 1].handler
+
+#define NODE (bytecode->nodes[instruction.a])
+
+static InterpreterResult run(Bytecode *bytecode, Env *env, Buffer *sink) {
+  Value *stack = alloca((bytecode->max_stack + 1) * sizeof(Value));
+  Frame *frames = alloca((bytecode->max_frames + 1) * sizeof(Frame));
+  Tuple *args = alloca(sizeof(Tuple) + bytecode->max_args * sizeof(Value));
+  Instruction *code = bytecode->code;
+  Instruction *ip = code;
+  size_t sp = 0;
+  size_t fp = 0;
+  InterpreterResult signal = { IR_VALUE, nil_value, 0 };
+  while (1) {
+    Instruction instruction = *(ip++);
+    switch ((OpCode) instruction.op) {
+      case OP_HALT:
+        return (InterpreterResult) { IR_VALUE, stack[sp - 1], 0 };
+      case OP_NIL:
+        stack[sp++] = nil_value;
+        break;
+      case OP_CONST:
+        stack[sp++] = bytecode->constants[instruction.a];
+        break;
+      case OP_STRING:
+        stack[sp++] = create_string(NODE->string_value.bytes, NODE->string_value.size, env->arena);
+        break;
+      case OP_LOAD_NAME:
+        stack[sp++] = eval_name(*NODE, instruction.b, env);
+        break;
+      case OP_LOAD_LOCAL: {
+        Local *local = get_local(bytecode, env, instruction.depth, instruction.b);
+        if (local && local->defined) {
+          stack[sp++] = local->value;
+        } else if (NODE->type == N_SUPPRESS) {
+          stack[sp++] = eval_name(*NODE->suppress_value, 1, env);
+        } else {
+          stack[sp++] = eval_name(*NODE, 0, env);
+        }
+        break;
+      }
+      case OP_STORE_NAME:
+        env_put(bytecode->constants[instruction.a].symbol_value, stack[--sp], env);
+        break;
+      case OP_STORE_LOCAL:
+        if (env->function == bytecode) {
+          env->locals[instruction.b].value = stack[--sp];
+          env->locals[instruction.b].defined = 1;
+        } else {
+          env_put(bytecode->locals[instruction.b], stack[--sp], env);
+        }
+        break;
+      case OP_LIST: {
+        Value array = create_array(instruction.a, env->arena);
+        sp -= instruction.a;
+        for (size_t i = 0; i < instruction.a; i++) {
+          array_push(array.array_value, stack[sp + i], env->arena);
+        }
+        stack[sp++] = array;
+        break;
+      }
+      case OP_OBJECT: {
+        Value object = create_object(instruction.a, env->arena);
+        sp -= 2 * instruction.a;
+        for (size_t i = 0; i < instruction.a; i++) {
+          object_put(object.object_value, stack[sp + 2 * i], stack[sp + 2 * i + 1], env->arena);
+        }
+        stack[sp++] = object;
+        break;
+      }
+      case OP_CALL:
+      case OP_CALL_NAME: {
+        Value callee;
+        if (instruction.op == OP_CALL) {
+          callee = stack[--sp];
+        } else if (!env_get(NODE->apply_value.callee->name_value, &callee, env)) {
+          eval_error(*NODE->apply_value.callee, "undefined function: %s", NODE->apply_value.callee->name_value);
+          sp -= LL_SIZE(NODE->apply_value.args);
+          stack[sp++] = nil_value;
+          break;
+        }
+        args->size = LL_SIZE(NODE->apply_value.args);
+        sp -= args->size;
+        memcpy(args->values, stack + sp, args->size * sizeof(Value));
+        stack[sp++] = call_value(*NODE, callee, args, instruction.b, env);
+        break;
+      }
+      case OP_SUBSCRIPT: {
+        Value index = stack[--sp];
+        stack[sp - 1] = subscript_value(*NODE, stack[sp - 1], index, instruction.b);
+        break;
+      }
+      case OP_DOT:
+        stack[sp - 1] = get_property(*NODE, stack[sp - 1], instruction.b);
+        break;
+      case OP_PREFIX:
+        stack[sp - 1] = eval_prefix_operator(*NODE, stack[sp - 1]);
+        break;
+      case OP_INFIX: {
+        Value right = stack[--sp];
+        stack[sp - 1] = eval_infix_operator(*NODE, stack[sp - 1], right, env);
+        break;
+      }
+      case OP_TUPLE:
+        eval_error(*NODE, "unexpected tuple");
+        stack[sp++] = nil_value;
+        break;
+      case OP_CLOSURE: {
+        Value closure = create_closure(NODE->fn_value.params, NODE->fn_value.free_variables,
+            *NODE->fn_value.body, env, env->arena);
+        closure.closure_value->code = bytecode->functions[instruction.b];
+        stack[sp++] = closure;
+        break;
+      }
+      case OP_POP:
+        sp--;
+        break;
+      case OP_JUMP:
+        ip = code + instruction.a;
+        break;
+      case OP_JUMP_IF_FALSE:
+        if (!is_truthy(stack[--sp])) {
+          ip = code + instruction.a;
+        }
+        break;
+      case OP_JUMP_IF_TRUE:
+        if (is_truthy(stack[sp - 1])) {
+          ip = code + instruction.a;
+        } else {
+          sp--;
+        }
+        break;
+      case OP_CASE: {
+        Value key = stack[--sp];
+        if (equals(stack[sp - 1], key)) {
+          sp--;
+        } else {
+          ip = code + instruction.a;
+        }
+        break;
+      }
+      case OP_EXPORT:
+        if (instruction.b) {
+          env_put(NODE->export_value.left, stack[--sp], env);
+        }
+        array_push(env->exports, create_symbol(NODE->export_value.left), env->arena);
+        stack[sp++] = nil_value;
+        break;
+      case OP_ASSIGN_NAME:
+        assign_name(*NODE, stack[sp - 1], env);
+        stack[sp - 1] = nil_value;
+        break;
+      case OP_ASSIGN_LOCAL: {
+        Local *local = get_local(bytecode, env, 0, instruction.b);
+        if (!local || (NODE->assign_value.operator != I_NONE && !local->defined)) {
+          assign_name(*NODE, stack[sp - 1], env);
+        } else {
+          if (NODE->assign_value.operator != I_NONE) {
+            stack[sp - 1] = eval_assign_operator(*NODE, local->value, stack[sp - 1], env);
+          }
+          local->value = stack[sp - 1];
+          local->defined = 1;
+        }
+        stack[sp - 1] = nil_value;
+        break;
+      }
+      case OP_ASSIGN_SUBSCRIPT:
+        sp -= 2;
+        assign_subscript(*NODE, stack[sp], stack[sp + 1], stack[sp - 1], env);
+        stack[sp - 1] = nil_value;
+        break;
+      case OP_ASSIGN_DOT:
+        sp--;
+        assign_property(*NODE, stack[sp], stack[sp - 1], env);
+        stack[sp - 1] = nil_value;
+        break;
+      case OP_ASSIGN_INVALID:
+        eval_error(*NODE->assign_value.left, "left side of assignment is invalid");
+        stack[sp - 1] = nil_value;
+        break;
+      case OP_BLOCK_BEGIN:
+        frames[fp] = (Frame) { .handler = instruction.a, .stack_size = sp };
+        if (sink && ip - 1 == code) {
+          frames[fp].out = sink;
+        } else {
+          frames[fp].buffer = create_buffer(0);
+          frames[fp].out = &frames[fp].buffer;
+        }
+        fp++;
+        break;
+      case OP_APPEND:
+        value_to_string(stack[--sp], frames[fp - 1].out);
+        break;
+      case OP_APPEND_STRING:
+        buffer_append_bytes(frames[fp - 1].out, NODE->string_value.bytes, NODE->string_value.size);
+        break;
+      case OP_BLOCK_END:
+        fp--;
+        if (frames[fp].out == &frames[fp].buffer) {
+          stack[sp++] = frame_to_string(&frames[fp], env);
+        } else {
+          stack[sp++] = nil_value;
+        }
+        break;
+      case OP_BLOCK_UNWIND:
+        fp--;
+        if (signal.type != IR_RETURN) {
+          value_to_string(signal.value, frames[fp].out);
+          if (frames[fp].out == &frames[fp].buffer) {
+            signal.value = frame_to_string(&frames[fp], env);
+          } else {
+            signal.value = nil_value;
+          }
+        } else if (frames[fp].out == &frames[fp].buffer) {
+          delete_buffer(frames[fp].buffer);
+        }
+        RAISE();
+        break;
+      case OP_FOR_BEGIN: {
+        Node *loop = bytecode->nodes[instruction.b];
+        Value collection = stack[--sp];
+        if (!is_empty_collection(loop, collection)) {
+          frames[fp] = (Frame) {
+            .handler = instruction.a,
+            .stack_size = sp,
+            .node = loop,
+            .collection = collection,
+            .index = 0,
+            .loops = env->loops
+          };
+          if (instruction.depth) {
+            frames[fp].out = frames[fp - 1].out;
+          } else {
+            frames[fp].buffer = create_buffer(0);
+            frames[fp].out = &frames[fp].buffer;
+          }
+          if (collection.type == V_OBJECT) {
+            frames[fp].it = iterate_object(collection.object_value);
+          }
+          fp++;
+          ip = code + instruction.a + 1;
+        }
+        break;
+      }
+      case OP_FOR_NEXT: {
+        Frame *frame = &frames[fp - 1];
+        Value key, value;
+        if (!frame_next(frame, &key, &value)) {
+          ip = code + instruction.a;
+          break;
+        }
+        stack[sp++] = value;
+        if (frame->node->for_value.key) {
+          stack[sp++] = key;
+        }
+        env->loops = frame->loops + 1;
+        break;
+      }
+      case OP_FOR_APPEND:
+        if (instruction.b) {
+          value_to_string(stack[--sp], frames[fp - 1].out);
+        }
+        env->loops = frames[fp - 1].loops;
+        ip = code + instruction.a;
+        break;
+      case OP_FOR_CATCH:
+        env->loops = frames[fp - 1].loops;
+        if (signal.type != IR_RETURN) {
+          value_to_string(signal.value, frames[fp - 1].out);
+        }
+        if (signal.type == IR_CONTINUE && signal.level <= 1) {
+          signal = (InterpreterResult) { IR_VALUE, nil_value, 0 };
+        } else {
+          ip = code + instruction.a;
+        }
+        break;
+      case OP_FOR_END: {
+        fp--;
+        int owner = frames[fp].out == &frames[fp].buffer;
+        if (signal.type == IR_RETURN) {
+          if (owner) {
+            delete_buffer(frames[fp].buffer);
+          }
+          RAISE();
+          break;
+        }
+        if ((signal.type == IR_CONTINUE || signal.type == IR_BREAK) && signal.level > 1) {
+          signal.value = owner ? frame_to_string(&frames[fp], env) : nil_value;
+          signal.level--;
+          RAISE();
+          break;
+        }
+        signal = (InterpreterResult) { IR_VALUE, nil_value, 0 };
+        if (owner) {
+          stack[sp++] = frame_to_string(&frames[fp], env);
+        }
+        break;
+      }
+      case OP_RETURN:
+        signal = (InterpreterResult) { IR_RETURN, stack[--sp], 0 };
+        RAISE();
+        break;
+      case OP_BREAK: {
+        int64_t level = get_loop_level(*NODE, env);
+        if (!level) {
+          stack[sp++] = nil_value;
+          break;
+        }
+        signal = (InterpreterResult) { NODE->type == N_BREAK ? IR_BREAK : IR_CONTINUE, nil_value, level };
+        RAISE();
+        break;
+      }
+    }
+  }
+}
+
+InterpreterResult execute(Bytecode *bytecode, Env *env) {
+  return run(bytecode, env, NULL);
+}
+
+InterpreterResult execute_to_buffer(Bytecode *bytecode, Env *env, Buffer *buffer) {
+  size_t start = buffer->size;
+  InterpreterResult result = run(bytecode, env, buffer);
+  if (result.type == IR_RETURN) {
+    buffer->size = start;
+  } else {
+    value_to_string(result.value, buffer);
+    result.value = nil_value;
+  }
+  return result;
+}
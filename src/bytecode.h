@@ -0,0 +1,95 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include "ast.h"
+#include "interpreter.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+  OP_HALT,
+  OP_NIL,
+  OP_CONST,
+  OP_STRING,
+  OP_LOAD_NAME,
+  OP_LOAD_LOCAL,
+  OP_STORE_NAME,
+  OP_STORE_LOCAL,
+  OP_LIST,
+  OP_OBJECT,
+  OP_CALL,
+  OP_CALL_NAME,
+  OP_SUBSCRIPT,
+  OP_DOT,
+  OP_PREFIX,
+  OP_INFIX,
+  OP_TUPLE,
+  OP_CLOSURE,
+  OP_POP,
+  OP_JUMP,
+  OP_JUMP_IF_FALSE,
+  OP_JUMP_IF_TRUE,
+  OP_CASE,
+  OP_EXPORT,
+  OP_ASSIGN_NAME,
+  OP_ASSIGN_LOCAL,
+  OP_ASSIGN_SUBSCRIPT,
+  OP_ASSIGN_DOT,
+  OP_ASSIGN_INVALID,
+  OP_BLOCK_BEGIN,
+  OP_APPEND,
+  OP_APPEND_STRING,
+  OP_BLOCK_END,
+  OP_BLOCK_UNWIND,
+  OP_FOR_BEGIN,
+  OP_FOR_NEXT,
+  OP_FOR_APPEND,
+  OP_FOR_CATCH,
+  OP_FOR_END,
+  OP_RETURN,
+  OP_BREAK
+} OpCode;
+
+typedef struct {
+  uint8_t op;
+  uint16_t depth;
+  uint32_t a;
+  uint32_t b;
+} Instruction;
+
+struct Bytecode {
+  Bytecode *parent;
+  Instruction *code;
+  size_t size;
+  size_t capacity;
+  Value *constants;
+  size_t constants_size;
+  size_t constants_capacity;
+  Node **nodes;
+  size_t nodes_size;
+  size_t nodes_capacity;
+  Bytecode **functions;
+  size_t functions_size;
+  size_t functions_capacity;
+  Symbol *locals;
+  size_t locals_size;
+  size_t locals_capacity;
+  size_t max_stack;
+  size_t max_frames;
+  size_t max_args;
+};
+
+Bytecode *compile(Node *node);
+void delete_bytecode(Bytecode *bytecode);
+void init_locals(Bytecode *bytecode, Env *env);
+InterpreterResult execute(Bytecode *bytecode, Env *env);
+InterpreterResult execute_to_buffer(Bytecode *bytecode, Env *env, Buffer *buffer);
+
+#endif
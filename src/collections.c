@@ -7,7 +7,6 @@
 #include "collections.h"
 
 #include "interpreter.h"
-#include "util/sort_r.h"
 
 #include <alloca.h>
 #include <stdlib.h>
@@ -15,14 +14,70 @@
 
 #ifdef WITH_UNICODE
 #include <unicode/ucol.h>
+#include <unicode/ustring.h>
 #endif
 
 typedef struct {
   Value func;
   Env *env;
   int reverse;
+#ifdef WITH_UNICODE
+  UCollator *collator;
+#endif
 } CompareContext;
 
+typedef struct {
+  Value key;
+  Value value;
+  size_t index;
+} SortItem;
+
+typedef int (* ItemCompare)(const SortItem *a, const SortItem *b, CompareContext *context);
+
+typedef enum {
+  S_MAP,
+  S_FLAT_MAP,
+  S_FILTER,
+  S_EXCLUDE,
+  S_TAKE,
+  S_DROP,
+  S_SORT_BY,
+  S_SORT_BY_DESC
+} SequenceOp;
+
+typedef struct Sequence Sequence;
+
+// A lazy sequence is an operation applied to either an array or another sequence. Consecutive operations are fused
+// into a single pass over the source array when the sequence is forced, and sorting is the only operation that
+// requires the complete output of the preceding operations.
+struct Sequence {
+  Sequence *source;
+  Array *array;
+  SequenceOp op;
+  Value func;
+  int64_t n;
+  Env *env;
+};
+
+typedef struct {
+  Sequence *sequence;
+  int64_t count;
+} Stage;
+
+typedef struct {
+  Stage *stages;
+  size_t size;
+  Array *dest;
+  Env *env;
+} Pass;
+
+typedef enum {
+  PUSH_MORE,
+  PUSH_STOP,
+  PUSH_ERROR
+} PushResult;
+
+
 static Value length(const Tuple *args, Env *env) {
   check_args(1, args, env);
   Value arg = args->values[0];
@@ -71,7 +126,566 @@ static Value values(const Tuple *args, Env *env) {
   return array;
 }
 
+#ifdef WITH_UNICODE
+// The collator is opened the first time it's needed and kept open until the end of the sort
+static UCollator *get_collator(CompareContext *context) {
+  if (!context->collator) {
+    UErrorCode status = U_ZERO_ERROR;
+    char *locale = NULL; // TODO
+    context->collator = ucol_open(locale, &status);
+    if (U_FAILURE(status)) {
+      env_error(context->env, -1, "collator error: %s", u_errorName(status));
+      context->collator = NULL;
+    }
+  }
+  return context->collator;
+}
+#endif
+
+static void close_compare_context(CompareContext *context) {
+#ifdef WITH_UNICODE
+  if (context->collator) {
+    ucol_close(context->collator);
+    context->collator = NULL;
+  }
+#endif
+}
+
+static int compare_bytes(const String *a, const String *b) {
+  int result = memcmp(a->bytes, b->bytes, a->size < b->size ? a->size : b->size);
+  if (result) {
+    return result;
+  }
+  return (a->size > b->size) - (a->size < b->size);
+}
+
+static int compare_values(const void *pa, const void *pb, void *pc) {
+  Value a = *(Value *) pa;
+  Value b = *(Value *) pb;
+  CompareContext *context = (CompareContext *) pc;
+  if (a.type != b.type) {
+    return a.type - b.type;
+  }
+  switch (a.type) {
+    case V_NIL:
+      return 0;
+    case V_BOOL:
+      return !!a.int_value - !!b.int_value;
+    case V_INT:
+      return a.int_value - b.int_value;
+    case V_FLOAT:
+      if (a.float_value < b.float_value) {
+        return -1;
+      } else if (a.float_value > b.float_value) {
+        return 1;
+      } else {
+        return 0;
+      }
+    case V_SYMBOL:
+      return strcmp(a.symbol_value, b.symbol_value);
+    case V_STRING: {
+#ifdef WITH_UNICODE
+      UCollator *collator = get_collator(context);
+      if (!collator) {
+        return 0;
+      }
+      UErrorCode status = U_ZERO_ERROR;
+      UCollationResult result = ucol_strcollUTF8(collator, (char *) a.string_value->bytes, a.string_value->size,
+          (char *) b.string_value->bytes, b.string_value->size, &status);
+      if (U_FAILURE(status)) {
+        env_error(context->env, -1, "collator error: %s", u_errorName(status));
+        return 0;
+      }
+      return result;
+#else
+      return compare_bytes(a.string_value, b.string_value);
+#endif
+    }
+    case V_ARRAY: {
+      size_t length = a.array_value->size > b.array_value->size ? a.array_value->size : b.array_value->size;
+      for (size_t i = 0; i < length; i++) {
+        int subresult = compare_values(&a.array_value->cells[i], &b.array_value->cells[i], pc);
+        if (subresult) {
+          return subresult;
+        }
+      }
+      if (a.array_value->size > b.array_value->size) {
+        return 1;
+      }
+      if (a.array_value->size < b.array_value->size) {
+        return -1;
+      }
+      return 0;
+    }
+    case V_OBJECT:
+      return 0;
+    case V_TIME:
+      if (a.time_value < b.time_value) {
+        return -1;
+      } else if (a.time_value > b.time_value) {
+        return 1;
+      } else {
+        return 0;
+      }
+    case V_FUNCTION:
+    case V_CLOSURE:
+    case V_LAZY:
+      return 0;
+  }
+  return 0;
+}
+
+static int compare_value_items(const SortItem *a, const SortItem *b, CompareContext *context) {
+  return compare_values(&a->key, &b->key, context);
+}
+
+static int compare_int_items(const SortItem *a, const SortItem *b, CompareContext *context) {
+  return (a->key.int_value > b->key.int_value) - (a->key.int_value < b->key.int_value);
+}
+
+static int compare_float_items(const SortItem *a, const SortItem *b, CompareContext *context) {
+  return (a->key.float_value > b->key.float_value) - (a->key.float_value < b->key.float_value);
+}
+
+static int compare_time_items(const SortItem *a, const SortItem *b, CompareContext *context) {
+  return (a->key.time_value > b->key.time_value) - (a->key.time_value < b->key.time_value);
+}
+
+static int compare_byte_items(const SortItem *a, const SortItem *b, CompareContext *context) {
+  return compare_bytes(a->key.string_value, b->key.string_value);
+}
+
+static int compare_with_items(const SortItem *a, const SortItem *b, CompareContext *context) {
+  Tuple *func_args = alloca(sizeof(Tuple) + 2 * sizeof(Value));
+  func_args->size = 2;
+  func_args->values[0] = a->value;
+  func_args->values[1] = b->value;
+  Value result;
+  if (!apply(context->func, func_args, &result, context->env)) {
+    return 0;
+  }
+  if (result.type == V_INT) {
+    return (result.int_value > 0) - (result.int_value < 0);
+  } else if (result.type == V_FLOAT) {
+    return (result.float_value > 0) - (result.float_value < 0);
+  } else {
+    env_error(context->env, -1, "invalid comparator return value of type %s", value_name(result.type));
+    return 0;
+  }
+}
+
+#ifdef WITH_UNICODE
+// Replaces string keys with collation keys that give the same order when compared bytewise
+static int get_collation_keys(SortItem *items, size_t size, CompareContext *context, Arena *arena) {
+  UCollator *collator = get_collator(context);
+  if (!collator) {
+    return 0;
+  }
+  UChar *buffer = NULL;
+  int32_t capacity = 0;
+  for (size_t i = 0; i < size; i++) {
+    String *string = items[i].key.string_value;
+    UErrorCode status = U_ZERO_ERROR;
+    int32_t length;
+    u_strFromUTF8WithSub(buffer, capacity, &length, (char *) string->bytes, string->size, 0xFFFD, NULL, &status);
+    if (status == U_BUFFER_OVERFLOW_ERROR) {
+      capacity = length;
+      buffer = reallocate(buffer, capacity * sizeof(UChar));
+      status = U_ZERO_ERROR;
+      u_strFromUTF8WithSub(buffer, capacity, &length, (char *) string->bytes, string->size, 0xFFFD, NULL, &status);
+    }
+    if (U_FAILURE(status)) {
+      env_error(context->env, -1, "collator error: %s", u_errorName(status));
+      free(buffer);
+      return 0;
+    }
+    int32_t key_size = ucol_getSortKey(collator, buffer, length, NULL, 0);
+    Value key = allocate_string(key_size, arena);
+    ucol_getSortKey(collator, buffer, length, key.string_value->bytes, key_size);
+    items[i].key = key;
+  }
+  free(buffer);
+  return 1;
+}
+#endif
+
+// Chooses a comparator based on the types of the keys so that the type is only checked once per sort
+static ItemCompare get_item_compare(SortItem *items, size_t size, CompareContext *context, Arena *arena) {
+  if (!size) {
+    return compare_value_items;
+  }
+  ValueType type = items[0].key.type;
+  for (size_t i = 1; i < size; i++) {
+    if (items[i].key.type != type) {
+      return compare_value_items;
+    }
+  }
+  switch (type) {
+    case V_INT:
+      return compare_int_items;
+    case V_FLOAT:
+      return compare_float_items;
+    case V_TIME:
+      return compare_time_items;
+    case V_STRING:
+#ifdef WITH_UNICODE
+      if (!get_collation_keys(items, size, context, arena)) {
+        return NULL;
+      }
+#endif
+      return compare_byte_items;
+    default:
+      return compare_value_items;
+  }
+}
+
+// Items with equal keys are ordered by their original position, which makes every sort stable
+static int order_items(const SortItem *a, const SortItem *b, ItemCompare compare, CompareContext *context) {
+  int result = compare(a, b, context);
+  if (context->reverse) {
+    result = -result;
+  }
+  if (!result) {
+    result = (a->index > b->index) - (a->index < b->index);
+  }
+  return result;
+}
+
+#define MERGE_SORT_RUN 8
+
+static void merge_sort(SortItem *items, size_t size, ItemCompare compare, CompareContext *context) {
+  for (size_t start = 0; start < size; start += MERGE_SORT_RUN) {
+    size_t end = start + MERGE_SORT_RUN < size ? start + MERGE_SORT_RUN : size;
+    for (size_t i = start + 1; i < end; i++) {
+      SortItem item = items[i];
+      size_t j = i;
+      while (j > start && order_items(&items[j - 1], &item, compare, context) > 0) {
+        items[j] = items[j - 1];
+        j--;
+      }
+      items[j] = item;
+    }
+  }
+  if (size <= MERGE_SORT_RUN) {
+    return;
+  }
+  SortItem *buffer = allocate(size * sizeof(SortItem));
+  SortItem *src = items;
+  SortItem *dest = buffer;
+  for (size_t width = MERGE_SORT_RUN; width < size; width <<= 1) {
+    for (size_t left = 0; left < size; left += 2 * width) {
+      size_t middle = left + width < size ? left + width : size;
+      size_t right = left + 2 * width < size ? left + 2 * width : size;
+      size_t i = left, j = middle, k = left;
+      while (i < middle && j < right) {
+        if (order_items(&src[j], &src[i], compare, context) < 0) {
+          dest[k++] = src[j++];
+        } else {
+          dest[k++] = src[i++];
+        }
+      }
+      memcpy(dest + k, src + i, (middle - i) * sizeof(SortItem));
+      k += middle - i;
+      memcpy(dest + k, src + j, (right - j) * sizeof(SortItem));
+    }
+    SortItem *temp = src;
+    src = dest;
+    dest = temp;
+  }
+  if (src != items) {
+    memcpy(items, src, size * sizeof(SortItem));
+  }
+  free(buffer);
+}
+
+static void sift_down(SortItem *heap, size_t size, size_t i, ItemCompare compare, CompareContext *context) {
+  while (1) {
+    size_t largest = i;
+    size_t left = 2 * i + 1;
+    size_t right = left + 1;
+    if (left < size && order_items(&heap[left], &heap[largest], compare, context) > 0) {
+      largest = left;
+    }
+    if (right < size && order_items(&heap[right], &heap[largest], compare, context) > 0) {
+      largest = right;
+    }
+    if (largest == i) {
+      return;
+    }
+    SortItem temp = heap[i];
+    heap[i] = heap[largest];
+    heap[largest] = temp;
+    i = largest;
+  }
+}
+
+// Moves the first limit items in sorted order to the beginning of the array using a heap
+static void select_items(SortItem *items, size_t size, size_t limit, ItemCompare compare, CompareContext *context) {
+  if (!limit) {
+    return;
+  }
+  for (size_t i = limit / 2; i-- > 0;) {
+    sift_down(items, limit, i, compare, context);
+  }
+  for (size_t i = limit; i < size; i++) {
+    if (order_items(&items[i], &items[0], compare, context) < 0) {
+      items[0] = items[i];
+      sift_down(items, limit, 0, compare, context);
+    }
+  }
+}
+
+// Sorts the elements of an array by the results of applying key_func to each of them (once), or by the elements
+// themselves if key_func is nil, or using compare_func if it's not nil. If limit is non-negative only the first limit
+// elements of the result are needed. Returns NULL and leaves an error in the environment on failure.
+static Array *sort_array(Array *array, Value key_func, Value compare_func, int reverse, int64_t limit, Env *env) {
+  size_t size = array->size;
+  SortItem *items = allocate((size ? size : 1) * sizeof(SortItem));
+  Tuple *func_args = alloca(sizeof(Tuple) + sizeof(Value));
+  func_args->size = 1;
+  for (size_t i = 0; i < size; i++) {
+    items[i].value = array->cells[i];
+    items[i].index = i;
+    if (key_func.type == V_NIL) {
+      items[i].key = items[i].value;
+    } else {
+      func_args->values[0] = items[i].value;
+      if (!apply(key_func, func_args, &items[i].key, env)) {
+        free(items);
+        return NULL;
+      }
+    }
+  }
+  Array *dest = NULL;
+  Arena *key_arena = create_arena();
+  CompareContext context = {compare_func, env, reverse};
+  ItemCompare compare = compare_func.type != V_NIL ? compare_with_items
+    : get_item_compare(items, size, &context, key_arena);
+  if (compare) {
+    if (limit >= 0 && limit < size) {
+      select_items(items, size, limit, compare, &context);
+      size = limit;
+    }
+    merge_sort(items, size, compare, &context);
+    if (!env->error) {
+      dest = create_array(size, env->arena).array_value;
+      for (size_t i = 0; i < size; i++) {
+        dest->cells[i] = items[i].value;
+      }
+      dest->size = size;
+    }
+  }
+  close_compare_context(&context);
+  delete_arena(key_arena);
+  free(items);
+  return dest;
+}
+
+static Array *run_sequence(Sequence *sequence);
+
+// Passes a value through the remaining stages of a pass, returns PUSH_STOP when no more values are needed
+static PushResult push_value(Pass *pass, size_t stage_index, Value value) {
+  Tuple *func_args = alloca(sizeof(Tuple) + 2 * sizeof(Value));
+  func_args->size = 2;
+  for (size_t i = stage_index; i < pass->size; i++) {
+    Stage *stage = &pass->stages[i];
+    Sequence *sequence = stage->sequence;
+    if (sequence->op == S_TAKE) {
+      if (stage->count >= sequence->n) {
+        return PUSH_STOP;
+      }
+      stage->count++;
+      PushResult result = push_value(pass, i + 1, value);
+      if (result == PUSH_MORE && stage->count >= sequence->n) {
+        return PUSH_STOP;
+      }
+      return result;
+    } else if (sequence->op == S_DROP) {
+      if (stage->count < sequence->n) {
+        stage->count++;
+        return PUSH_MORE;
+      }
+      continue;
+    }
+    func_args->values[0] = value;
+    func_args->values[1] = create_int(stage->count);
+    stage->count++;
+    Value result;
+    if (!apply(sequence->func, func_args, &result, pass->env)) {
+      return PUSH_ERROR;
+    }
+    if (sequence->op == S_MAP) {
+      value = result;
+    } else if (sequence->op == S_FILTER) {
+      if (!is_truthy(result)) {
+        return PUSH_MORE;
+      }
+    } else if (sequence->op == S_EXCLUDE) {
+      if (is_truthy(result)) {
+        return PUSH_MORE;
+      }
+    } else if (result.type == V_ARRAY) {
+      for (size_t j = 0; j < result.array_value->size; j++) {
+        PushResult push_result = push_value(pass, i + 1, result.array_value->cells[j]);
+        if (push_result != PUSH_MORE) {
+          return push_result;
+        }
+      }
+      return PUSH_MORE;
+    } else {
+      env_error(pass->env, -1, "invalid return value of type %s", value_name(result.type));
+      return PUSH_ERROR;
+    }
+  }
+  array_push(pass->dest, value, pass->env->arena);
+  return PUSH_MORE;
+}
+
+// Sorts the output of a sort_by() or sort_by_desc() sequence. If limit is non-negative only the first limit elements
+// are needed, in which case they are selected using a heap before sorting.
+static Array *sort_sequence(Sequence *sequence, int64_t limit) {
+  Array *input = sequence->source ? run_sequence(sequence->source) : sequence->array;
+  if (!input) {
+    return NULL;
+  }
+  return sort_array(input, sequence->func, nil_value, sequence->op == S_SORT_BY_DESC, limit, sequence->env);
+}
+
+// Forces a sequence, returns NULL and leaves an error in the environment on failure
+static Array *run_sequence(Sequence *sequence) {
+  if (sequence->op == S_SORT_BY || sequence->op == S_SORT_BY_DESC) {
+    return sort_sequence(sequence, -1);
+  }
+  size_t size = 0;
+  Sequence *first = sequence;
+  while (1) {
+    size++;
+    if (!first->source || first->source->op == S_SORT_BY || first->source->op == S_SORT_BY_DESC) {
+      break;
+    }
+    first = first->source;
+  }
+  Pass pass;
+  pass.stages = alloca(size * sizeof(Stage));
+  pass.size = size;
+  pass.env = sequence->env;
+  // The number of input elements needed to produce the complete output, or -1 if unknown
+  int64_t limit = -1;
+  int preserves_size = 1;
+  int slices = 1;
+  Sequence *stage = sequence;
+  for (size_t i = size; i-- > 0; stage = stage->source) {
+    pass.stages[i].sequence = stage;
+    pass.stages[i].count = 0;
+    if (stage->op != S_TAKE && stage->op != S_DROP) {
+      slices = 0;
+    }
+    if (stage->op == S_TAKE) {
+      int64_t n = stage->n > 0 ? stage->n : 0;
+      if (limit < 0 || n < limit) {
+        limit = n;
+      }
+    } else if (stage->op == S_DROP) {
+      if (limit >= 0 && stage->n > 0) {
+        limit += stage->n;
+      }
+    } else if (stage->op != S_MAP) {
+      limit = -1;
+      preserves_size = 0;
+    }
+  }
+  Array *input = first->source ? sort_sequence(first->source, limit) : first->array;
+  if (!input) {
+    return NULL;
+  }
+  if (slices) {
+    // Only take() and drop(), so the result is a slice of the input
+    size_t offset = 0;
+    size_t length = input->size;
+    for (size_t i = 0; i < size; i++) {
+      size_t n = pass.stages[i].sequence->n > 0 ? pass.stages[i].sequence->n : 0;
+      if (n > length) {
+        n = length;
+      }
+      if (pass.stages[i].sequence->op == S_TAKE) {
+        length = n;
+      } else {
+        offset += n;
+        length -= n;
+      }
+    }
+    return create_array_slice(input, offset, length, sequence->env->arena).array_value;
+  }
+  size_t capacity = 0;
+  if (preserves_size) {
+    capacity = limit >= 0 && limit < input->size ? limit : input->size;
+  }
+  pass.dest = create_array(capacity, sequence->env->arena).array_value;
+  if (limit == 0) {
+    return pass.dest;
+  }
+  for (size_t i = 0; i < input->size; i++) {
+    PushResult result = push_value(&pass, 0, input->cells[i]);
+    if (result == PUSH_STOP) {
+      break;
+    } else if (result == PUSH_ERROR) {
+      return NULL;
+    }
+  }
+  return pass.dest;
+}
+
+static int force_sequence(Value key, void *context, Value *value) {
+  Array *array = run_sequence(context);
+  if (!array) {
+    return 0;
+  }
+  *value = (Value) { .type = V_ARRAY, .array_value = array };
+  return 1;
+}
+
+static int is_sequence(Value value) {
+  return value.type == V_LAZY && value.lazy_value->func == force_sequence;
+}
+
+static int is_sequence_source(Value value) {
+  return value.type == V_ARRAY || is_sequence(value);
+}
+
+// Reads and clears the sequence_call flag, which must be done before any other function is called
+static int get_sequence_call(Env *env) {
+  int sequence_call = env->sequence_call;
+  env->sequence_call = 0;
+  return sequence_call;
+}
+
+// Creates a sequence and forces it unless the result is passed directly to another collection function
+static Value create_sequence(SequenceOp op, Value src, Value func, int64_t n, int sequence_call, Env *env) {
+  Sequence *sequence = arena_allocate(sizeof(Sequence), env->arena);
+  if (src.type == V_LAZY) {
+    sequence->source = src.lazy_value->context;
+    sequence->array = NULL;
+  } else {
+    sequence->source = NULL;
+    sequence->array = src.array_value;
+  }
+  sequence->op = op;
+  sequence->func = func;
+  sequence->n = n;
+  sequence->env = env;
+  if (sequence_call) {
+    return create_lazy(force_sequence, sequence, env->arena);
+  }
+  Array *array = run_sequence(sequence);
+  if (!array) {
+    env->error_arg = sequence->source ? -1 : 1;
+    return nil_value;
+  }
+  return (Value) { .type = V_ARRAY, .array_value = array };
+}
+
 static Value map(const Tuple *args, Env *env) {
+  int sequence_call = get_sequence_call(env);
   check_args(2, args, env);
   Value src = args->values[0];
   Value func = args->values[1];
@@ -79,22 +693,11 @@ static Value map(const Tuple *args, Env *env) {
     arg_type_error(1, V_FUNCTION, args, env);
     return nil_value;
   }
-  Tuple *func_args = alloca(sizeof(Tuple) + 2 * sizeof(Value));
-  func_args->size = 2;
-  if (src.type == V_ARRAY) {
-    Value dest = create_array(src.array_value->size, env->arena);
-    for (size_t i = 0; i < src.array_value->size; i++) {
-      func_args->values[0] = src.array_value->cells[i];
-      func_args->values[1] = create_int(i);
-      Value value;
-      if (!apply(func, func_args, &value, env)) {
-        env->error_arg = 1;
-        return nil_value;
-      }
-      array_push(dest.array_value, value, env->arena);
-    }
-    return dest;
+  if (is_sequence_source(src)) {
+    return create_sequence(S_MAP, src, func, 0, sequence_call, env);
   } else if (src.type == V_OBJECT) {
+    Tuple *func_args = alloca(sizeof(Tuple) + 2 * sizeof(Value));
+    func_args->size = 2;
     Value dest = create_object(object_size(src.object_value), env->arena);
     ObjectIterator it = iterate_object(src.object_value);
     Value key, value;
@@ -144,6 +747,7 @@ static Value map_keys(const Tuple *args, Env *env) {
 }
 
 static Value flat_map(const Tuple *args, Env *env) {
+  int sequence_call = get_sequence_call(env);
   check_args(2, args, env);
   Value src = args->values[0];
   Value func = args->values[1];
@@ -151,27 +755,8 @@ static Value flat_map(const Tuple *args, Env *env) {
     arg_type_error(1, V_FUNCTION, args, env);
     return nil_value;
   }
-  Tuple *func_args = alloca(sizeof(Tuple) + 2 * sizeof(Value));
-  func_args->size = 2;
-  if (src.type == V_ARRAY) {
-    Value dest = create_array(src.array_value->size, env->arena);
-    for (size_t i = 0; i < src.array_value->size; i++) {
-      func_args->values[0] = src.array_value->cells[i];
-      func_args->values[1] = create_int(i);
-      Value value;
-      if (!apply(func, func_args, &value, env)) {
-        env->error_arg = 1;
-        return nil_value;
-      }
-      if (value.type == V_ARRAY) {
-        for (size_t j = 0; j < value.array_value->size; j++) {
-          array_push(dest.array_value, value.array_value->cells[j], env->arena);
-        }
-      } else {
-        env_error(env, 1, "invalid return value of type %s", value_name(value.type));
-      }
-    }
-    return dest;
+  if (is_sequence_source(src)) {
+    return create_sequence(S_FLAT_MAP, src, func, 0, sequence_call, env);
   } else {
     arg_type_error(0, V_ARRAY, args, env);
     return nil_value;
@@ -179,6 +764,7 @@ static Value flat_map(const Tuple *args, Env *env) {
 }
 
 static Value filter(const Tuple *args, Env *env) {
+  int sequence_call = get_sequence_call(env);
   check_args(2, args, env);
   Value src = args->values[0];
   Value func = args->values[1];
@@ -186,24 +772,11 @@ static Value filter(const Tuple *args, Env *env) {
     arg_type_error(1, V_FUNCTION, args, env);
     return nil_value;
   }
-  Tuple *func_args = alloca(sizeof(Tuple) + 2 * sizeof(Value));
-  func_args->size = 2;
-  if (src.type == V_ARRAY) {
-    Value dest = create_array(0, env->arena);
-    for (size_t i = 0; i < src.array_value->size; i++) {
-      func_args->values[0] = src.array_value->cells[i];
-      func_args->values[1] = create_int(i);
-      Value include;
-      if (!apply(func, func_args, &include, env)) {
-        env->error_arg = 1;
-        return nil_value;
-      }
-      if (is_truthy(include)) {
-        array_push(dest.array_value, src.array_value->cells[i], env->arena);
-      }
-    }
-    return dest;
+  if (is_sequence_source(src)) {
+    return create_sequence(S_FILTER, src, func, 0, sequence_call, env);
   } else if (src.type == V_OBJECT) {
+    Tuple *func_args = alloca(sizeof(Tuple) + 2 * sizeof(Value));
+    func_args->size = 2;
     Value dest = create_object(0, env->arena);
     ObjectIterator it = iterate_object(src.object_value);
     Value key, value;
@@ -227,6 +800,7 @@ static Value filter(const Tuple *args, Env *env) {
 }
 
 static Value exclude(const Tuple *args, Env *env) {
+  int sequence_call = get_sequence_call(env);
   check_args(2, args, env);
   Value src = args->values[0];
   Value func = args->values[1];
@@ -234,24 +808,11 @@ static Value exclude(const Tuple *args, Env *env) {
     arg_type_error(1, V_FUNCTION, args, env);
     return nil_value;
   }
-  Tuple *func_args = alloca(sizeof(Tuple) + 2 * sizeof(Value));
-  func_args->size = 2;
-  if (src.type == V_ARRAY) {
-    Value dest = create_array(0, env->arena);
-    for (size_t i = 0; i < src.array_value->size; i++) {
-      func_args->values[0] = src.array_value->cells[i];
-      func_args->values[1] = create_int(i);
-      Value include;
-      if (!apply(func, func_args, &include, env)) {
-        env->error_arg = 1;
-        return nil_value;
-      }
-      if (!is_truthy(include)) {
-        array_push(dest.array_value, src.array_value->cells[i], env->arena);
-      }
-    }
-    return dest;
+  if (is_sequence_source(src)) {
+    return create_sequence(S_EXCLUDE, src, func, 0, sequence_call, env);
   } else if (src.type == V_OBJECT) {
+    Tuple *func_args = alloca(sizeof(Tuple) + 2 * sizeof(Value));
+    func_args->size = 2;
     Value dest = create_object(0, env->arena);
     ObjectIterator it = iterate_object(src.object_value);
     Value key, value;
@@ -274,97 +835,6 @@ static Value exclude(const Tuple *args, Env *env) {
   }
 }
 
-static int compare_values(const void *pa, const void *pb, void *pc) {
-  Value a = *(Value *) pa;
-  Value b = *(Value *) pb;
-  CompareContext *context = (CompareContext *) pc;
-  if (a.type != b.type) {
-    return a.type - b.type;
-  }
-  switch (a.type) {
-    case V_NIL:
-      return 0;
-    case V_BOOL:
-      return !!a.int_value - !!b.int_value;
-    case V_INT:
-      return a.int_value - b.int_value;
-    case V_FLOAT:
-      if (a.float_value < b.float_value) {
-        return -1;
-      } else if (a.float_value > b.float_value) {
-        return 1;
-      } else {
-        return 0;
-      }
-    case V_SYMBOL:
-      return strcmp(a.symbol_value, b.symbol_value);
-    case V_STRING: {
-#ifdef WITH_UNICODE
-      UErrorCode status = U_ZERO_ERROR;
-      char *locale = NULL; // TODO
-      UCollator *coll = ucol_open(locale, &status);
-      UCollationResult result = UCOL_EQUAL;
-      if (U_SUCCESS(status)) {
-        result = ucol_strcollUTF8(coll, (char *) a.string_value->bytes, a.string_value->size,
-            (char *) b.string_value->bytes, b.string_value->size, &status);
-      }
-      ucol_close(coll);
-      if (U_FAILURE(status)) {
-        env_error(context->env, -1, "collator error: %s", u_errorName(status));
-        return 0;
-      }
-      return result;
-#else
-      size_t length = a.string_value->size > b.string_value->size ? a.string_value->size : b.string_value->size;
-      for (size_t i = 0; i < length; i++) {
-        if (a.string_value->bytes[i] < b.string_value->bytes[i]) {
-          return -1;
-        } else if (a.string_value->bytes[i] > b.string_value->bytes[i]) {
-          return 1;
-        }
-      }
-      if (a.string_value->size > b.string_value->size) {
-        return 1;
-      }
-      if (a.string_value->size < b.string_value->size) {
-        return -1;
-      }
-      return 0;
-#endif
-    }
-    case V_ARRAY: {
-      size_t length = a.array_value->size > b.array_value->size ? a.array_value->size : b.array_value->size;
-      for (size_t i = 0; i < length; i++) {
-        int subresult = compare_values(&a.array_value->cells[i], &b.array_value->cells[i], pc);
-        if (subresult) {
-          return subresult;
-        }
-      }
-      if (a.array_value->size > b.array_value->size) {
-        return 1;
-      }
-      if (a.array_value->size < b.array_value->size) {
-        return -1;
-      }
-      return 0;
-    }
-    case V_OBJECT:
-      return 0;
-    case V_TIME:
-      if (a.time_value < b.time_value) {
-        return -1;
-      } else if (a.time_value > b.time_value) {
-        return 1;
-      } else {
-        return 0;
-      }
-    case V_FUNCTION:
-    case V_CLOSURE:
-      return 0;
-  }
-  return 0;
-}
-
 static Value sort(const Tuple *args, Env *env) {
   check_args(1, args, env);
   Value src = args->values[0];
@@ -372,46 +842,11 @@ static Value sort(const Tuple *args, Env *env) {
     arg_type_error(0, V_ARRAY, args, env);
     return nil_value;
   }
-  Value dest = create_array(src.array_value->size, env->arena);
-  memcpy(dest.array_value->cells, src.array_value->cells, src.array_value->size * sizeof(Value));
-  dest.array_value->size = src.array_value->size;
-  CompareContext context = {nil_value, env, 0};
-  sort_r(dest.array_value->cells, dest.array_value->size, sizeof(Value), compare_values, &context);
-  return dest;
-}
-
-static int sort_with_compare(const void *pa, const void *pb, void *pc) {
-  Value a = *(Value *) pa;
-  Value b = *(Value *) pb;
-  CompareContext *context = (CompareContext *) pc;
-  Tuple *func_args = alloca(sizeof(Tuple) + 2 * sizeof(Value));
-  func_args->size = 2;
-  func_args->values[0] = a;
-  func_args->values[1] = b;
-  Value result;
-  if (!apply(context->func, func_args, &result, context->env)) {
-    return 0;
-  }
-  if (result.type == V_INT) {
-    if (result.int_value < 0) {
-      return -1;
-    } else if (result.int_value > 0) {
-      return 1;
-    } else {
-      return 0;
-    }
-  } else if (result.type == V_FLOAT) {
-    if (result.float_value < 0) {
-      return -1;
-    } else if (result.float_value > 0) {
-      return 1;
-    } else {
-      return 0;
-    }
-  } else {
-    env_error(context->env, -1, "invalid comparator return value of type %s", value_name(result.type));
-    return 0;
+  Array *dest = sort_array(src.array_value, nil_value, nil_value, 0, -1, env);
+  if (!dest) {
+    return nil_value;
   }
+  return (Value) { .type = V_ARRAY, .array_value = dest };
 }
 
 static Value sort_with(const Tuple *args, Env *env) {
@@ -426,45 +861,19 @@ static Value sort_with(const Tuple *args, Env *env) {
     arg_type_error(1, V_FUNCTION, args, env);
     return nil_value;
   }
-  Value dest = create_array(src.array_value->size, env->arena);
-  memcpy(dest.array_value->cells, src.array_value->cells, src.array_value->size * sizeof(Value));
-  dest.array_value->size = src.array_value->size;
-  CompareContext context = {func, env, 0};
-  sort_r(dest.array_value->cells, dest.array_value->size, sizeof(Value), sort_with_compare, &context);
-  if (env->error) {
+  Array *dest = sort_array(src.array_value, nil_value, func, 0, -1, env);
+  if (!dest) {
     env->error_arg = 1;
     return nil_value;
   }
-  return dest;
-}
-
-static int sort_by_compare(const void *pa, const void *pb, void *pc) {
-  Value a = *(Value *) pa;
-  Value b = *(Value *) pb;
-  CompareContext *context = (CompareContext *) pc;
-  Tuple *func_args = alloca(sizeof(Tuple) + 2 * sizeof(Value));
-  func_args->size = 1;
-  func_args->values[0] = a;
-  Value result_a, result_b;
-  // TODO: don't apply function to the same element multiple times, maybe start
-  // by applying function to all elements, then sort by results aftwerwards?
-  if (!apply(context->func, func_args, &result_a, context->env)) {
-    return 0;
-  }
-  func_args->values[0] = b;
-  if (!apply(context->func, func_args, &result_b, context->env)) {
-    return 0;
-  }
-  if (context->reverse) {
-    return -compare_values(&result_a, &result_b, pc);
-  }
-  return compare_values(&result_a, &result_b, pc);
+  return (Value) { .type = V_ARRAY, .array_value = dest };
 }
 
 static Value sort_by(const Tuple *args, Env *env) {
+  int sequence_call = get_sequence_call(env);
   check_args(2, args, env);
   Value src = args->values[0];
-  if (src.type != V_ARRAY) {
+  if (!is_sequence_source(src)) {
     arg_type_error(0, V_ARRAY, args, env);
     return nil_value;
   }
@@ -473,22 +882,14 @@ static Value sort_by(const Tuple *args, Env *env) {
     arg_type_error(1, V_FUNCTION, args, env);
     return nil_value;
   }
-  Value dest = create_array(src.array_value->size, env->arena);
-  memcpy(dest.array_value->cells, src.array_value->cells, src.array_value->size * sizeof(Value));
-  dest.array_value->size = src.array_value->size;
-  CompareContext context = {func, env, 0};
-  sort_r(dest.array_value->cells, dest.array_value->size, sizeof(Value), sort_by_compare, &context);
-  if (env->error) {
-    env->error_arg = 1;
-    return nil_value;
-  }
-  return dest;
+  return create_sequence(S_SORT_BY, src, func, 0, sequence_call, env);
 }
 
 static Value sort_by_desc(const Tuple *args, Env *env) {
+  int sequence_call = get_sequence_call(env);
   check_args(2, args, env);
   Value src = args->values[0];
-  if (src.type != V_ARRAY) {
+  if (!is_sequence_source(src)) {
     arg_type_error(0, V_ARRAY, args, env);
     return nil_value;
   }
@@ -497,16 +898,7 @@ static Value sort_by_desc(const Tuple *args, Env *env) {
     arg_type_error(1, V_FUNCTION, args, env);
     return nil_value;
   }
-  Value dest = create_array(src.array_value->size, env->arena);
-  memcpy(dest.array_value->cells, src.array_value->cells, src.array_value->size * sizeof(Value));
-  dest.array_value->size = src.array_value->size;
-  CompareContext context = {func, env, 1};
-  sort_r(dest.array_value->cells, dest.array_value->size, sizeof(Value), sort_by_compare, &context);
-  if (env->error) {
-    env->error_arg = 1;
-    return nil_value;
-  }
-  return dest;
+  return create_sequence(S_SORT_BY_DESC, src, func, 0, sequence_call, env);
 }
 
 static Value group_by(const Tuple *args, Env *env) {
@@ -522,30 +914,21 @@ static Value group_by(const Tuple *args, Env *env) {
     return nil_value;
   }
   Value dest = create_array(0, env->arena);
-  Tuple *func_args = alloca(sizeof(Tuple) + 2 * sizeof(Value));
+  // Maps each key to the position of its group in dest
+  Value groups = create_object(0, env->arena);
+  Tuple *func_args = alloca(sizeof(Tuple) + sizeof(Value));
+  func_args->size = 1;
   for (size_t i = 0; i < src.array_value->size; i++) {
-    func_args->size = 1;
     func_args->values[0] = src.array_value->cells[i];
-    Value result_a, result_b;
-    // TODO: don't apply function to the same element multiple times, maybe start
-    // by applying function to all elements, then group by results aftwerwards?
-    if (!apply(func, func_args, &result_a, env)) {
+    Value key, position;
+    if (!apply(func, func_args, &key, env)) {
       env->error_arg = 1;
       return nil_value;
     }
-    size_t j;
-    for (j = 0; j < dest.array_value->size; j++) {
-      func_args->values[0] = dest.array_value->cells[j].array_value->cells[0];
-      if (!apply(func, func_args, &result_b, env)) {
-        env->error_arg = 1;
-        return nil_value;
-      }
-      if (equals(result_a, result_b)) {
-        array_push(dest.array_value->cells[j].array_value, src.array_value->cells[i], env->arena);
-        break;
-      }
-    }
-    if (j >= dest.array_value->size) {
+    if (object_get(groups.object_value, key, &position)) {
+      array_push(dest.array_value->cells[position.int_value].array_value, src.array_value->cells[i], env->arena);
+    } else {
+      object_put(groups.object_value, key, create_int(dest.array_value->size), env->arena);
       Value new_array = create_array(0, env->arena);
       array_push(new_array.array_value, src.array_value->cells[i], env->arena);
       array_push(dest.array_value, new_array, env->arena);
@@ -555,6 +938,7 @@ static Value group_by(const Tuple *args, Env *env) {
 }
 
 static Value take(const Tuple *args, Env *env) {
+  int sequence_call = get_sequence_call(env);
   check_args(2, args, env);
   Value n = args->values[1];
   if (n.type != V_INT) {
@@ -562,16 +946,8 @@ static Value take(const Tuple *args, Env *env) {
     return nil_value;
   }
   Value src = args->values[0];
-  if (src.type == V_ARRAY) {
-    if (n.int_value > src.array_value->size) {
-      n.int_value = src.array_value->size;
-    }
-    Value dest = create_array(n.int_value, env->arena);
-    if (n.int_value > 0) {
-      dest.array_value->size = n.int_value;
-      memcpy(dest.array_value->cells, src.array_value->cells, dest.array_value->size * sizeof(Value));
-    }
-    return dest;
+  if (is_sequence_source(src)) {
+    return create_sequence(S_TAKE, src, nil_value, n.int_value, sequence_call, env);
   } else if (src.type == V_STRING ){
     if (n.int_value > src.string_value->size) {
       n.int_value = src.string_value->size;
@@ -588,6 +964,7 @@ static Value take(const Tuple *args, Env *env) {
 }
 
 static Value drop(const Tuple *args, Env *env) {
+  int sequence_call = get_sequence_call(env);
   check_args(2, args, env);
   Value n = args->values[1];
   if (n.type != V_INT) {
@@ -595,16 +972,8 @@ static Value drop(const Tuple *args, Env *env) {
     return nil_value;
   }
   Value src = args->values[0];
-  if (src.type == V_ARRAY) {
-    if (n.int_value > src.array_value->size) {
-      n.int_value = src.array_value->size;
-    }
-    Value dest = create_array(src.array_value->size - n.int_value, env->arena);
-    if (n.int_value < src.array_value->size) {
-      dest.array_value->size = src.array_value->size - n.int_value;
-      memcpy(dest.array_value->cells, src.array_value->cells + n.int_value, dest.array_value->size * sizeof(Value));
-    }
-    return dest;
+  if (is_sequence_source(src)) {
+    return create_sequence(S_DROP, src, nil_value, n.int_value, sequence_call, env);
   } else if (src.type == V_STRING ){
     if (n.int_value > src.string_value->size) {
       n.int_value = src.string_value->size;
@@ -722,6 +1091,41 @@ static Value delete(const Tuple *args, Env *env) {
   return false_value;
 }
 
+static const struct {
+  const char *name;
+  Value (*function)(const Tuple *, Env *);
+} sequence_functions[] = {
+  {"map", map},
+  {"flat_map", flat_map},
+  {"filter", filter},
+  {"exclude", exclude},
+  {"sort_by", sort_by},
+  {"sort_by_desc", sort_by_desc},
+  {"take", take},
+  {"drop", drop},
+};
+
+int is_sequence_function(const char *name) {
+  for (size_t i = 0; i < sizeof(sequence_functions) / sizeof(sequence_functions[0]); i++) {
+    if (strcmp(sequence_functions[i].name, name) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int accepts_sequence(Value func) {
+  if (func.type != V_FUNCTION) {
+    return 0;
+  }
+  for (size_t i = 0; i < sizeof(sequence_functions) / sizeof(sequence_functions[0]); i++) {
+    if (sequence_functions[i].function == func.function_value) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 void import_collections(Env *env) {
   env_def_fn("length", length, env);
   env_def_fn("keys", keys, env);
@@ -11,4 +11,9 @@
 
 void import_collections(Env *env);
 
+// Returns 1 if the name belongs to one of the collection functions that can return lazy sequences
+int is_sequence_function(const char *name);
+// Returns 1 if the function accepts a lazy sequence as its first argument
+int accepts_sequence(Value func);
+
 #endif
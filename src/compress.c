@@ -0,0 +1,214 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#include "compress.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <utime.h>
+
+#if defined(WITH_ZLIB)
+#include <zlib.h>
+#endif
+
+#if defined(WITH_BROTLI)
+#include <brotli/encode.h>
+#endif
+
+const char * const encoding_names[] = {"gzip", "br"};
+const char * const encoding_suffixes[] = {".gz", ".br"};
+
+static const char *compressible_extensions[] = {
+  "html", "htm", "css", "js", "mjs", "json", "svg", "xml", "rss", "atom", "txt", "map", NULL
+};
+
+int is_compressible(const Path *path) {
+  const char *extension = path_get_extension(path);
+  for (const char **e = compressible_extensions; *e; e++) {
+    if (strcmp(extension, *e) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int encoding_is_supported(Encoding encoding) {
+  switch (encoding) {
+    case E_GZIP:
+#if defined(WITH_ZLIB)
+      return 1;
+#else
+      return 0;
+#endif
+    case E_BROTLI:
+#if defined(WITH_BROTLI)
+      return 1;
+#else
+      return 0;
+#endif
+  }
+  return 0;
+}
+
+Path *get_compressed_path(const Path *path, Encoding encoding) {
+  const char *suffix = encoding_suffixes[encoding];
+  size_t suffix_length = strlen(suffix);
+  char *bytes = allocate(path->size + suffix_length + 1);
+  memcpy(bytes, path->path, path->size);
+  memcpy(bytes + path->size, suffix, suffix_length + 1);
+  Path *compressed_path = create_path(bytes, path->size + suffix_length);
+  free(bytes);
+  return compressed_path;
+}
+
+// Compressed files get the modification time of the original, so a mismatch means the original has changed
+int compressed_is_current(const Path *path, const Path *compressed_path) {
+  struct stat original, compressed;
+  return stat(path->path, &original) == 0 && stat(compressed_path->path, &compressed) == 0
+    && original.st_mtime == compressed.st_mtime;
+}
+
+#if defined(WITH_ZLIB)
+static int gzip_compress(const Buffer *input, Buffer *output) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return 0;
+  }
+  *output = create_buffer(deflateBound(&stream, input->size));
+  stream.next_in = input->data;
+  stream.avail_in = input->size;
+  stream.next_out = output->data;
+  stream.avail_out = output->capacity;
+  int status = deflate(&stream, Z_FINISH);
+  output->size = stream.total_out;
+  deflateEnd(&stream);
+  if (status != Z_STREAM_END) {
+    delete_buffer(*output);
+    return 0;
+  }
+  return 1;
+}
+#endif
+
+#if defined(WITH_BROTLI)
+static int brotli_compress(const Buffer *input, Buffer *output) {
+  *output = create_buffer(BrotliEncoderMaxCompressedSize(input->size));
+  size_t size = output->capacity;
+  if (!BrotliEncoderCompress(BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, input->size,
+        input->data, &size, output->data)) {
+    delete_buffer(*output);
+    return 0;
+  }
+  output->size = size;
+  return 1;
+}
+#endif
+
+static int compress_buffer(Encoding encoding, const Buffer *input, Buffer *output) {
+  switch (encoding) {
+    case E_GZIP:
+#if defined(WITH_ZLIB)
+      return gzip_compress(input, output);
+#else
+      return 0;
+#endif
+    case E_BROTLI:
+#if defined(WITH_BROTLI)
+      return brotli_compress(input, output);
+#else
+      return 0;
+#endif
+  }
+  return 0;
+}
+
+static int read_file(const Path *path, Buffer *buffer) {
+  FILE *file = fopen(path->path, "rb");
+  if (!file) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, strerror(errno));
+    return 0;
+  }
+  *buffer = create_buffer(8192);
+  size_t n;
+  while ((n = fread(buffer->data + buffer->size, 1, buffer->capacity - buffer->size, file)) > 0) {
+    buffer->size += n;
+    if (buffer->size == buffer->capacity) {
+      buffer->capacity <<= 1;
+      buffer->data = reallocate(buffer->data, buffer->capacity);
+    }
+  }
+  int status = !ferror(file);
+  if (!status) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "read error: %s" SGR_RESET "\n", path->path, strerror(errno));
+    delete_buffer(*buffer);
+  }
+  fclose(file);
+  return status;
+}
+
+static int write_file(const Path *path, const Buffer *buffer, time_t mtime) {
+  FILE *file = fopen(path->path, "wb");
+  if (!file) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, strerror(errno));
+    return 0;
+  }
+  int status = fwrite(buffer->data, 1, buffer->size, file) == buffer->size;
+  if (fclose(file) != 0) {
+    status = 0;
+  }
+  if (!status) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "write error: %s" SGR_RESET "\n", path->path, strerror(errno));
+    return 0;
+  }
+  struct utimbuf utime_buffer;
+  utime_buffer.actime = mtime;
+  utime_buffer.modtime = mtime;
+  utime(path->path, &utime_buffer);
+  return 1;
+}
+
+int write_compressed_outputs(const Path *path) {
+  if (!is_compressible(path)) {
+    return 1;
+  }
+  int status = 1;
+  int loaded = 0;
+  Buffer input;
+  for (Encoding encoding = E_GZIP; encoding <= E_BROTLI; encoding++) {
+    if (!encoding_is_supported(encoding)) {
+      continue;
+    }
+    Path *compressed_path = get_compressed_path(path, encoding);
+    if (!compressed_is_current(path, compressed_path)) {
+      if (!loaded) {
+        if (!read_file(path, &input)) {
+          delete_path(compressed_path);
+          return 0;
+        }
+        loaded = 1;
+      }
+      Buffer output;
+      if (!compress_buffer(encoding, &input, &output)) {
+        fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s compression failed" SGR_RESET "\n", path->path,
+            encoding_names[encoding]);
+        status = 0;
+      } else {
+        if (!write_file(compressed_path, &output, get_mtime(path->path))) {
+          status = 0;
+        }
+        delete_buffer(output);
+      }
+    }
+    delete_path(compressed_path);
+  }
+  if (loaded) {
+    delete_buffer(input);
+  }
+  return status;
+}
@@ -0,0 +1,26 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "util.h"
+
+typedef enum {
+  E_GZIP,
+  E_BROTLI
+} Encoding;
+
+extern const char * const encoding_names[];
+extern const char * const encoding_suffixes[];
+
+int is_compressible(const Path *path);
+int encoding_is_supported(Encoding encoding);
+Path *get_compressed_path(const Path *path, Encoding encoding);
+int compressed_is_current(const Path *path, const Path *compressed_path);
+int write_compressed_outputs(const Path *path);
+
+#endif
@@ -4,12 +4,17 @@
  * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
  */
 
+#define _GNU_SOURCE
 #include "contentmap.h"
 
 #include "build.h"
 #include "html.h"
 #include "interpreter.h"
+#include "markdown.h"
+#include "module.h"
+#include "parsecache.h"
 #include "parser.h"
+#include "profile.h"
 #include "reader.h"
 #include "strings.h"
 
@@ -17,9 +22,13 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 typedef struct PathStack PathStack;
 
@@ -29,9 +38,16 @@ struct PathStack {
    char *name;
 };
 
-static void read_front_matter(Object *obj, FILE *file, const Path *path, Env *env);
-static Value read_file_content(Object *obj, FILE *file, const Path *path, Env *env);
-static Value parse_content(Value content, const Path *path, Env *env);
+typedef struct {
+  Array *includes;
+  int cacheable;
+} ContentSources;
+
+static long read_front_matter(Object *obj, const Path *path, ContentSources *sources, Env *env);
+static Value read_file_content(Object *obj, const Path *path, long offset, ContentSources *sources, Value *html,
+    Env *env);
+static Value parse_content(Value content, Value html, const Path *path, ContentSources *sources, Env *env);
+static int has_closure_handlers(Env *env);
 
 static Value path_stack_to_string(PathStack *path_stack, Arena *arena) {
   if (!path_stack) {
@@ -97,30 +113,36 @@ typedef struct {
   Env *env;
   const Path *src_file;
   const Path *dir;
+  ContentSources *sources;
 } ContentIncludeArgs;
 
 static HtmlTransformation transform_content_includes(Value node, void *context) {
   ContentIncludeArgs *args = context;
   if (node.type == V_OBJECT) {
     Value comment;
-    if (object_get_symbol(node.object_value, "comment", &comment) && comment.type == V_STRING) {
+    if (object_get_known(node.object_value, comment, &comment) && comment.type == V_STRING) {
       if (string_starts_with("include:", comment.string_value)) {
         Path *path = create_path((char *) comment.string_value->bytes + sizeof("include:") - 1,
             comment.string_value->size - sizeof("include:") + 1);
         Path *abs_path = path_join(args->dir, path, 1);
         Value replacement = create_string(NULL, 0, args->env->arena);
-        load_asset_module(abs_path, args->env);
-        FILE *file = fopen(abs_path->path, "r");
-        if (file) {
-          Value front_matter = create_object(0, args->env->arena);
-          Value type = copy_c_string(path_get_extension(abs_path), args->env->arena);
-          object_def(front_matter.object_value, "type", type, args->env);
-          read_front_matter(front_matter.object_value, file, abs_path, args->env);
-          Value content = read_file_content(front_matter.object_value, file, abs_path, args->env);
-          fclose(file);
-          replacement = parse_content(content, abs_path, args->env);
+        Module *module = load_asset_module(abs_path, args->env);
+        Value include = create_object(2, args->env->arena);
+        object_def_known(include.object_value, path, path_to_string(abs_path, args->env->arena), args->env);
+        object_def_known(include.object_value, modified, create_time(module->mtime), args->env);
+        array_push(args->sources->includes, include, args->env->arena);
+        Value front_matter = create_object(0, args->env->arena);
+        Value type = copy_c_string(path_get_extension(abs_path), args->env->arena);
+        object_def_known(front_matter.object_value, type, type, args->env);
+        long offset = read_front_matter(front_matter.object_value, abs_path, args->sources, args->env);
+        if (offset >= 0) {
+          Value html = nil_value;
+          Value content = read_file_content(front_matter.object_value, abs_path, offset, args->sources, &html,
+              args->env);
+          replacement = parse_content(content, html, abs_path, args->sources, args->env);
         } else {
           html_error(node, args->src_file, "include failed: %s: %s", path->path, strerror(errno));
+          args->sources->cacheable = 0;
         }
         delete_path(abs_path);
         delete_path(path);
@@ -131,23 +153,29 @@ static HtmlTransformation transform_content_includes(Value node, void *context)
   return HTML_NO_ACTION;
 }
 
-static int has_read_more(Value node) {
+typedef struct {
+  Env *env;
+  int found_title;
+  int read_more;
+  Value title;
+} ContentInfoArgs;
+
+static HtmlTransformation find_content_info(Value node, void *context) {
+  ContentInfoArgs *args = context;
   if (node.type == V_OBJECT) {
     Value comment;
-    if (object_get_symbol(node.object_value, "comment", &comment) && comment.type == V_STRING) {
-      return string_equals("more", comment.string_value);
-    } else {
-      Value children;
-      if (object_get_symbol(node.object_value, "children", &children) && children.type == V_ARRAY) {
-        for (size_t i = 0; i < children.array_value->size; i++) {
-          if (has_read_more(children.array_value->cells[i])) {
-            return 1;
-          }
-        }
+    if (object_get_known(node.object_value, comment, &comment) && comment.type == V_STRING) {
+      if (string_equals("more", comment.string_value)) {
+        args->read_more = 1;
       }
+    } else if (!args->found_title && html_is_tag(node, "h1")) {
+      StringBuffer title_buffer = create_string_buffer(0, args->env->arena);
+      html_text_content(node, &title_buffer);
+      args->title = finalize_string_buffer(title_buffer);
+      args->found_title = 1;
     }
   }
-  return 0;
+  return HTML_NO_ACTION;
 }
 
 static Array *toc_get_section(Array *toc, int level, String **number, String **id, Env *env) {
@@ -156,9 +184,9 @@ static Array *toc_get_section(Array *toc, int level, String **number, String **i
   }
   Object *last_entry = toc->cells[toc->size - 1].object_value;
   Value children;
-  if (!object_get_symbol(last_entry, "children", &children)) {
+  if (!object_get_known(last_entry, children, &children)) {
     children = create_array(0, env->arena);
-    object_def(last_entry, "children", children, env);
+    object_def_known(last_entry, children, children, env);
   }
   Value number_value;
   if (object_get_symbol(last_entry, "number", &number_value) && number_value.type == V_STRING) {
@@ -171,6 +199,16 @@ static Array *toc_get_section(Array *toc, int level, String **number, String **i
   return toc_get_section(children.array_value, level - 1, number, id, env);
 }
 
+// 0: removed, 1: separator, otherwise the byte to output
+static const uint8_t slug_map[256] = {
+  ['\t'] = 1, ['\n'] = 1, ['\r'] = 1, [' '] = 1, ['-'] = 1,
+  ['0'] = '0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
+  ['A'] = 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o', 'p', 'q', 'r', 's', 't', 'u',
+  'v', 'w', 'x', 'y', 'z',
+  ['a'] = 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o', 'p', 'q', 'r', 's', 't', 'u',
+  'v', 'w', 'x', 'y', 'z'
+};
+
 static Value slugify(String *string, String *prefix, String *sep, Arena *arena) {
   size_t size = string->size;
   if (prefix && sep) {
@@ -181,84 +219,98 @@ static Value slugify(String *string, String *prefix, String *sep, Arena *arena)
     string_buffer_append(&buffer, prefix);
     string_buffer_append(&buffer, sep);
   }
+  // The slug is never longer than the string, so it's written directly into the buffer
+  uint8_t *dest = buffer.string->bytes + buffer.string->size;
+  uint8_t *start = buffer.string->bytes;
   for (size_t i = 0; i < string->size; i++) {
-    uint8_t byte = string->bytes[i];
-    if ((byte >= '0' && byte <= '9') || (byte >= 'a' && byte <= 'z')) {
-      string_buffer_put(&buffer, byte);
-    } else if (byte >= 'A' && byte <= 'Z') {
-      string_buffer_put(&buffer, tolower(byte));
-    } else if (byte == '-' || byte == ' ' || byte == '\t' || byte == '\n' || byte == '\r') {
-      if (buffer.string->size && buffer.string->bytes[buffer.string->size - 1] != '-') {
-        string_buffer_put(&buffer, '-');
-      }
+    uint8_t byte = slug_map[string->bytes[i]];
+    if (byte > 1) {
+      *(dest++) = byte;
+    } else if (byte && dest > start && dest[-1] != '-') {
+      *(dest++) = '-';
     }
   }
+  buffer.string->size = dest - start;
   return finalize_string_buffer(buffer);
 }
 
-static void build_toc(Value node, Array *toc, int min_level, int max_level, int numbered_headings,
-    String *sep1, String *sep2, String *nested_id_sep, Env *env) {
+typedef struct {
+  Env *env;
+  Array *toc;
+  int min_level;
+  int max_level;
+  int numbered_headings;
+  String *sep1;
+  String *sep2;
+  String *nested_id_sep;
+  Array *lists;
+} TocArgs;
+
+static void add_toc_entry(Value node, int level, TocArgs *args) {
+  Env *env = args->env;
+  String *parent_number = NULL;
+  String *parent_id = NULL;
+  Array *section = toc_get_section(args->toc, level - args->min_level, &parent_number, &parent_id, env);
+  Value entry = create_object(0, env->arena);
+  StringBuffer buffer = create_string_buffer(0, env->arena);
+  html_text_content(node, &buffer);
+  Value title = string_trim(finalize_string_buffer(buffer).string_value, (uint8_t *) " \r\n\t", 4, env->arena);
+  if (args->numbered_headings >= level) {
+    StringBuffer number_buffer = create_string_buffer(0, env->arena);
+    if (parent_number) {
+      string_buffer_append(&number_buffer, parent_number);
+      string_buffer_append(&number_buffer, args->sep1);
+    }
+    string_buffer_printf(&number_buffer, "%zd", section->size + 1);
+    Value number = finalize_string_buffer(number_buffer);
+    object_def(entry.object_value, "number", number, env);
+    html_prepend_child(node, (Value) { .type = V_STRING, .string_value = args->sep2 }, env->arena);
+    html_prepend_child(node, number, env->arena);
+  }
+  object_def_known(entry.object_value, title, title, env);
+  Value id = html_get_attribute(node, "id");
+  if (id.type != V_STRING) {
+    id = slugify(title.string_value, parent_id, args->nested_id_sep, env->arena);
+    html_set_attribute(node, "id", id.string_value, env);
+  }
+  object_def(entry.object_value, "id", id, env);
+  array_push(section, entry, env->arena);
+}
+
+// Headings are added to the table of contents and <!--toc--> comments are replaced with empty lists that are
+// filled by fill_toc_lists() once the whole document has been traversed
+static HtmlTransformation build_toc(Value node, void *context) {
+  TocArgs *args = context;
   if (node.type == V_OBJECT) {
-    Value node_tag;
-    if (object_get_symbol(node.object_value, "tag", &node_tag) && node_tag.type == V_SYMBOL) {
+    Value node_tag, comment;
+    if (object_get_known(node.object_value, tag, &node_tag) && node_tag.type == V_SYMBOL) {
       if (node_tag.symbol_value[0] == 'h' && node_tag.symbol_value[1] >= '1'
           && node_tag.symbol_value[1] <= '6' && node_tag.symbol_value[2] == '\0') {
         int level = node_tag.symbol_value[1] - '0';
-        if (level >= min_level && level <= max_level && html_get_attribute(node, "data-toc-ignore").type == V_NIL) {
-          String *parent_number = NULL;
-          String *parent_id = NULL;
-          Array *section = toc_get_section(toc, level - min_level, &parent_number, &parent_id, env);
-          Value entry = create_object(0, env->arena);
-          StringBuffer buffer = create_string_buffer(0, env->arena);
-          html_text_content(node, &buffer);
-          Value title = string_trim(finalize_string_buffer(buffer).string_value, (uint8_t *) " \r\n\t", 4, env->arena);
-          if (numbered_headings >= level) {
-            StringBuffer number_buffer = create_string_buffer(0, env->arena);
-            if (parent_number) {
-              string_buffer_append(&number_buffer, parent_number);
-              string_buffer_append(&number_buffer, sep1);
-            }
-            string_buffer_printf(&number_buffer, "%zd", section->size + 1);
-            Value number = finalize_string_buffer(number_buffer);
-            object_def(entry.object_value, "number", number, env);
-            html_prepend_child(node, (Value) { .type = V_STRING, .string_value = sep2 }, env->arena);
-            html_prepend_child(node, number, env->arena);
-          }
-          object_def(entry.object_value, "title", title, env);
-          Value id = html_get_attribute(node, "id");
-          if (id.type != V_STRING) {
-            id = slugify(title.string_value, parent_id, nested_id_sep, env->arena);
-            html_set_attribute(node, "id", id.string_value, env);
-          }
-          object_def(entry.object_value, "id", id, env);
-          array_push(section, entry, env->arena);
+        if (level >= args->min_level && level <= args->max_level
+            && html_get_attribute(node, "data-toc-ignore").type == V_NIL) {
+          add_toc_entry(node, level, args);
         }
       }
-    }
-    Value children;
-    if (object_get_symbol(node.object_value, "children", &children) && children.type == V_ARRAY) {
-      for (size_t i = 0; i < children.array_value->size; i++) {
-        build_toc(children.array_value->cells[i], toc, min_level, max_level, numbered_headings,
-            sep1, sep2, nested_id_sep, env);
+    } else if (object_get_known(node.object_value, comment, &comment) && comment.type == V_STRING) {
+      if (string_equals("toc", comment.string_value)) {
+        Value list = html_create_element("ol", 0, args->env);
+        array_push(args->lists, list, args->env->arena);
+        return HTML_REPLACE(list);
       }
     }
   }
+  return HTML_NO_ACTION;
 }
 
-typedef struct {
-  Env *env;
-  Array *toc;
-} InsertTocArgs;
-
-static Value print_toc(Array *toc, Env *env) {
-  Value list = html_create_element("ol", 0, env);
+static void print_toc(Value list, Array *toc, Env *env) {
   for (size_t i = 0; i < toc->size; i++) {
     Value entry = toc->cells[i];
     if (entry.type != V_OBJECT) {
       continue;
     }
     Value title, id;
-    if (!object_get_symbol(entry.object_value, "title", &title) || title.type != V_STRING) {
+    if (!object_get_known(entry.object_value, title, &title) || title.type != V_STRING) {
       continue;
     }
     if (!object_get_symbol(entry.object_value, "id", &id) || id.type != V_STRING) {
@@ -273,33 +325,34 @@ static Value print_toc(Array *toc, Env *env) {
     html_append_child(link, title, env->arena);
     html_append_child(list_element, link, env->arena);
     Value children;
-    if (object_get_symbol(entry.object_value, "children", &children) && children.type == V_ARRAY) {
-      html_append_child(list_element, print_toc(children.array_value, env), env->arena);
+    if (object_get_known(entry.object_value, children, &children) && children.type == V_ARRAY) {
+      Value child_list = html_create_element("ol", 0, env);
+      print_toc(child_list, children.array_value, env);
+      html_append_child(list_element, child_list, env->arena);
     }
     html_append_child(list, list_element, env->arena);
   }
-  return list;
 }
 
-static HtmlTransformation insert_toc(Value node, void *context) {
-  InsertTocArgs *args = context;
-  if (node.type == V_OBJECT) {
-    Value comment;
-    if (object_get_symbol(node.object_value, "comment", &comment) && comment.type == V_STRING) {
-      if (string_equals("toc", comment.string_value)) {
-        return HTML_REPLACE(print_toc(args->toc, args->env));
-      }
-    }
+static void fill_toc_lists(TocArgs *args) {
+  for (size_t i = 0; i < args->lists->size; i++) {
+    print_toc(args->lists->cells[i], args->toc, args->env);
   }
-  return HTML_NO_ACTION;
 }
 
-static void read_front_matter(Object *obj, FILE *file, const Path *path, Env *env) {
-  Reader *reader = open_reader(file, path, env->symbol_map);
+// Returns the offset of the content following the front matter, or -1 if the file can't be opened
+static long read_front_matter(Object *obj, const Path *path, ContentSources *sources, Env *env) {
+  Reader *reader = open_file_reader(path, env->symbol_map);
+  if (!reader) {
+    sources->cacheable = 0;
+    return -1;
+  }
   if (reader_errors(reader)) {
     close_reader(reader);
-    return;
+    sources->cacheable = 0;
+    return 0;
   }
+  long offset = 0;
   set_reader_silent(1, reader);
   TokenStream tokens = read_all(reader, 0);
   while (peek_token(tokens)->type == T_LF) {
@@ -308,6 +361,7 @@ static void read_front_matter(Object *obj, FILE *file, const Path *path, Env *en
   if (peek_token(tokens)->type == T_PUNCT && peek_token(tokens)->punct_value == '{') {
     set_reader_silent(0, reader);
     Module *front_matter = parse_object_notation(tokens, path, 0);
+    offset = get_reader_offset(reader);
     close_reader(reader);
     if (!front_matter->data_value.parse_error) {
       Value front_matter_obj = interpret(*front_matter->data_value.root, env).value;
@@ -320,163 +374,558 @@ static void read_front_matter(Object *obj, FILE *file, const Path *path, Env *en
       } else {
         fprintf(stderr, SGR_BOLD "%s: " INFO_LABEL "unexpected front matter of type %s" SGR_RESET "\n", path->path,
             value_name(front_matter_obj.type));
+        sources->cacheable = 0;
       }
+      // Closures defined in the front matter refer to its syntax tree
+      arena_adopt(env->arena, front_matter->arena);
+      front_matter->arena = NULL;
     } else {
-      rewind(file);
+      offset = 0;
+      sources->cacheable = 0;
     }
     delete_module(front_matter);
   } else {
     close_reader(reader);
-    rewind(file);
   }
+  return offset;
 }
 
-static Value read_file_content(Object *obj, FILE *file, const Path *path, Env *env) {
-  Buffer buffer = create_buffer(8192);
-  size_t n;
-  do {
-    if (buffer.size) {
-      buffer.capacity += 8192;
-      buffer.data = reallocate(buffer.data, buffer.capacity);
+// If html is not NULL and the content is markdown, it is converted directly to an HTML node which is stored in html,
+// in which case the unconverted content is returned
+static Value read_file_content(Object *obj, const Path *path, long offset, ContentSources *sources, Value *html,
+    Env *env) {
+  if (html) {
+    *html = nil_value;
+  }
+  int fd = open(path->path, O_RDONLY);
+  struct stat stat_buffer;
+  if (fd < 0 || fstat(fd, &stat_buffer) != 0) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
     }
-    n = fread(buffer.data + buffer.size, 1, 8192, file);
-    buffer.size += n;
-  } while (n == 8192);
-  if (!feof(file)) {
-    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "read error: %s" SGR_RESET "\n", path->path, strerror(errno));
+    sources->cacheable = 0;
+    return create_string(NULL, 0, env->arena);
+  }
+  // The body is read directly into the string instead of growing a buffer
+  size_t size = stat_buffer.st_size > offset ? stat_buffer.st_size - offset : 0;
+  Value content = allocate_string(size, env->arena);
+  size_t total = 0;
+  while (total < size) {
+    ssize_t n = pread(fd, content.string_value->bytes + total, size - total, offset + total);
+    if (n < 0) {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "read error: %s" SGR_RESET "\n", path->path, strerror(errno));
+      sources->cacheable = 0;
+      break;
+    } else if (n == 0) {
+      break;
+    }
+    total += n;
+  }
+  close(fd);
+  if (size) {
+    size_t start = 0;
+    if (offset > 0) {
+      // Skip the rest of the line containing the end of the front matter
+      while (start < total && (content.string_value->bytes[start] == ' '
+            || content.string_value->bytes[start] == '\t')) {
+        start++;
+      }
+      if (start < total && content.string_value->bytes[start] == '\r') {
+        start++;
+      }
+      if (start < total && content.string_value->bytes[start] == '\n') {
+        start++;
+      }
+      memmove(content.string_value->bytes, content.string_value->bytes + start, total - start);
+    }
+    content.string_value->size = total - start;
   }
-  Value content = create_string(buffer.data, buffer.size, env->arena);
-  delete_buffer(buffer);
   Value content_handlers;
-  if (env_get(get_symbol("CONTENT_HANDLERS", env->symbol_map), &content_handlers, env)
+  if (env_get_known(CONTENT_HANDLERS, &content_handlers, env)
       && content_handlers.type == V_OBJECT) {
     Value type;
-    if (object_get(obj, create_symbol(get_symbol("type", env->symbol_map)), &type)
+    if (object_get(obj, create_symbol(known_symbols.type), &type)
         && type.type == V_STRING) {
       Value handler;
       if (object_get(content_handlers.object_value, type, &handler)) {
-        if (handler.type == V_FUNCTION || handler.type == V_CLOSURE) {
+        if (html && is_markdown_handler(handler)
+            && (*html = markdown_to_node(content.string_value, env)).type != V_NIL) {
+          return content;
+        } else if (handler.type == V_FUNCTION || handler.type == V_CLOSURE) {
           Tuple *func_args = alloca(sizeof(Tuple) + sizeof(Value));
           func_args->size = 1;
           func_args->values[0] = content;
           if (!apply(handler, func_args, &content, env)) {
             env->error_arg = -1;
+            sources->cacheable = 0;
           }
         } else {
           char *type_string = string_to_c_string(type.string_value);
           fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "invalid handler for content type '%s'" SGR_RESET "\n",
               path->path, type_string);
           free(type_string);
+          sources->cacheable = 0;
         }
       } else {
         char *type_string = string_to_c_string(type.string_value);
         fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "handler not found for content type '%s'" SGR_RESET "\n",
             path->path, type_string);
         free(type_string);
+        sources->cacheable = 0;
       }
     } else {
       fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "unknown content type" SGR_RESET "\n", path->path);
+      sources->cacheable = 0;
     }
   } else {
     fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "CONTENT_HANDLERS not found or invalid" SGR_RESET "\n", path->path);
+    sources->cacheable = 0;
   }
   return content;
 }
 
-static Value parse_content(Value content, const Path *path, Env *env) {
-  Value html;
-  if (content.type == V_STRING) {
+static Value parse_content(Value content, Value html, const Path *path, ContentSources *sources, Env *env) {
+  if (html.type == V_NIL && content.type == V_STRING) {
     html = html_parse(content.string_value, env);
-    if (html.type != V_NIL) {
-      Value src_root;
-      if (env_get_symbol("SRC_ROOT", &src_root, env) && src_root.type == V_STRING) {
-        Path *src_root_path = string_to_path(src_root.string_value);
-        Path *abs_asset_base = path_get_parent(path);
-        Path *asset_base = path_get_relative(src_root_path, abs_asset_base);
-        if (asset_base) {
-          ContentLinkArgs content_link_args = {env, asset_base};
-          html_transform(html, transform_content_links, &content_link_args);
-          ContentIncludeArgs content_include_args = {env, path, abs_asset_base};
-          html_transform(html, transform_content_includes, &content_include_args);
-          delete_path(asset_base);
-        }
-        delete_path(abs_asset_base);
-        delete_path(src_root_path);
+  }
+  if (html.type != V_NIL) {
+    Value src_root;
+    if (env_get_known(SRC_ROOT, &src_root, env) && src_root.type == V_STRING) {
+      Path *src_root_path = string_to_path(src_root.string_value);
+      Path *abs_asset_base = path_get_parent(path);
+      Path *asset_base = path_get_relative(src_root_path, abs_asset_base);
+      if (asset_base) {
+        ContentLinkArgs content_link_args = {env, asset_base};
+        ContentIncludeArgs content_include_args = {env, path, abs_asset_base, sources};
+        HtmlTransformer transformers[] = {
+          {transform_content_links, &content_link_args},
+          {transform_content_includes, &content_include_args}
+        };
+        html_transform_all(html, transformers, 2, env->arena);
+        delete_path(asset_base);
       }
-    } else {
-      html = create_string(NULL, 0, env->arena);
-    } 
+      delete_path(abs_asset_base);
+      delete_path(src_root_path);
+    }
   } else {
     html = create_string(NULL, 0, env->arena);
   }
   return html;
 }
 
-static Value create_content_object(const Path *path, const char *name, PathStack *path_stack, Env *env) {
+static Hash get_content_cache_key(Env *env) {
+  Hash h = INIT_HASH;
+  Value src_root;
+  if (env_get_known(SRC_ROOT, &src_root, env)) {
+    h = stable_value_hash(h, src_root);
+  }
+  Value content_handlers;
+  if (env_get_known(CONTENT_HANDLERS, &content_handlers, env) && content_handlers.type == V_OBJECT) {
+    ObjectIterator it = iterate_object(content_handlers.object_value);
+    Value type, handler;
+    while (object_iterator_next(&it, &type, &handler)) {
+      h = stable_value_hash(h, type);
+      h = stable_value_hash(h, handler);
+      if (handler.type == V_FUNCTION) {
+        // Built-in handlers are told apart by their offset within the executable
+        intptr_t offset = (intptr_t) handler.function_value - (intptr_t) import_contentmap;
+        for (int i = 0; i < sizeof(offset); i++) {
+          h = HASH_ADD_BYTE(GET_BYTE(i, offset), h);
+        }
+      } else if (handler.type == V_CLOSURE && handler.closure_value->body.module.file_name) {
+        time_t mtime = get_mtime(handler.closure_value->body.module.file_name->path);
+        for (int i = 0; i < sizeof(mtime); i++) {
+          h = HASH_ADD_BYTE(GET_BYTE(i, mtime), h);
+        }
+      }
+    }
+  }
+  return h;
+}
+
+static int includes_are_current(Array *includes, Env *env) {
+  int current = 1;
+  for (size_t i = 0; i < includes->size; i++) {
+    Value include = includes->cells[i];
+    Value include_path, modified;
+    if (include.type != V_OBJECT || !object_get_known(include.object_value, path, &include_path)
+        || include_path.type != V_STRING || !object_get_known(include.object_value, modified, &modified)
+        || modified.type != V_TIME) {
+      return 0;
+    }
+    Path *path = string_to_path(include_path.string_value);
+    Module *module = load_asset_module(path, env);
+    if (module->mtime != modified.time_value) {
+      current = 0;
+    }
+    delete_path(path);
+  }
+  return current;
+}
+
+typedef struct LazyContent LazyContent;
+
+struct LazyContent {
+  Env *env;
+  Object *obj;
+  Value path;
+  Value front_matter;
+  Hash cache_key;
+  long offset;
+  int cacheable;
+  int converted;
+  Value content;
+  // Markdown that was converted directly to html, content is only rendered from it when it's needed
+  Value source;
+  Value html;
+  int found_title;
+  Value title;
+  Value read_more;
+  Value toc;
+  Array *includes;
+  // Set if the converted content is kept in its own arena so that it can be released, see release_content()
+  Arena *arena;
+  size_t size;
+  LazyContent *prev;
+  LazyContent *next;
+};
+
+static size_t content_memory_limit = 0;
+static int releasable_content = 0;
+static size_t released_content_size = 0;
+// Content in releasable arenas, most recently used first
+static LazyContent *released_content_head = NULL;
+static LazyContent *released_content_tail = NULL;
+
+void set_content_memory_limit(size_t limit) {
+  content_memory_limit = limit;
+}
+
+static void unlink_lazy_content(LazyContent *lazy) {
+  if (lazy->prev) {
+    lazy->prev->next = lazy->next;
+  } else {
+    released_content_head = lazy->next;
+  }
+  if (lazy->next) {
+    lazy->next->prev = lazy->prev;
+  } else {
+    released_content_tail = lazy->prev;
+  }
+  lazy->prev = lazy->next = NULL;
+}
+
+static void link_lazy_content(LazyContent *lazy) {
+  lazy->prev = NULL;
+  lazy->next = released_content_head;
+  if (released_content_head) {
+    released_content_head->prev = lazy;
+  } else {
+    released_content_tail = lazy;
+  }
+  released_content_head = lazy;
+}
+
+static void release_lazy_content(LazyContent *lazy) {
+  unlink_lazy_content(lazy);
+  released_content_size -= lazy->size;
+  delete_arena(lazy->arena);
+  lazy->arena = NULL;
+  lazy->size = 0;
+  lazy->converted = 0;
+  lazy->content = nil_value;
+  lazy->source = nil_value;
+  lazy->html = nil_value;
+  lazy->found_title = 0;
+  lazy->title = nil_value;
+  lazy->read_more = false_value;
+  lazy->toc = nil_value;
+  lazy->includes = NULL;
+}
+
+void release_content(void) {
+  while (released_content_tail && released_content_size > content_memory_limit) {
+    release_lazy_content(released_content_tail);
+  }
+}
+
+void set_releasable_content(int releasable) {
+  releasable_content = releasable && content_memory_limit;
+  if (!releasable) {
+    while (released_content_tail) {
+      release_lazy_content(released_content_tail);
+    }
+  }
+}
+
+static int restore_content(LazyContent *lazy, Value cached) {
+  Value content, html, title, read_more, toc, includes;
+  if (cached.type != V_OBJECT
+      || !object_get_known(cached.object_value, content, &content)
+      || !object_get_known(cached.object_value, html, &html)
+      || !object_get_known(cached.object_value, read_more, &read_more)
+      || !object_get_known(cached.object_value, toc, &toc)
+      || !object_get_known(cached.object_value, includes, &includes) || includes.type != V_ARRAY) {
+    return 0;
+  }
+  if (!includes_are_current(includes.array_value, lazy->env)) {
+    return 0;
+  }
+  lazy->converted = 1;
+  lazy->content = content;
+  lazy->source = nil_value;
+  lazy->html = html;
+  lazy->found_title = object_get_known(cached.object_value, title, &title);
+  lazy->title = lazy->found_title ? title : nil_value;
+  lazy->read_more = read_more;
+  lazy->toc = toc;
+  lazy->includes = includes.array_value;
+  return 1;
+}
+
+static Value get_content_string(LazyContent *lazy) {
+  if (lazy->source.type == V_STRING) {
+    lazy->content = markdown_to_html(lazy->source.string_value, lazy->env);
+    lazy->source = nil_value;
+  }
+  return lazy->content;
+}
+
+static void convert_content(LazyContent *lazy, const Path *path) {
+  Env *env = lazy->env;
+  if (!lazy->converted && restore_content(lazy, read_content_cache(path, lazy->cache_key, env->symbol_map,
+          env->arena))) {
+    return;
+  }
+  int had_error = !!env->error;
+  ContentSources sources = {create_array(0, env->arena).array_value, lazy->cacheable && !had_error};
+  lazy->converted = 1;
+  lazy->includes = sources.includes;
+  lazy->found_title = 0;
+  lazy->read_more = false_value;
+  lazy->toc = create_array(0, env->arena);
+  Value html;
+  Value content = read_file_content(lazy->obj, path, lazy->offset, &sources, &html, env);
+  lazy->source = nil_value;
+  if (html.type != V_NIL) {
+    lazy->source = content;
+    content = nil_value;
+  }
+  html = parse_content(content, html, path, &sources, env);
+  int max_toc_level = 6;
+  Value temp;
+  if (object_get_symbol(lazy->obj, "toc_depth", &temp) && temp.type == V_INT) {
+    max_toc_level = temp.int_value;
+  }
+  int numbered_headings = 0;
+  if (object_get_symbol(lazy->obj, "numbered_headings", &temp) && temp.type == V_INT) {
+    numbered_headings = temp.int_value;
+  }
+  String *nested_id_sep = NULL;
+  if (object_get_symbol(lazy->obj, "nested_id_sep", &temp) && temp.type == V_STRING) {
+    nested_id_sep = temp.string_value;
+  }
+  Value toc = create_array(0, env->arena);
+  ContentInfoArgs content_info_args = {env, 0, 0, nil_value};
+  TocArgs toc_args = {env, toc.array_value, 2, max_toc_level, numbered_headings,
+    copy_c_string(".", env->arena).string_value, copy_c_string(". ", env->arena).string_value, nested_id_sep,
+    create_array(0, env->arena).array_value};
+  HtmlTransformer transformers[] = {
+    {find_content_info, &content_info_args},
+    {build_toc, &toc_args}
+  };
+  html_transform_all(html, transformers, max_toc_level > 1 ? 2 : 1, env->arena);
+  fill_toc_lists(&toc_args);
+  lazy->content = content;
+  lazy->html = html;
+  lazy->found_title = content_info_args.found_title;
+  lazy->title = content_info_args.title;
+  lazy->read_more = content_info_args.read_more ? true_value : false_value;
+  lazy->toc = toc;
+  if (!had_error && env->error) {
+    // The content may be converted long after list_content() has returned, so the error is reported here
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, env->error);
+    env_clear_error(env);
+  } else if (sources.cacheable && !env->error && parse_cache_is_enabled()) {
+    Value cached = create_object(6, env->arena);
+    object_def_known(cached.object_value, content, get_content_string(lazy), env);
+    object_def_known(cached.object_value, html, html, env);
+    if (content_info_args.found_title) {
+      object_def_known(cached.object_value, title, content_info_args.title, env);
+    }
+    object_def_known(cached.object_value, read_more, lazy->read_more, env);
+    object_def_known(cached.object_value, toc, toc, env);
+    Value includes = { .type = V_ARRAY, .array_value = sources.includes };
+    object_def_known(cached.object_value, includes, includes, env);
+    write_content_cache(path, lazy->cache_key, cached);
+  }
+}
+
+static int get_lazy_content(Value key, void *context, Value *value) {
+  LazyContent *lazy = context;
+  Path *path = string_to_path(lazy->path.string_value);
+  // Also a dependency of every page that reads the converted content
+  load_asset_module(path, lazy->env);
+  if (!lazy->converted || !includes_are_current(lazy->includes, lazy->env)) {
+    ProfileTimer timer = profile_start();
+    if (lazy->arena) {
+      release_lazy_content(lazy);
+    }
+    // Content handlers written in Plet may keep references to the content in global state
+    if (releasable_content && !has_closure_handlers(lazy->env)) {
+      Arena *env_arena = lazy->env->arena;
+      lazy->arena = create_arena();
+      lazy->env->arena = lazy->arena;
+      convert_content(lazy, path);
+      lazy->env->arena = env_arena;
+      lazy->size = get_arena_size(lazy->arena);
+      released_content_size += lazy->size;
+      link_lazy_content(lazy);
+    } else {
+      convert_content(lazy, path);
+    }
+    profile_end(timer, PROFILE_CONTENT, path->path);
+  } else if (lazy->arena && lazy != released_content_head) {
+    unlink_lazy_content(lazy);
+    link_lazy_content(lazy);
+  }
+  delete_path(path);
+  const char *field = key.symbol_value;
+  if (strcmp(field, "content") == 0) {
+    *value = get_content_string(lazy);
+  } else if (strcmp(field, "html") == 0) {
+    *value = lazy->html;
+  } else if (strcmp(field, "title") == 0) {
+    if (lazy->found_title) {
+      *value = lazy->title;
+    } else {
+      return object_get_known(lazy->front_matter.object_value, title, value);
+    }
+  } else if (strcmp(field, "read_more") == 0) {
+    *value = lazy->read_more;
+  } else {
+    *value = lazy->toc;
+  }
+  // The converted content is shared by every page that reads it
+  freeze_value(*value);
+  return 1;
+}
+
+// If included is not NULL the content is converted immediately and the included files are added to it, otherwise
+// the content, html, title, read_more and toc properties are converted the first time one of them is read. If body
+// is 0 only the front matter is read and those properties are omitted.
+static Value read_content_object(const Path *path, const char *name, Value relative_path, int body,
+    Array *included, Env *env) {
   Value obj = create_object(0, env->arena);
-  object_def(obj.object_value, "path", path_to_string(path, env->arena), env);
-  object_def(obj.object_value, "relative_path", path_stack_to_string(path_stack, env->arena), env);
+  Value path_value = path_to_string(path, env->arena);
+  object_def_known(obj.object_value, path, path_value, env);
+  object_def_known(obj.object_value, relative_path, relative_path, env);
   Value name_value = copy_c_string(name, env->arena);
   for (size_t i = name_value.string_value->size - 1; i > 0; i--) {
     if (name_value.string_value->bytes[i] == '.') {
       Value type_value = create_string(name_value.string_value->bytes + i + 1,
           name_value.string_value->size - i - 1, env->arena);
-      object_def(obj.object_value, "type", type_value, env);
+      object_def_known(obj.object_value, type, type_value, env);
       name_value.string_value->size = i;
       break;
     }
   }
-  object_def(obj.object_value, "name", name_value, env);
+  object_def_known(obj.object_value, name, name_value, env);
   Module *m = load_asset_module(path, env);
-  object_def(obj.object_value, "modified", create_time(m->mtime), env);
-  FILE *file = fopen(path->path, "r");
-  if (!file) {
+  object_def_known(obj.object_value, modified, create_time(m->mtime), env);
+  ContentSources sources = {create_array(0, env->arena).array_value, !env->error};
+  Value front_matter = create_object(0, env->arena);
+  long offset = read_front_matter(front_matter.object_value, path, &sources, env);
+  if (offset < 0) {
     fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, strerror(errno));
     return nil_value;
   }
-  read_front_matter(obj.object_value, file, path, env);
-  Value content = read_file_content(obj.object_value, file, path, env);
-  fclose(file);
-  object_def(obj.object_value, "content", content, env);
-  Value html = parse_content(content, path, env);
-  object_def(obj.object_value, "html", html, env);
-  Value title_tag = html_find_tag(get_symbol("h1", env->symbol_map), html);
-  if (title_tag.type != V_NIL) {
-    StringBuffer title_buffer = create_string_buffer(0, env->arena);
-    html_text_content(title_tag, &title_buffer);
-    object_def(obj.object_value, "title", finalize_string_buffer(title_buffer), env);
-  }
-  object_def(obj.object_value, "read_more", has_read_more(html) ? true_value : false_value, env);
-  int max_toc_level = 6;
-  Value temp;
-  if (object_get_symbol(obj.object_value, "toc_depth", &temp) && temp.type == V_INT) {
-    max_toc_level = temp.int_value;
+  ObjectIterator it = iterate_object(front_matter.object_value);
+  Value entry_key, entry_value;
+  while (object_iterator_next(&it, &entry_key, &entry_value)) {
+    object_put(obj.object_value, entry_key, entry_value, env->arena);
   }
-  int numbered_headings = 0;
-  if (object_get_symbol(obj.object_value, "numbered_headings", &temp) && temp.type == V_INT) {
-    numbered_headings = temp.int_value;
+  if (!body) {
+    return obj;
   }
-  String *nested_id_sep = NULL;
-  if (object_get_symbol(obj.object_value, "nested_id_sep", &temp) && temp.type == V_STRING) {
-    nested_id_sep = temp.string_value;
+  Hash cache_key = get_content_cache_key(env);
+  LazyContent *lazy = arena_allocate(sizeof(LazyContent), env->arena);
+  *lazy = (LazyContent) { env, obj.object_value, path_value, front_matter, cache_key, offset,
+    sources.cacheable, 0, nil_value, nil_value, nil_value, 0, nil_value, false_value, nil_value, sources.includes,
+    NULL, 0, NULL, NULL };
+  if (included) {
+    convert_content(lazy, path);
+    object_def_known(obj.object_value, content, get_content_string(lazy), env);
+    object_def_known(obj.object_value, html, lazy->html, env);
+    if (lazy->found_title) {
+      object_def_known(obj.object_value, title, lazy->title, env);
+    }
+    object_def_known(obj.object_value, read_more, lazy->read_more, env);
+    object_def_known(obj.object_value, toc, lazy->toc, env);
+    for (size_t i = 0; i < lazy->includes->size; i++) {
+      array_push(included, lazy->includes->cells[i], env->arena);
+    }
+    return obj;
   }
-  Value toc = create_array(0, env->arena);
-  if (max_toc_level > 1) {
-    Value sep1 = copy_c_string(".", env->arena);
-    Value sep2 = copy_c_string(". ", env->arena);
-    build_toc(html, toc.array_value, 2, max_toc_level, numbered_headings, sep1.string_value,
-       sep2.string_value, nested_id_sep, env); 
-    InsertTocArgs insert_toc_args = {env, toc.array_value};
-    html_transform(html, insert_toc, &insert_toc_args);
-  }
-  object_def(obj.object_value, "toc", toc, env);
+  Value value = create_lazy(get_lazy_content, lazy, env->arena);
+  object_def_known(obj.object_value, content, value, env);
+  object_def_known(obj.object_value, html, value, env);
+  object_def_known(obj.object_value, title, value, env);
+  object_def_known(obj.object_value, read_more, value, env);
+  object_def_known(obj.object_value, toc, value, env);
+  return obj;
+}
+
+static Value create_content_object(const Path *path, const char *name, Value relative_path, int body,
+    Array *included, Env *env) {
+  ProfileTimer timer = profile_start();
+  Value obj = read_content_object(path, name, relative_path, body, included, env);
+  profile_end(timer, PROFILE_CONTENT, path->path);
   return obj;
 }
 
-static int find_content(const Path *path, int recursive, const char *suffix, size_t suffix_length,
-    PathStack *path_stack, Array *content, Env *env) {
+typedef struct {
+  Path *path;
+  Value relative_path;
+} ContentFile;
+
+typedef struct {
+  ContentFile *files;
+  size_t size;
+  size_t capacity;
+  int body;
+} ContentFileList;
+
+static int content_jobs = 1;
+
+void set_content_jobs(int jobs) {
+  content_jobs = jobs;
+}
+
+static void add_content_file(ContentFileList *list, const Path *path, PathStack *path_stack, Env *env) {
+  if (list->size >= list->capacity) {
+    list->capacity = list->capacity ? list->capacity << 1 : 16;
+    list->files = reallocate(list->files, list->capacity * sizeof(ContentFile));
+  }
+  ContentFile *file = &list->files[list->size++];
+  file->path = copy_path(path);
+  file->relative_path = path_stack_to_string(path_stack, env->arena);
+}
+
+static void delete_content_files(ContentFileList *list) {
+  for (size_t i = 0; i < list->size; i++) {
+    delete_path(list->files[i].path);
+  }
+  if (list->files) {
+    free(list->files);
+  }
+}
+
+static void find_content(const Path *path, int recursive, const char *suffix, size_t suffix_length,
+    PathStack *path_stack, ContentFileList *files, Env *env) {
+  add_dependency(path, env);
   DIR *dir = opendir(path->path);
-  int status = 1;
   if (dir) {
     struct dirent *file;
     while ((file = readdir(dir))) {
@@ -493,25 +942,202 @@ static int find_content(const Path *path, int recursive, const char *suffix, siz
             }
           }
           if (match) {
-            Value obj = create_content_object(subpath, file->d_name, path_stack, env);
-            if (obj.type == V_OBJECT) {
-              array_push(content, obj, env->arena);
-            } else {
-              status = 0;
-            }
+            add_content_file(files, subpath, path_stack, env);
           }
         } else if (recursive) {
           PathStack next = {NULL, path_stack, file->d_name};
           if (path_stack) {
             path_stack->next = &next;
           }
-          status = status && find_content(subpath, recursive, suffix, suffix_length, &next, content, env);
+          find_content(subpath, recursive, suffix, suffix_length, &next, files, env);
         }
         delete_path(subpath);
       }
     }
     closedir(dir);
   }
+}
+
+static int has_closure_handlers(Env *env) {
+  Value content_handlers;
+  if (!env_get_known(CONTENT_HANDLERS, &content_handlers, env) || content_handlers.type != V_OBJECT) {
+    return 0;
+  }
+  ObjectIterator it = iterate_object(content_handlers.object_value);
+  Value type, handler;
+  while (object_iterator_next(&it, &type, &handler)) {
+    if (handler.type == V_CLOSURE) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void load_content_worker(ContentFileList *files, size_t offset, int jobs, FILE *out, Env *env) {
+  Buffer buffer = create_buffer(0);
+  for (size_t i = offset; i < files->size; i += jobs) {
+    ContentFile *file = &files->files[i];
+    Value included = create_array(0, env->arena);
+    Value obj = create_content_object(file->path, path_get_name(file->path), file->relative_path, files->body,
+        included.array_value, env);
+    if (env->error) {
+      // Let the parent reproduce the error so that it is reported by the caller
+      env_clear_error(env);
+      fputc(0, out);
+      continue;
+    } else if (obj.type != V_OBJECT) {
+      fputc(2, out);
+      continue;
+    }
+    Value result = create_object(2, env->arena);
+    object_def(result.object_value, "object", obj, env);
+    object_def_known(result.object_value, includes, included, env);
+    buffer.size = 0;
+    if (!serialize_value(result, &buffer)) {
+      fputc(0, out);
+      continue;
+    }
+    uint64_t size = buffer.size;
+    fputc(1, out);
+    fwrite(&size, sizeof(uint64_t), 1, out);
+    fwrite(buffer.data, 1, buffer.size, out);
+  }
+  delete_buffer(buffer);
+}
+
+static Value read_worker_content(FILE *in, Env *env) {
+  uint64_t size;
+  if (fread(&size, sizeof(uint64_t), 1, in) != 1) {
+    return nil_value;
+  }
+  uint8_t *data = malloc(size ? size : 1);
+  if (!data) {
+    return nil_value;
+  }
+  Value obj = nil_value;
+  if (fread(data, 1, size, in) == size) {
+    Value result = deserialize_value(data, size, env->symbol_map, env->arena);
+    Value includes;
+    if (result.type == V_OBJECT && object_get_symbol(result.object_value, "object", &obj)
+        && object_get_known(result.object_value, includes, &includes) && includes.type == V_ARRAY) {
+      // The worker's dependencies are lost with it, so they are added here
+      Value path;
+      if (obj.type == V_OBJECT && object_get_known(obj.object_value, path, &path) && path.type == V_STRING) {
+        Path *content_path = string_to_path(path.string_value);
+        load_asset_module(content_path, env);
+        delete_path(content_path);
+      }
+      for (size_t i = 0; i < includes.array_value->size; i++) {
+        Value include = includes.array_value->cells[i];
+        if (include.type == V_OBJECT && object_get_known(include.object_value, path, &path)
+            && path.type == V_STRING) {
+          Path *include_path = string_to_path(path.string_value);
+          load_asset_module(include_path, env);
+          delete_path(include_path);
+        }
+      }
+    } else {
+      obj = nil_value;
+    }
+  }
+  free(data);
+  return obj;
+}
+
+static int load_content_parallel(ContentFileList *files, int jobs, Array *content, Env *env) {
+  pid_t *pids = allocate(jobs * sizeof(pid_t));
+  FILE **results = allocate(jobs * sizeof(FILE *));
+  int workers = 0;
+  fflush(NULL);
+  for (int k = 0; k < jobs; k++) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+      fprintf(stderr, ERROR_LABEL "unable to create pipe: %s" SGR_RESET "\n", strerror(errno));
+      break;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+      fprintf(stderr, ERROR_LABEL "unable to fork: %s" SGR_RESET "\n", strerror(errno));
+      close(fds[0]);
+      close(fds[1]);
+      break;
+    }
+    if (pid == 0) {
+      for (int j = 0; j < workers; j++) {
+        fclose(results[j]);
+      }
+      close(fds[0]);
+      FILE *out = fdopen(fds[1], "w");
+      clear_profile();
+      if (out) {
+        load_content_worker(files, k, jobs, out, env);
+        if (is_profiling()) {
+          write_profile(out);
+        }
+        fclose(out);
+      }
+      fflush(NULL);
+      _exit(0);
+    }
+    close(fds[1]);
+    pids[workers] = pid;
+    results[workers] = fdopen(fds[0], "r");
+    workers++;
+  }
+  int status = 1;
+  for (size_t i = 0; i < files->size; i++) {
+    ContentFile *file = &files->files[i];
+    int result = 0;
+    Value obj = nil_value;
+    if (i % jobs < (size_t) workers) {
+      result = fgetc(results[i % jobs]);
+      if (result == 1) {
+        obj = read_worker_content(results[i % jobs], env);
+      }
+    }
+    if (result == 0 || (result == 1 && obj.type != V_OBJECT) || result == EOF) {
+      obj = create_content_object(file->path, path_get_name(file->path), file->relative_path, files->body, NULL,
+        env);
+    }
+    if (obj.type == V_OBJECT) {
+      array_push(content, obj, env->arena);
+    } else {
+      status = 0;
+    }
+  }
+  for (int k = 0; k < workers; k++) {
+    if (is_profiling() && !read_profile(results[k])) {
+      fprintf(stderr, ERROR_LABEL "invalid profile from content worker %d" SGR_RESET "\n", k + 1);
+    }
+    fclose(results[k]);
+    waitpid(pids[k], NULL, 0);
+  }
+  free(pids);
+  free(results);
+  return status;
+}
+
+static int load_content(ContentFileList *files, Array *content, Env *env) {
+  int jobs = content_jobs;
+  if ((size_t) jobs > files->size) {
+    jobs = files->size;
+  }
+  // Closure handlers are evaluated in the parent, in order, since they may depend on global state. With a memory
+  // limit the content is instead converted when it is first used and released again when memory runs low.
+  if (jobs > 1 && (!files->body || (!has_closure_handlers(env) && !content_memory_limit))) {
+    return load_content_parallel(files, jobs, content, env);
+  }
+  int status = 1;
+  for (size_t i = 0; i < files->size; i++) {
+    ContentFile *file = &files->files[i];
+    Value obj = create_content_object(file->path, path_get_name(file->path), file->relative_path, files->body, NULL,
+        env);
+    if (obj.type == V_OBJECT) {
+      array_push(content, obj, env->arena);
+    } else {
+      status = 0;
+    }
+  }
   return status;
 }
 
@@ -523,6 +1149,7 @@ static Value list_content(const Tuple *args, Env *env) {
     return nil_value;
   }
   int recursive = 1;
+  int body = 1;
   char *suffix = NULL;
   if (args->size > 1) {
     Value options = args->values[1];
@@ -534,6 +1161,9 @@ static Value list_content(const Tuple *args, Env *env) {
     if (object_get(options.object_value, create_symbol(get_symbol("recursive", env->symbol_map)), &value)) {
       recursive = is_truthy(value);
     }
+    if (object_get(options.object_value, create_symbol(get_symbol("body", env->symbol_map)), &value)) {
+      body = is_truthy(value);
+    }
     if (object_get(options.object_value, create_symbol(get_symbol("suffix", env->symbol_map)), &value)
         && value.type == V_STRING) {
       suffix = string_to_c_string(value.string_value);
@@ -548,8 +1178,11 @@ static Value list_content(const Tuple *args, Env *env) {
     delete_path(path);
     return nil_value;
   }
-  Value content = create_array(0, env->arena);
-  int result = find_content(src_path, recursive, suffix, suffix ? strlen(suffix) : 0, NULL, content.array_value, env);
+  ContentFileList files = {NULL, 0, 0, body};
+  find_content(src_path, recursive, suffix, suffix ? strlen(suffix) : 0, NULL, &files, env);
+  Value content = create_array(files.size, env->arena);
+  int result = load_content(&files, content.array_value, env);
+  delete_content_files(&files);
   if (!result) {
     env_error(env, -1, "encountered one or more errors when listing content");
   }
@@ -574,7 +1207,8 @@ static Value read_content(const Tuple *args, Env *env) {
   if (!src_path) {
     return nil_value;
   }
-  Value obj = create_content_object(src_path, path_get_name(src_path), NULL, env);
+  Value obj = create_content_object(src_path, path_get_name(src_path), path_stack_to_string(NULL, env->arena), 1,
+      NULL, env);
   if (obj.type != V_OBJECT) {
     env_error(env, -1, "content read error");
   }
@@ -9,6 +9,14 @@
 
 #include "value.h"
 
+void set_content_jobs(int jobs);
+// Limits the size of content converted while compiling pages, 0 for no limit
+void set_content_memory_limit(size_t limit);
+// While enabled (and a limit is set), content converted on demand is kept in separate arenas
+void set_releasable_content(int releasable);
+// Releases the least recently used converted content until the limit is no longer exceeded, the content is
+// loaded from the content cache or converted again the next time it is used
+void release_content(void);
 void import_contentmap(Env *env);
 
 #endif
@@ -0,0 +1,480 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#include "dataparser.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define MAX_DATA_DEPTH 512
+#define MAX_NUMBER_LENGTH 63
+
+typedef struct {
+  const uint8_t *p;
+  const uint8_t *end;
+  int json;
+  SymbolMap *symbol_map;
+  Arena *arena;
+  // Elements of the arrays and objects currently being parsed, keys and values of objects alternate. Containers are
+  // only allocated once all of their elements are known, so they never have to grow.
+  Value *stack;
+  size_t stack_size;
+  size_t stack_capacity;
+  // Used for strings containing escape sequences and for names
+  Buffer buffer;
+  int depth;
+} DataParser;
+
+static int parse_value(DataParser *parser, Value *value);
+
+static void push_value(DataParser *parser, Value value) {
+  if (parser->stack_size >= parser->stack_capacity) {
+    parser->stack_capacity = parser->stack_capacity ? parser->stack_capacity << 1 : 64;
+    parser->stack = reallocate(parser->stack, parser->stack_capacity * sizeof(Value));
+  }
+  parser->stack[parser->stack_size++] = value;
+}
+
+static void skip_ws(DataParser *parser) {
+  const uint8_t *p = parser->p;
+  while (p < parser->end) {
+    if (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r') {
+      p++;
+    } else if (*p == '#' && !parser->json) {
+      const uint8_t *lf = memchr(p, '\n', parser->end - p);
+      p = lf ? lf : parser->end;
+    } else {
+      break;
+    }
+  }
+  parser->p = p;
+}
+
+// Finds the first quote, backslash or stop byte, 16 bytes at a time where possible
+static const uint8_t *scan_string(const uint8_t *p, const uint8_t *end, uint8_t quote, uint8_t stop) {
+#if defined(__SSE2__)
+  __m128i quotes = _mm_set1_epi8((char) quote);
+  __m128i backslashes = _mm_set1_epi8('\\');
+  __m128i stops = _mm_set1_epi8((char) stop);
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *) p);
+    __m128i matches = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quotes), _mm_cmpeq_epi8(chunk, backslashes)),
+        _mm_cmpeq_epi8(chunk, stops));
+    int mask = _mm_movemask_epi8(matches);
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#endif
+  while (p < end && *p != quote && *p != '\\' && *p != stop) {
+    p++;
+  }
+  return p;
+}
+
+static int read_hex(DataParser *parser, int length, uint32_t *code_point) {
+  if (parser->end - parser->p < length) {
+    return 0;
+  }
+  *code_point = 0;
+  for (int i = 0; i < length; i++) {
+    int c = *parser->p++;
+    if (!isxdigit(c)) {
+      return 0;
+    }
+    *code_point = (*code_point << 4) | (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+  }
+  return 1;
+}
+
+static int put_utf8(uint32_t code_point, Buffer *buffer) {
+  if (code_point < 0x80) {
+    buffer_put(buffer, code_point);
+  } else if (code_point < 0x800) {
+    buffer_put(buffer, 0xC0 | (code_point >> 6));
+    buffer_put(buffer, 0x80 | (code_point & 0x3F));
+  } else if (code_point < 0x10000) {
+    buffer_put(buffer, 0xE0 | (code_point >> 12));
+    buffer_put(buffer, 0x80 | ((code_point >> 6) & 0x3F));
+    buffer_put(buffer, 0x80 | (code_point & 0x3F));
+  } else if (code_point < 0x110000) {
+    buffer_put(buffer, 0xF0 | (code_point >> 18));
+    buffer_put(buffer, 0x80 | ((code_point >> 12) & 0x3F));
+    buffer_put(buffer, 0x80 | ((code_point >> 6) & 0x3F));
+    buffer_put(buffer, 0x80 | (code_point & 0x3F));
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+// Same escape sequences as string literals in the language, except that UTF-16 surrogate pairs are combined
+static int read_escape(DataParser *parser, uint8_t quote) {
+  if (parser->p >= parser->end) {
+    return 0;
+  }
+  uint32_t code_point;
+  int c = *parser->p++;
+  switch (c) {
+    case '"':
+    case '\'':
+    case '\\':
+    case '/':
+      buffer_put(&parser->buffer, c);
+      return 1;
+    case '{':
+    case '}':
+      if (quote != '"') {
+        return 0;
+      }
+      buffer_put(&parser->buffer, c);
+      return 1;
+    case 'b':
+      buffer_put(&parser->buffer, '\b');
+      return 1;
+    case 'f':
+      buffer_put(&parser->buffer, '\f');
+      return 1;
+    case 'n':
+      buffer_put(&parser->buffer, '\n');
+      return 1;
+    case 'r':
+      buffer_put(&parser->buffer, '\r');
+      return 1;
+    case 't':
+      buffer_put(&parser->buffer, '\t');
+      return 1;
+    case 'x':
+      if (!read_hex(parser, 2, &code_point)) {
+        return 0;
+      }
+      buffer_put(&parser->buffer, code_point);
+      return 1;
+    case 'u':
+      if (!read_hex(parser, 4, &code_point)) {
+        return 0;
+      }
+      if (code_point >= 0xD800 && code_point < 0xDC00 && parser->end - parser->p >= 6 && parser->p[0] == '\\'
+          && parser->p[1] == 'u') {
+        const uint8_t *low_start = parser->p;
+        uint32_t low;
+        parser->p += 2;
+        if (read_hex(parser, 4, &low) && low >= 0xDC00 && low < 0xE000) {
+          code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+        } else {
+          parser->p = low_start;
+        }
+      }
+      return put_utf8(code_point, &parser->buffer);
+    case 'U':
+      if (!read_hex(parser, 8, &code_point)) {
+        return 0;
+      }
+      return put_utf8(code_point, &parser->buffer);
+    default:
+      return 0;
+  }
+}
+
+// Bytes either points into the data or, if the string contains escape sequences, to the buffer
+static int read_string(DataParser *parser, const uint8_t **bytes, size_t *size) {
+  uint8_t quote = *parser->p++;
+  // Double-quoted strings in object notation may contain interpolations, and """ starts a verbatim string
+  uint8_t stop = quote;
+  if (quote == '"' && !parser->json) {
+    if (parser->end - parser->p >= 2 && parser->p[0] == '"' && parser->p[1] == '"') {
+      return 0;
+    }
+    stop = '{';
+  }
+  const uint8_t *start = parser->p;
+  const uint8_t *p = scan_string(start, parser->end, quote, stop);
+  if (p < parser->end && *p == quote) {
+    *bytes = start;
+    *size = p - start;
+    parser->p = p + 1;
+    return 1;
+  }
+  parser->buffer.size = 0;
+  while (p < parser->end && *p == '\\') {
+    buffer_append_bytes(&parser->buffer, start, p - start);
+    parser->p = p + 1;
+    if (!read_escape(parser, quote)) {
+      return 0;
+    }
+    start = parser->p;
+    p = scan_string(start, parser->end, quote, stop);
+  }
+  if (p >= parser->end || *p != quote) {
+    return 0;
+  }
+  buffer_append_bytes(&parser->buffer, start, p - start);
+  *bytes = parser->buffer.data;
+  *size = parser->buffer.size;
+  parser->p = p + 1;
+  return 1;
+}
+
+static int parse_string(DataParser *parser, Value *value) {
+  const uint8_t *bytes;
+  size_t size;
+  if (!read_string(parser, &bytes, &size)) {
+    return 0;
+  }
+  *value = create_string(bytes, size, parser->arena);
+  return 1;
+}
+
+// JSON keys become symbols, like names in object notation, so that they can be accessed with '.'
+static int parse_json_key(DataParser *parser, Value *value) {
+  const uint8_t *bytes;
+  size_t size;
+  if (!read_string(parser, &bytes, &size) || memchr(bytes, '\0', size)) {
+    return 0;
+  }
+  if (bytes != parser->buffer.data) {
+    parser->buffer.size = 0;
+    buffer_append_bytes(&parser->buffer, bytes, size);
+  }
+  buffer_put(&parser->buffer, '\0');
+  *value = create_symbol(get_symbol((const char *) parser->buffer.data, parser->symbol_map));
+  return 1;
+}
+
+static int parse_number(DataParser *parser, Value *value) {
+  const uint8_t *p = parser->p;
+  const uint8_t *end = parser->end;
+  const uint8_t *start = p;
+  int is_float = 0;
+  if (*p == '-') {
+    p++;
+  }
+  if (p >= end || !isdigit(*p)) {
+    return 0;
+  }
+  while (p < end && isdigit(*p)) {
+    p++;
+  }
+  if (p < end && *p == '.') {
+    is_float = 1;
+    p++;
+    while (p < end && isdigit(*p)) {
+      p++;
+    }
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    is_float = 1;
+    p++;
+    if (p < end && (*p == '+' || *p == '-')) {
+      p++;
+    }
+    while (p < end && isdigit(*p)) {
+      p++;
+    }
+  }
+  if (p - start > MAX_NUMBER_LENGTH) {
+    return 0;
+  }
+  char number[MAX_NUMBER_LENGTH + 1];
+  memcpy(number, start, p - start);
+  number[p - start] = '\0';
+  if (is_float) {
+    *value = create_float(strtod(number, NULL));
+  } else {
+    *value = create_int(strtoll(number, NULL, 10));
+  }
+  parser->p = p;
+  return 1;
+}
+
+static int is_name_char(uint8_t c) {
+  return c == '_' || isalnum(c) || c & 0x80;
+}
+
+// Returns a null-terminated name in the buffer
+static const char *parse_name(DataParser *parser) {
+  const uint8_t *start = parser->p;
+  while (parser->p < parser->end && is_name_char(*parser->p)) {
+    parser->p++;
+  }
+  if (parser->p == start) {
+    return NULL;
+  }
+  parser->buffer.size = 0;
+  buffer_append_bytes(&parser->buffer, start, parser->p - start);
+  buffer_put(&parser->buffer, '\0');
+  return (const char *) parser->buffer.data;
+}
+
+static int parse_keyword(DataParser *parser, Value *value) {
+  const char *name = parse_name(parser);
+  if (!name) {
+    return 0;
+  }
+  if (strcmp(name, "true") == 0) {
+    *value = true_value;
+  } else if (strcmp(name, "false") == 0) {
+    *value = false_value;
+  } else if (strcmp(name, parser->json ? "null" : "nil") == 0) {
+    *value = nil_value;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+// Parses elements until the closing bracket, a comma after the last element is allowed
+static int parse_elements(DataParser *parser, uint8_t close, int is_object) {
+  skip_ws(parser);
+  if (parser->p < parser->end && *parser->p == close) {
+    parser->p++;
+    return 1;
+  }
+  while (1) {
+    Value element;
+    if (is_object) {
+      if (parser->p >= parser->end) {
+        return 0;
+      }
+      if (parser->json && *parser->p == '"') {
+        if (!parse_json_key(parser, &element)) {
+          return 0;
+        }
+      } else if (*parser->p == '"' || (*parser->p == '\'' && !parser->json)) {
+        if (!parse_string(parser, &element)) {
+          return 0;
+        }
+      } else {
+        const char *name = parse_name(parser);
+        if (!name || isdigit(name[0])) {
+          return 0;
+        }
+        element = create_symbol(get_symbol(name, parser->symbol_map));
+      }
+      push_value(parser, element);
+      skip_ws(parser);
+      if (parser->p >= parser->end || *parser->p != ':') {
+        return 0;
+      }
+      parser->p++;
+      skip_ws(parser);
+    }
+    if (!parse_value(parser, &element)) {
+      return 0;
+    }
+    push_value(parser, element);
+    skip_ws(parser);
+    if (parser->p >= parser->end) {
+      return 0;
+    }
+    if (*parser->p == close) {
+      parser->p++;
+      return 1;
+    }
+    if (*parser->p != ',') {
+      return 0;
+    }
+    parser->p++;
+    skip_ws(parser);
+    if (parser->p < parser->end && *parser->p == close) {
+      parser->p++;
+      return 1;
+    }
+  }
+}
+
+static int parse_array(DataParser *parser, Value *value) {
+  size_t base = parser->stack_size;
+  parser->p++;
+  if (!parse_elements(parser, ']', 0)) {
+    return 0;
+  }
+  size_t size = parser->stack_size - base;
+  *value = create_array(size, parser->arena);
+  if (size) {
+    memcpy(value->array_value->cells, parser->stack + base, size * sizeof(Value));
+    value->array_value->size = size;
+  }
+  parser->stack_size = base;
+  return 1;
+}
+
+static int parse_object(DataParser *parser, Value *value) {
+  size_t base = parser->stack_size;
+  parser->p++;
+  if (!parse_elements(parser, '}', 1)) {
+    return 0;
+  }
+  size_t size = (parser->stack_size - base) / 2;
+  *value = create_object(size, parser->arena);
+  for (size_t i = 0; i < size; i++) {
+    object_put(value->object_value, parser->stack[base + 2 * i], parser->stack[base + 2 * i + 1], parser->arena);
+  }
+  parser->stack_size = base;
+  return 1;
+}
+
+static int parse_value(DataParser *parser, Value *value) {
+  if (parser->p >= parser->end) {
+    return 0;
+  }
+  int result;
+  switch (*parser->p) {
+    case '{':
+    case '[':
+      if (parser->depth >= MAX_DATA_DEPTH) {
+        return 0;
+      }
+      parser->depth++;
+      result = *parser->p == '{' ? parse_object(parser, value) : parse_array(parser, value);
+      parser->depth--;
+      return result;
+    case '"':
+    case '\'':
+      if (*parser->p == '\'' && parser->json) {
+        return 0;
+      }
+      return parse_string(parser, value);
+    case '-':
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+      return parse_number(parser, value);
+    default:
+      return parse_keyword(parser, value);
+  }
+}
+
+int parse_data(const uint8_t *data, size_t size, int json, SymbolMap *symbol_map, Arena *arena, Value *value) {
+  DataParser parser = {
+    .p = data,
+    .end = data + size,
+    .json = json,
+    .symbol_map = symbol_map,
+    .arena = arena,
+    .stack = NULL,
+    .stack_size = 0,
+    .stack_capacity = 0,
+    .buffer = create_buffer(0),
+    .depth = 0
+  };
+  skip_ws(&parser);
+  int result = parse_value(&parser, value);
+  if (result) {
+    skip_ws(&parser);
+    result = parser.p == parser.end;
+  }
+  if (parser.stack) {
+    free(parser.stack);
+  }
+  delete_buffer(parser.buffer);
+  return result;
+}
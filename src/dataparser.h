@@ -0,0 +1,18 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef DATAPARSER_H
+#define DATAPARSER_H
+
+#include "value.h"
+
+// Builds values directly from JSON, or from the literal subset of the object notation used by .tson files: objects,
+// arrays, strings without interpolation, numbers, true, false and nil (null in JSON). Returns 0 if the data contains
+// anything else, in which case it must be evaluated by the parser and interpreter instead, which also report errors.
+// Double-quoted strings in JSON are never interpolated, and keys in JSON objects become symbols.
+int parse_data(const uint8_t *data, size_t size, int json, SymbolMap *symbol_map, Arena *arena, Value *value);
+
+#endif
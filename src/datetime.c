@@ -7,6 +7,9 @@
 #define _GNU_SOURCE
 #include "datetime.h"
 
+#include "hashmap.h"
+#include "strings.h"
+
 #include <ctype.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -26,6 +29,61 @@ typedef struct {
   size_t length;
 } DateParseInput;
 
+#define LOCAL_TIME_CACHE_SIZE 256
+
+typedef struct {
+  int valid;
+  time_t timestamp;
+  struct tm tm;
+} LocalTimeEntry;
+
+#define PARSED_TIME_CACHE_SIZE 64
+#define MAX_PARSED_TIME_LENGTH 32
+
+typedef struct {
+  uint8_t length;
+  uint8_t bytes[MAX_PARSED_TIME_LENGTH];
+  time_t timestamp;
+} ParsedTimeEntry;
+
+typedef enum {
+  DF_LITERAL,
+  DF_YEAR,
+  DF_MONTH,
+  DF_DAY,
+  DF_SPACE_PADDED_DAY,
+  DF_HOUR,
+  DF_MINUTE,
+  DF_SECOND,
+  DF_DAY_NAME,
+  DF_MONTH_NAME,
+  // Any other conversion, formatted with strftime()
+  DF_OTHER
+} DateFormatOpType;
+
+typedef struct {
+  DateFormatOpType type;
+  // Offset and length of the literal text or conversion specification in DateFormat.format
+  size_t offset;
+  size_t length;
+} DateFormatOp;
+
+#define DATE_FORMAT_CACHE_SIZE 16
+
+// A format string split into literal text and conversions
+typedef struct {
+  char *format;
+  size_t size;
+  DateFormatOp *ops;
+  size_t ops_size;
+} DateFormat;
+
+static LocalTimeEntry local_time_cache[LOCAL_TIME_CACHE_SIZE];
+static int timezone_initialized = 0;
+static ParsedTimeEntry parsed_time_cache[PARSED_TIME_CACHE_SIZE];
+static DateFormat *date_format_cache[DATE_FORMAT_CACHE_SIZE];
+static size_t date_format_cache_next = 0;
+
 static Value now(const Tuple *args, Env *env) {
   check_args(0, args, env);
   return create_time(time(NULL));
@@ -100,14 +158,33 @@ static time_t parse_iso8601(DateParseInput *input) {
   return result;
 }
 
+// Front matter dates are usually formatted by several templates, and mktime() is slow, so recently parsed strings
+// are remembered
+static time_t parse_time_string(const String *string) {
+  ParsedTimeEntry *entry = NULL;
+  if (string->size <= MAX_PARSED_TIME_LENGTH) {
+    entry = &parsed_time_cache[hash_bytes(string->bytes, string->size, 0) % PARSED_TIME_CACHE_SIZE];
+    if (entry->length == string->size && string->size && memcmp(entry->bytes, string->bytes, string->size) == 0) {
+      return entry->timestamp;
+    }
+  }
+  DateParseInput input = {string->bytes, string->size};
+  time_t timestamp = parse_iso8601(&input);
+  if (entry) {
+    entry->length = string->size;
+    memcpy(entry->bytes, string->bytes, string->size);
+    entry->timestamp = timestamp;
+  }
+  return timestamp;
+}
+
 static int parse_time_value(Value arg, time_t *result) {
   if (arg.type == V_TIME) {
     *result = arg.time_value;
   } else if (arg.type == V_INT) {
     *result = (time_t) arg.int_value;
   } else if (arg.type == V_STRING) {
-    DateParseInput input = {arg.string_value->bytes, arg.string_value->size};
-    *result = parse_iso8601(&input);
+    *result = parse_time_string(arg.string_value);
   } else {
     return 0;
   }
@@ -125,6 +202,178 @@ static Value time_(const Tuple *args, Env *env) {
   }
 }
 
+static DateFormat *compile_date_format(const uint8_t *format, size_t size) {
+  DateFormat *date_format = allocate(sizeof(DateFormat));
+  date_format->format = allocate(size + 1);
+  memcpy(date_format->format, format, size);
+  date_format->format[size] = '\0';
+  date_format->size = size;
+  date_format->ops = NULL;
+  date_format->ops_size = 0;
+  size_t ops_capacity = 0;
+  size_t i = 0;
+  while (i < size) {
+    DateFormatOp op = { .type = DF_LITERAL, .offset = i };
+    if (format[i] != '%' || i + 1 >= size) {
+      while (i < size && (format[i] != '%' || i + 1 >= size)) {
+        i++;
+      }
+    } else if (format[i + 1] == '%') {
+      // Only the second percent sign is output
+      op.offset = i + 1;
+      i += 2;
+    } else {
+      i++;
+      // Flags, field width and modifiers are left to strftime()
+      while (i < size - 1 && format[i] && strchr("_-0^#+EO123456789", format[i])) {
+        i++;
+      }
+      switch (i == op.offset + 1 ? format[i] : 0) {
+        case 'Y': op.type = DF_YEAR; break;
+        case 'm': op.type = DF_MONTH; break;
+        case 'd': op.type = DF_DAY; break;
+        case 'e': op.type = DF_SPACE_PADDED_DAY; break;
+        case 'H': op.type = DF_HOUR; break;
+        case 'M': op.type = DF_MINUTE; break;
+        case 'S': op.type = DF_SECOND; break;
+        case 'a': op.type = DF_DAY_NAME; break;
+        case 'b': op.type = DF_MONTH_NAME; break;
+        default: op.type = DF_OTHER; break;
+      }
+      i++;
+    }
+    op.length = i - op.offset;
+    if (date_format->ops_size >= ops_capacity) {
+      ops_capacity = ops_capacity ? ops_capacity << 1 : 8;
+      date_format->ops = reallocate(date_format->ops, ops_capacity * sizeof(DateFormatOp));
+    }
+    date_format->ops[date_format->ops_size++] = op;
+  }
+  return date_format;
+}
+
+static void delete_date_format(DateFormat *date_format) {
+  free(date_format->format);
+  if (date_format->ops) {
+    free(date_format->ops);
+  }
+  free(date_format);
+}
+
+// Templates tend to use a few different formats over and over again
+static DateFormat *get_date_format(const uint8_t *format, size_t size) {
+  for (size_t i = 0; i < DATE_FORMAT_CACHE_SIZE; i++) {
+    DateFormat *date_format = date_format_cache[i];
+    if (date_format && date_format->size == size && memcmp(date_format->format, format, size) == 0) {
+      return date_format;
+    }
+  }
+  DateFormat **slot = &date_format_cache[date_format_cache_next];
+  date_format_cache_next = (date_format_cache_next + 1) % DATE_FORMAT_CACHE_SIZE;
+  if (*slot) {
+    delete_date_format(*slot);
+  }
+  *slot = compile_date_format(format, size);
+  return *slot;
+}
+
+static void put_digits(int value, int width, char pad, StringBuffer *buffer) {
+  char digits[10];
+  int length = 0;
+  do {
+    digits[length++] = '0' + value % 10;
+    value /= 10;
+  } while (value && length < (int) sizeof(digits));
+  while (length < width--) {
+    string_buffer_put(buffer, pad);
+  }
+  while (length) {
+    string_buffer_put(buffer, digits[--length]);
+  }
+}
+
+// Returns 0 if a conversion specification is too long
+static int format_time(const DateFormat *date_format, const struct tm *t, StringBuffer *buffer) {
+  for (size_t i = 0; i < date_format->ops_size; i++) {
+    const DateFormatOp *op = &date_format->ops[i];
+    switch (op->type) {
+      case DF_LITERAL:
+        string_buffer_append_bytes(buffer, (uint8_t *) date_format->format + op->offset, op->length);
+        break;
+      case DF_YEAR:
+        // strftime() doesn't pad years before 1000
+        if (t->tm_year < 1000 - 1900 || t->tm_year > 9999 - 1900) {
+          goto other;
+        }
+        put_digits(t->tm_year + 1900, 4, '0', buffer);
+        break;
+      case DF_MONTH:
+        put_digits(t->tm_mon + 1, 2, '0', buffer);
+        break;
+      case DF_DAY:
+        put_digits(t->tm_mday, 2, '0', buffer);
+        break;
+      case DF_SPACE_PADDED_DAY:
+        put_digits(t->tm_mday, 2, ' ', buffer);
+        break;
+      case DF_HOUR:
+        put_digits(t->tm_hour, 2, '0', buffer);
+        break;
+      case DF_MINUTE:
+        put_digits(t->tm_min, 2, '0', buffer);
+        break;
+      case DF_SECOND:
+        put_digits(t->tm_sec, 2, '0', buffer);
+        break;
+      case DF_DAY_NAME:
+        if (t->tm_wday < 0 || t->tm_wday > 6) {
+          goto other;
+        }
+        string_buffer_append_bytes(buffer, (uint8_t *) rfc2822_day_names[t->tm_wday], 3);
+        break;
+      case DF_MONTH_NAME:
+        if (t->tm_mon < 0 || t->tm_mon > 11) {
+          goto other;
+        }
+        string_buffer_append_bytes(buffer, (uint8_t *) rfc2822_month_names[t->tm_mon], 3);
+        break;
+      case DF_OTHER:
+      other: {
+        char spec[32];
+        char output[128];
+        if (op->length >= sizeof(spec)) {
+          return 0;
+        }
+        memcpy(spec, date_format->format + op->offset, op->length);
+        spec[op->length] = '\0';
+        // Some conversions, e.g. %p, may legitimately be empty
+        size_t size = strftime(output, sizeof(output), spec, t);
+        string_buffer_append_bytes(buffer, (uint8_t *) output, size);
+        break;
+      }
+    }
+  }
+  return 1;
+}
+
+static Value format_date(time_t timestamp, const uint8_t *format, size_t size, Env *env) {
+  struct tm t;
+  if (!local_time(timestamp, &t)) {
+    env_error(env, -1, "date formatting error: %s", strerror(errno));
+    return nil_value;
+  }
+  StringBuffer buffer = create_string_buffer(size + 16, env->arena);
+  if (!format_time(get_date_format(format, size), &t, &buffer)) {
+    env_error(env, -1, "date formatting error: invalid format");
+    return nil_value;
+  }
+  if (!buffer.string->size) {
+    env_error(env, -1, "date formatting error: empty result");
+    return nil_value;
+  }
+  return finalize_string_buffer(buffer);
+}
+
 static Value date(const Tuple *args, Env *env) {
   check_args(2, args, env);
   time_t arg;
@@ -137,26 +386,7 @@ static Value date(const Tuple *args, Env *env) {
     arg_type_error(1, V_STRING, args, env);
     return nil_value;
   }
-  struct tm *t = localtime(&arg);
-  // TODO: improve
-  char output[100];
-  if (t) {
-    char *format_string = allocate(format.string_value->size + 1);
-    memcpy(format_string, format.string_value->bytes, format.string_value->size);
-    format_string[format.string_value->size] = '\0';
-    size_t size = strftime(output, sizeof(output), format_string, t);
-    if (size) {
-      free(format_string);
-      return create_string((uint8_t *) output, size, env->arena);
-    } else {
-      env_error(env, -1, "date formatting error: empty result");
-      free(format_string);
-      return nil_value;
-    }
-  } else {
-    env_error(env, -1, "date formatting error: %s", strerror(errno));
-    return nil_value;
-  }
+  return format_date(arg, format.string_value->bytes, format.string_value->size, env);
 }
 
 static Value iso8601(const Tuple *args, Env *env) {
@@ -166,20 +396,8 @@ static Value iso8601(const Tuple *args, Env *env) {
     arg_error(0, "time|int|string", args, env);
     return nil_value;
   }
-  struct tm *t = localtime(&arg);
-  char output[100];
-  if (t) {
-    size_t size = strftime(output, sizeof(output), "%Y-%m-%dT%H:%M:%S%z", t);
-    if (size) {
-      return create_string((uint8_t *) output, size, env->arena);
-    } else {
-      env_error(env, -1, "date formatting error: empty result");
-      return nil_value;
-    }
-  } else {
-    env_error(env, -1, "date formatting error: %s", strerror(errno));
-    return nil_value;
-  }
+  const char *format = "%Y-%m-%dT%H:%M:%S%z";
+  return format_date(arg, (const uint8_t *) format, strlen(format), env);
 }
 
 static Value rfc2822(const Tuple *args, Env *env) {
@@ -208,8 +426,41 @@ void import_datetime(Env *env) {
   env_def_fn("rfc2822", rfc2822, env);
 }
 
+int local_time(time_t timestamp, struct tm *result) {
+  LocalTimeEntry *entry = &local_time_cache[hash_word(timestamp, 0) % LOCAL_TIME_CACHE_SIZE];
+  if (entry->valid && entry->timestamp == timestamp) {
+    *result = entry->tm;
+    return 1;
+  }
+  // Unlike localtime(), localtime_r() doesn't have to check for changes to the time zone on every call
+  if (!timezone_initialized) {
+    tzset();
+    timezone_initialized = 1;
+  }
+  if (!localtime_r(&timestamp, result)) {
+    return 0;
+  }
+  entry->valid = 1;
+  entry->timestamp = timestamp;
+  entry->tm = *result;
+  return 1;
+}
+
+int http_date(time_t timestamp, Buffer *buffer) {
+  struct tm tm;
+  struct tm *t = gmtime_r(&timestamp, &tm);
+  if (t) {
+    buffer_printf(buffer, "%s, %02d %s %d %02d:%02d:%02d GMT", rfc2822_day_names[t->tm_wday], t->tm_mday,
+        rfc2822_month_names[t->tm_mon], t->tm_year + 1900, t->tm_hour, t->tm_min, t->tm_sec);
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
 int rfc2822_date(time_t timestamp, Buffer *buffer) {
-  struct tm *t = localtime(&timestamp);
+  struct tm tm;
+  struct tm *t = local_time(timestamp, &tm) ? &tm : NULL;
   if (t) {
     char timezone[10];
     if (!strftime(timezone, sizeof(timezone), " %z", t)) {
@@ -11,6 +11,9 @@
 
 void import_datetime(Env *env);
 
+// Like localtime_r(), but remembers recently converted timestamps
+int local_time(time_t timestamp, struct tm *result);
 int rfc2822_date(time_t timestamp, Buffer *buffer);
+int http_date(time_t timestamp, Buffer *buffer);
 
 #endif
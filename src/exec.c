@@ -10,9 +10,12 @@
 #include "strings.h"
 
 #include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 static void shell_encode_byte(StringBuffer *buffer, uint8_t byte) {
   switch (byte) {
@@ -56,6 +59,86 @@ static Value shell_escape(const Tuple *args, Env *env) {
   return finalize_string_buffer(buffer);
 }
 
+typedef struct {
+  pid_t pid;
+  int fd;
+  StringBuffer output;
+} Process;
+
+static int exec_jobs = 1;
+
+void set_exec_jobs(int jobs) {
+  exec_jobs = jobs;
+}
+
+static int start_process(const char *command, Process *process, Env *env) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    env_error(env, -1, "unable to create pipe: %s", strerror(errno));
+    return 0;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    env_error(env, -1, "unable to fork: %s", strerror(errno));
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    if (dup2(fds[1], STDOUT_FILENO) < 0) {
+      _exit(127);
+    }
+    close(fds[1]);
+    execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+    _exit(127);
+  }
+  close(fds[1]);
+  process->pid = pid;
+  process->fd = fds[0];
+  process->output = create_string_buffer(8192, env->arena);
+  return 1;
+}
+
+// Reads the available output directly into the arena, returns 0 when the process has closed its output
+static int read_process(Process *process, Env *env) {
+  StringBuffer *output = &process->output;
+  if (output->capacity - output->string->size < 4096) {
+    string_buffer_reserve(output, output->capacity);
+  }
+  ssize_t n = read(process->fd, output->string->bytes + output->string->size,
+      output->capacity - output->string->size);
+  if (n > 0) {
+    output->string->size += n;
+    return 1;
+  } else if (n < 0 && errno == EINTR) {
+    return 1;
+  } else if (n < 0) {
+    env_error(env, -1, "read error: %s", strerror(errno));
+  }
+  return 0;
+}
+
+static Value finish_process(Process *process) {
+  close(process->fd);
+  while (waitpid(process->pid, NULL, 0) < 0 && errno == EINTR) {
+  }
+  return finalize_string_buffer(process->output);
+}
+
+static int create_command(Value command_value, const Value *args, size_t num_args, StringBuffer *command) {
+  if (command_value.type != V_STRING) {
+    return 0;
+  }
+  string_buffer_append(command, command_value.string_value);
+  for (size_t i = 0; i < num_args; i++) {
+    string_buffer_put(command, ' ');
+    shell_encode_value(command, args[i]);
+  }
+  string_buffer_put(command, '\0');
+  return 1;
+}
+
 static Value plet_exec(const Tuple *args, Env *env) {
   check_args_min(1, args, env);
   Value command_value = args->values[0];
@@ -64,37 +147,95 @@ static Value plet_exec(const Tuple *args, Env *env) {
     return nil_value;
   }
   StringBuffer command = create_string_buffer(command_value.string_value->size, env->arena);
-  string_buffer_append(&command, command_value.string_value);
-  for (size_t i = 1; i < args->size; i++) {
-    string_buffer_put(&command, ' ');
-    shell_encode_value(&command, args->values[i]);
-  }
-  string_buffer_put(&command, '\0');
-  FILE *p = popen((char *) command.string->bytes, "r");
-  if (!p) {
-    env_error(env, -1, "unable to fork: %s", strerror(errno));
+  create_command(command_value, args->values + 1, args->size - 1, &command);
+  Process process;
+  if (!start_process((char *) command.string->bytes, &process, env)) {
     return nil_value;
   }
-  Buffer buffer = create_buffer(8192);
-  size_t n;
-  do {
-    if (buffer.size) {
-      buffer.capacity += 8192;
-      buffer.data = reallocate(buffer.data, buffer.capacity);
+  while (read_process(&process, env)) {
+  }
+  return finish_process(&process);
+}
+
+static Value exec_all(const Tuple *args, Env *env) {
+  check_args(1, args, env);
+  Value commands = args->values[0];
+  if (commands.type != V_ARRAY) {
+    arg_type_error(0, V_ARRAY, args, env);
+    return nil_value;
+  }
+  size_t n = commands.array_value->size;
+  char **command_strings = allocate((n ? n : 1) * sizeof(char *));
+  for (size_t i = 0; i < n; i++) {
+    Value command_value = commands.array_value->cells[i];
+    StringBuffer command = create_string_buffer(0, env->arena);
+    if (command_value.type == V_ARRAY && command_value.array_value->size > 0) {
+      Array *array = command_value.array_value;
+      command_value = array->cells[0];
+      create_command(command_value, array->cells + 1, array->size - 1, &command);
+    } else {
+      create_command(command_value, NULL, 0, &command);
     }
-    n = fread(buffer.data + buffer.size, 1, 8192, p);
-    buffer.size += n;
-  } while (n == 8192);
-  if (!feof(p)) {
-    env_error(env, -1, "read error: %s", strerror(errno));
+    if (command_value.type != V_STRING) {
+      env_error(env, 0, "element %zd of commands must be a string or an array starting with a string", i);
+      free(command_strings);
+      return nil_value;
+    }
+    command_strings[i] = (char *) command.string->bytes;
+  }
+  // Up to exec_jobs commands are running at any time, their outputs are read as they become available
+  int jobs = exec_jobs < 1 ? 1 : exec_jobs;
+  Process *processes = allocate(jobs * sizeof(Process));
+  struct pollfd *fds = allocate(jobs * sizeof(struct pollfd));
+  size_t *indices = allocate(jobs * sizeof(size_t));
+  Value result = create_array(n, env->arena);
+  for (size_t i = 0; i < n; i++) {
+    result.array_value->cells[i] = nil_value;
+  }
+  result.array_value->size = n;
+  size_t next = 0;
+  int running = 0;
+  while (running > 0 || (next < n && !env->error)) {
+    while (running < jobs && next < n && !env->error) {
+      if (start_process(command_strings[next], &processes[running], env)) {
+        fds[running] = (struct pollfd) { .fd = processes[running].fd, .events = POLLIN };
+        indices[running] = next;
+        running++;
+      }
+      next++;
+    }
+    if (!running) {
+      break;
+    }
+    if (poll(fds, running, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      env_error(env, -1, "poll failed: %s", strerror(errno));
+      break;
+    }
+    for (int k = running - 1; k >= 0; k--) {
+      if (fds[k].revents && !read_process(&processes[k], env)) {
+        result.array_value->cells[indices[k]] = finish_process(&processes[k]);
+        running--;
+        processes[k] = processes[running];
+        fds[k] = fds[running];
+        indices[k] = indices[running];
+      }
+    }
+  }
+  for (int k = 0; k < running; k++) {
+    finish_process(&processes[k]);
   }
-  pclose(p);
-  Value output = create_string(buffer.data, buffer.size, env->arena);
-  delete_buffer(buffer);
-  return output;
+  free(command_strings);
+  free(processes);
+  free(fds);
+  free(indices);
+  return result;
 }
 
 void import_exec(Env *env) {
   env_def_fn("shell_escape", shell_escape, env);
   env_def_fn("exec", plet_exec, env);
+  env_def_fn("exec_all", exec_all, env);
 }
@@ -9,6 +9,8 @@
 
 #include "value.h"
 
+// Maximum number of commands run at the same time by exec_all()
+void set_exec_jobs(int jobs);
 void import_exec(Env *env);
 
 #endif
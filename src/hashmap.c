@@ -9,54 +9,264 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+
+#define H1(HASH) ((HASH) >> 7)
+#define H2(HASH) ((uint8_t) ((HASH) & 0x7f))
+
+#define ENTRY(MAP, INDEX) ((MAP)->entries + (INDEX) * (MAP)->entry_size)
+
+#define HASH_SECRET0 0xa0761d6478bd642full
+#define HASH_SECRET1 0xe7037ed1a0b428dbull
+
+static uint64_t hash_mix(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+  __extension__ typedef unsigned __int128 uint128;
+  uint128 r = (uint128) a * b;
+  return (uint64_t) r ^ (uint64_t) (r >> 64);
+#else
+  uint64_t a_high = a >> 32, a_low = (uint32_t) a, b_high = b >> 32, b_low = (uint32_t) b;
+  uint64_t high = a_high * b_high, mid0 = a_high * b_low, mid1 = b_high * a_low, low = a_low * b_low;
+  uint64_t t = low + (mid0 << 32);
+  uint64_t carry = t < low;
+  uint64_t lo = t + (mid1 << 32);
+  carry += lo < t;
+  uint64_t hi = high + (mid0 >> 32) + (mid1 >> 32) + carry;
+  return lo ^ hi;
+#endif
+}
+
+static uint64_t read64(const uint8_t *p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint64_t read32(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+// Based on wyhash: reads the input 8 or 16 bytes at a time and mixes using 64x64->128 bit multiplication
+Hash hash_bytes(const void *data, size_t size, Hash seed) {
+  const uint8_t *p = data;
+  uint64_t s = hash_mix((uint64_t) seed ^ HASH_SECRET0, HASH_SECRET1);
+  uint64_t a, b;
+  if (size <= 16) {
+    if (size >= 4) {
+      a = (read32(p) << 32) | read32(p + ((size >> 3) << 2));
+      b = (read32(p + size - 4) << 32) | read32(p + size - 4 - ((size >> 3) << 2));
+    } else if (size > 0) {
+      a = ((uint64_t) p[0] << 16) | ((uint64_t) p[size >> 1] << 8) | p[size - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t remaining = size;
+    while (remaining > 16) {
+      s = hash_mix(read64(p) ^ HASH_SECRET1, read64(p + 8) ^ s);
+      p += 16;
+      remaining -= 16;
+    }
+    a = read64(p + remaining - 16);
+    b = read64(p + remaining - 8);
+  }
+  return (Hash) hash_mix(HASH_SECRET1 ^ size, hash_mix(a ^ HASH_SECRET1, b ^ s));
+}
+
+Hash hash_word(uint64_t word, Hash seed) {
+  return (Hash) hash_mix(word ^ HASH_SECRET1, (uint64_t) seed ^ HASH_SECRET0);
+}
+
+#if defined(__SSE2__)
+
+// One bit per slot
+typedef uint32_t GroupMask;
+#define GROUP_MASK_SHIFT 0
+
+static GroupMask group_match(const uint8_t *ctrl, uint8_t h2) {
+  __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char) h2)));
+}
+
+static GroupMask group_match_empty(const uint8_t *ctrl) {
+  return group_match(ctrl, CTRL_EMPTY);
+}
+
+static GroupMask group_match_free(const uint8_t *ctrl) {
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) ctrl));
+}
+
+#else
+
+// Portable version operating on 8 control bytes at a time, the mask has the high bit of each matching byte set
+typedef uint64_t GroupMask;
+#define GROUP_MASK_SHIFT 3
+#define GROUP_LSBS 0x0101010101010101ull
+#define GROUP_MSBS 0x8080808080808080ull
+
+static uint64_t load_group(const uint8_t *ctrl) {
+  uint64_t group = read64(ctrl);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  group = __builtin_bswap64(group);
+#endif
+  return group;
+}
+
+// May report false positives for full slots, which are then rejected by the equality function
+static GroupMask group_match(const uint8_t *ctrl, uint8_t h2) {
+  uint64_t x = load_group(ctrl) ^ (GROUP_LSBS * h2);
+  return (x - GROUP_LSBS) & ~x & GROUP_MSBS;
+}
+
+static GroupMask group_match_empty(const uint8_t *ctrl) {
+  uint64_t group = load_group(ctrl);
+  return group & (~group << 6) & GROUP_MSBS;
+}
+
+static GroupMask group_match_free(const uint8_t *ctrl) {
+  return load_group(ctrl) & GROUP_MSBS;
+}
+
+#endif
+
+static size_t group_mask_first(GroupMask mask) {
+#if defined(__GNUC__)
+  return (sizeof(GroupMask) > sizeof(unsigned) ? __builtin_ctzll(mask) : __builtin_ctz(mask)) >> GROUP_MASK_SHIFT;
+#else
+  size_t n = 0;
+  while (!(mask & 1)) {
+    mask >>= 1;
+    n++;
+  }
+  return n >> GROUP_MASK_SHIFT;
+#endif
+}
+
+#define GROUP_MASK_NEXT(MASK) ((MASK) & ((MASK) - 1))
+
+static size_t max_load(size_t capacity) {
+  return capacity - capacity / 8;
+}
+
+static void allocate_slots(GenericHashMap *map, size_t capacity) {
+  // The first group of control bytes is mirrored after the last slot, so a group can always be loaded with a
+  // single unaligned read
+  size_t ctrl_size = (capacity + HASH_MAP_GROUP_SIZE + 15) & ~(size_t) 15;
+  map->capacity = capacity;
+  map->mask = capacity - 1;
+  map->ctrl = arena_allocate(ctrl_size + capacity * map->entry_size, map->arena);
+  map->entries = map->ctrl + ctrl_size;
+  memset(map->ctrl, CTRL_EMPTY, capacity + HASH_MAP_GROUP_SIZE);
+  map->growth_left = max_load(capacity);
+}
+
+static void set_ctrl(GenericHashMap *map, size_t index, uint8_t ctrl) {
+  map->ctrl[index] = ctrl;
+  if (index < HASH_MAP_GROUP_SIZE) {
+    map->ctrl[map->capacity + index] = ctrl;
+  }
+}
+
+static int find_entry(GenericHashMap *map, const void *entry, Hash hash_code, size_t *index) {
+  uint8_t h2 = H2(hash_code);
+  size_t position = H1(hash_code) & map->mask;
+  size_t stride = 0;
+  while (1) {
+    const uint8_t *group = map->ctrl + position;
+    GroupMask match = group_match(group, h2);
+    while (match) {
+      size_t i = (position + group_mask_first(match)) & map->mask;
+      if (map->equals_func(ENTRY(map, i), entry)) {
+        *index = i;
+        return 1;
+      }
+      match = GROUP_MASK_NEXT(match);
+    }
+    if (group_match_empty(group)) {
+      return 0;
+    }
+    stride += HASH_MAP_GROUP_SIZE;
+    position = (position + stride) & map->mask;
+  }
+}
+
+static size_t find_free_slot(GenericHashMap *map, Hash hash_code) {
+  size_t position = H1(hash_code) & map->mask;
+  size_t stride = 0;
+  while (1) {
+    GroupMask free_slots = group_match_free(map->ctrl + position);
+    if (free_slots) {
+      return (position + group_mask_first(free_slots)) & map->mask;
+    }
+    stride += HASH_MAP_GROUP_SIZE;
+    position = (position + stride) & map->mask;
+  }
+}
+
+static void insert_new_entry(GenericHashMap *map, const void *entry, Hash hash_code) {
+  size_t i = find_free_slot(map, hash_code);
+  if (!map->growth_left && map->ctrl[i] != CTRL_DELETED) {
+    // Rehashing in place is enough to get rid of tombstones if the map is less than half full
+    if (map->size < max_load(map->capacity) / 2) {
+      generic_hash_map_resize(map, map->capacity);
+    } else {
+      generic_hash_map_resize(map, map->capacity << 1);
+    }
+    i = find_free_slot(map, hash_code);
+  }
+  if (map->ctrl[i] == CTRL_EMPTY) {
+    map->growth_left--;
+  }
+  set_ctrl(map, i, H2(hash_code));
+  memcpy(ENTRY(map, i), entry, map->entry_size);
+  map->size++;
+}
+
 int init_generic_hash_map(GenericHashMap *map, size_t entry_size, size_t initial_capacity,
     HashFunc hash_code_func, EqualityFunc equals_func, Arena *arena) {
-  map->size = 0;
-  map->capacity = 8;
-  if (initial_capacity > 8) {
-    while (map->capacity < initial_capacity) {
-      map->capacity <<= 1;
-    }
+  size_t capacity = HASH_MAP_GROUP_SIZE;
+  while (max_load(capacity) < initial_capacity) {
+    capacity <<= 1;
   }
-  map->mask = map->capacity - 1;
-  map->upper_cap = map->capacity / 2;
-  map->lower_cap = map->capacity / 8;
+  map->size = 0;
   map->hash_code_func = hash_code_func;
   map->equals_func = equals_func;
   map->entry_size = entry_size;
-  map->bucket_size_shift = 0;
   map->arena = arena;
-  size_t bucket_size = sizeof(GenericBucket) + entry_size;
-  if (bucket_size > 1) {
-    bucket_size--;
-    do {
-      map->bucket_size_shift++;
-    } while (bucket_size >>= 1);
-  }
-  map->bucket_size = 1 << map->bucket_size_shift;
-  size_t size = map->capacity * map->bucket_size;
-  map->buckets = arena_allocate(size, map->arena);
-  memset(map->buckets, 0, size);
+  allocate_slots(map, capacity);
   return 1;
 }
 
 void delete_generic_hash_map(GenericHashMap *map) {
   if (!map->arena) {
-    free(map->buckets);
+    free(map->ctrl);
   }
 }
 
+void generic_hash_map_clear(GenericHashMap *map) {
+  memset(map->ctrl, CTRL_EMPTY, map->capacity + HASH_MAP_GROUP_SIZE);
+  map->size = 0;
+  map->growth_left = max_load(map->capacity);
+}
+
 HashMapIterator generic_hash_map_iterate(GenericHashMap *map) {
   return (HashMapIterator){ .map = map, .next_bucket =  0 };
 }
 
 int generic_hash_map_next(HashMapIterator *iterator, void *result) {
-  GenericBucket *current = NULL;
-  while (iterator->next_bucket < iterator->map->capacity) {
-    current = (GenericBucket *)(iterator->map->buckets + (iterator->next_bucket << iterator->map->bucket_size_shift));
-    iterator->next_bucket++;
-    if (current->defined && !current->deleted) {
-      memcpy(result, current + 1, iterator->map->entry_size);
+  GenericHashMap *map = iterator->map;
+  while (iterator->next_bucket < map->capacity) {
+    size_t i = iterator->next_bucket++;
+    if (!(map->ctrl[i] & CTRL_EMPTY)) {
+      memcpy(result, ENTRY(map, i), map->entry_size);
       return 1;
     }
   }
@@ -64,130 +274,84 @@ int generic_hash_map_next(HashMapIterator *iterator, void *result) {
 }
 
 int generic_hash_map_resize(GenericHashMap *map, size_t new_capacity) {
+  while (max_load(new_capacity) <= map->size) {
+    new_capacity <<= 1;
+  }
   size_t old_capacity = map->capacity;
-  uint8_t *old_buckets = map->buckets;
-  map->capacity = new_capacity;
-  size_t size = map->capacity * map->bucket_size;
-  map->buckets = arena_allocate(size, map->arena);
-  memset(map->buckets, 0, size);
-  map->mask = new_capacity - 1;
-  map->upper_cap = map->capacity / 2;
-  map->lower_cap = map->capacity / 8;
-  uint8_t *next = old_buckets;
-  for (size_t i = 0; i < old_capacity; i++, next += map->bucket_size) {
-    GenericBucket *old_bucket = (GenericBucket *)next;
-    if (old_bucket->defined && !old_bucket->deleted) {
-      Hash hash_code = old_bucket->hash;
-      Hash hash = hash_code & map->mask;
-      GenericBucket *bucket = (GenericBucket *)(map->buckets + (hash << map->bucket_size_shift));
-      while (bucket->defined) {
-        hash = (hash + 1) & map->mask;
-        bucket = (GenericBucket *)(map->buckets + (hash << map->bucket_size_shift));
-      }
-      bucket->hash = hash_code;
-      bucket->defined = 1;
-      memcpy(bucket + 1, old_bucket + 1, map->entry_size);
+  uint8_t *old_ctrl = map->ctrl;
+  uint8_t *old_entries = map->entries;
+  allocate_slots(map, new_capacity);
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (!(old_ctrl[i] & CTRL_EMPTY)) {
+      const uint8_t *entry = old_entries + i * map->entry_size;
+      Hash hash_code = map->hash_code_func(entry);
+      size_t j = find_free_slot(map, hash_code);
+      set_ctrl(map, j, H2(hash_code));
+      memcpy(ENTRY(map, j), entry, map->entry_size);
     }
   }
+  map->growth_left -= map->size;
   if (!map->arena) {
-    free(old_buckets);
+    free(old_ctrl);
   }
   return 1;
 }
 
 int generic_hash_map_add(GenericHashMap *map, const void *entry) {
-  if (map->size > map->upper_cap) {
-    if (!generic_hash_map_resize(map, map->capacity << 1)) {
-      return 0;
-    }
-  }
   Hash hash_code = map->hash_code_func(entry);
-  Hash hash = hash_code & map->mask;
-  GenericBucket *bucket = (GenericBucket *)(map->buckets + (hash << map->bucket_size_shift));
-  while (bucket->defined && !bucket->deleted) {
-    if (map->equals_func(bucket + 1, entry)) {
-      return 0;
-    }
-    hash = (hash + 1) & map->mask;
-    bucket = (GenericBucket *)(map->buckets + (hash << map->bucket_size_shift));
+  size_t i;
+  if (find_entry(map, entry, hash_code, &i)) {
+    return 0;
   }
-  bucket->hash = hash_code;
-  bucket->defined = 1;
-  bucket->deleted = 0;
-  memcpy(bucket + 1, entry, map->entry_size);
-  map->size++;
+  insert_new_entry(map, entry, hash_code);
   return 1;
 }
 
 int generic_hash_map_set(GenericHashMap *map, const void *entry, int *exists, void *existing) {
-  if (exists) {
-    *exists = 0;
-  }
-  if (map->size > map->upper_cap) {
-    if (!generic_hash_map_resize(map, map->capacity << 1)) {
-      return 0;
-    }
-  }
   Hash hash_code = map->hash_code_func(entry);
-  Hash hash = hash_code & map->mask;
-  GenericBucket *bucket = (GenericBucket *)(map->buckets + (hash << map->bucket_size_shift));
-  while (bucket->defined && !bucket->deleted) {
-    if (map->equals_func(bucket + 1, entry)) {
-      if (exists) {
-        *exists = 1;
-      }
-      if (existing) {
-        memcpy(existing, bucket + 1, map->entry_size);
-      }
-      map->size--;
-      break;
+  size_t i;
+  if (find_entry(map, entry, hash_code, &i)) {
+    if (exists) {
+      *exists = 1;
     }
-    hash = (hash + 1) & map->mask;
-    bucket = (GenericBucket *)(map->buckets + (hash << map->bucket_size_shift));
+    if (existing) {
+      memcpy(existing, ENTRY(map, i), map->entry_size);
+    }
+    memcpy(ENTRY(map, i), entry, map->entry_size);
+    return 1;
   }
-  bucket->hash = hash_code;
-  bucket->defined = 1;
-  bucket->deleted = 0;
-  memcpy(bucket + 1, entry, map->entry_size);
-  map->size++;
+  if (exists) {
+    *exists = 0;
+  }
+  insert_new_entry(map, entry, hash_code);
   return 1;
 }
 
 int generic_hash_map_remove(GenericHashMap *map, const void *entry, void *removed) {
   Hash hash_code = map->hash_code_func(entry);
-  Hash hash = hash_code & map->mask;
-  GenericBucket *bucket = (GenericBucket *)(map->buckets + (hash << map->bucket_size_shift));
-  while (bucket->defined) {
-    if (!bucket->deleted && hash_code == bucket->hash && map->equals_func(bucket + 1, entry)) {
-      if (removed) {
-        memcpy(removed, bucket + 1, map->entry_size);
-      }
-      bucket->deleted = 1;
-      map->size--;
-      if (!map->arena && map->size < map->lower_cap && map->capacity > 8) {
-        generic_hash_map_resize(map, map->capacity >> 1);
-      }
-      return 1;
-    }
-    hash = (hash + 1) & map->mask;
-    bucket = (GenericBucket *)(map->buckets + (hash << map->bucket_size_shift));
+  size_t i;
+  if (!find_entry(map, entry, hash_code, &i)) {
+    return 0;
   }
-  return 0;
+  if (removed) {
+    memcpy(removed, ENTRY(map, i), map->entry_size);
+  }
+  set_ctrl(map, i, CTRL_DELETED);
+  map->size--;
+  if (!map->arena && map->size < map->capacity / 8 && map->capacity > HASH_MAP_GROUP_SIZE) {
+    generic_hash_map_resize(map, map->capacity >> 1);
+  }
+  return 1;
 }
 
 int generic_hash_map_get(GenericHashMap *map, const void *entry, void *result) {
   Hash hash_code = map->hash_code_func(entry);
-  Hash hash = hash_code & map->mask;
-  GenericBucket *bucket = (GenericBucket *)(map->buckets + (hash << map->bucket_size_shift));
-  while (bucket->defined) {
-    if (!bucket->deleted && hash_code == bucket->hash && map->equals_func(bucket + 1, entry)) {
-      if (result) {
-        memcpy(result, bucket + 1, map->entry_size);
-      }
-      return 1;
-    }
-    hash = (hash + 1) & map->mask;
-    bucket = (GenericBucket *)(map->buckets + (hash << map->bucket_size_shift));
+  size_t i;
+  if (!find_entry(map, entry, hash_code, &i)) {
+    return 0;
   }
-  return 0;
+  if (result) {
+    memcpy(result, ENTRY(map, i), map->entry_size);
+  }
+  return 1;
 }
@@ -41,28 +41,29 @@ typedef uint32_t Hash;
           HASH_ADD_BYTE(GET_BYTE(3, PTR), HASH))))
 #endif
 
+#if defined(__SSE2__)
+#define HASH_MAP_GROUP_SIZE 16
+#else
+#define HASH_MAP_GROUP_SIZE 8
+#endif
+
 typedef Hash (* HashFunc)(const void *);
 typedef int (* EqualityFunc)(const void *, const void *);
 
-typedef struct {
-  Hash hash;
-  char defined;
-  char deleted;
-} GenericBucket;
-
+// Open addressing with one control byte per slot, stored separately from the entries. A control byte is either
+// empty, deleted, or the lowest 7 bits of the hash of the entry in the slot. Lookups compare a whole group of
+// control bytes at once and only call the equality function on slots whose 7 bits match.
 typedef struct {
   size_t size;
   size_t capacity;
   size_t mask;
-  size_t upper_cap;
-  size_t lower_cap;
+  size_t growth_left;
   size_t entry_size;
-  size_t bucket_size;
-  size_t bucket_size_shift;
   HashFunc hash_code_func;
   EqualityFunc equals_func;
   Arena *arena;
-  uint8_t *buckets;
+  uint8_t *ctrl;
+  uint8_t *entries;
 } GenericHashMap;
 
 typedef struct {
@@ -70,11 +71,18 @@ typedef struct {
   size_t next_bucket;
 } HashMapIterator;
 
+// Word-at-a-time hash functions for in-memory hash maps. The FNV-1a macros above are kept for hashes that are
+// persisted, e.g. cache file names, since the values of these functions may change between versions.
+Hash hash_bytes(const void *data, size_t size, Hash seed);
+Hash hash_word(uint64_t word, Hash seed);
+
 int init_generic_hash_map(GenericHashMap *map, size_t entry_size, size_t initial_capacity,
     HashFunc hash_code_func, EqualityFunc equals_func, Arena *arena);
 
 void delete_generic_hash_map(GenericHashMap *map);
 
+void generic_hash_map_clear(GenericHashMap *map);
+
 HashMapIterator generic_hash_map_iterate(GenericHashMap *map);
 
 int generic_hash_map_next(HashMapIterator *iterator, void *result);
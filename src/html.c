@@ -18,54 +18,66 @@
 #include <gumbo.h>
 #endif
 
-static void html_encode_byte(StringBuffer *buffer, uint8_t byte, int quotes) {
-  switch (byte) {
-    case '&':
-      string_buffer_printf(buffer, "&amp;");
-      break;
-    case '"':
-      if (quotes) {
-        string_buffer_printf(buffer, "&quot;");
-      } else {
-        string_buffer_put(buffer, byte);
-      }
-      break;
-    case '\'':
-      if (quotes) {
-        string_buffer_printf(buffer, "&#39;");
-      } else {
-        string_buffer_put(buffer, byte);
-      }
-      break;
-    case '<':
-      string_buffer_printf(buffer, "&lt;");
-      break;
-    case '>':
-      string_buffer_printf(buffer, "&gt;");
-      break;
-    default:
-      string_buffer_put(buffer, byte);
-      break;
+// 0: copied as is, 1: always escaped, 2: escaped in attribute values
+static const uint8_t html_escape_class[256] = {
+  ['&'] = 1, ['<'] = 1, ['>'] = 1, ['"'] = 2, ['\''] = 2
+};
+
+static void html_encode_bytes(StringBuffer *buffer, const uint8_t *bytes, size_t size, int quotes) {
+  uint8_t mask = quotes ? 3 : 1;
+  size_t start = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (!(html_escape_class[bytes[i]] & mask)) {
+      continue;
+    }
+    string_buffer_append_bytes(buffer, bytes + start, i - start);
+    start = i + 1;
+    switch (bytes[i]) {
+      case '&':
+        string_buffer_append_bytes(buffer, (const uint8_t *) "&amp;", 5);
+        break;
+      case '"':
+        string_buffer_append_bytes(buffer, (const uint8_t *) "&quot;", 6);
+        break;
+      case '\'':
+        string_buffer_append_bytes(buffer, (const uint8_t *) "&#39;", 5);
+        break;
+      case '<':
+        string_buffer_append_bytes(buffer, (const uint8_t *) "&lt;", 4);
+        break;
+      case '>':
+        string_buffer_append_bytes(buffer, (const uint8_t *) "&gt;", 4);
+        break;
+    }
   }
+  string_buffer_append_bytes(buffer, bytes + start, size - start);
+}
+
+static void html_encode_string(StringBuffer *buffer, const String *string, int quotes) {
+  html_encode_bytes(buffer, string->bytes, string->size, quotes);
+}
+
+static void append_symbol(StringBuffer *buffer, Symbol symbol) {
+  string_buffer_append_bytes(buffer, (const uint8_t *) symbol, strlen(symbol));
 }
 
 static Value h(const Tuple *args, Env *env) {
   check_args(1, args, env);
   Value value = args->values[0];
-  StringBuffer buffer = create_string_buffer(0, env->arena);
+  StringBuffer buffer;
   switch (value.type) {
-    case V_SYMBOL:
-      while (*value.symbol_value) {
-        html_encode_byte(&buffer, *value.symbol_value, 1);
-        value.symbol_value++;
-      }
+    case V_SYMBOL: {
+      size_t size = strlen(value.symbol_value);
+      buffer = create_string_buffer(size, env->arena);
+      html_encode_bytes(&buffer, (const uint8_t *) value.symbol_value, size, 1);
       break;
+    }
     case V_STRING:
-      for (size_t i = 0; i < value.string_value->size; i++) {
-        html_encode_byte(&buffer, value.string_value->bytes[i], 1);
-      }
+      buffer = create_string_buffer(value.string_value->size, env->arena);
+      html_encode_string(&buffer, value.string_value, 1);
       break;
     default:
+      buffer = create_string_buffer(0, env->arena);
       string_buffer_append_value(&buffer, value);
       break;
   }
@@ -89,7 +101,7 @@ static Value href(const Tuple *args, Env *env) {
         return nil_value;
       }
     }
-  } else if (!env_get(get_symbol("PATH", env->symbol_map), &path, env) || path.type != V_STRING) {
+  } else if (!env_get_known(PATH, &path, env) || path.type != V_STRING) {
     env_error(env, -1, "PATH is not set or not a string");
     return nil_value;
   }
@@ -109,47 +121,68 @@ static Value href(const Tuple *args, Env *env) {
     }
   }
   Value root_path;
-  if (env_get(get_symbol("ROOT_PATH", env->symbol_map), &root_path, env) && root_path.type == V_STRING) {
+  if (env_get_known(ROOT_PATH, &root_path, env) && root_path.type == V_STRING) {
     path = combine_string_paths(root_path.string_value, path.string_value, env);
   }
   StringBuffer buffer = create_string_buffer(0, env->arena);
   string_buffer_printf(&buffer, " href=\"");
-  for (size_t i = 0; i < path.string_value->size; i++) {
-    html_encode_byte(&buffer, path.string_value->bytes[i], 1);
-  }
+  html_encode_string(&buffer, path.string_value, 1);
   string_buffer_printf(&buffer, "\"");
   if (class.string_value->size) {
     string_buffer_printf(&buffer, " class=\"");
-    for (size_t i = 0; i < class.string_value->size; i++) {
-      html_encode_byte(&buffer, class.string_value->bytes[i], 1);
-    }
+    html_encode_string(&buffer, class.string_value, 1);
     string_buffer_printf(&buffer, "\"");
   }
   return finalize_string_buffer(buffer);
 }
 
-static void html_to_string(Value node, StringBuffer *buffer, Env *env) {
+// Upper bound on the serialized size, ignoring escapes, used to allocate the output buffer once
+static size_t html_estimate_size(Value node) {
+  if (node.type == V_STRING) {
+    return node.string_value->size;
+  } else if (node.type != V_OBJECT) {
+    return 0;
+  }
+  size_t size = 0;
+  Value tag, attributes, children;
+  if (object_get_known(node.object_value, tag, &tag) && tag.type == V_SYMBOL) {
+    size += 2 * strlen(tag.symbol_value) + 5;
+    if (object_get_known(node.object_value, attributes, &attributes) && attributes.type == V_OBJECT) {
+      ObjectIterator it = iterate_object(attributes.object_value);
+      Value key, value;
+      while (object_iterator_next(&it, &key, &value)) {
+        if (key.type == V_SYMBOL && value.type == V_STRING) {
+          size += strlen(key.symbol_value) + value.string_value->size + 4;
+        }
+      }
+    }
+  }
+  if (object_get_known(node.object_value, children, &children) && children.type == V_ARRAY) {
+    for (size_t i = 0; i < children.array_value->size; i++) {
+      size += html_estimate_size(children.array_value->cells[i]);
+    }
+  }
+  return size;
+}
+
+static void html_to_string(Value node, StringBuffer *buffer) {
   if (node.type == V_OBJECT) {
     Value tag = nil_value;
-    object_get(node.object_value, create_symbol(get_symbol("tag", env->symbol_map)), &tag);
+    object_get_known(node.object_value, tag, &tag);
     if (tag.type == V_SYMBOL) {
       string_buffer_put(buffer, '<');
-      string_buffer_printf(buffer, "%s", tag.symbol_value);
+      append_symbol(buffer, tag.symbol_value);
       Value attributes;
-      if (object_get(node.object_value, create_symbol(get_symbol("attributes", env->symbol_map)),
-            &attributes) && attributes.type == V_OBJECT) {
+      if (object_get_known(node.object_value, attributes, &attributes) && attributes.type == V_OBJECT) {
         ObjectIterator it = iterate_object(attributes.object_value);
         Value key, value;
         while (object_iterator_next(&it, &key, &value)) {
           if (key.type == V_SYMBOL && value.type == V_STRING) {
             string_buffer_put(buffer, ' ');
-            string_buffer_printf(buffer, "%s", key.symbol_value);
+            append_symbol(buffer, key.symbol_value);
             if (value.string_value->size) {
-              string_buffer_put(buffer, '=');
-              string_buffer_put(buffer, '"');
-              for (size_t i = 0; i < value.string_value->size; i++) {
-                html_encode_byte(buffer, value.string_value->bytes[i], 1);
-              }
+              string_buffer_append_bytes(buffer, (const uint8_t *) "=\"", 2);
+              html_encode_string(buffer, value.string_value, 1);
               string_buffer_put(buffer, '"');
             }
           }
@@ -158,32 +191,27 @@ static void html_to_string(Value node, StringBuffer *buffer, Env *env) {
       string_buffer_put(buffer, '>');
     }
     Value children;
-    if (object_get(node.object_value, create_symbol(get_symbol("children", env->symbol_map)), &children)
-        && children.type == V_ARRAY) {
+    if (object_get_known(node.object_value, children, &children) && children.type == V_ARRAY) {
       for (size_t i = 0; i < children.array_value->size; i++) {
-        html_to_string(children.array_value->cells[i], buffer, env);
+        html_to_string(children.array_value->cells[i], buffer);
       }
     }
     Value self_closing = nil_value;
-    object_get(node.object_value, create_symbol(get_symbol("self_closing", env->symbol_map)),
-        &self_closing);
+    object_get_known(node.object_value, self_closing, &self_closing);
     if (tag.type == V_SYMBOL && !is_truthy(self_closing)) {
-      string_buffer_put(buffer, '<');
-      string_buffer_put(buffer, '/');
-      string_buffer_printf(buffer, "%s", tag.symbol_value);
+      string_buffer_append_bytes(buffer, (const uint8_t *) "</", 2);
+      append_symbol(buffer, tag.symbol_value);
       string_buffer_put(buffer, '>');
     }
   } else if (node.type == V_STRING) {
-    for (size_t i = 0; i < node.string_value->size; i++) {
-      html_encode_byte(buffer, node.string_value->bytes[i], 0);
-    }
+    html_encode_string(buffer, node.string_value, 0);
   }
 }
 
 static Value html(const Tuple *args, Env *env) {
   check_args(1, args, env);
-  StringBuffer output = create_string_buffer(0, env->arena);
-  html_to_string(args->values[0], &output, env);
+  StringBuffer output = create_string_buffer(html_estimate_size(args->values[0]), env->arena);
+  html_to_string(args->values[0], &output);
   return finalize_string_buffer(output);
 }
 
@@ -192,7 +220,7 @@ static Value no_title(const Tuple *args, Env *env) {
   Value src = args->values[0];
   Value title_tag = html_find_tag(get_symbol("h1", env->symbol_map), src);
   if (title_tag.type == V_OBJECT) {
-    html_remove_node(title_tag.object_value, src);
+    html_remove_node(title_tag.object_value, src, env->arena);
   }
   return src;
 }
@@ -203,6 +231,7 @@ typedef struct {
   Path *dist_root;
   Path *asset_root;
   Object *reverse_paths;
+  int fingerprint;
   Env *env;
 } LinkArgs;
 
@@ -225,6 +254,13 @@ static int transform_link(Value node, const char *attribute_name, LinkArgs *args
       delete_path(reverse_path);
     } else {
       Path *asset_web_path = path_join(args->asset_root, asset_path, 1);
+      if (args->fingerprint) {
+        Path *fingerprinted_path = get_fingerprinted_path(src_path, asset_web_path);
+        if (fingerprinted_path) {
+          delete_path(asset_web_path);
+          asset_web_path = fingerprinted_path;
+        }
+      }
       Path *dist_path = path_join(args->dist_root, asset_web_path, 1);
       if (copy_asset(src_path, dist_path)) {
         notify_output_observers(dist_path, args->env);
@@ -246,11 +282,54 @@ static int transform_link(Value node, const char *attribute_name, LinkArgs *args
   return 1;
 }
 
+static void transform_srcset(Value node, LinkArgs *args) {
+  Value srcset = html_get_attribute(node, "srcset");
+  if (srcset.type != V_STRING) {
+    return;
+  }
+  const uint8_t *bytes = srcset.string_value->bytes;
+  size_t size = srcset.string_value->size;
+  StringBuffer output = create_string_buffer(size, args->env->arena);
+  size_t i = 0;
+  while (i < size) {
+    // Candidates are separated by commas, each candidate is a URL optionally followed by a descriptor
+    size_t start = i;
+    while (i < size && bytes[i] != ',') {
+      i++;
+    }
+    size_t end = i;
+    while (start < end && bytes[start] == ' ') {
+      start++;
+    }
+    size_t url_end = start;
+    while (url_end < end && bytes[url_end] != ' ') {
+      url_end++;
+    }
+    if (output.string->size) {
+      string_buffer_append_bytes(&output, (const uint8_t *) ", ", 2);
+    }
+    size_t prefix_length = sizeof("pletlink:") - 1;
+    if (url_end - start > prefix_length && memcmp(bytes + start, "pletlink:", prefix_length) == 0) {
+      Path *web_path = create_path((char *) bytes + start + prefix_length, url_end - start - prefix_length);
+      string_buffer_append_value(&output, get_web_path(web_path, args->absolute, args->env));
+      delete_path(web_path);
+    } else {
+      string_buffer_append_bytes(&output, bytes + start, url_end - start);
+    }
+    string_buffer_append_bytes(&output, bytes + url_end, end - url_end);
+    i++;
+  }
+  html_set_attribute(node, "srcset", finalize_string_buffer(output).string_value, args->env);
+}
+
 static HtmlTransformation transform_links(Value node, void *context) {
   LinkArgs *args = context;
   if (!transform_link(node, "src", args)) {
     transform_link(node, "href", args);
   }
+  if (html_is_tag(node, "img") || html_is_tag(node, "source")) {
+    transform_srcset(node, args);
+  }
   return HTML_NO_ACTION;
 }
 
@@ -260,10 +339,11 @@ static Value links_or_urls(Value src, int absolute, Env *env) {
     Path *dist_root = get_dist_root(env);
     if (dist_root) {
       Value reverse_paths;
-      if (env_get_symbol("REVERSE_PATHS", &reverse_paths, env) && reverse_paths.type == V_OBJECT) {
+      if (env_get_known(REVERSE_PATHS, &reverse_paths, env) && reverse_paths.type == V_OBJECT) {
         Path *asset_root = create_path("assets", -1);
-        LinkArgs context = {absolute, src_root, dist_root, asset_root, reverse_paths.object_value, env};
-        src = html_transform(src, transform_links, &context);
+        LinkArgs context = {absolute, src_root, dist_root, asset_root, reverse_paths.object_value,
+            asset_fingerprinting_enabled(env), env};
+        src = html_transform(src, transform_links, &context, env->arena);
         delete_path(asset_root);
       } else {
         env_error(env, -1, "REVERSE_PATHS missing or not an object");
@@ -302,7 +382,7 @@ static HtmlTransformation transform_read_more(Value node, void *context) {
   }
   if (node.type == V_OBJECT) {
     Value comment;
-    if (object_get_symbol(node.object_value, "comment", &comment) && comment.type == V_STRING) {
+    if (object_get_known(node.object_value, comment, &comment) && comment.type == V_STRING) {
       if (string_equals("more", comment.string_value)) {
         args->after_split = 1;
         return HTML_REMOVE;
@@ -316,7 +396,7 @@ static Value read_more(const Tuple *args, Env *env) {
   check_args(1, args, env);
   Value src = args->values[0];
   ReadMoreArgs context = {0};
-  src = html_transform(src, transform_read_more, &context);
+  src = html_transform(src, transform_read_more, &context, env->arena);
   return src;
 }
 
@@ -356,56 +436,69 @@ void import_html(Env *env) {
 
 #ifdef WITH_GUMBO
 
-static Value convert_gumbo_node(GumboNode *node, Env *env) {
+// Tag names are interned once per document instead of once per node
+typedef struct {
+  Symbol tags[GUMBO_TAG_LAST + 1];
+} HtmlSymbols;
+
+static void init_html_symbols(HtmlSymbols *symbols) {
+  memset(symbols->tags, 0, sizeof(symbols->tags));
+}
+
+static Symbol get_tag_symbol(GumboTag tag, HtmlSymbols *symbols, SymbolMap *symbol_map) {
+  if (tag > GUMBO_TAG_LAST) {
+    tag = GUMBO_TAG_UNKNOWN;
+  }
+  if (!symbols->tags[tag]) {
+    symbols->tags[tag] = get_symbol(gumbo_normalized_tagname(tag), symbol_map);
+  }
+  return symbols->tags[tag];
+}
+
+static void html_put(Object *object, Symbol key, Value value, Arena *arena) {
+  object_put(object, create_symbol(key), value, arena);
+}
+
+static Value convert_gumbo_children(GumboVector *nodes, HtmlSymbols *symbols, Env *env);
+
+static Value convert_gumbo_node(GumboNode *node, HtmlSymbols *symbols, Env *env) {
   switch (node->type) {
     case GUMBO_NODE_DOCUMENT: {
-      Value obj = create_object(2, env->arena);
-      object_def(obj.object_value, "type", create_symbol(get_symbol("document", env->symbol_map)), env);
-      Value children = create_array(node->v.element.children.length, env->arena);
-      for (unsigned int i = 0; i < node->v.element.children.length; i++) {
-        Value child = convert_gumbo_node(node->v.element.children.data[i], env);
-        if (child.type != V_NIL) {
-          array_push(children.array_value, child, env->arena);
-        }
-      }
-      object_def(obj.object_value, "children", children, env);
-      object_def(obj.object_value, "line", create_int(node->v.element.start_pos.line), env);
+      Value obj = create_object(4, env->arena);
+      html_put(obj.object_value, known_symbols.type, create_symbol(known_symbols.document), env->arena);
+      html_put(obj.object_value, known_symbols.children,
+          convert_gumbo_children(&node->v.element.children, symbols, env), env->arena);
+      html_put(obj.object_value, known_symbols.line, create_int(node->v.element.start_pos.line), env->arena);
       return obj;
     }
     case GUMBO_NODE_ELEMENT: {
-      Value obj = create_object(4, env->arena);
-      object_def(obj.object_value, "type", create_symbol(get_symbol("element", env->symbol_map)), env);
-      object_def(obj.object_value, "tag",
-          create_symbol(get_symbol(gumbo_normalized_tagname(node->v.element.tag), env->symbol_map)),
-          env);
-      Value attributes = create_object(node->v.element.attributes.length, env->arena);
+      Value obj = create_object(6, env->arena);
+      html_put(obj.object_value, known_symbols.type, create_symbol(known_symbols.element), env->arena);
+      html_put(obj.object_value, known_symbols.tag,
+          create_symbol(get_tag_symbol(node->v.element.tag, symbols, env->symbol_map)), env->arena);
+      Value attributes = create_object(node->v.element.attributes.length ? node->v.element.attributes.length : 1,
+          env->arena);
       for (unsigned int i = 0; i < node->v.element.attributes.length; i++) {
         GumboAttribute *attribute = node->v.element.attributes.data[i];
         object_put(attributes.object_value, create_symbol(get_symbol(attribute->name, env->symbol_map)),
             copy_c_string(attribute->value, env->arena), env->arena);
       }
-      object_def(obj.object_value, "attributes", attributes, env);
-      Value children = create_array(node->v.element.children.length, env->arena);
-      for (unsigned int i = 0; i < node->v.element.children.length; i++) {
-        Value child = convert_gumbo_node(node->v.element.children.data[i], env);
-        if (child.type != V_NIL) {
-          array_push(children.array_value, child, env->arena);
-        }
-      }
-      object_def(obj.object_value, "children", children, env);
-      object_def(obj.object_value, "self_closing",
-          node->v.element.original_end_tag.length == 0 ? true_value : false_value, env);
-      object_def(obj.object_value, "line", create_int(node->v.element.start_pos.line), env);
+      html_put(obj.object_value, known_symbols.attributes, attributes, env->arena);
+      html_put(obj.object_value, known_symbols.children,
+          convert_gumbo_children(&node->v.element.children, symbols, env), env->arena);
+      html_put(obj.object_value, known_symbols.self_closing,
+          node->v.element.original_end_tag.length == 0 ? true_value : false_value, env->arena);
+      html_put(obj.object_value, known_symbols.line, create_int(node->v.element.start_pos.line), env->arena);
       return obj;
     }
     case GUMBO_NODE_TEXT:
     case GUMBO_NODE_CDATA:
       return copy_c_string(node->v.text.text, env->arena);
     case GUMBO_NODE_COMMENT: {
-      Value obj = create_object(2, env->arena);
-      object_def(obj.object_value, "type", create_symbol(get_symbol("comment", env->symbol_map)), env);
-      object_def(obj.object_value, "comment", copy_c_string(node->v.text.text, env->arena), env);
-      object_def(obj.object_value, "line", create_int(node->v.text.start_pos.line), env);
+      Value obj = create_object(3, env->arena);
+      html_put(obj.object_value, known_symbols.type, create_symbol(known_symbols.comment), env->arena);
+      html_put(obj.object_value, known_symbols.comment, copy_c_string(node->v.text.text, env->arena), env->arena);
+      html_put(obj.object_value, known_symbols.line, create_int(node->v.text.start_pos.line), env->arena);
       return obj;
     }
     case GUMBO_NODE_WHITESPACE:
@@ -416,15 +509,28 @@ static Value convert_gumbo_node(GumboNode *node, Env *env) {
   }
 }
 
+static Value convert_gumbo_children(GumboVector *nodes, HtmlSymbols *symbols, Env *env) {
+  Value children = create_array(nodes->length ? nodes->length : 1, env->arena);
+  for (unsigned int i = 0; i < nodes->length; i++) {
+    Value child = convert_gumbo_node(nodes->data[i], symbols, env);
+    if (child.type != V_NIL) {
+      array_push(children.array_value, child, env->arena);
+    }
+  }
+  return children;
+}
+
 Value html_parse(String *html, Env *env) {
   GumboOptions options = kGumboDefaultOptions;
   options.fragment_context = GUMBO_TAG_DIV;
   GumboOutput *output = gumbo_parse_with_options(&options, (char *) html->bytes, html->size);
-  Value root = convert_gumbo_node(output->root, env);
+  HtmlSymbols symbols;
+  init_html_symbols(&symbols);
+  Value root = convert_gumbo_node(output->root, &symbols, env);
   gumbo_destroy_output(&options, output);
   if (root.type == V_OBJECT) {
-      object_def(root.object_value, "type", create_symbol(get_symbol("fragment", env->symbol_map)), env);
-      object_def(root.object_value, "tag", nil_value, env);
+    html_put(root.object_value, known_symbols.type, create_symbol(known_symbols.fragment), env->arena);
+    html_put(root.object_value, known_symbols.tag, nil_value, env->arena);
   }
   return root;
 }
@@ -440,7 +546,7 @@ Value html_parse(String *html, Env *env) {
 void html_text_content(Value node, StringBuffer *buffer) {
   if (node.type == V_OBJECT) {
     Value children;
-    if (object_get_symbol(node.object_value, "children", &children)) {
+    if (object_get_known(node.object_value, children, &children)) {
       if (children.type == V_ARRAY) {
         for (size_t i = 0; i < children.array_value->size; i++) {
           html_text_content(children.array_value->cells[i], buffer);
@@ -455,13 +561,13 @@ void html_text_content(Value node, StringBuffer *buffer) {
 Value html_find_tag(Symbol tag_name, Value node) {
   if (node.type == V_OBJECT) {
     Value node_tag;
-    if (object_get_symbol(node.object_value, "tag", &node_tag)) {
+    if (object_get_known(node.object_value, tag, &node_tag)) {
       if (node_tag.type == V_SYMBOL && node_tag.symbol_value == tag_name) {
         return node;
       }
     }
     Value children;
-    if (object_get_symbol(node.object_value, "children", &children)
+    if (object_get_known(node.object_value, children, &children)
         && children.type == V_ARRAY) {
       for (size_t i = 0; i < children.array_value->size; i++) {
         Value result = html_find_tag(tag_name, children.array_value->cells[i]);
@@ -474,17 +580,17 @@ Value html_find_tag(Symbol tag_name, Value node) {
   return nil_value;
 }
 
-int html_remove_node(Object *needle, Value haystack) {
+int html_remove_node(Object *needle, Value haystack, Arena *arena) {
   if (haystack.type == V_OBJECT) {
     if (haystack.object_value == needle) {
       return 1;
     }
     Value children;
-    if (object_get_symbol(haystack.object_value, "children", &children)
+    if (object_get_known(haystack.object_value, children, &children)
         && children.type == V_ARRAY) {
       for (size_t i = 0; i < children.array_value->size; i++) {
-        if (html_remove_node(needle, children.array_value->cells[i])) {
-          array_remove(children.array_value, i);
+        if (html_remove_node(needle, children.array_value->cells[i], arena)) {
+          array_remove(children.array_value, i, arena);
           break;
         }
       }
@@ -493,26 +599,28 @@ int html_remove_node(Object *needle, Value haystack) {
   return 0;
 }
 
-static HtmlTransformation internal_html_transform(Value node, HtmlTransformation (*acceptor)(Value, void *),
-    void *context);
-
-static HtmlTransformation internal_html_transform(Value node, HtmlTransformation (*acceptor)(Value, void *),
-    void *context) {
-  HtmlTransformation transformation = acceptor(node, context);
-  if (transformation.type != HT_NO_ACTION) {
-    return transformation;
+// Transformers are applied in order, the first one that acts on a node stops the rest from seeing it and its
+// children
+static HtmlTransformation internal_html_transform(Value node, const HtmlTransformer *transformers, size_t n,
+    Arena *arena) {
+  HtmlTransformation transformation = HTML_NO_ACTION;
+  for (size_t i = 0; i < n; i++) {
+    transformation = transformers[i].acceptor(node, transformers[i].context);
+    if (transformation.type != HT_NO_ACTION) {
+      return transformation;
+    }
   }
   if (node.type == V_OBJECT) {
     Value children;
-    if (object_get_symbol(node.object_value, "children", &children) && children.type == V_ARRAY) {
+    if (object_get_known(node.object_value, children, &children) && children.type == V_ARRAY) {
       for (size_t i = 0; i < children.array_value->size; i++) {
-        HtmlTransformation child_ht = internal_html_transform(children.array_value->cells[i], acceptor,
-            context);
+        HtmlTransformation child_ht = internal_html_transform(children.array_value->cells[i], transformers, n,
+            arena);
         if (child_ht.type == HT_REMOVE) {
-          array_remove(children.array_value, i);
+          array_remove(children.array_value, i, arena);
           i--;
         } else if (child_ht.type == HT_REPLACE) {
-          children.array_value->cells[i] = child_ht.replacement;
+          array_set(children.array_value, i, child_ht.replacement, arena);
         }
       }
     }
@@ -520,8 +628,8 @@ static HtmlTransformation internal_html_transform(Value node, HtmlTransformation
   return transformation;
 }
 
-Value html_transform(Value node, HtmlTransformation (*acceptor)(Value, void *), void *context) {
-  HtmlTransformation transformation = internal_html_transform(node, acceptor, context);
+Value html_transform_all(Value node, const HtmlTransformer *transformers, size_t n, Arena *arena) {
+  HtmlTransformation transformation = internal_html_transform(node, transformers, n, arena);
   if (transformation.type == HT_REMOVE) {
     return nil_value;
   } else if (transformation.type == HT_REPLACE) {
@@ -531,10 +639,15 @@ Value html_transform(Value node, HtmlTransformation (*acceptor)(Value, void *),
   }
 }
 
+Value html_transform(Value node, HtmlAcceptor acceptor, void *context, Arena *arena) {
+  HtmlTransformer transformer = {acceptor, context};
+  return html_transform_all(node, &transformer, 1, arena);
+}
+
 int html_is_tag(Value node, const char *tag_name) {
   if (node.type == V_OBJECT) {
     Value node_tag;
-    if (object_get_symbol(node.object_value, "tag", &node_tag)) {
+    if (object_get_known(node.object_value, tag, &node_tag)) {
       if (node_tag.type == V_SYMBOL && strcmp(node_tag.symbol_value, tag_name) == 0) {
         return 1;
       }
@@ -545,20 +658,20 @@ int html_is_tag(Value node, const char *tag_name) {
 
 Value html_create_element(const char *tag_name, int self_closing, Env *env) {
   Value node = create_object(5, env->arena);
-  object_def(node.object_value, "type", create_symbol(get_symbol("element", env->symbol_map)), env);
-  object_def(node.object_value, "tag", create_symbol(get_symbol(tag_name, env->symbol_map)), env);
+  object_def_known(node.object_value, type, create_symbol(known_symbols.element), env);
+  object_def_known(node.object_value, tag, create_symbol(get_symbol(tag_name, env->symbol_map)), env);
   Value attributes = create_object(0, env->arena);
-  object_def(node.object_value, "attributes", attributes, env);
+  object_def_known(node.object_value, attributes, attributes, env);
   Value children = create_array(0, env->arena);
-  object_def(node.object_value, "children", children, env);
-  object_def(node.object_value, "self_closing", self_closing ? true_value : false_value, env);
+  object_def_known(node.object_value, children, children, env);
+  object_def_known(node.object_value, self_closing, self_closing ? true_value : false_value, env);
   return node;
 }
 
 void html_prepend_child(Value node, Value child, Arena *arena) {
   if (node.type == V_OBJECT) {
     Value children;
-    if (object_get_symbol(node.object_value, "children", &children) && children.type == V_ARRAY) {
+    if (object_get_known(node.object_value, children, &children) && children.type == V_ARRAY) {
       array_unshift(children.array_value, child, arena);
     }
   }
@@ -567,7 +680,7 @@ void html_prepend_child(Value node, Value child, Arena *arena) {
 void html_append_child(Value node, Value child, Arena *arena) {
   if (node.type == V_OBJECT) {
     Value children;
-    if (object_get_symbol(node.object_value, "children", &children) && children.type == V_ARRAY) {
+    if (object_get_known(node.object_value, children, &children) && children.type == V_ARRAY) {
       array_push(children.array_value, child, arena);
     }
   }
@@ -576,7 +689,7 @@ void html_append_child(Value node, Value child, Arena *arena) {
 Value html_get_attribute(Value node, const char *attribute_name) {
   if (node.type == V_OBJECT) {
     Value attributes;
-    if (object_get_symbol(node.object_value, "attributes", &attributes) && attributes.type == V_OBJECT) {
+    if (object_get_known(node.object_value, attributes, &attributes) && attributes.type == V_OBJECT) {
       Value attribute;
       if (object_get_symbol(attributes.object_value, attribute_name, &attribute)) {
         return attribute;
@@ -589,7 +702,7 @@ Value html_get_attribute(Value node, const char *attribute_name) {
 void html_set_attribute(Value node, const char *attribute_name, String *string_value, Env *env) {
   if (node.type == V_OBJECT) {
     Value attributes;
-    if (object_get_symbol(node.object_value, "attributes", &attributes) && attributes.type == V_OBJECT) {
+    if (object_get_known(node.object_value, attributes, &attributes) && attributes.type == V_OBJECT) {
       Value value = (Value) { .type = V_STRING, .string_value = string_value };
       object_def(attributes.object_value, attribute_name, value, env);
     }
@@ -599,7 +712,7 @@ void html_set_attribute(Value node, const char *attribute_name, String *string_v
 void html_error(Value node, const Path *path, const char *format, ...) {
   va_list va;
   Value line;
-  if (node.type == V_OBJECT && object_get_symbol(node.object_value, "line", &line) && line.type == V_INT) {
+  if (node.type == V_OBJECT && object_get_known(node.object_value, line, &line) && line.type == V_INT) {
     fprintf(stderr, SGR_BOLD "%s:%" PRId64 ": " ERROR_LABEL, path->path, line.int_value);
   } else {
     fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL, path->path);
@@ -15,7 +15,7 @@ void import_html(Env *env);
 Value html_parse(String *html, Env *env);
 void html_text_content(Value node, StringBuffer *buffer);
 Value html_find_tag(Symbol tag_name, Value node);
-int html_remove_node(Object *needle, Value haystack);
+int html_remove_node(Object *needle, Value haystack, Arena *arena);
 
 typedef enum {
   HT_NO_ACTION,
@@ -32,7 +32,15 @@ typedef struct {
 #define HTML_REMOVE ((HtmlTransformation) { .type = HT_REMOVE })
 #define HTML_REPLACE(REPLACEMENT) ((HtmlTransformation) { .type = HT_REPLACE, .replacement = (REPLACEMENT) })
 
-Value html_transform(Value node, HtmlTransformation (*acceptor)(Value, void *), void *context);
+typedef HtmlTransformation (* HtmlAcceptor)(Value node, void *context);
+
+typedef struct {
+  HtmlAcceptor acceptor;
+  void *context;
+} HtmlTransformer;
+
+Value html_transform(Value node, HtmlAcceptor acceptor, void *context, Arena *arena);
+Value html_transform_all(Value node, const HtmlTransformer *transformers, size_t n, Arena *arena);
 
 int html_is_tag(Value node, const char *tag_name);
 Value html_create_element(const char *tag_name, int self_closing, Env *env);
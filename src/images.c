@@ -4,89 +4,482 @@
  * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
  */
 
+#define _GNU_SOURCE
 #include "images.h"
 
 #include "build.h"
+#include "buildcache.h"
 #include "html.h"
 #include "sitemap.h"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <utime.h>
 
 #ifdef WITH_IMAGEMAGICK
 #include <MagickWand/MagickWand.h>
 #endif
 
+#define IMAGE_INFO_CACHE_VERSION "plet-images 1"
+
 const char *supported_image_types[] = {"png", "jpg", "jpeg", "webp"};
 
+static int is_supported(const char *extension) {
+  size_t length = sizeof(supported_image_types) / sizeof(char *);
+  for (size_t i = 0; i < length; i++) {
+    if (strcmp(extension, supported_image_types[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+typedef struct {
+  char *format;
+  const char *mime_type;
+} ImageFormat;
+
+static const ImageFormat image_formats[] = {
+  {"webp", "image/webp"},
+  {"avif", "image/avif"},
+  {"jpg", "image/jpeg"},
+  {"png", "image/png"},
+};
+
 typedef struct {
   int64_t max_width;
   int64_t max_height;
   int64_t quality;
   int link_full;
   int preserve_lossless;
+  int *widths;
+  size_t num_widths;
+  const ImageFormat **formats;
+  size_t num_formats;
+  Value sizes;
   Path *src_root;
   Path *dist_root;
   Path *asset_root;
   Env *env;
 } ImageArgs;
 
-static int is_supported(const char *extension) {
-  size_t length = sizeof(supported_image_types) / sizeof(char *);
-  for (size_t i = 0; i < length; i++) {
-    if (strcmp(extension, supported_image_types[i]) == 0) {
-      return 1;
+typedef struct {
+  Path *dest;
+  int width;
+  int height;
+  int quality;
+} ImageTarget;
+
+typedef struct {
+  Path *src;
+  ImageTarget *targets;
+  size_t size;
+  size_t capacity;
+} ImageJob;
+
+typedef struct {
+  Path *src;
+  size_t index;
+} ImageJobEntry;
+
+typedef struct {
+  ImageJob *jobs;
+  size_t size;
+  size_t capacity;
+  GenericHashMap srcs;
+  GenericHashMap dests;
+  int defer;
+} ImageJobQueue;
+
+static ImageJobQueue queue = { .defer = 0 };
+static size_t handled_images = 0;
+
+static void write_image_info_entries(FILE *out);
+static int read_image_info_entry(FILE *in, Buffer *buffer);
+
+static Hash path_entry_hash(const void *p) {
+  const Path *path = *(const Path **) p;
+  return hash_bytes(path->path, path->size, INIT_HASH);
+}
+
+static int path_entry_equals(const void *a, const void *b) {
+  return strcmp((*(const Path **) a)->path, (*(const Path **) b)->path) == 0;
+}
+
+#ifdef WITH_IMAGEMAGICK
+static int magick_initialized = 0;
+
+static void init_magick(void) {
+  if (!magick_initialized) {
+    MagickWandGenesis();
+    atexit(MagickWandTerminus);
+    magick_initialized = 1;
+  }
+}
+
+static int compare_target_width(const void *a, const void *b) {
+  const ImageTarget *target_a = *(const ImageTarget **) a;
+  const ImageTarget *target_b = *(const ImageTarget **) b;
+  if (target_a->width != target_b->width) {
+    return target_b->width - target_a->width;
+  }
+  return target_b->height - target_a->height;
+}
+#endif
+
+#ifdef WITH_IMAGEMAGICK
+static void copy_mtime(const struct stat *src_stat, const Path *dest) {
+  struct utimbuf utime_buffer;
+  utime_buffer.actime = src_stat->st_atime;
+  utime_buffer.modtime = src_stat->st_mtime;
+  utime(dest->path, &utime_buffer);
+}
+
+// The key of each target covers the source and every resize leading up to it, since targets are produced by scaling
+// down the previous one
+static CacheKey *get_image_cache_keys(const Path *src, const ImageTarget **targets, size_t size) {
+  CacheKey key = create_cache_key("image");
+  if (!cache_key_add_file(&key, src)) {
+    return NULL;
+  }
+  CacheKey *keys = allocate(size * sizeof(CacheKey));
+  int width = 0, height = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (targets[i]->width != width || targets[i]->height != height) {
+      width = targets[i]->width;
+      height = targets[i]->height;
+      cache_key_add_int(&key, width);
+      cache_key_add_int(&key, height);
     }
+    keys[i] = key;
+    cache_key_add_int(&keys[i], targets[i]->quality);
+    const char *extension = path_get_extension(targets[i]->dest);
+    cache_key_add_bytes(&keys[i], extension, strlen(extension));
   }
-  return 0;
+  return keys;
 }
 
-static void resize_image(const Path *src_path, const Path *dist_path, int width, int height, ImageArgs *args) {
+static int restore_cached_images(const ImageTarget **targets, const CacheKey *keys, size_t size,
+    const struct stat *src_stat) {
+  for (size_t i = 0; i < size; i++) {
+    if (!build_cache_get_file(keys[i], targets[i]->dest)) {
+      return 0;
+    }
+    if (src_stat) {
+      copy_mtime(src_stat, targets[i]->dest);
+    }
+  }
+  return 1;
+}
+#endif
+
+static void resize_image(const ImageJob *job) {
 #ifdef WITH_IMAGEMAGICK
-  MagickWandGenesis();
+  struct stat stat_buffer;
+  int src_stat = stat(job->src->path, &stat_buffer);
+  // The source is decoded once, every target is then produced by scaling the
+  // previous (larger) one down further
+  const ImageTarget **targets = allocate(job->size * sizeof(ImageTarget *));
+  for (size_t i = 0; i < job->size; i++) {
+    targets[i] = &job->targets[i];
+  }
+  qsort(targets, job->size, sizeof(ImageTarget *), compare_target_width);
+  CacheKey *keys = NULL;
+  if (build_cache_is_enabled()) {
+    keys = get_image_cache_keys(job->src, targets, job->size);
+    if (keys && restore_cached_images(targets, keys, job->size, src_stat == 0 ? &stat_buffer : NULL)) {
+      free(keys);
+      free(targets);
+      return;
+    }
+  }
+  init_magick();
   MagickWand *wand = NewMagickWand();
-  MagickBooleanType status = MagickReadImage(wand, src_path->path);
-  if (status == MagickFalse) {
+  if (MagickReadImage(wand, job->src->path) == MagickFalse) {
     ExceptionType severity;
     char *description = MagickGetException(wand, &severity);
-    env_error(args->env, ENV_ARG_ALL, "ImageMagick error: %s", description);
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "ImageMagick error: %s" SGR_RESET "\n", job->src->path, description);
     MagickRelinquishMemory(description);
-  } else {
-    MagickResizeImage(wand, width, height, LanczosFilter);
-    MagickSetImageCompressionQuality(wand, args->quality);
-    status = MagickWriteImage(wand, dist_path->path);
-    if (status == MagickTrue) {
-      struct stat stat_buffer;
-      if (stat(src_path->path, &stat_buffer) == 0) {
-        struct utimbuf utime_buffer;
-        utime_buffer.actime = stat_buffer.st_atime;
-        utime_buffer.modtime = stat_buffer.st_mtime;
-        utime(dist_path->path, &utime_buffer);
+    DestroyMagickWand(wand);
+    free(keys);
+    free(targets);
+    return;
+  }
+  int width = 0, height = 0;
+  for (size_t i = 0; i < job->size; i++) {
+    const ImageTarget *target = targets[i];
+    if (target->width != width || target->height != height) {
+      MagickResizeImage(wand, target->width, target->height, LanczosFilter);
+      width = target->width;
+      height = target->height;
+    }
+    MagickSetImageCompressionQuality(wand, target->quality);
+    if (MagickWriteImage(wand, target->dest->path) == MagickFalse) {
+      ExceptionType severity;
+      char *description = MagickGetException(wand, &severity);
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "ImageMagick error: %s" SGR_RESET "\n", target->dest->path,
+          description);
+      MagickRelinquishMemory(description);
+    } else {
+      if (keys) {
+        build_cache_put_file(keys[i], target->dest);
+      }
+      if (src_stat == 0) {
+        copy_mtime(&stat_buffer, target->dest);
       }
     }
   }
+  free(keys);
+  free(targets);
   DestroyMagickWand(wand);
-  MagickWandTerminus();
 #else
-  if (copy_file(src_path->path, dist_path->path)) {
-    notify_output_observers(dist_path, args->env);
+  for (size_t i = 0; i < job->size; i++) {
+    copy_file(job->src->path, job->targets[i].dest->path);
   }
 #endif
 }
 
+static void add_image_job(const Path *src, const Path *dest, int width, int height, int quality) {
+  if (!queue.capacity) {
+    init_generic_hash_map(&queue.srcs, sizeof(ImageJobEntry), 0, path_entry_hash, path_entry_equals, NULL);
+    init_generic_hash_map(&queue.dests, sizeof(Path *), 0, path_entry_hash, path_entry_equals, NULL);
+  }
+  if (generic_hash_map_get(&queue.dests, &dest, NULL)) {
+    return;
+  }
+  ImageJobEntry entry = { .src = (Path *) src };
+  ImageJob *job;
+  if (generic_hash_map_get(&queue.srcs, &entry, &entry)) {
+    job = &queue.jobs[entry.index];
+  } else {
+    if (queue.size >= queue.capacity) {
+      queue.capacity = queue.capacity ? queue.capacity << 1 : 16;
+      queue.jobs = reallocate(queue.jobs, queue.capacity * sizeof(ImageJob));
+    }
+    entry.index = queue.size;
+    job = &queue.jobs[queue.size++];
+    job->src = copy_path(src);
+    job->targets = NULL;
+    job->size = 0;
+    job->capacity = 0;
+    entry.src = job->src;
+    generic_hash_map_add(&queue.srcs, &entry);
+  }
+  if (job->size >= job->capacity) {
+    job->capacity = job->capacity ? job->capacity << 1 : 4;
+    job->targets = reallocate(job->targets, job->capacity * sizeof(ImageTarget));
+  }
+  ImageTarget *target = &job->targets[job->size++];
+  target->dest = copy_path(dest);
+  target->width = width;
+  target->height = height;
+  target->quality = quality;
+  generic_hash_map_add(&queue.dests, &target->dest);
+}
+
+static void clear_image_jobs(void) {
+  for (size_t i = 0; i < queue.size; i++) {
+    delete_path(queue.jobs[i].src);
+    for (size_t j = 0; j < queue.jobs[i].size; j++) {
+      delete_path(queue.jobs[i].targets[j].dest);
+    }
+    free(queue.jobs[i].targets);
+  }
+  queue.size = 0;
+  if (queue.capacity) {
+    generic_hash_map_clear(&queue.srcs);
+    generic_hash_map_clear(&queue.dests);
+  }
+}
+
+size_t get_handled_image_count(void) {
+  return handled_images;
+}
+
+void defer_image_jobs(int defer) {
+  queue.defer = defer;
+  if (!defer) {
+    clear_image_jobs();
+  }
+}
+
+void write_image_jobs(FILE *out) {
+  for (size_t i = 0; i < queue.size; i++) {
+    ImageJob *job = &queue.jobs[i];
+    for (size_t j = 0; j < job->size; j++) {
+      ImageTarget *target = &job->targets[j];
+      fputc(1, out);
+      fwrite(job->src->path, 1, job->src->size + 1, out);
+      fwrite(target->dest->path, 1, target->dest->size + 1, out);
+      int32_t parameters[3] = {target->width, target->height, target->quality};
+      fwrite(parameters, sizeof(int32_t), 3, out);
+    }
+  }
+  // Image metadata read by a worker is sent along so that the parent can save it
+  write_image_info_entries(out);
+  fputc(0, out);
+}
+
+static Path *read_job_path(FILE *in, Buffer *buffer) {
+  int c;
+  buffer->size = 0;
+  while ((c = fgetc(in)) != EOF && c) {
+    buffer_put(buffer, c);
+  }
+  if (c == EOF) {
+    return NULL;
+  }
+  return create_path((char *) buffer->data, buffer->size);
+}
+
+int read_image_jobs(FILE *in) {
+  Buffer buffer = create_buffer(0);
+  int status = 1;
+  int tag;
+  while ((tag = fgetc(in)) == 1 || tag == 2) {
+    if (tag == 2) {
+      if (!read_image_info_entry(in, &buffer)) {
+        status = 0;
+        break;
+      }
+      continue;
+    }
+    Path *src = read_job_path(in, &buffer);
+    Path *dest = src ? read_job_path(in, &buffer) : NULL;
+    int32_t parameters[3];
+    if (dest && fread(parameters, sizeof(int32_t), 3, in) == 3) {
+      add_image_job(src, dest, parameters[0], parameters[1], parameters[2]);
+    } else {
+      status = 0;
+    }
+    if (src) {
+      delete_path(src);
+    }
+    if (dest) {
+      delete_path(dest);
+    }
+    if (!status) {
+      break;
+    }
+  }
+  delete_buffer(buffer);
+  return status;
+}
+
+static void run_image_jobs_parallel(int jobs) {
+  pid_t *pids = allocate(jobs * sizeof(pid_t));
+  int workers = 0;
+  fflush(NULL);
+  for (int k = 0; k < jobs; k++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      fprintf(stderr, ERROR_LABEL "unable to fork: %s" SGR_RESET "\n", strerror(errno));
+      break;
+    }
+    if (pid == 0) {
+      for (size_t i = k; i < queue.size; i += jobs) {
+        resize_image(&queue.jobs[i]);
+      }
+      fflush(NULL);
+      _exit(0);
+    }
+    pids[workers++] = pid;
+  }
+  for (int k = 0; k < workers; k++) {
+    waitpid(pids[k], NULL, 0);
+  }
+  free(pids);
+  if (workers < jobs) {
+    // Whatever the missing workers would have done is done here instead
+    for (size_t i = 0; i < queue.size; i++) {
+      if (i % jobs >= workers) {
+        resize_image(&queue.jobs[i]);
+      }
+    }
+  }
+}
+
+void run_image_jobs(int jobs, Env *env) {
+  if (queue.size > 1 && jobs > 1) {
+    if (jobs > queue.size) {
+      jobs = queue.size;
+    }
+    run_image_jobs_parallel(jobs);
+  } else {
+    for (size_t i = 0; i < queue.size; i++) {
+      resize_image(&queue.jobs[i]);
+    }
+  }
+  for (size_t i = 0; i < queue.size; i++) {
+    for (size_t j = 0; j < queue.jobs[i].size; j++) {
+      if (!asset_has_changed(queue.jobs[i].src, queue.jobs[i].targets[j].dest)) {
+        notify_output_observers(queue.jobs[i].targets[j].dest, env);
+      }
+    }
+  }
+  clear_image_jobs();
+}
+
+static void request_resize(const Path *src_path, const Path *dist_path, int width, int height, ImageArgs *args) {
+  if (queue.defer) {
+    add_image_job(src_path, dist_path, width, height, args->quality);
+    return;
+  }
+  ImageTarget target = {(Path *) dist_path, width, height, args->quality};
+  ImageJob job = {(Path *) src_path, &target, 1, 1};
+  resize_image(&job);
+  if (!asset_has_changed(src_path, dist_path)) {
+    notify_output_observers(dist_path, args->env);
+  }
+}
+
+static Path *get_variant_web_path(const Path *asset_web_path, int width, int height, const char *format,
+    ImageArgs *args) {
+  const char *name = path_get_name(asset_web_path);
+  const char *ext = path_get_extension(asset_web_path);
+  Buffer new_name = create_buffer(0);
+  if (format) {
+    if (ext[0]) {
+      buffer_printf(&new_name, "%.*s.%dx%dq%d.%s", ext - name - 1, name, width, height, args->quality, format);
+    } else {
+      buffer_printf(&new_name, "%s.%dx%dq%d.%s", name, width, height, args->quality, format);
+    }
+  } else if (ext[0]) {
+    if (args->preserve_lossless) {
+      buffer_printf(&new_name, "%.*s.%dx%dq%d.%s", ext - name - 1, name, width, height, args->quality, ext);
+    } else {
+      buffer_printf(&new_name, "%.*s.%dx%dq%d.jpg", ext - name - 1, name, width, height, args->quality);
+    }
+  } else {
+    buffer_printf(&new_name, "%s.%dx%dq%d.jpg", name, width, height, args->quality);
+  }
+  Path *new_name_path = create_path((char *) new_name.data, new_name.size);
+  delete_buffer(new_name);
+  Path *parent = path_get_parent(asset_web_path);
+  Path *variant_web_path = path_join(parent, new_name_path, 1);
+  delete_path(parent);
+  delete_path(new_name_path);
+  return variant_web_path;
+}
+
 static Path *handle_image(const Path *asset_path, const Path *src_path, int *attr_width, int *attr_height,
-    Path **original_asset_web_path, int *larger, ImageArgs *args) {
+    Path **original_asset_web_path, int *larger, PletImageInfo *info_out, ImageArgs *args) {
+  handled_images++;
   Path *asset_web_path = path_join(args->asset_root, asset_path, 1);
   Path *dist_path = path_join(args->dist_root, asset_web_path, 1);
   Path *dest_dir = path_get_parent(dist_path);
   *larger = 0;
+  info_out->type = IMG_UNKNOWN;
   if (mkdir_rec(dest_dir->path)) {
     char *extension = path_get_lowercase_extension(src_path);
     if (is_supported(extension)) {
       PletImageInfo info = get_image_info(src_path);
+      *info_out = info;
       if (info.type == IMG_UNKNOWN) {
         env_error(args->env, ENV_ARG_ALL, "unknown image type: %s", src_path->path);
       } else if (info.type == IMG_NOT_FOUND) {
@@ -122,23 +515,6 @@ static Path *handle_image(const Path *asset_path, const Path *src_path, int *att
           *attr_width = target_width;
           *attr_height = target_height;
           if (target_width * target_height * 2 < width * height) {
-            const char *name = path_get_name(dist_path);
-            const char *ext = path_get_extension(dist_path);
-            Buffer new_name = create_buffer(0);
-            if (extension[0]) {
-              if (args->preserve_lossless) {
-                buffer_printf(&new_name, "%.*s.%dx%dq%d.%s", ext - name - 1, name, target_width, target_height,
-                    args->quality, ext);
-              } else {
-                buffer_printf(&new_name, "%.*s.%dx%dq%d.jpg", ext - name - 1, name, target_width, target_height,
-                    args->quality);
-              }
-            } else {
-              buffer_printf(&new_name, "%s.%dx%dq%d.jpg", name, target_width, target_height, args->quality);
-            }
-            Path *new_name_path = create_path((char *) new_name.data, new_name.size);
-            delete_buffer(new_name);
-            Path *asset_web_path_parent = path_get_parent(asset_web_path);
             if (original_asset_web_path) {
               if (asset_has_changed(src_path, dist_path)) {
                 if (copy_file(src_path->path, dist_path->path)) {
@@ -146,17 +522,17 @@ static Path *handle_image(const Path *asset_path, const Path *src_path, int *att
                 }
               }
               *original_asset_web_path = asset_web_path;
-            } else {
+            }
+            Path *variant_web_path = get_variant_web_path(asset_web_path, target_width, target_height, NULL, args);
+            if (!original_asset_web_path) {
               delete_path(asset_web_path);
             }
-            asset_web_path = path_join(asset_web_path_parent, new_name_path, 1);
-            delete_path(asset_web_path_parent);
-            delete_path(new_name_path);
+            asset_web_path = variant_web_path;
             delete_path(dist_path);
             dist_path = path_join(args->dist_root, asset_web_path, 1);
 
             if (asset_has_changed(src_path, dist_path)) {
-              resize_image(src_path, dist_path, target_width, target_height, args);
+              request_resize(src_path, dist_path, target_width, target_height, args);
             }
           } else if (asset_has_changed(src_path, dist_path)) {
             if (copy_file(src_path->path, dist_path->path)) {
@@ -204,6 +580,90 @@ static void get_size_attributes(Value node, int *width, int *height) {
   }
 }
 
+static int compare_widths(const void *a, const void *b) {
+  return *(const int *) a - *(const int *) b;
+}
+
+static Value get_srcset(const Path *asset_path, const Path *src_path, const Path *image_web_path,
+    const int *widths, size_t num_widths, int target_width, int target_height, const ImageFormat *format,
+    ImageArgs *args) {
+  Path *asset_web_path = path_join(args->asset_root, asset_path, 1);
+  StringBuffer srcset = create_string_buffer(0, args->env->arena);
+  for (size_t i = 0; i < num_widths; i++) {
+    int width = widths[i];
+    int height = (int) (width * (int64_t) target_height / target_width);
+    if (height < 1) {
+      height = 1;
+    }
+    if (i) {
+      string_buffer_append_bytes(&srcset, (const uint8_t *) ", ", 2);
+    }
+    if (!format && width == target_width) {
+      string_buffer_printf(&srcset, "pletlink:%s %dw", image_web_path->path, width);
+      continue;
+    }
+    Path *variant_web_path = get_variant_web_path(asset_web_path, width, height, format ? format->format : NULL,
+        args);
+    Path *dist_path = path_join(args->dist_root, variant_web_path, 1);
+    if (asset_has_changed(src_path, dist_path)) {
+      request_resize(src_path, dist_path, width, height, args);
+    }
+    string_buffer_printf(&srcset, "pletlink:%s %dw", variant_web_path->path, width);
+    delete_path(dist_path);
+    delete_path(variant_web_path);
+  }
+  delete_path(asset_web_path);
+  return finalize_string_buffer(srcset);
+}
+
+static Value add_srcset(Value node, const Path *asset_path, const Path *src_path, const Path *image_web_path,
+    PletImageInfo info, int target_width, int target_height, ImageArgs *args) {
+  int *widths = allocate((args->num_widths + 1) * sizeof(int));
+  size_t num_widths = 0;
+  for (size_t i = 0; i < args->num_widths; i++) {
+    // Widths wider than the source would only be upscaled copies
+    if (args->widths[i] > 0 && args->widths[i] < info.width && args->widths[i] != target_width) {
+      widths[num_widths++] = args->widths[i];
+    }
+  }
+  widths[num_widths++] = target_width;
+  qsort(widths, num_widths, sizeof(int), compare_widths);
+  size_t unique = 1;
+  for (size_t i = 1; i < num_widths; i++) {
+    if (widths[i] != widths[unique - 1]) {
+      widths[unique++] = widths[i];
+    }
+  }
+  num_widths = unique;
+  if (num_widths > 1) {
+    Value srcset = get_srcset(asset_path, src_path, image_web_path, widths, num_widths, target_width, target_height,
+        NULL, args);
+    html_set_attribute(node, "srcset", srcset.string_value, args->env);
+    if (args->sizes.type == V_STRING) {
+      html_set_attribute(node, "sizes", args->sizes.string_value, args->env);
+    }
+  }
+  if (args->num_formats) {
+    Value picture = html_create_element("picture", 0, args->env);
+    for (size_t i = 0; i < args->num_formats; i++) {
+      Value source = html_create_element("source", 1, args->env);
+      html_set_attribute(source, "type", copy_c_string(args->formats[i]->mime_type, args->env->arena).string_value,
+          args->env);
+      Value srcset = get_srcset(asset_path, src_path, image_web_path, widths, num_widths, target_width,
+          target_height, args->formats[i], args);
+      html_set_attribute(source, "srcset", srcset.string_value, args->env);
+      if (args->sizes.type == V_STRING) {
+        html_set_attribute(source, "sizes", args->sizes.string_value, args->env);
+      }
+      html_append_child(picture, source, args->env->arena);
+    }
+    html_append_child(picture, node, args->env->arena);
+    node = picture;
+  }
+  free(widths);
+  return node;
+}
+
 static HtmlTransformation transform_images(Value node, void *context) {
   ImageArgs *args = context;
   if (html_is_tag(node, "img")) {
@@ -219,19 +679,14 @@ static HtmlTransformation transform_images(Value node, void *context) {
 
       int larger = 0;
 
+      PletImageInfo info;
+
       Path *asset_web_path = handle_image(asset_path, src_path, &attr_width, &attr_height,
-          args->link_full ? &original_asset_web_path : NULL, &larger, args);
+          args->link_full ? &original_asset_web_path : NULL, &larger, &info, args);
 
       StringBuffer new_link = create_string_buffer(sizeof("pletlink:") + asset_web_path->size, args->env->arena);
       string_buffer_printf(&new_link, "pletlink:%s", asset_web_path->path);
       html_set_attribute(node, "src", finalize_string_buffer(new_link).string_value, args->env);
-      delete_path(src_path);
-      delete_path(asset_path);
-      if (!original_asset_web_path && larger && args->link_full) {
-        original_asset_web_path = asset_web_path;
-      } else {
-        delete_path(asset_web_path);
-      }
 
       if (attr_width) {
         StringBuffer buffer = create_string_buffer(0, args->env->arena);
@@ -244,23 +699,98 @@ static HtmlTransformation transform_images(Value node, void *context) {
         html_set_attribute(node, "height", buffer.string, args->env);
       }
 
+      Value image_node = node;
+      if ((args->num_widths || args->num_formats) && info.type != IMG_UNKNOWN && info.type != IMG_NOT_FOUND
+          && attr_width && attr_height) {
+        image_node = add_srcset(node, asset_path, src_path, asset_web_path, info, attr_width, attr_height, args);
+      }
+
+      delete_path(src_path);
+      delete_path(asset_path);
+      if (!original_asset_web_path && larger && args->link_full) {
+        original_asset_web_path = asset_web_path;
+      } else {
+        delete_path(asset_web_path);
+      }
+
       if (original_asset_web_path) {
         Value link_node = html_create_element("a", 0, args->env);
         StringBuffer original_link = create_string_buffer(sizeof("pletlink:") + original_asset_web_path->size,
             args->env->arena);
         string_buffer_printf(&original_link, "pletlink:%s", original_asset_web_path->path);
         html_set_attribute(link_node, "href", finalize_string_buffer(original_link).string_value, args->env);
-        html_append_child(link_node, node, args->env->arena);
+        html_append_child(link_node, image_node, args->env->arena);
         delete_path(original_asset_web_path);
         return HTML_REPLACE(link_node);
       }
+      if (image_node.type != node.type || image_node.object_value != node.object_value) {
+        return HTML_REPLACE(image_node);
+      }
     }
   }
   return HTML_NO_ACTION;
 }
 
+static int get_srcset_options(Value options, ImageArgs *image_args, Env *env) {
+  Value widths, formats;
+  if (object_get_symbol(options.object_value, "widths", &widths) && widths.type != V_NIL) {
+    if (widths.type != V_ARRAY || !widths.array_value->size) {
+      env_error(env, 5, "srcset widths must be a non-empty array of integers");
+      return 0;
+    }
+    image_args->widths = allocate(widths.array_value->size * sizeof(int));
+    for (size_t i = 0; i < widths.array_value->size; i++) {
+      Value width = widths.array_value->cells[i];
+      if (width.type != V_INT) {
+        env_error(env, 5, "srcset widths must be an array of integers");
+        return 0;
+      }
+      image_args->widths[image_args->num_widths++] = width.int_value;
+    }
+  }
+  if (object_get_symbol(options.object_value, "formats", &formats) && formats.type != V_NIL) {
+    if (formats.type != V_ARRAY || !formats.array_value->size) {
+      env_error(env, 5, "srcset formats must be a non-empty array of strings");
+      return 0;
+    }
+    image_args->formats = allocate(formats.array_value->size * sizeof(ImageFormat *));
+    for (size_t i = 0; i < formats.array_value->size; i++) {
+      Value format = formats.array_value->cells[i];
+      if (format.type != V_STRING) {
+        env_error(env, 5, "srcset formats must be an array of strings");
+        return 0;
+      }
+      const ImageFormat *image_format = NULL;
+      for (size_t j = 0; j < sizeof(image_formats) / sizeof(ImageFormat); j++) {
+        if (string_equals(image_formats[j].format, format.string_value)) {
+          image_format = &image_formats[j];
+          break;
+        }
+      }
+      if (!image_format) {
+        env_error(env, 5, "unsupported image format: %.*s", format.string_value->size, format.string_value->bytes);
+        return 0;
+      }
+      image_args->formats[image_args->num_formats++] = image_format;
+    }
+  }
+  if (object_get_symbol(options.object_value, "sizes", &image_args->sizes) && image_args->sizes.type != V_STRING
+      && image_args->sizes.type != V_NIL) {
+    env_error(env, 5, "srcset sizes must be a string");
+    return 0;
+  }
+#ifndef WITH_IMAGEMAGICK
+  if (image_args->num_formats) {
+    // Without ImageMagick variants are plain copies of the source, so other formats can't be produced
+    env_warn(env, 5, "plet was built without ImageMagick, srcset formats are ignored");
+    image_args->num_formats = 0;
+  }
+#endif
+  return 1;
+}
+
 static Value images(const Tuple *args, Env *env) {
-  check_args_between(1, 5, args, env);
+  check_args_between(1, 6, args, env);
   Value src = args->values[0];
   Value max_width = create_int(640);
   if (args->size > 1) {
@@ -295,14 +825,32 @@ static Value images(const Tuple *args, Env *env) {
   if (env_get_symbol("IMAGE_PRESERVE_LOSSLESS", &preserve_lossless_value, env)) {
     preserve_lossless = is_truthy(preserve_lossless_value);
   }
+  ImageArgs context = {max_width.int_value, max_height.int_value, quality.int_value, link_full,
+    preserve_lossless, NULL, 0, NULL, 0, nil_value, NULL, NULL, NULL, env};
+  if (args->size > 5 && args->values[5].type != V_NIL) {
+    if (args->values[5].type != V_OBJECT) {
+      arg_type_error(5, V_OBJECT, args, env);
+      return nil_value;
+    }
+    if (!get_srcset_options(args->values[5], &context, env)) {
+      if (context.widths) {
+        free(context.widths);
+      }
+      if (context.formats) {
+        free(context.formats);
+      }
+      return nil_value;
+    }
+  }
   Path *src_root = get_src_root(env);
   if (src_root) {
     Path *dist_root = get_dist_root(env);
     if (dist_root) {
       Path *asset_root = create_path("assets", -1);
-      ImageArgs context = {max_width.int_value, max_height.int_value, quality.int_value, link_full,
-        preserve_lossless, src_root, dist_root, asset_root, env};
-      src = html_transform(src, transform_images, &context);
+      context.src_root = src_root;
+      context.dist_root = dist_root;
+      context.asset_root = asset_root;
+      src = html_transform(src, transform_images, &context, env->arena);
       delete_path(asset_root);
       delete_path(dist_root);
     } else {
@@ -312,6 +860,12 @@ static Value images(const Tuple *args, Env *env) {
   } else {
     env_error(env, -1, "SRC_ROOT missing or not a string");
   }
+  if (context.widths) {
+    free(context.widths);
+  }
+  if (context.formats) {
+    free(context.formats);
+  }
   return src;
 }
 
@@ -325,7 +879,7 @@ static Value image_info(const Tuple *args, Env *env) {
   Path *path = string_to_src_path(src.string_value, env);
   PletImageInfo info = get_image_info(path);
   delete_path(path);
-  if (info.type == IMG_UNKNOWN || IMG_NOT_FOUND) {
+  if (info.type == IMG_UNKNOWN || info.type == IMG_NOT_FOUND) {
     return nil_value;
   }
   Value result = create_object(3, env->arena);
@@ -333,13 +887,13 @@ static Value image_info(const Tuple *args, Env *env) {
   object_def(result.object_value, "height", create_int(info.height), env);
   switch (info.type) {
     case IMG_PNG:
-      object_def(result.object_value, "type", copy_c_string("png", env->arena), env);
+      object_def_known(result.object_value, type, copy_c_string("png", env->arena), env);
       break;
     case IMG_JPEG:
-      object_def(result.object_value, "type", copy_c_string("jpeg", env->arena), env);
+      object_def_known(result.object_value, type, copy_c_string("jpeg", env->arena), env);
       break;
     case IMG_WEBP:
-      object_def(result.object_value, "type", copy_c_string("webp", env->arena), env);
+      object_def_known(result.object_value, type, copy_c_string("webp", env->arena), env);
       break;
     case IMG_UNKNOWN:
     case IMG_NOT_FOUND:
@@ -462,7 +1016,7 @@ static PletImageInfo get_webp_size(FILE *f) {
 #define RIFF_SIGNATURE "RIFF"
 #define WEBP_SIGNATURE "WEBP"
 
-PletImageInfo get_image_info(const Path *path) {
+static PletImageInfo read_image_info(const Path *path) {
   PletImageInfo info = { IMG_UNKNOWN };
   FILE *f = fopen(path->path, "r");
   if (!f) {
@@ -489,3 +1043,217 @@ PletImageInfo get_image_info(const Path *path) {
   fclose(f);
   return info;
 }
+
+typedef struct {
+  Path *path;
+  time_t mtime;
+  int64_t size;
+  PletImageInfo info;
+  int used;
+  int dirty;
+} ImageInfoEntry;
+
+static GenericHashMap image_info_cache;
+static int image_info_cache_initialized = 0;
+static size_t image_info_cache_saved = 0;
+
+static const char *image_type_names[] = {"missing", "unknown", "png", "jpeg", "webp"};
+
+static Hash image_info_entry_hash(const void *p) {
+  return path_entry_hash(&(*(const ImageInfoEntry **) p)->path);
+}
+
+static int image_info_entry_equals(const void *a, const void *b) {
+  return strcmp((*(const ImageInfoEntry **) a)->path->path, (*(const ImageInfoEntry **) b)->path->path) == 0;
+}
+
+static ImageInfoEntry *get_image_info_entry(const Path *path) {
+  if (!image_info_cache_initialized) {
+    init_generic_hash_map(&image_info_cache, sizeof(ImageInfoEntry *), 0, image_info_entry_hash,
+        image_info_entry_equals, NULL);
+    image_info_cache_initialized = 1;
+  }
+  ImageInfoEntry *entry;
+  if (generic_hash_map_get(&image_info_cache, &(ImageInfoEntry *) { &(ImageInfoEntry) { .path = (Path *) path } },
+        &entry)) {
+    return entry;
+  }
+  return NULL;
+}
+
+static void put_image_info_entry(const Path *path, time_t mtime, int64_t size, PletImageInfo info, int used,
+    int dirty) {
+  ImageInfoEntry *entry = get_image_info_entry(path);
+  if (!entry) {
+    entry = allocate(sizeof(ImageInfoEntry));
+    entry->path = copy_path(path);
+    generic_hash_map_add(&image_info_cache, &entry);
+  }
+  entry->mtime = mtime;
+  entry->size = size;
+  entry->info = info;
+  entry->used = used;
+  entry->dirty = dirty;
+}
+
+PletImageInfo get_image_info(const Path *path) {
+  struct stat stat_buffer;
+  if (stat(path->path, &stat_buffer) != 0) {
+    return read_image_info(path);
+  }
+  ImageInfoEntry *entry = get_image_info_entry(path);
+  if (entry && entry->mtime == stat_buffer.st_mtime && entry->size == stat_buffer.st_size) {
+    entry->used = 1;
+    return entry->info;
+  }
+  PletImageInfo info = read_image_info(path);
+  if (info.type != IMG_NOT_FOUND) {
+    put_image_info_entry(path, stat_buffer.st_mtime, stat_buffer.st_size, info, 1, 1);
+  }
+  return info;
+}
+
+static void write_image_info_entries(FILE *out) {
+  if (!image_info_cache_initialized) {
+    return;
+  }
+  ImageInfoEntry *entry;
+  HashMapIterator it = generic_hash_map_iterate(&image_info_cache);
+  while (generic_hash_map_next(&it, &entry)) {
+    if (entry->used) {
+      fputc(2, out);
+      fwrite(entry->path->path, 1, entry->path->size + 1, out);
+      int64_t stamp[2] = {entry->mtime, entry->size};
+      fwrite(stamp, sizeof(int64_t), 2, out);
+      int32_t parameters[4] = {entry->info.type, entry->info.width, entry->info.height, entry->dirty};
+      fwrite(parameters, sizeof(int32_t), 4, out);
+    }
+  }
+}
+
+static int read_image_info_entry(FILE *in, Buffer *buffer) {
+  Path *path = read_job_path(in, buffer);
+  if (!path) {
+    return 0;
+  }
+  int64_t stamp[2];
+  int32_t parameters[4];
+  int status = fread(stamp, sizeof(int64_t), 2, in) == 2 && fread(parameters, sizeof(int32_t), 4, in) == 4;
+  if (status) {
+    PletImageInfo info = {(PletImageType) parameters[0], parameters[1], parameters[2]};
+    ImageInfoEntry *entry = get_image_info_entry(path);
+    put_image_info_entry(path, stamp[0], stamp[1], info, 1, parameters[3] || (entry && entry->dirty));
+  }
+  delete_path(path);
+  return status;
+}
+
+void read_image_info_cache(const Path *path) {
+  FILE *file = fopen(path->path, "r");
+  if (!file) {
+    return;
+  }
+  char *line = NULL;
+  size_t n = 0;
+  ssize_t length = getline(&line, &n, file);
+  if (length > 0 && strcmp(line, IMAGE_INFO_CACHE_VERSION "\n") == 0) {
+    image_info_cache_saved = 0;
+    while ((length = getline(&line, &n, file)) > 0) {
+      if (line[length - 1] == '\n') {
+        line[--length] = '\0';
+      }
+      char *end;
+      time_t mtime = (time_t) strtoll(line, &end, 10);
+      if (*end != ' ') {
+        break;
+      }
+      int64_t size = strtoll(end + 1, &end, 10);
+      if (*end != ' ') {
+        break;
+      }
+      char *type_name = end + 1;
+      end = strchr(type_name, ' ');
+      if (!end) {
+        break;
+      }
+      PletImageInfo info = { IMG_UNKNOWN };
+      for (size_t i = IMG_UNKNOWN; i < sizeof(image_type_names) / sizeof(char *); i++) {
+        if (strncmp(type_name, image_type_names[i], end - type_name) == 0 && !image_type_names[i][end - type_name]) {
+          info.type = (PletImageType) i;
+        }
+      }
+      info.width = (int) strtol(end + 1, &end, 10);
+      if (*end != ' ') {
+        break;
+      }
+      info.height = (int) strtol(end + 1, &end, 10);
+      if (*end != ' ') {
+        break;
+      }
+      Path *image_path = create_path(end + 1, -1);
+      // Entries already read during this process are at least as recent as the cache file
+      if (!get_image_info_entry(image_path)) {
+        put_image_info_entry(image_path, mtime, size, info, 0, 0);
+      }
+      delete_path(image_path);
+      image_info_cache_saved++;
+    }
+  }
+  free(line);
+  fclose(file);
+}
+
+void write_image_info_cache(const Path *path) {
+  if (!image_info_cache_initialized) {
+    return;
+  }
+  size_t used = 0;
+  int dirty = 0;
+  ImageInfoEntry *entry;
+  HashMapIterator it = generic_hash_map_iterate(&image_info_cache);
+  while (generic_hash_map_next(&it, &entry)) {
+    if (entry->used) {
+      used++;
+      dirty |= entry->dirty;
+    }
+  }
+  if (dirty || used != image_info_cache_saved) {
+    // Only images used by this build are kept
+    Path *temp_path = create_path(path->path, -1);
+    temp_path = reallocate(temp_path, sizeof(Path) + temp_path->size + sizeof(".tmp"));
+    memcpy(temp_path->path + temp_path->size, ".tmp", sizeof(".tmp"));
+    temp_path->size += sizeof(".tmp") - 1;
+    FILE *file = fopen(temp_path->path, "w");
+    if (!file) {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", temp_path->path, strerror(errno));
+    } else {
+      int status = fprintf(file, IMAGE_INFO_CACHE_VERSION "\n") > 0;
+      it = generic_hash_map_iterate(&image_info_cache);
+      while (status && generic_hash_map_next(&it, &entry)) {
+        if (entry->used) {
+          status = fprintf(file, "%" PRId64 " %" PRId64 " %s %d %d %s\n", (int64_t) entry->mtime, entry->size,
+              image_type_names[entry->info.type], entry->info.width, entry->info.height, entry->path->path) > 0;
+        }
+      }
+      if (fclose(file) != 0) {
+        status = 0;
+      }
+      if (!status) {
+        fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "write error: %s" SGR_RESET "\n", temp_path->path,
+            strerror(errno));
+        remove(temp_path->path);
+      } else if (rename(temp_path->path, path->path) != 0) {
+        fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, strerror(errno));
+        remove(temp_path->path);
+      } else {
+        image_info_cache_saved = used;
+      }
+    }
+    delete_path(temp_path);
+  }
+  it = generic_hash_map_iterate(&image_info_cache);
+  while (generic_hash_map_next(&it, &entry)) {
+    entry->used = 0;
+    entry->dirty = 0;
+  }
+}
@@ -9,6 +9,8 @@
 
 #include "value.h"
 
+#include <stdio.h>
+
 void import_images(Env *env);
 
 typedef enum {
@@ -26,5 +28,14 @@ typedef struct {
 } PletImageInfo;
 
 PletImageInfo get_image_info(const Path *path);
+void read_image_info_cache(const Path *path);
+void write_image_info_cache(const Path *path);
+
+// Number of images copied or resized into dist by images(), output that depends on them can't be restored on its own
+size_t get_handled_image_count(void);
+void defer_image_jobs(int defer);
+void write_image_jobs(FILE *out);
+int read_image_jobs(FILE *in);
+void run_image_jobs(int jobs, Env *env);
 
 #endif
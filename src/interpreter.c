@@ -6,6 +6,9 @@
 
 #include "interpreter.h"
 
+#include "bytecode.h"
+#include "collections.h"
+#include "profile.h"
 #include "strings.h"
 
 #include <alloca.h>
@@ -22,7 +25,9 @@ typedef enum {
   C_EQ
 } Comparison;
 
-static void eval_error(Node node, const char *format, ...) {
+static int use_bytecode = 1;
+
+void eval_error(Node node, const char *format, ...) {
   va_list va;
   fprintf(stderr, SGR_BOLD "%s:%d:%d: " ERROR_LABEL, node.module.file_name->path, node.start.line, node.start.column);
   va_start(va, format);
@@ -32,26 +37,56 @@ static void eval_error(Node node, const char *format, ...) {
   print_error_line(node.module.file_name->path, node.start, node.end);
 }
 
-int apply(Value func, const Tuple *args, Value *return_value, Env *env) {
+void set_bytecode_enabled(int enabled) {
+  use_bytecode = enabled;
+}
+
+static Value call_closure(Closure *closure, const Tuple *args) {
+  Env *closure_env = create_child_env(closure->env);
+  int compiled = use_bytecode && closure->code;
+  if (compiled) {
+    init_locals(closure->code, closure_env);
+  }
+  int i = 0;
+  NameList *params = closure->params;
+  while (params) {
+    Value arg;
+    if (i < args->size) {
+      arg = args->values[i];
+    } else {
+      arg = nil_value;
+    }
+    env_put(params->head, arg, closure_env);
+    params = params->tail;
+    i++;
+  }
+  if (compiled) {
+    return execute(closure->code, closure_env).value;
+  }
+  return interpret(closure->body, closure_env).value;
+}
+
+static const char *get_function_name(Node *callee_node, Value callee, char *buffer, size_t size) {
+  if (callee_node && callee_node->type == N_NAME) {
+    return callee_node->name_value;
+  } else if (callee_node && callee_node->type == N_DOT) {
+    return callee_node->dot_value.name;
+  } else if (callee.type == V_CLOSURE) {
+    Node body = callee.closure_value->body;
+    snprintf(buffer, size, "<closure %s:%d>", get_profile_name(body.module.file_name->path), body.start.line);
+    return buffer;
+  }
+  return "<function>";
+}
+
+static int apply_value(Value func, const Tuple *args, Value *return_value, Env *env) {
   if (func.type == V_FUNCTION) {
     env_clear_error(env);
+    env->sequence_call = 0;
     *return_value = func.function_value(args, env);
     return !env->error;
   } else if (func.type == V_CLOSURE) {
-    int i = 0;
-    NameList *params = func.closure_value->params;
-    while (params) {
-      Value arg;
-      if (i < args->size) {
-        arg = args->values[i];
-      } else {
-        arg = nil_value;
-      }
-      env_put(params->head, arg, func.closure_value->env);
-      params = params->tail;
-      i++;
-    }
-    *return_value = interpret(func.closure_value->body, func.closure_value->env).value;
+    *return_value = call_closure(func.closure_value, args);
     return 1;
   } else {
     env_error(env, -1, "value of type %s is not a function", value_name(func.type));
@@ -59,14 +94,79 @@ int apply(Value func, const Tuple *args, Value *return_value, Env *env) {
   }
 }
 
-static InterpreterResult eval_apply(Node node, Env *env) {
+int apply(Value func, const Tuple *args, Value *return_value, Env *env) {
+  if (!is_profiling()) {
+    return apply_value(func, args, return_value, env);
+  }
+  ProfileTimer timer = profile_start();
+  int status = apply_value(func, args, return_value, env);
+  char name[256];
+  profile_end(timer, PROFILE_FUNCTION, get_function_name(NULL, func, name, sizeof(name)));
+  return status;
+}
+
+static Value call_callee(Node node, Value callee, Tuple *args, int sequence_call, Env *env) {
+  if (args->size && args->values[0].type == V_LAZY && !accepts_sequence(callee)) {
+    Lazy *sequence = args->values[0].lazy_value;
+    if (!sequence->func(nil_value, sequence->context, &args->values[0])) {
+      display_env_error(node.apply_value.args->head, env->error_level, 1, "%s", env->error);
+      env_clear_error(env);
+      return nil_value;
+    }
+  }
+  if (callee.type == V_FUNCTION) {
+    env_clear_error(env);
+    env->calling_node = &node;
+    env->sequence_call = sequence_call;
+    Value return_value = callee.function_value(args, env);
+    env->sequence_call = 0;
+    if (env->error) {
+      if (env->error_arg < 0 || env->error_arg >= args->size) {
+        display_env_error(node, env->error_level, env->error_arg != ENV_ARG_NONE, "%s", env->error);
+      } else {
+        NodeList *arg_nodes = node.apply_value.args;
+        while (env->error_arg > 0) {
+          arg_nodes = arg_nodes->tail;
+          env->error_arg--;
+        }
+        display_env_error(arg_nodes->head, env->error_level, 1, "%s", env->error);
+      }
+      env_clear_error(env);
+    }
+    return return_value;
+  } else if (callee.type == V_CLOSURE) {
+    return call_closure(callee.closure_value, args);
+  } else {
+    if (node.apply_value.callee->type != N_SUPPRESS || callee.type != V_NIL) {
+      eval_error(*node.apply_value.callee, "value of type %s is not a function", value_name(callee.type));
+    }
+    return nil_value;
+  }
+}
+
+Value call_value(Node node, Value callee, Tuple *args, int sequence_call, Env *env) {
+  if (!is_profiling() || (callee.type != V_FUNCTION && callee.type != V_CLOSURE)) {
+    return call_callee(node, callee, args, sequence_call, env);
+  }
+  ProfileTimer timer = profile_start();
+  Value return_value = call_callee(node, callee, args, sequence_call, env);
+  char name[256];
+  profile_end(timer, PROFILE_FUNCTION, get_function_name(node.apply_value.callee, callee, name, sizeof(name)));
+  return return_value;
+}
+
+static InterpreterResult eval_apply(Node node, int sequence_call, Env *env) {
   InterpreterResult result;
-  int suppress = node.apply_value.callee->type == N_SUPPRESS;
   Tuple *args = alloca(sizeof(Tuple) + LL_SIZE(node.apply_value.args) * sizeof(Value));
   args->size = LL_SIZE(node.apply_value.args);
   NodeList *arg_nodes = node.apply_value.args;
   for (int i = 0; i < args->size; i++) {
-    result = interpret(arg_nodes->head, env);
+    if (i == 0 && arg_nodes->head.type == N_APPLY && node.apply_value.callee->type == N_NAME
+        && is_sequence_function(node.apply_value.callee->name_value)) {
+      result = eval_apply(arg_nodes->head, 1, env);
+    } else {
+      result = interpret(arg_nodes->head, env);
+    }
     if (result.type != IR_VALUE) {
       return result;
     }
@@ -86,148 +186,135 @@ static InterpreterResult eval_apply(Node node, Env *env) {
     }
     callee = result.value;
   }
-  if (callee.type == V_FUNCTION) {
-    env_clear_error(env);
-    env->calling_node = &node;
-    Value return_value = callee.function_value(args, env);
-    if (env->error) {
-      if (env->error_arg < 0 || env->error_arg >= args->size) {
-        display_env_error(node, env->error_level, env->error_arg != ENV_ARG_NONE, "%s", env->error);
-      } else {
-        arg_nodes = node.apply_value.args;
-        while (env->error_arg > 0) {
-          arg_nodes = arg_nodes->tail;
-          env->error_arg--;
-        }
-        display_env_error(arg_nodes->head, env->error_level, 1, "%s", env->error);
-      }
-      env_clear_error(env);
-    }
-    return RESULT_VALUE(return_value);
-  } else if (callee.type == V_CLOSURE) {
-    Env *closure_env = create_child_env(callee.closure_value->env);
-    int i = 0;
-    NameList *params = callee.closure_value->params;
-    while (params) {
-      Value arg;
-      if (i < args->size) {
-        arg = args->values[i];
-      } else {
-        arg = nil_value;
-      }
-      env_put(params->head, arg, closure_env);
-      params = params->tail;
-      i++;
-    }
-    result = interpret(callee.closure_value->body, closure_env);
-    return RESULT_VALUE(result.value);
-  } else {
-    if (!suppress || callee.type != V_NIL) {
-      eval_error(*node.apply_value.callee, "value of type %s is not a function", value_name(callee.type));
-    }
-    return RESULT_VALUE(nil_value);
-  }
+  return RESULT_VALUE(call_value(node, callee, args, sequence_call, env));
 }
 
-static InterpreterResult eval_subscript(Node node, Env *env, int suppress_name_error) {
-  int suppress_type_error = node.subscript_value.list->type == N_SUPPRESS;
-  InterpreterResult result = interpret(*node.subscript_value.list, env);
-  if (result.type != IR_VALUE) {
-    return result;
+Value eval_name(Node node, int suppress_name_error, Env *env) {
+  Value value;
+  if (env_get(node.name_value, &value, env)) {
+    return value;
   }
-  Value object = result.value;
-  result = interpret(*node.subscript_value.index, env);
-  if (result.type != IR_VALUE) {
-    return result;
+  if (!suppress_name_error) {
+    eval_error(node, "undefined variable: %s", node.name_value);
   }
-  Value index = result.value;
+  return nil_value;
+}
+
+Value subscript_value(Node node, Value object, Value index, int suppress_name_error) {
+  int suppress_type_error = node.subscript_value.list->type == N_SUPPRESS;
   if (object.type == V_OBJECT) {
     Value value;
     if (object_get(object.object_value, index, &value)) {
-      return RESULT_VALUE(value);
+      return value;
     }
-    return RESULT_VALUE(nil_value);
+    return nil_value;
   }
   if (index.type != V_INT) {
     if (!suppress_name_error) {
       eval_error(*node.subscript_value.index, "value of type %s is not a valid array index", value_name(index.type));
     }
-    return RESULT_VALUE(nil_value);
+    return nil_value;
   }
   if (object.type == V_ARRAY) {
     if (index.int_value < 0 || index.int_value >= object.array_value->size) {
       if (!suppress_name_error) {
         eval_error(*node.subscript_value.index, "array index out of range: %" PRId64, index.int_value);
       }
-      return RESULT_VALUE(nil_value);
+      return nil_value;
     }
-    return RESULT_VALUE(object.array_value->cells[index.int_value]);
+    return object.array_value->cells[index.int_value];
   } else if (object.type == V_STRING) {
     if (index.int_value < 0 || index.int_value >= object.string_value->size) {
       if (!suppress_name_error) {
         eval_error(*node.subscript_value.index, "string index out of range: %" PRId64, index.int_value);
       }
-      return RESULT_VALUE(nil_value);
+      return nil_value;
     }
-    return RESULT_VALUE(create_int(object.string_value->bytes[index.int_value]));
+    return create_int(object.string_value->bytes[index.int_value]);
   } else {
     if (!suppress_type_error || object.type != V_NIL) {
       eval_error(*node.subscript_value.list, "value of type %s is not indexable", value_name(object.type));
     }
-    return RESULT_VALUE(nil_value);
+    return nil_value;
   }
 }
 
-static InterpreterResult eval_dot(Node node, Env *env, int suppress_name_error) {
-  int suppress_type_error = node.dot_value.object->type == N_SUPPRESS;
-  InterpreterResult result = interpret(*node.dot_value.object, env);
+static InterpreterResult eval_subscript(Node node, Env *env, int suppress_name_error) {
+  InterpreterResult result = interpret(*node.subscript_value.list, env);
   if (result.type != IR_VALUE) {
     return result;
   }
   Value object = result.value;
+  result = interpret(*node.subscript_value.index, env);
+  if (result.type != IR_VALUE) {
+    return result;
+  }
+  return RESULT_VALUE(subscript_value(node, object, result.value, suppress_name_error));
+}
+
+Value get_property(Node node, Value object, int suppress_name_error) {
   if (object.type != V_OBJECT) {
-    if (!suppress_type_error || object.type != V_NIL) {
+    if (node.dot_value.object->type != N_SUPPRESS || object.type != V_NIL) {
       eval_error(*node.dot_value.object, "value of type %s is not an object", value_name(object.type));
     }
-    return RESULT_VALUE(nil_value);
+    return nil_value;
   }
-  Value key = create_symbol(node.dot_value.name);
   Value value;
-  if (object_get(object.object_value, key, &value)) {
-    return RESULT_VALUE(value);
+  if (object_get(object.object_value, create_symbol(node.dot_value.name), &value)) {
+    return value;
   }
   if (!suppress_name_error) {
     eval_error(node, "undefined object property: %s", node.dot_value.name);
   }
-  return RESULT_VALUE(nil_value);
+  return nil_value;
 }
 
-static InterpreterResult eval_prefix(Node node, Env *env) {
-  InterpreterResult operand = interpret(*node.prefix_value.operand, env);
-  if (operand.type != IR_VALUE) {
-    return operand;
+static InterpreterResult eval_dot(Node node, Env *env, int suppress_name_error) {
+  InterpreterResult result = interpret(*node.dot_value.object, env);
+  if (result.type != IR_VALUE) {
+    return result;
   }
+  return RESULT_VALUE(get_property(node, result.value, suppress_name_error));
+}
+
+Value eval_prefix_operator(Node node, Value operand) {
   switch (node.prefix_value.operator) {
     case P_NOT:
-      if (is_truthy(operand.value)) {
-        return RESULT_VALUE(nil_value);
+      if (is_truthy(operand)) {
+        return nil_value;
       } else {
-        return RESULT_VALUE(true_value);
+        return true_value;
       }
     case P_NEG:
-      if (operand.value.type == V_INT) {
-        return RESULT_VALUE(create_int(-operand.value.int_value));
-      } else if (operand.value.type == V_FLOAT) {
-        return RESULT_VALUE(create_float(-operand.value.float_value));
+      if (operand.type == V_INT) {
+        return create_int(-operand.int_value);
+      } else if (operand.type == V_FLOAT) {
+        return create_float(-operand.float_value);
       } else {
-        eval_error(*node.prefix_value.operand, "value of type is not a number", value_name(operand.value.type));
-        return RESULT_VALUE(nil_value);
+        eval_error(*node.prefix_value.operand, "value of type is not a number", value_name(operand.type));
+        return nil_value;
       }
   }
-  return RESULT_VALUE(nil_value);
+  return nil_value;
+}
+
+static InterpreterResult eval_prefix(Node node, Env *env) {
+  InterpreterResult operand = interpret(*node.prefix_value.operand, env);
+  if (operand.type != IR_VALUE) {
+    return operand;
+  }
+  return RESULT_VALUE(eval_prefix_operator(node, operand.value));
 }
 
 static Value concatenate_strings(Value left, Value right, Env *env) {
+  if (left.type == V_STRING) {
+    if (right.type != V_STRING) {
+      StringBuffer buffer = create_string_buffer(0, env->arena);
+      string_buffer_append_value(&buffer, right);
+      right = finalize_string_buffer(buffer);
+    }
+    return append_string(left.string_value, right.string_value->bytes, right.string_value->size, env->arena);
+  }
   StringBuffer buffer = create_string_buffer(0, env->arena);
   string_buffer_append_value(&buffer, left);
   string_buffer_append_value(&buffer, right);
@@ -389,60 +476,48 @@ static Comparison compare_values(Node node, Value left, Value right, const char
   return C_ERROR;
 }
 
-static InterpreterResult eval_infix(Node node, Env *env) {
-  InterpreterResult right, left = interpret(*node.infix_value.left, env);
-  if (left.type != IR_VALUE) {
-    return left;
-  }
-  if (node.infix_value.operator != I_AND && node.infix_value.operator != I_OR) {
-    right = interpret(*node.infix_value.right, env);
-    if (right.type != IR_VALUE) {
-      return right;
-    }
-  }
+Value eval_infix_operator(Node node, Value left, Value right, Env *env) {
   switch (node.infix_value.operator) {
     case I_NONE:
-      return RESULT_VALUE(nil_value);
+    case I_AND:
+    case I_OR:
+      return nil_value;
     case I_ADD:
-      return eval_add(node, left.value, right.value, env);
+      return eval_add(node, left, right, env).value;
     case I_SUB:
-      return eval_sub(node, left.value, right.value, env);
+      return eval_sub(node, left, right, env).value;
     case I_MUL:
-      return eval_mul(node, left.value, right.value, env);
+      return eval_mul(node, left, right, env).value;
     case I_DIV:
-      return eval_div(node, left.value, right.value, env);
+      return eval_div(node, left, right, env).value;
     case I_MOD:
-      return eval_mod(node, left.value, right.value, env);
+      return eval_mod(node, left, right, env).value;
     case I_LT:
-      return compare_values(node, left.value, right.value, "<", env) == C_LT
-        ? RESULT_VALUE(true_value)
-        : RESULT_VALUE(nil_value);
+      return compare_values(node, left, right, "<", env) == C_LT ? true_value : nil_value;
     case I_LEQ: {
-      Comparison c = compare_values(node, left.value, right.value, "<", env);
-      return c == C_LT || c == C_EQ
-        ? RESULT_VALUE(true_value)
-        : RESULT_VALUE(nil_value);
+      Comparison c = compare_values(node, left, right, "<", env);
+      return c == C_LT || c == C_EQ ? true_value : nil_value;
     }
     case I_GT:
-      return compare_values(node, left.value, right.value, ">", env) == C_GT
-        ? RESULT_VALUE(true_value)
-        : RESULT_VALUE(nil_value);
+      return compare_values(node, left, right, ">", env) == C_GT ? true_value : nil_value;
     case I_GEQ: {
-      Comparison c = compare_values(node, left.value, right.value, "<", env);
-      return c == C_GT || c == C_EQ
-        ? RESULT_VALUE(true_value)
-        : RESULT_VALUE(nil_value);
+      Comparison c = compare_values(node, left, right, "<", env);
+      return c == C_GT || c == C_EQ ? true_value : nil_value;
     }
     case I_EQ:
-      if (equals(left.value, right.value)) {
-        return RESULT_VALUE(true_value);
-      }
-      return RESULT_VALUE(nil_value);
+      return equals(left, right) ? true_value : nil_value;
     case I_NEQ:
-      if (equals(left.value, right.value)) {
-        return RESULT_VALUE(nil_value);
-      }
-      return RESULT_VALUE(true_value);
+      return equals(left, right) ? nil_value : true_value;
+  }
+  return nil_value;
+}
+
+static InterpreterResult eval_infix(Node node, Env *env) {
+  InterpreterResult right, left = interpret(*node.infix_value.left, env);
+  if (left.type != IR_VALUE) {
+    return left;
+  }
+  switch (node.infix_value.operator) {
     case I_AND:
       if (is_truthy(left.value)) {
         return interpret(*node.infix_value.right, env);
@@ -453,8 +528,13 @@ static InterpreterResult eval_infix(Node node, Env *env) {
         return left;
       }
       return interpret(*node.infix_value.right, env);
+    default:
+      right = interpret(*node.infix_value.right, env);
+      if (right.type != IR_VALUE) {
+        return right;
+      }
+      return RESULT_VALUE(eval_infix_operator(node, left.value, right.value, env));
   }
-  return RESULT_VALUE(nil_value);
 }
 
 static InterpreterResult eval_if(Node node, Env *env) {
@@ -623,18 +703,80 @@ static InterpreterResult eval_switch(Node node, Env *env) {
   return RESULT_VALUE(nil_value);
 }
 
-static InterpreterResult eval_assign_operator(Node node, Value existing, Value value, Env *env) {
+Value eval_assign_operator(Node node, Value existing, Value value, Env *env) {
   switch (node.assign_value.operator) {
     case I_ADD:
-      return eval_add(node, existing, value, env);
+      return eval_add(node, existing, value, env).value;
     case I_SUB:
-      return eval_sub(node, existing, value, env);
+      return eval_sub(node, existing, value, env).value;
     case I_MUL:
-      return eval_mul(node, existing, value, env);
+      return eval_mul(node, existing, value, env).value;
     case I_DIV:
-      return eval_div(node, existing, value, env);
+      return eval_div(node, existing, value, env).value;
     default:
-      return RESULT_VALUE(value);
+      return value;
+  }
+}
+
+void assign_name(Node node, Value value, Env *env) {
+  if (node.assign_value.operator != I_NONE) {
+    Value existing;
+    if (!env_get(node.assign_value.left->name_value, &existing, env)) {
+      eval_error(*node.assign_value.left, "undefined variable: %s",
+          node.assign_value.left->name_value);
+      return;
+    }
+    value = eval_assign_operator(node, existing, value, env);
+  }
+  env_put(node.assign_value.left->name_value, value, env);
+}
+
+void assign_subscript(Node node, Value object, Value index, Value value, Env *env) {
+  if (object.type == V_OBJECT) {
+    if (node.assign_value.operator != I_NONE) {
+      Value existing;
+      if (!object_get(object.object_value, index, &existing)) {
+        eval_error(*node.assign_value.left, "undefined object property");
+        return;
+      }
+      value = eval_assign_operator(node, existing, value, env);
+    }
+    object_put(object.object_value, index, value, env->arena);
+  } else if (object.type == V_ARRAY) {
+    if (index.type != V_INT) {
+      eval_error(*node.assign_value.left->subscript_value.index,
+          "value of type %s is not a valid array index", value_name(index.type));
+    } else if (index.int_value < 0 || index.int_value >= object.array_value->size) {
+      eval_error(*node.assign_value.left->subscript_value.index,
+          "array index out of range: %" PRId64, index.int_value);
+    } else {
+      if (node.assign_value.operator != I_NONE) {
+        value = eval_assign_operator(node, object.array_value->cells[index.int_value], value, env);
+      }
+      array_set(object.array_value, index.int_value, value, env->arena);
+    }
+  } else {
+    eval_error(*node.assign_value.left->subscript_value.list, "value of type %s is not indexable",
+        value_name(object.type));
+  }
+}
+
+void assign_property(Node node, Value object, Value value, Env *env) {
+  if (object.type == V_OBJECT) {
+    Value key = create_symbol(node.assign_value.left->dot_value.name);
+    if (node.assign_value.operator != I_NONE) {
+      Value existing;
+      if (!object_get(object.object_value, key, &existing)) {
+        eval_error(*node.assign_value.left, "undefined object property: %s",
+            key.symbol_value);
+        return;
+      }
+      value = eval_assign_operator(node, existing, value, env);
+    }
+    object_put(object.object_value, key, value, env->arena);
+  } else {
+    eval_error(*node.assign_value.left->dot_value.object, "value of type %s is not an object",
+        value_name(object.type));
   }
 }
 
@@ -645,23 +787,9 @@ static InterpreterResult eval_assign(Node node, Env *env) {
   }
   Value value = result.value;
   switch (node.assign_value.left->type) {
-    case N_NAME: {
-      if (node.assign_value.operator != I_NONE) {
-        Value existing;
-        if (!env_get(node.assign_value.left->name_value, &existing, env)) {
-          eval_error(*node.assign_value.left, "undefined variable: %s",
-              node.assign_value.left->name_value);
-          return RESULT_VALUE(nil_value);
-        }
-        result = eval_assign_operator(node, existing, value, env);
-        if (result.type != IR_VALUE) {
-          return result;
-        }
-        value = result.value;
-      }
-      env_put(node.assign_value.left->name_value, value, env);
+    case N_NAME:
+      assign_name(node, value, env);
       break;
-    }
     case N_SUBSCRIPT: {
       result = interpret(*node.assign_value.left->subscript_value.list, env);
       if (result.type != IR_VALUE) {
@@ -672,42 +800,7 @@ static InterpreterResult eval_assign(Node node, Env *env) {
       if (result.type != IR_VALUE) {
         return result;
       }
-      Value index = result.value;
-      if (object.type == V_OBJECT) {
-        if (node.assign_value.operator != I_NONE) {
-          Value existing;
-          if (!object_get(object.object_value, index, &existing)) {
-            eval_error(*node.assign_value.left, "undefined object property");
-            return RESULT_VALUE(nil_value);
-          }
-          result = eval_assign_operator(node, existing, value, env);
-          if (result.type != IR_VALUE) {
-            return result;
-          }
-          value = result.value;
-        }
-        object_put(object.object_value, index, value, env->arena);
-      } else if (object.type == V_ARRAY) {
-        if (index.type != V_INT) {
-          eval_error(*node.assign_value.left->subscript_value.index,
-              "value of type %s is not a valid array index", value_name(index.type));
-        } else if (index.int_value < 0 || index.int_value >= object.array_value->size) {
-          eval_error(*node.assign_value.left->subscript_value.index,
-              "array index out of range: %" PRId64, index.int_value);
-        } else {
-          if (node.assign_value.operator != I_NONE) {
-            result = eval_assign_operator(node, object.array_value->cells[index.int_value], value, env);
-            if (result.type != IR_VALUE) {
-              return result;
-            }
-            value = result.value;
-          }
-          object.array_value->cells[index.int_value] = value;
-        }
-      } else {
-        eval_error(*node.assign_value.left->subscript_value.list, "value of type %s is not indexable",
-            value_name(object.type));
-      }
+      assign_subscript(node, object, result.value, value, env);
       break;
     }
     case N_DOT: {
@@ -715,27 +808,7 @@ static InterpreterResult eval_assign(Node node, Env *env) {
       if (result.type != IR_VALUE) {
         return result;
       }
-      Value object = result.value;
-      if (object.type == V_OBJECT) {
-        Value key = create_symbol(node.assign_value.left->dot_value.name);
-        if (node.assign_value.operator != I_NONE) {
-          Value existing;
-          if (!object_get(object.object_value, key, &existing)) {
-            eval_error(*node.assign_value.left, "undefined object property: %s",
-                key.symbol_value);
-            return RESULT_VALUE(nil_value);
-          }
-          result = eval_assign_operator(node, existing, value, env);
-          if (result.type != IR_VALUE) {
-            return result;
-          }
-          value = result.value;
-        }
-        object_put(object.object_value, key, value, env->arena);
-      } else {
-        eval_error(*node.assign_value.left->dot_value.object, "value of type %s is not an object",
-            value_name(object.type));
-      }
+      assign_property(node, result.value, value, env);
       break;
     }
     default:
@@ -745,16 +818,25 @@ static InterpreterResult eval_assign(Node node, Env *env) {
   return RESULT_VALUE(nil_value);
 }
 
+int64_t get_loop_level(Node node, Env *env) {
+  const char *keyword = node.type == N_BREAK ? "break" : "continue";
+  int64_t level = node.type == N_BREAK ? node.break_value : node.continue_value;
+  if (!env->loops) {
+    eval_error(node, "unexpected %s outside of loop", keyword);
+    return 0;
+  }
+  if (level < 1 || level > env->loops) {
+    eval_error(node, "invalid numeric argument for %s, expected an integer between 1 and %" PRId64,
+        keyword, env->loops);
+    level = level < 1 ? 1 : env->loops;
+  }
+  return level;
+}
+
 InterpreterResult interpret(Node node, Env *env) {
   switch (node.type) {
-    case N_NAME: {
-      Value value;
-      if (env_get(node.name_value, &value, env)) {
-        return RESULT_VALUE(value);
-      }
-      eval_error(node, "undefined variable: %s", node.name_value);
-      return RESULT_VALUE(nil_value);
-    }
+    case N_NAME:
+      return RESULT_VALUE(eval_name(node, 0, env));
     case N_INT:
       return RESULT_VALUE(create_int(node.int_value));
     case N_FLOAT:
@@ -799,7 +881,7 @@ InterpreterResult interpret(Node node, Env *env) {
       return RESULT_VALUE(object);
     }
     case N_APPLY:
-      return eval_apply(node, env);
+      return eval_apply(node, 0, env);
     case N_SUBSCRIPT:
       return eval_subscript(node, env, 0);
     case N_DOT:
@@ -836,6 +918,12 @@ InterpreterResult interpret(Node node, Env *env) {
     case N_BLOCK: {
       Buffer buffer = create_buffer(0);
       while (node.block_value) {
+        if (node.block_value->head.type == N_STRING) {
+          buffer_append_bytes(&buffer, node.block_value->head.string_value.bytes,
+              node.block_value->head.string_value.size);
+          node.block_value = node.block_value->tail;
+          continue;
+        }
         InterpreterResult result = interpret(node.block_value->head, env);
         if (result.type != IR_VALUE) {
           if (result.type != IR_RETURN) {
@@ -854,13 +942,8 @@ InterpreterResult interpret(Node node, Env *env) {
     }
     case N_SUPPRESS:
       switch (node.suppress_value->type) {
-        case N_NAME: {
-          Value value;
-          if (env_get(node.suppress_value->name_value, &value, env)) {
-            return RESULT_VALUE(value);
-          }
-          return RESULT_VALUE(nil_value);
-        }
+        case N_NAME:
+          return RESULT_VALUE(eval_name(*node.suppress_value, 1, env));
         case N_SUBSCRIPT:
           return eval_subscript(*node.suppress_value, env, 1);
         case N_DOT:
@@ -879,27 +962,38 @@ InterpreterResult interpret(Node node, Env *env) {
       return (InterpreterResult) { IR_RETURN, nil_value };
     }
     case N_BREAK:
-      if (!env->loops) {
-        eval_error(node, "unexpected break outside of loop");
+    case N_CONTINUE: {
+      int64_t level = get_loop_level(node, env);
+      if (!level) {
         return RESULT_VALUE(nil_value);
       }
-      if (node.break_value < 1 || node.break_value > env->loops) {
-        eval_error(node, "invalid numeric argument for break, expected an integer between 1 and %" PRId64,
-            env->loops);
-        node.break_value = node.break_value < 1 ? 1 : env->loops;
-      }
-      return (InterpreterResult) { IR_BREAK, nil_value, node.break_value };
-    case N_CONTINUE:
-      if (!env->loops) {
-        eval_error(node, "unexpected continue outside of loop");
-        return RESULT_VALUE(nil_value);
-      }
-      if (node.continue_value < 1 || node.continue_value > env->loops) {
-        eval_error(node, "invalid numeric argument for continue, expected an integer between 1 and %" PRId64,
-            env->loops);
-        node.continue_value = node.continue_value < 1 ? 1 : env->loops;
-      }
-      return (InterpreterResult) { IR_CONTINUE, nil_value, node.continue_value };
+      return (InterpreterResult) { node.type == N_BREAK ? IR_BREAK : IR_CONTINUE, nil_value, level };
+    }
   }
   return RESULT_VALUE(nil_value);
 }
+
+InterpreterResult eval_module(Module *module, Env *env) {
+  if (!use_bytecode) {
+    return interpret(*module->user_value.root, env);
+  }
+  if (!module->user_value.code) {
+    module->user_value.code = compile(module->user_value.root);
+  }
+  return execute(module->user_value.code, env);
+}
+
+InterpreterResult eval_module_to_buffer(Module *module, Env *env, Buffer *buffer) {
+  if (!use_bytecode) {
+    InterpreterResult result = interpret(*module->user_value.root, env);
+    if (result.type != IR_RETURN) {
+      value_to_string(result.value, buffer);
+      result.value = nil_value;
+    }
+    return result;
+  }
+  if (!module->user_value.code) {
+    module->user_value.code = compile(module->user_value.root);
+  }
+  return execute_to_buffer(module->user_value.code, env, buffer);
+}
@@ -22,7 +22,22 @@ typedef struct InterpreterResult {
   int64_t level;
 } InterpreterResult;
 
+void set_bytecode_enabled(int enabled);
+void eval_error(Node node, const char *format, ...);
 int apply(Value func, const Tuple *args, Value *return_value, Env *env);
+Value call_value(Node node, Value callee, Tuple *args, int sequence_call, Env *env);
+Value eval_name(Node node, int suppress_name_error, Env *env);
+Value subscript_value(Node node, Value object, Value index, int suppress_name_error);
+Value get_property(Node node, Value object, int suppress_name_error);
+Value eval_prefix_operator(Node node, Value operand);
+Value eval_infix_operator(Node node, Value left, Value right, Env *env);
+Value eval_assign_operator(Node node, Value existing, Value value, Env *env);
+void assign_name(Node node, Value value, Env *env);
+void assign_subscript(Node node, Value object, Value index, Value value, Env *env);
+void assign_property(Node node, Value object, Value value, Env *env);
+int64_t get_loop_level(Node node, Env *env);
 InterpreterResult interpret(Node node, Env *env);
+InterpreterResult eval_module(Module *module, Env *env);
+InterpreterResult eval_module_to_buffer(Module *module, Env *env, Buffer *buffer);
 
 #endif
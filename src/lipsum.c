@@ -138,3 +138,195 @@ int lipsum(GlobalArgs args) {
   }
   return 0;
 }
+
+#ifdef WITH_MARKDOWN
+#define LIPSUM_CONTENT_SUFFIX ".md"
+#else
+#define LIPSUM_CONTENT_SUFFIX ".html"
+#endif
+
+// A 1x1 transparent PNG
+static const uint8_t lipsum_png[] = {
+  0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52, 0x00, 0x00, 0x00,
+  0x01, 0x00, 0x00, 0x00, 0x01, 0x08, 0x06, 0x00, 0x00, 0x00, 0x1f, 0x15, 0xc4, 0x89, 0x00, 0x00, 0x00, 0x0a, 0x49,
+  0x44, 0x41, 0x54, 0x78, 0x9c, 0x63, 0x00, 0x01, 0x00, 0x00, 0x05, 0x00, 0x01, 0x0d, 0x0a, 0x2d, 0xb4, 0x00, 0x00,
+  0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae, 0x42, 0x60, 0x82
+};
+
+static FILE *open_site_file(const Path *dir, const char *name) {
+  Path *file = path_append(dir, name);
+  Path *parent = path_get_parent(file);
+  FILE *out = NULL;
+  if (mkdir_rec(parent->path)) {
+    out = fopen(file->path, "wb");
+  }
+  if (!out) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", file->path, strerror(errno));
+  }
+  delete_path(parent);
+  delete_path(file);
+  return out;
+}
+
+static int close_site_file(FILE *out) {
+  int status = !ferror(out);
+  return fclose(out) == 0 && status;
+}
+
+static int write_site_index(const Path *dir, LipsumSite site) {
+  FILE *out = open_site_file(dir, "index.plet");
+  if (!out) {
+    return 0;
+  }
+  fprintf(out, "posts = list_content('content/posts', {suffix: '%s'}) | sort_by_desc(.published)\n",
+      LIPSUM_CONTENT_SUFFIX);
+  fprintf(out, "add_static('images')\n");
+  fprintf(out, "for post in posts\n");
+  fprintf(out, "  add_page(\"posts/{post.name}/index.html\", 'templates/post.plet.html', {post: post})\n");
+  fprintf(out, "end for\n");
+  fprintf(out, "paginate(posts, 10, 'blog%%page%%/index.html', 'templates/list.plet.html', {title: 'Blog'})\n");
+  fprintf(out, "tags = [");
+  for (int i = 0; i < site.tags; i++) {
+    fprintf(out, "%s'tag%d'", i ? ", " : "", i);
+  }
+  fprintf(out, "]\n");
+  fprintf(out, "for tag in tags\n");
+  fprintf(out, "  tagged = posts | filter(p => p.tags | contains(tag))\n");
+  fprintf(out, "  paginate(tagged, 10, \"tags/{tag}%%page%%/index.html\", 'templates/list.plet.html', "
+      "{title: tag})\n");
+  fprintf(out, "end for\n");
+  return close_site_file(out);
+}
+
+static int write_site_templates(const Path *dir, LipsumSite site) {
+  FILE *out;
+  char name[64];
+  for (int i = 0; i < site.layout_depth; i++) {
+    snprintf(name, sizeof(name), "templates/layout%d.plet.html", i);
+    if (!(out = open_site_file(dir, name))) {
+      return 0;
+    }
+    if (i) {
+      fprintf(out, "{LAYOUT = 'layout%d.plet.html'}\n", i - 1);
+      fprintf(out, "<div class=\"layout%d\">\n{CONTENT}\n</div>\n", i);
+    } else {
+      fprintf(out, "<!DOCTYPE html>\n<html>\n<head>\n<title>{title}</title>\n</head>\n<body>\n");
+      fprintf(out, "{CONTENT}\n</body>\n</html>\n");
+    }
+    if (!close_site_file(out)) {
+      return 0;
+    }
+  }
+  char layout[64] = "";
+  if (site.layout_depth > 0) {
+    snprintf(layout, sizeof(layout), "{LAYOUT = 'layout%d.plet.html'}", site.layout_depth - 1);
+  }
+  if (!(out = open_site_file(dir, "templates/post.plet.html"))) {
+    return 0;
+  }
+  fprintf(out, "%s{title = post.title}\n", layout);
+  fprintf(out, "<article>\n<h1>{post.title}</h1>\n<time>{post.published | date('%%Y-%%m-%%d')}</time>\n");
+  fprintf(out, "{post.html | no_title | links | html}\n");
+  fprintf(out, "{embed('tags.plet.html')}\n</article>\n");
+  if (!close_site_file(out)) {
+    return 0;
+  }
+  if (!(out = open_site_file(dir, "templates/tags.plet.html"))) {
+    return 0;
+  }
+  fprintf(out, "<ul>{for tag in post.tags}");
+  fprintf(out, "<li><a href=\"{\"tags/{tag}/index.html\" | link}\">{tag}</a></li>{end for}</ul>\n");
+  if (!close_site_file(out)) {
+    return 0;
+  }
+  if (!(out = open_site_file(dir, "templates/list.plet.html"))) {
+    return 0;
+  }
+  fprintf(out, "%s\n<h1>{title}</h1>\n", layout);
+  fprintf(out, "{for post in PAGE.items}\n");
+  fprintf(out, "<h2><a href=\"{\"posts/{post.name}/index.html\" | link}\">{post.title}</a></h2>\n");
+  fprintf(out, "{post.html | no_title | read_more | links | html}\n{end for}\n");
+  fprintf(out, "<nav>{for page in page_list(5)}<a href=\"{page | page_link}\">{page}</a>{end for}</nav>\n");
+  return close_site_file(out);
+}
+
+static int write_site_post(const Path *dir, int index, LipsumSite site) {
+  char name[64];
+  snprintf(name, sizeof(name), "content/posts/post%d" LIPSUM_CONTENT_SUFFIX, index);
+  FILE *out = open_site_file(dir, name);
+  if (!out) {
+    return 0;
+  }
+  char *title = lipsum_words(rand() % 6 + 1);
+  title[0] = toupper(title[0]);
+  fprintf(out, "{\n");
+  fprintf(out, "  title: '%s',\n", title);
+  fprintf(out, "  published: '%04d-%02d-%02dT%02d:00:00Z',\n", 2015 + rand() % 10, rand() % 12 + 1, rand() % 28 + 1,
+      rand() % 24);
+  fprintf(out, "  tags: [");
+  if (site.tags > 0) {
+    int tags = rand() % 3 + 1;
+    for (int i = 0; i < tags; i++) {
+      fprintf(out, "%s'tag%d'", i ? ", " : "", rand() % site.tags);
+    }
+  }
+  fprintf(out, "],\n");
+  fprintf(out, "}\n");
+#ifdef WITH_MARKDOWN
+  fprintf(out, "\n# %s\n", title);
+#else
+  fprintf(out, "<h1>%s</h1>\n", title);
+#endif
+  free(title);
+  int paragraphs = site.paragraphs > 0 ? rand() % site.paragraphs + 1 : 0;
+  for (int i = 0; i < paragraphs; i++) {
+    char *paragraph = lipsum_paragraph(rand() % 6 + 1);
+#ifdef WITH_MARKDOWN
+    fprintf(out, "\n%s\n", paragraph);
+#else
+    fprintf(out, "<p>%s</p>\n", paragraph);
+#endif
+    free(paragraph);
+    if (i == 0) {
+#ifdef WITH_MARKDOWN
+      fprintf(out, "\n<!--more-->\n");
+#else
+      fprintf(out, "<!--more-->\n");
+#endif
+    }
+    if (site.images > 0 && i == paragraphs / 2) {
+      int image = rand() % site.images;
+#ifdef WITH_MARKDOWN
+      fprintf(out, "\n![Image %d](../../images/image%d.png)\n", image, image);
+#else
+      fprintf(out, "<p><img src=\"../../images/image%d.png\" alt=\"Image %d\"></p>\n", image, image);
+#endif
+    }
+  }
+  return close_site_file(out);
+}
+
+int lipsum_site(const Path *dir, LipsumSite site) {
+  srand(site.seed);
+  if (!write_site_index(dir, site) || !write_site_templates(dir, site)) {
+    return 0;
+  }
+  for (int i = 0; i < site.pages; i++) {
+    if (!write_site_post(dir, i, site)) {
+      return 0;
+    }
+  }
+  for (int i = 0; i < site.images; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "images/image%d.png", i);
+    FILE *out = open_site_file(dir, name);
+    if (!out) {
+      return 0;
+    }
+    fwrite(lipsum_png, 1, sizeof(lipsum_png), out);
+    if (!close_site_file(out)) {
+      return 0;
+    }
+  }
+  return 1;
+}
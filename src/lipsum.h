@@ -9,6 +9,22 @@
 
 #include "build.h"
 
+typedef struct {
+  // Number of content files, each gets a page
+  int pages;
+  // Maximum number of paragraphs per content file
+  int paragraphs;
+  // Number of nested layouts around each page
+  int layout_depth;
+  // Number of images in the images directory, referenced from the content files
+  int images;
+  // Number of distinct tags, each gets a paginated list of the content files with that tag
+  int tags;
+  unsigned int seed;
+} LipsumSite;
+
 int lipsum(GlobalArgs args);
+// Generates a synthetic site in dir for benchmarking, the same seed always results in the same site
+int lipsum_site(const Path *dir, LipsumSite site);
 
 #endif
@@ -26,13 +26,21 @@
 #include <string.h>
 #include <unistd.h>
 
-const char *short_options = "hvtp:";
+const char *short_options = "hvtp:j:acC:m:M:s:P::";
 
 const struct option long_options[] = {
   {"help", no_argument, NULL, 'h'},
   {"version", no_argument, NULL, 'v'},
   {"template", no_argument, NULL, 't'},
   {"port", required_argument, NULL, 'p'},
+  {"jobs", required_argument, NULL, 'j'},
+  {"ast", no_argument, NULL, 'a'},
+  {"cache", no_argument, NULL, 'c'},
+  {"build-cache", required_argument, NULL, 'C'},
+  {"page-cache", required_argument, NULL, 'm'},
+  {"memory-limit", required_argument, NULL, 'M'},
+  {"shard", required_argument, NULL, 's'},
+  {"profile", optional_argument, NULL, 'P'},
   {0, 0, 0, 0}
 };
 
@@ -47,12 +55,21 @@ static void print_help(const char *program_name) {
   describe_option("v", "version", "Show version information.");
   describe_option("t", "template", "Parse file as a template.");
   describe_option("p", "port", "Port for built-in web server.");
+  describe_option("j", "jobs", "Number of pages to build in parallel.");
+  describe_option("a", "ast", "Use the AST interpreter instead of the bytecode VM.");
+  describe_option("c", "cache", "Cache parsed templates and data in .plet-cache.");
+  describe_option("C", "build-cache", "Share rendered pages and images through a directory or URL.");
+  describe_option("m", "page-cache", "Size of the server's rendered page cache in MiB.");
+  describe_option("M", "memory-limit", "Release converted content above this size in MiB while building.");
+  describe_option("s", "shard", "Only build the pages of shard <k>/<n>.");
+  describe_option("P[<file>]", "profile[=<file>]", "Print build timings, optionally write a trace to <file>.");
   puts("commands:");
   puts("  build             Build site from index.plet");
   puts("  watch             Build site from index.plet and watch for changes");
   puts("  serve             Serve site (for development/testing purposes)");
   puts("  eval <file>       Evaluate a single source file");
   puts("  init              Create a new site in the current directory");
+  puts("  merge [<file>...] Combine the build manifests of sharded builds");
   puts("  clean             Remove generated files");
   puts("  lipsum [<dir>]    Generate random markdown content");
 }
@@ -87,7 +104,7 @@ static int eval(GlobalArgs args) {
       import_contentmap(env);
       import_html(env);
       import_markdown(env);
-      Value output = interpret(*module->user_value.root, env).value;
+      Value output = eval_module(module, env).value;
       if (output.type == V_STRING) {
         for (size_t i = 0 ; i < output.string_value->size; i++) {
           putchar((char) output.string_value->bytes[i]);
@@ -137,6 +154,13 @@ static int clean(GlobalArgs args) {
     }
   }
   delete_path(dist);
+  Path *cache = path_append(root, ".plet-cache");
+  if (is_dir(cache->path)) {
+    if (!delete_dir(cache)) {
+      status = 1;
+    }
+  }
+  delete_path(cache);
   delete_path(root);
   return status;
 }
@@ -145,6 +169,15 @@ int main(int argc, char *argv[]) {
   GlobalArgs args;
   args.parse_as_template = 0;
   args.port = "6500";
+  args.jobs = 1;
+  args.parse_cache = 0;
+  args.build_cache = NULL;
+  args.page_cache_size = 64 << 20;
+  args.memory_limit = 0;
+  args.shard = 0;
+  args.shards = 1;
+  args.profile = 0;
+  args.trace_path = NULL;
   int opt;
   int option_index;
   while ((opt = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1) {
@@ -161,6 +194,57 @@ int main(int argc, char *argv[]) {
       case 'p':
         args.port = optarg;
         break;
+      case 'j':
+        args.jobs = atoi(optarg);
+        if (args.jobs < 1) {
+          fprintf(stderr, ERROR_LABEL "invalid number of jobs: %s" SGR_RESET "\n", optarg);
+          return 1;
+        }
+        break;
+      case 'a':
+        set_bytecode_enabled(0);
+        break;
+      case 'c':
+        args.parse_cache = 1;
+        break;
+      case 'C':
+        args.build_cache = optarg;
+        break;
+      case 'm': {
+        char *end;
+        long size = strtol(optarg, &end, 10);
+        if (*end || size < 0) {
+          fprintf(stderr, ERROR_LABEL "invalid page cache size: %s" SGR_RESET "\n", optarg);
+          return 1;
+        }
+        args.page_cache_size = (size_t) size << 20;
+        break;
+      }
+      case 'M': {
+        char *end;
+        long size = strtol(optarg, &end, 10);
+        if (*end || size < 1) {
+          fprintf(stderr, ERROR_LABEL "invalid memory limit: %s" SGR_RESET "\n", optarg);
+          return 1;
+        }
+        args.memory_limit = (size_t) size << 20;
+        break;
+      }
+      case 's': {
+        int k, n;
+        char end;
+        if (sscanf(optarg, "%d/%d%c", &k, &n, &end) != 2 || n < 1 || k < 1 || k > n) {
+          fprintf(stderr, ERROR_LABEL "invalid shard: %s" SGR_RESET "\n", optarg);
+          return 1;
+        }
+        args.shard = k - 1;
+        args.shards = n;
+        break;
+      }
+      case 'P':
+        args.profile = 1;
+        args.trace_path = optarg;
+        break;
     }
   }
   if (optind >= argc) {
@@ -182,6 +266,8 @@ int main(int argc, char *argv[]) {
     return eval(args);
   } else if (strcmp(command, "init") == 0) {
     return init(args);
+  } else if (strcmp(command, "merge") == 0) {
+    return merge(args);
   } else if (strcmp(command, "clean") == 0) {
     return clean(args);
   } else if (strcmp(command, "lipsum") == 0) {
@@ -0,0 +1,295 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#define _GNU_SOURCE
+#include "manifest.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MANIFEST_VERSION "plet-cache 1"
+
+static Hash path_hash(const Path *path) {
+  return hash_bytes(path->path, path->size, INIT_HASH);
+}
+
+static Hash dependency_hash(const void *p) {
+  return path_hash(((Dependency *) p)->path);
+}
+
+static int dependency_equals(const void *a, const void *b) {
+  return strcmp(((Dependency *) a)->path->path, ((Dependency *) b)->path->path) == 0;
+}
+
+static Hash page_hash(const void *p) {
+  return path_hash((*(ManifestPage **) p)->dest);
+}
+
+static int page_equals(const void *a, const void *b) {
+  return strcmp((*(ManifestPage **) a)->dest->path, (*(ManifestPage **) b)->dest->path) == 0;
+}
+
+static void delete_dependencies(GenericHashMap *map) {
+  Dependency dependency;
+  HashMapIterator it = generic_hash_map_iterate(map);
+  while (generic_hash_map_next(&it, &dependency)) {
+    delete_path(dependency.path);
+  }
+  delete_generic_hash_map(map);
+}
+
+static void add_dependency_entry(GenericHashMap *map, const Path *path, time_t mtime) {
+  if (generic_hash_map_get(map, &(Dependency) { .path = (Path *) path }, NULL)) {
+    return;
+  }
+  generic_hash_map_add(map, &(Dependency) { .path = copy_path(path), .mtime = mtime });
+}
+
+ManifestPage *create_manifest_page(const Path *dest, Hash input_hash) {
+  ManifestPage *page = allocate(sizeof(ManifestPage));
+  page->dest = copy_path(dest);
+  page->input_hash = input_hash;
+  init_generic_hash_map(&page->dependencies, sizeof(Dependency), 0, dependency_hash, dependency_equals, NULL);
+  return page;
+}
+
+void delete_manifest_page(ManifestPage *page) {
+  delete_dependencies(&page->dependencies);
+  delete_path(page->dest);
+  free(page);
+}
+
+void manifest_page_add_dependency(ManifestPage *page, const Path *path) {
+  add_dependency_entry(&page->dependencies, path, get_mtime(path->path));
+}
+
+static char *read_line(FILE *file, char **line, size_t *n) {
+  ssize_t length = getline(line, n, file);
+  if (length <= 0) {
+    return NULL;
+  }
+  if ((*line)[length - 1] == '\n') {
+    (*line)[length - 1] = '\0';
+  }
+  return *line;
+}
+
+static ManifestPage *read_manifest_page_lines(FILE *file, char **line, size_t *n) {
+  if (!read_line(file, line, n) || strncmp(*line, "page ", 5) != 0) {
+    return NULL;
+  }
+  char *end;
+  Hash input_hash = (Hash) strtoull(*line + 5, &end, 16);
+  if (*end != ' ') {
+    return NULL;
+  }
+  Path *dest = create_path(end + 1, -1);
+  ManifestPage *page = create_manifest_page(dest, input_hash);
+  delete_path(dest);
+  while (read_line(file, line, n)) {
+    if (strcmp(*line, "end") == 0) {
+      return page;
+    }
+    if (strncmp(*line, "dep ", 4) != 0) {
+      break;
+    }
+    time_t mtime = (time_t) strtoll(*line + 4, &end, 10);
+    if (*end != ' ') {
+      break;
+    }
+    Path *path = create_path(end + 1, -1);
+    add_dependency_entry(&page->dependencies, path, mtime);
+    delete_path(path);
+  }
+  delete_manifest_page(page);
+  return NULL;
+}
+
+ManifestPage *read_manifest_page(FILE *file) {
+  char *line = NULL;
+  size_t n = 0;
+  ManifestPage *page = read_manifest_page_lines(file, &line, &n);
+  free(line);
+  return page;
+}
+
+int write_manifest_page(ManifestPage *page, FILE *file) {
+  fprintf(file, "page %016" PRIx64 " %s\n", (uint64_t) page->input_hash, page->dest->path);
+  Dependency dependency;
+  HashMapIterator it = generic_hash_map_iterate(&page->dependencies);
+  while (generic_hash_map_next(&it, &dependency)) {
+    fprintf(file, "dep %" PRId64 " %s\n", (int64_t) dependency.mtime, dependency.path->path);
+  }
+  return fprintf(file, "end\n") > 0;
+}
+
+Manifest *create_manifest(Hash globals_hash) {
+  Manifest *manifest = allocate(sizeof(Manifest));
+  manifest->globals_hash = globals_hash;
+  init_generic_hash_map(&manifest->pages, sizeof(ManifestPage *), 0, page_hash, page_equals, NULL);
+  init_generic_hash_map(&manifest->mtimes, sizeof(Dependency), 0, dependency_hash, dependency_equals, NULL);
+  return manifest;
+}
+
+void delete_manifest(Manifest *manifest) {
+  ManifestPage *page;
+  HashMapIterator it = generic_hash_map_iterate(&manifest->pages);
+  while (generic_hash_map_next(&it, &page)) {
+    delete_manifest_page(page);
+  }
+  delete_generic_hash_map(&manifest->pages);
+  delete_dependencies(&manifest->mtimes);
+  free(manifest);
+}
+
+static Manifest *read_manifest_file(FILE *file, const Hash *globals_hash) {
+  Manifest *manifest = NULL;
+  char *line = NULL;
+  size_t n = 0;
+  if (read_line(file, &line, &n) && strcmp(line, MANIFEST_VERSION) == 0
+      && read_line(file, &line, &n) && strncmp(line, "globals ", 8) == 0) {
+    Hash file_globals_hash = (Hash) strtoull(line + 8, NULL, 16);
+    if (!globals_hash || file_globals_hash == *globals_hash) {
+      manifest = create_manifest(file_globals_hash);
+      ManifestPage *page;
+      while ((page = read_manifest_page_lines(file, &line, &n))) {
+        manifest_put_page(manifest, page);
+      }
+    }
+  }
+  free(line);
+  return manifest;
+}
+
+Manifest *read_manifest(const Path *path, Hash globals_hash) {
+  FILE *file = fopen(path->path, "r");
+  if (!file) {
+    return create_manifest(globals_hash);
+  }
+  Manifest *manifest = read_manifest_file(file, &globals_hash);
+  fclose(file);
+  return manifest ? manifest : create_manifest(globals_hash);
+}
+
+Manifest *read_any_manifest(const Path *path) {
+  FILE *file = fopen(path->path, "r");
+  if (!file) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, strerror(errno));
+    return NULL;
+  }
+  Manifest *manifest = read_manifest_file(file, NULL);
+  fclose(file);
+  if (!manifest) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "not a build manifest" SGR_RESET "\n", path->path);
+  }
+  return manifest;
+}
+
+int merge_manifest(Manifest *manifest, Manifest *other) {
+  int status = 1;
+  ManifestPage *page;
+  HashMapIterator it = generic_hash_map_iterate(&other->pages);
+  while (generic_hash_map_next(&it, &page)) {
+    if (manifest_get_page(manifest, page->dest)) {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "output written by more than one shard" SGR_RESET "\n",
+          page->dest->path);
+      delete_manifest_page(page);
+      status = 0;
+    } else {
+      manifest_put_page(manifest, page);
+    }
+  }
+  delete_generic_hash_map(&other->pages);
+  init_generic_hash_map(&other->pages, sizeof(ManifestPage *), 0, page_hash, page_equals, NULL);
+  return status;
+}
+
+int write_manifest(Manifest *manifest, const Path *path) {
+  Path *temp_path = create_path(path->path, -1);
+  temp_path = reallocate(temp_path, sizeof(Path) + temp_path->size + sizeof(".tmp"));
+  memcpy(temp_path->path + temp_path->size, ".tmp", sizeof(".tmp"));
+  temp_path->size += sizeof(".tmp") - 1;
+  int status = 0;
+  FILE *file = fopen(temp_path->path, "w");
+  if (!file) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", temp_path->path, strerror(errno));
+  } else {
+    status = fprintf(file, MANIFEST_VERSION "\nglobals %016" PRIx64 "\n", (uint64_t) manifest->globals_hash) > 0;
+    ManifestPage *page;
+    HashMapIterator it = generic_hash_map_iterate(&manifest->pages);
+    while (status && generic_hash_map_next(&it, &page)) {
+      status = write_manifest_page(page, file);
+    }
+    if (fclose(file) != 0) {
+      status = 0;
+    }
+    if (!status) {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "write error: %s" SGR_RESET "\n", temp_path->path,
+          strerror(errno));
+      remove(temp_path->path);
+    } else if (rename(temp_path->path, path->path) != 0) {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, strerror(errno));
+      remove(temp_path->path);
+      status = 0;
+    }
+  }
+  delete_path(temp_path);
+  return status;
+}
+
+ManifestPage *manifest_get_page(Manifest *manifest, const Path *dest) {
+  ManifestPage *page;
+  if (generic_hash_map_get(&manifest->pages, &(ManifestPage *) { &(ManifestPage) { .dest = (Path *) dest } },
+        &page)) {
+    return page;
+  }
+  return NULL;
+}
+
+void manifest_put_page(Manifest *manifest, ManifestPage *page) {
+  ManifestPage *existing;
+  int exists;
+  generic_hash_map_set(&manifest->pages, &page, &exists, &existing);
+  if (exists) {
+    delete_manifest_page(existing);
+  }
+}
+
+ManifestPage *manifest_take_page(Manifest *manifest, const Path *dest) {
+  ManifestPage *existing;
+  if (generic_hash_map_remove(&manifest->pages, &(ManifestPage *) { &(ManifestPage) { .dest = (Path *) dest } },
+        &existing)) {
+    return existing;
+  }
+  return NULL;
+}
+
+static time_t get_cached_mtime(Manifest *manifest, const Path *path) {
+  Dependency cached;
+  if (generic_hash_map_get(&manifest->mtimes, &(Dependency) { .path = (Path *) path }, &cached)) {
+    return cached.mtime;
+  }
+  time_t mtime = get_mtime(path->path);
+  generic_hash_map_add(&manifest->mtimes, &(Dependency) { .path = copy_path(path), .mtime = mtime });
+  return mtime;
+}
+
+int manifest_page_is_current(Manifest *manifest, const Path *dest, Hash input_hash) {
+  ManifestPage *page = manifest_get_page(manifest, dest);
+  if (!page || page->input_hash != input_hash || !file_exists(dest->path)) {
+    return 0;
+  }
+  Dependency dependency;
+  HashMapIterator it = generic_hash_map_iterate(&page->dependencies);
+  while (generic_hash_map_next(&it, &dependency)) {
+    if (!dependency.mtime || get_cached_mtime(manifest, dependency.path) != dependency.mtime) {
+      return 0;
+    }
+  }
+  return 1;
+}
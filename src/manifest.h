@@ -0,0 +1,52 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include "hashmap.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <time.h>
+
+typedef struct {
+  Path *path;
+  time_t mtime;
+} Dependency;
+
+typedef struct {
+  Path *dest;
+  Hash input_hash;
+  GenericHashMap dependencies;
+} ManifestPage;
+
+typedef struct {
+  Hash globals_hash;
+  GenericHashMap pages;
+  GenericHashMap mtimes;
+} Manifest;
+
+ManifestPage *create_manifest_page(const Path *dest, Hash input_hash);
+void delete_manifest_page(ManifestPage *page);
+void manifest_page_add_dependency(ManifestPage *page, const Path *path);
+ManifestPage *read_manifest_page(FILE *file);
+int write_manifest_page(ManifestPage *page, FILE *file);
+
+Manifest *create_manifest(Hash globals_hash);
+void delete_manifest(Manifest *manifest);
+Manifest *read_manifest(const Path *path, Hash globals_hash);
+// Reads a manifest regardless of its globals hash, returns NULL on error
+Manifest *read_any_manifest(const Path *path);
+// Moves the pages of other into manifest, returns 0 if any of them were already in manifest
+int merge_manifest(Manifest *manifest, Manifest *other);
+int write_manifest(Manifest *manifest, const Path *path);
+ManifestPage *manifest_get_page(Manifest *manifest, const Path *dest);
+void manifest_put_page(Manifest *manifest, ManifestPage *page);
+ManifestPage *manifest_take_page(Manifest *manifest, const Path *dest);
+int manifest_page_is_current(Manifest *manifest, const Path *dest, Hash input_hash);
+
+#endif
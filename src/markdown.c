@@ -8,6 +8,10 @@
 
 #include "strings.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #ifdef WITH_MARKDOWN
 #ifdef WITH_STATIC_MD4C
 #include "../libs/md4c/src/md4c-html.h"
@@ -20,14 +24,562 @@ static void process_output(const MD_CHAR *output, MD_SIZE size, void *context) {
   string_buffer_append_bytes(buffer, (const uint8_t *) output, size);
 }
 
-static Value convert_markdown(String *input, Env *env) {
+Value markdown_to_html(String *input, Env *env) {
   StringBuffer buffer = create_string_buffer(0, env->arena);
   if (md_html((const char *) input->bytes, input->size, process_output, &buffer, MD_DIALECT_GITHUB, 0) != 0) {
     env_error(env, -1, "unknown markdown parser error");
   }
   return finalize_string_buffer(buffer);
 }
-#endif
+
+// The node tree built from the parser callbacks is the same as the one html_parse() would produce from the output of
+// md_html(), including whitespace between block elements and the line numbers of elements in that output.
+
+typedef enum {
+  MT_A, MT_BLOCKQUOTE, MT_BR, MT_CODE, MT_DEL, MT_EM, MT_H1, MT_H2, MT_H3, MT_H4, MT_H5, MT_H6, MT_HR, MT_IMG,
+  MT_INPUT, MT_LI, MT_OL, MT_P, MT_PRE, MT_STRONG, MT_TABLE, MT_TBODY, MT_TD, MT_TH, MT_THEAD, MT_TR, MT_UL,
+  MT_LAST = MT_UL
+} MarkdownTag;
+
+static const char *markdown_tag_names[] = {
+  "a", "blockquote", "br", "code", "del", "em", "h1", "h2", "h3", "h4", "h5", "h6", "hr", "img",
+  "input", "li", "ol", "p", "pre", "strong", "table", "tbody", "td", "th", "thead", "tr", "ul"
+};
+
+typedef struct {
+  Env *env;
+  // Tag names are interned once per document instead of once per node
+  Symbol tags[MT_LAST + 1];
+  Value *stack;
+  size_t depth;
+  size_t capacity;
+  // Adjacent text is merged into a single string like the HTML parser does
+  Buffer text;
+  int64_t line;
+  // Inside an image label the text goes into the alt attribute
+  int image_nesting;
+  Value image;
+  Buffer alt;
+  Buffer attribute;
+  Buffer raw_html;
+  int in_html_block;
+} MarkdownBuilder;
+
+static Value create_markdown_node(Symbol type, Symbol tag, int64_t line, int self_closing, Env *env) {
+  Value node = create_object(6, env->arena);
+  object_def_known(node.object_value, type, create_symbol(type), env);
+  object_def_known(node.object_value, tag, tag ? create_symbol(tag) : nil_value, env);
+  object_def_known(node.object_value, attributes, create_object(1, env->arena), env);
+  object_def_known(node.object_value, children, create_array(0, env->arena), env);
+  object_def_known(node.object_value, self_closing, self_closing ? true_value : false_value, env);
+  object_def_known(node.object_value, line, create_int(line), env);
+  return node;
+}
+
+static Array *get_markdown_children(Value node) {
+  Value children;
+  object_get_known(node.object_value, children, &children);
+  return children.array_value;
+}
+
+static void set_markdown_attribute(Value node, const char *name, const uint8_t *value, size_t size, Env *env) {
+  Value attributes;
+  object_get_known(node.object_value, attributes, &attributes);
+  object_put(attributes.object_value, create_symbol(get_symbol(name, env->symbol_map)),
+      create_string(value, size, env->arena), env->arena);
+}
+
+static void flush_markdown_text(MarkdownBuilder *builder) {
+  if (builder->text.size) {
+    array_push(get_markdown_children(builder->stack[builder->depth - 1]),
+        create_string(builder->text.data, builder->text.size, builder->env->arena), builder->env->arena);
+    builder->text.size = 0;
+  }
+}
+
+static void append_markdown_child(MarkdownBuilder *builder, Value child) {
+  flush_markdown_text(builder);
+  array_push(get_markdown_children(builder->stack[builder->depth - 1]), child, builder->env->arena);
+}
+
+static Value add_markdown_element(MarkdownBuilder *builder, MarkdownTag tag, int self_closing) {
+  if (!builder->tags[tag]) {
+    builder->tags[tag] = get_symbol(markdown_tag_names[tag], builder->env->symbol_map);
+  }
+  Value node = create_markdown_node(known_symbols.element, builder->tags[tag], builder->line, self_closing,
+      builder->env);
+  append_markdown_child(builder, node);
+  return node;
+}
+
+static Value open_markdown_element(MarkdownBuilder *builder, MarkdownTag tag) {
+  Value node = add_markdown_element(builder, tag, 0);
+  if (builder->depth >= builder->capacity) {
+    builder->capacity <<= 1;
+    builder->stack = reallocate(builder->stack, builder->capacity * sizeof(Value));
+  }
+  builder->stack[builder->depth++] = node;
+  return node;
+}
+
+static void close_markdown_element(MarkdownBuilder *builder) {
+  flush_markdown_text(builder);
+  if (builder->depth > 1) {
+    builder->depth--;
+  }
+}
+
+// Newlines written by md_html() around tags
+static void put_markdown_newline(MarkdownBuilder *builder) {
+  buffer_put(&builder->text, '\n');
+  builder->line++;
+}
+
+static void put_utf8(Buffer *buffer, uint32_t code_point) {
+  if (code_point == 0 || code_point > 0x10FFFF) {
+    code_point = 0xFFFD;
+  }
+  if (code_point < 0x80) {
+    buffer_put(buffer, code_point);
+  } else if (code_point < 0x800) {
+    buffer_put(buffer, 0xC0 | (code_point >> 6));
+    buffer_put(buffer, 0x80 | (code_point & 0x3F));
+  } else if (code_point < 0x10000) {
+    buffer_put(buffer, 0xE0 | (code_point >> 12));
+    buffer_put(buffer, 0x80 | ((code_point >> 6) & 0x3F));
+    buffer_put(buffer, 0x80 | (code_point & 0x3F));
+  } else {
+    buffer_put(buffer, 0xF0 | (code_point >> 18));
+    buffer_put(buffer, 0x80 | ((code_point >> 12) & 0x3F));
+    buffer_put(buffer, 0x80 | ((code_point >> 6) & 0x3F));
+    buffer_put(buffer, 0x80 | (code_point & 0x3F));
+  }
+}
+
+static const struct {
+  const char *name;
+  uint32_t code_point;
+} markdown_entities[] = {
+  {"amp", '&'}, {"lt", '<'}, {"gt", '>'}, {"quot", '"'}, {"apos", '\''}, {"nbsp", 0xA0}, {"copy", 0xA9},
+  {"reg", 0xAE}, {"trade", 0x2122}, {"hellip", 0x2026}, {"mdash", 0x2014}, {"ndash", 0x2013}, {"lsquo", 0x2018},
+  {"rsquo", 0x2019}, {"ldquo", 0x201C}, {"rdquo", 0x201D}, {"laquo", 0xAB}, {"raquo", 0xBB}, {"times", 0xD7},
+  {"divide", 0xF7}, {"deg", 0xB0}, {"middot", 0xB7}, {"bull", 0x2022}, {"euro", 0x20AC}, {"shy", 0xAD},
+  {"larr", 0x2190}, {"rarr", 0x2192}, {"uarr", 0x2191}, {"darr", 0x2193},
+};
+
+// Decodes an entity reported by the parser, returns 0 for named entities that aren't in the table above, in which
+// case the document is left to the HTML parser
+static int put_markdown_entity(Buffer *buffer, const MD_CHAR *text, MD_SIZE size) {
+  if (size < 3 || text[0] != '&' || text[size - 1] != ';') {
+    return 0;
+  }
+  if (text[1] == '#') {
+    uint32_t code_point = 0;
+    if (text[2] == 'x' || text[2] == 'X') {
+      for (MD_SIZE i = 3; i < size - 1; i++) {
+        int digit = text[i] >= 'a' ? text[i] - 'a' + 10 : text[i] >= 'A' ? text[i] - 'A' + 10 : text[i] - '0';
+        code_point = code_point < 0x110000 ? code_point * 16 + digit : code_point;
+      }
+    } else {
+      for (MD_SIZE i = 2; i < size - 1; i++) {
+        code_point = code_point < 0x110000 ? code_point * 10 + text[i] - '0' : code_point;
+      }
+    }
+    put_utf8(buffer, code_point);
+    return 1;
+  }
+  for (size_t i = 0; i < sizeof(markdown_entities) / sizeof(markdown_entities[0]); i++) {
+    if (strlen(markdown_entities[i].name) == size - 2 && memcmp(markdown_entities[i].name, text + 1, size - 2) == 0) {
+      put_utf8(buffer, markdown_entities[i].code_point);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int put_markdown_text(Buffer *buffer, MD_TEXTTYPE type, const MD_CHAR *text, MD_SIZE size) {
+  switch (type) {
+    case MD_TEXT_NULLCHAR:
+      put_utf8(buffer, 0);
+      return 1;
+    case MD_TEXT_ENTITY:
+      return put_markdown_entity(buffer, text, size);
+    default:
+      buffer_append_bytes(buffer, (const uint8_t *) text, size);
+      return 1;
+  }
+}
+
+static int is_url_safe(uint8_t c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+    || (c && strchr("~-_.+!*(),%#@?=;:/,+$&", c));
+}
+
+// Attribute values are decoded like md_html() writes them, URLs are also percent-encoded the same way
+static int set_markdown_attribute_value(MarkdownBuilder *builder, Value node, const char *name,
+    const MD_ATTRIBUTE *attribute, int url) {
+  Buffer *value = &builder->attribute;
+  value->size = 0;
+  for (size_t i = 0; attribute->substr_offsets[i] < attribute->size; i++) {
+    MD_OFFSET start = attribute->substr_offsets[i];
+    if (!put_markdown_text(value, attribute->substr_types[i], attribute->text + start,
+          attribute->substr_offsets[i + 1] - start)) {
+      return 0;
+    }
+  }
+  if (url) {
+    size_t size = value->size;
+    for (size_t i = 0; i < size; i++) {
+      if (!is_url_safe(value->data[i])) {
+        buffer_printf(value, "%%%02X", value->data[i]);
+      } else {
+        buffer_put(value, value->data[i]);
+      }
+    }
+    set_markdown_attribute(node, name, value->data + size, value->size - size, builder->env);
+  } else {
+    set_markdown_attribute(node, name, value->data, value->size, builder->env);
+  }
+  value->size = 0;
+  return 1;
+}
+
+static int is_markdown_space(uint8_t c) {
+  return c == ' ' || c == '\t' || c == '\n';
+}
+
+// Raw HTML is only accepted if it consists of comments and whitespace, e.g. <!--more--> and <!--include:file.md-->
+static int add_markdown_raw_html(MarkdownBuilder *builder, const uint8_t *html, size_t size) {
+  size_t i = 0;
+  while (i < size) {
+    if (is_markdown_space(html[i])) {
+      if (html[i] == '\n') {
+        put_markdown_newline(builder);
+      } else {
+        buffer_put(&builder->text, html[i]);
+      }
+      i++;
+      continue;
+    }
+    if (size - i < 7 || memcmp(html + i, "<!--", 4) != 0 || html[i + 4] == '>'
+        || (html[i + 4] == '-' && html[i + 5] == '>')) {
+      return 0;
+    }
+    size_t start = i + 4;
+    size_t end = start;
+    while (end + 2 < size && memcmp(html + end, "-->", 3) != 0) {
+      if (end + 3 < size && memcmp(html + end, "--!>", 4) == 0) {
+        return 0;
+      }
+      end++;
+    }
+    if (end + 2 >= size) {
+      return 0;
+    }
+    Value comment = create_object(3, builder->env->arena);
+    object_def_known(comment.object_value, type, create_symbol(known_symbols.comment), builder->env);
+    object_def_known(comment.object_value, comment, create_string(html + start, end - start, builder->env->arena),
+        builder->env);
+    object_def_known(comment.object_value, line, create_int(builder->line), builder->env);
+    append_markdown_child(builder, comment);
+    for (size_t j = start; j < end; j++) {
+      if (html[j] == '\n') {
+        builder->line++;
+      }
+    }
+    i = end + 3;
+  }
+  return 1;
+}
+
+static int enter_markdown_block(MD_BLOCKTYPE type, void *detail, void *context) {
+  MarkdownBuilder *builder = context;
+  Value node;
+  switch (type) {
+    case MD_BLOCK_DOC:
+      break;
+    case MD_BLOCK_QUOTE:
+      open_markdown_element(builder, MT_BLOCKQUOTE);
+      put_markdown_newline(builder);
+      break;
+    case MD_BLOCK_UL:
+      open_markdown_element(builder, MT_UL);
+      put_markdown_newline(builder);
+      break;
+    case MD_BLOCK_OL: {
+      MD_BLOCK_OL_DETAIL *ol = detail;
+      node = open_markdown_element(builder, MT_OL);
+      if (ol->start != 1) {
+        char start[16];
+        snprintf(start, sizeof(start), "%u", ol->start);
+        set_markdown_attribute(node, "start", (uint8_t *) start, strlen(start), builder->env);
+      }
+      put_markdown_newline(builder);
+      break;
+    }
+    case MD_BLOCK_LI: {
+      MD_BLOCK_LI_DETAIL *li = detail;
+      node = open_markdown_element(builder, MT_LI);
+      if (li->is_task) {
+        set_markdown_attribute(node, "class", (uint8_t *) "task-list-item", 14, builder->env);
+        Value input = add_markdown_element(builder, MT_INPUT, 1);
+        set_markdown_attribute(input, "type", (uint8_t *) "checkbox", 8, builder->env);
+        set_markdown_attribute(input, "class", (uint8_t *) "task-list-item-checkbox", 23, builder->env);
+        set_markdown_attribute(input, "disabled", NULL, 0, builder->env);
+        if (li->task_mark == 'x' || li->task_mark == 'X') {
+          set_markdown_attribute(input, "checked", NULL, 0, builder->env);
+        }
+      }
+      break;
+    }
+    case MD_BLOCK_HR:
+      add_markdown_element(builder, MT_HR, 1);
+      put_markdown_newline(builder);
+      break;
+    case MD_BLOCK_H: {
+      unsigned level = ((MD_BLOCK_H_DETAIL *) detail)->level;
+      open_markdown_element(builder, MT_H1 + (level >= 1 && level <= 6 ? level - 1 : 0));
+      break;
+    }
+    case MD_BLOCK_CODE: {
+      MD_BLOCK_CODE_DETAIL *code = detail;
+      open_markdown_element(builder, MT_PRE);
+      node = open_markdown_element(builder, MT_CODE);
+      if (code->lang.text) {
+        Buffer *value = &builder->attribute;
+        value->size = 0;
+        buffer_append_bytes(value, (const uint8_t *) "language-", 9);
+        for (size_t i = 0; code->lang.substr_offsets[i] < code->lang.size; i++) {
+          MD_OFFSET start = code->lang.substr_offsets[i];
+          if (!put_markdown_text(value, code->lang.substr_types[i], code->lang.text + start,
+                code->lang.substr_offsets[i + 1] - start)) {
+            return 1;
+          }
+        }
+        set_markdown_attribute(node, "class", value->data, value->size, builder->env);
+        value->size = 0;
+      }
+      break;
+    }
+    case MD_BLOCK_HTML:
+      builder->in_html_block = 1;
+      builder->raw_html.size = 0;
+      break;
+    case MD_BLOCK_P:
+      open_markdown_element(builder, MT_P);
+      break;
+    case MD_BLOCK_TABLE:
+      open_markdown_element(builder, MT_TABLE);
+      put_markdown_newline(builder);
+      break;
+    case MD_BLOCK_THEAD:
+      open_markdown_element(builder, MT_THEAD);
+      put_markdown_newline(builder);
+      break;
+    case MD_BLOCK_TBODY:
+      open_markdown_element(builder, MT_TBODY);
+      put_markdown_newline(builder);
+      break;
+    case MD_BLOCK_TR:
+      open_markdown_element(builder, MT_TR);
+      put_markdown_newline(builder);
+      break;
+    case MD_BLOCK_TH:
+    case MD_BLOCK_TD: {
+      MD_BLOCK_TD_DETAIL *td = detail;
+      node = open_markdown_element(builder, type == MD_BLOCK_TH ? MT_TH : MT_TD);
+      const char *align = td->align == MD_ALIGN_LEFT ? "left" : td->align == MD_ALIGN_CENTER ? "center"
+        : td->align == MD_ALIGN_RIGHT ? "right" : NULL;
+      if (align) {
+        set_markdown_attribute(node, "align", (uint8_t *) align, strlen(align), builder->env);
+      }
+      break;
+    }
+    default:
+      return 1;
+  }
+  return 0;
+}
+
+static int leave_markdown_block(MD_BLOCKTYPE type, void *detail, void *context) {
+  MarkdownBuilder *builder = context;
+  switch (type) {
+    case MD_BLOCK_DOC:
+    case MD_BLOCK_HR:
+      break;
+    case MD_BLOCK_HTML:
+      builder->in_html_block = 0;
+      if (!add_markdown_raw_html(builder, builder->raw_html.data, builder->raw_html.size)) {
+        return 1;
+      }
+      break;
+    case MD_BLOCK_CODE:
+      close_markdown_element(builder);
+      close_markdown_element(builder);
+      put_markdown_newline(builder);
+      break;
+    default:
+      close_markdown_element(builder);
+      put_markdown_newline(builder);
+      break;
+  }
+  return 0;
+}
+
+static int enter_markdown_span(MD_SPANTYPE type, void *detail, void *context) {
+  MarkdownBuilder *builder = context;
+  if (builder->image_nesting) {
+    // Like md_html(), only the text of spans inside an image label is kept
+    if (type == MD_SPAN_IMG) {
+      builder->image_nesting++;
+    }
+    return 0;
+  }
+  switch (type) {
+    case MD_SPAN_EM:
+      open_markdown_element(builder, MT_EM);
+      break;
+    case MD_SPAN_STRONG:
+      open_markdown_element(builder, MT_STRONG);
+      break;
+    case MD_SPAN_A: {
+      MD_SPAN_A_DETAIL *a = detail;
+      Value node = open_markdown_element(builder, MT_A);
+      if (!set_markdown_attribute_value(builder, node, "href", &a->href, 1)
+          || (a->title.text && !set_markdown_attribute_value(builder, node, "title", &a->title, 0))) {
+        return 1;
+      }
+      break;
+    }
+    case MD_SPAN_IMG: {
+      MD_SPAN_IMG_DETAIL *img = detail;
+      builder->image = add_markdown_element(builder, MT_IMG, 1);
+      if (!set_markdown_attribute_value(builder, builder->image, "src", &img->src, 1)) {
+        return 1;
+      }
+      builder->image_nesting = 1;
+      break;
+    }
+    case MD_SPAN_CODE:
+      open_markdown_element(builder, MT_CODE);
+      break;
+    case MD_SPAN_DEL:
+      open_markdown_element(builder, MT_DEL);
+      break;
+    default:
+      return 1;
+  }
+  return 0;
+}
+
+static int leave_markdown_span(MD_SPANTYPE type, void *detail, void *context) {
+  MarkdownBuilder *builder = context;
+  if (builder->image_nesting) {
+    if (type == MD_SPAN_IMG && --builder->image_nesting == 0) {
+      MD_SPAN_IMG_DETAIL *img = detail;
+      set_markdown_attribute(builder->image, "alt", builder->alt.data, builder->alt.size, builder->env);
+      builder->alt.size = 0;
+      if (img->title.text && !set_markdown_attribute_value(builder, builder->image, "title", &img->title, 0)) {
+        return 1;
+      }
+    }
+    return 0;
+  }
+  close_markdown_element(builder);
+  return 0;
+}
+
+static int markdown_text(MD_TEXTTYPE type, const MD_CHAR *text, MD_SIZE size, void *context) {
+  MarkdownBuilder *builder = context;
+  if (builder->in_html_block) {
+    buffer_append_bytes(&builder->raw_html, (const uint8_t *) text, size);
+    return 0;
+  }
+  if (builder->image_nesting) {
+    switch (type) {
+      case MD_TEXT_HTML:
+        return 1;
+      case MD_TEXT_BR:
+      case MD_TEXT_SOFTBR:
+        buffer_put(&builder->alt, ' ');
+        return 0;
+      default:
+        return !put_markdown_text(&builder->alt, type, text, size);
+    }
+  }
+  switch (type) {
+    case MD_TEXT_BR:
+      add_markdown_element(builder, MT_BR, 1);
+      put_markdown_newline(builder);
+      return 0;
+    case MD_TEXT_SOFTBR:
+      put_markdown_newline(builder);
+      return 0;
+    case MD_TEXT_HTML:
+      return !add_markdown_raw_html(builder, (const uint8_t *) text, size);
+    default:
+      for (MD_SIZE i = 0; i < size; i++) {
+        if (text[i] == '\n') {
+          builder->line++;
+        }
+      }
+      return !put_markdown_text(&builder->text, type, text, size);
+  }
+}
+
+Value markdown_to_node(String *input, Env *env) {
+  MarkdownBuilder builder;
+  memset(builder.tags, 0, sizeof(builder.tags));
+  builder.env = env;
+  builder.capacity = 16;
+  builder.stack = allocate(builder.capacity * sizeof(Value));
+  builder.depth = 1;
+  builder.text = create_buffer(0);
+  builder.line = 1;
+  builder.image_nesting = 0;
+  builder.image = nil_value;
+  builder.alt = create_buffer(0);
+  builder.attribute = create_buffer(0);
+  builder.raw_html = create_buffer(0);
+  builder.in_html_block = 0;
+  // Same shape as the fragment returned by html_parse()
+  Value root = create_markdown_node(known_symbols.fragment, 0, 0, 1, env);
+  builder.stack[0] = root;
+  MD_PARSER parser = {
+    .abi_version = 0,
+    .flags = MD_DIALECT_GITHUB,
+    .enter_block = enter_markdown_block,
+    .leave_block = leave_markdown_block,
+    .enter_span = enter_markdown_span,
+    .leave_span = leave_markdown_span,
+    .text = markdown_text,
+  };
+  if (md_parse((const char *) input->bytes, input->size, &parser, &builder) == 0) {
+    builder.depth = 1;
+    flush_markdown_text(&builder);
+  } else {
+    root = nil_value;
+  }
+  free(builder.stack);
+  delete_buffer(builder.text);
+  delete_buffer(builder.alt);
+  delete_buffer(builder.attribute);
+  delete_buffer(builder.raw_html);
+  return root;
+}
+
+#else /* ifdef WITH_MARKDOWN */
+
+Value markdown_to_html(String *input, Env *env) {
+  env_error(env, -1, "Plet was not compiled with markdown support");
+  return (Value) { .type = V_STRING, .string_value = input };
+}
+
+Value markdown_to_node(String *input, Env *env) {
+  return nil_value;
+}
+
+#endif /* ifdef WITH_MARKDOWN */
 
 static Value markdown(const Tuple *args, Env *env) {
   check_args(1, args, env);
@@ -36,21 +588,20 @@ static Value markdown(const Tuple *args, Env *env) {
     arg_type_error(0, V_STRING, args, env);
     return nil_value;
   }
-#ifdef WITH_MARKDOWN
-  return convert_markdown(input.string_value, env);
-#else
-  env_error(env, -1, "Plet was not compiled with markdown support");
-  return input;
-#endif
+  return markdown_to_html(input.string_value, env);
+}
+
+int is_markdown_handler(Value handler) {
+  return handler.type == V_FUNCTION && handler.function_value == markdown;
 }
 
 void import_markdown(Env *env) {
   env_def_fn("markdown", markdown, env);
 #ifdef WITH_MARKDOWN
   Value content_handlers;
-  if (!env_get(get_symbol("CONTENT_HANDLERS", env->symbol_map), &content_handlers, env)) {
+  if (!env_get_known(CONTENT_HANDLERS, &content_handlers, env)) {
     content_handlers = create_object(0, env->arena);
-    env_def("CONTENT_HANDLERS", content_handlers, env);
+    env_def_known(CONTENT_HANDLERS, content_handlers, env);
   }
   if (content_handlers.type == V_OBJECT) {
     object_put(content_handlers.object_value, copy_c_string("md", env->arena),
@@ -11,4 +11,10 @@
 
 void import_markdown(Env *env);
 
+int is_markdown_handler(Value handler);
+Value markdown_to_html(String *input, Env *env);
+// Builds the HTML node tree directly from the markdown parser's callbacks instead of parsing the output of
+// markdown_to_html(). Returns nil if the document contains raw HTML other than comments.
+Value markdown_to_node(String *input, Env *env);
+
 #endif
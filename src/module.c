@@ -6,17 +6,21 @@
 
 #include "module.h"
 
+#include "bytecode.h"
 #include "collections.h"
 #include "contentmap.h"
 #include "core.h"
+#include "dataparser.h"
 #include "datetime.h"
 #include "exec.h"
 #include "hashmap.h"
 #include "html.h"
 #include "images.h"
 #include "interpreter.h"
+#include "parsecache.h"
 #include "parser.h"
 #include "reader.h"
+#include "search.h"
 #include "sitemap.h"
 #include "strings.h"
 #include "util.h"
@@ -25,8 +29,18 @@
 #include <stdlib.h>
 #include <string.h>
 
+typedef struct BuiltinsEnv BuiltinsEnv;
+struct BuiltinsEnv {
+  void (*import_func)(Env *);
+  Env *env;
+  BuiltinsEnv *next;
+};
+
 struct ModuleMap {
   GenericHashMap map;
+  ManifestPage *dependencies;
+  Arena *builtins_arena;
+  BuiltinsEnv *builtins;
 };
 
 typedef struct {
@@ -35,13 +49,8 @@ typedef struct {
 } ModuleEntry;
 
 static Hash module_hash(const void *p) {
-  const char *name = ((ModuleEntry *) p)->key->path;
-  Hash h = INIT_HASH;
-  while (*name) {
-    h = HASH_ADD_BYTE(*name, h);
-    name++;
-  }
-  return h;
+  const Path *name = ((ModuleEntry *) p)->key;
+  return hash_bytes(name->path, name->size, INIT_HASH);
 }
 
 static int module_equals(const void *a, const void *b) {
@@ -51,6 +60,9 @@ static int module_equals(const void *a, const void *b) {
 ModuleMap *create_module_map(void) {
   ModuleMap *module_map = allocate(sizeof(ModuleMap));
   init_generic_hash_map(&module_map->map, sizeof(ModuleEntry), 0, module_hash, module_equals, NULL);
+  module_map->dependencies = NULL;
+  module_map->builtins_arena = NULL;
+  module_map->builtins = NULL;
   return module_map;
 }
 
@@ -61,6 +73,9 @@ void delete_module_map(ModuleMap *module_map) {
     delete_module(entry.value);
   }
   delete_generic_hash_map(&module_map->map);
+  if (module_map->builtins_arena) {
+    delete_arena(module_map->builtins_arena);
+  }
   free(module_map);
 }
 
@@ -89,6 +104,7 @@ void add_system_module(const char *name, void (*import_func)(Env *), ModuleMap *
   module->file_name = create_path(name, -1);
   module->mtime = 0;
   module->dirty = 0;
+  module->arena = NULL;
   module->system_value.import_func = import_func;
   add_module(module, module_map);
 }
@@ -103,6 +119,50 @@ void add_system_modules(ModuleMap *module_map) {
   add_system_module("html", import_html, module_map);
   add_system_module("sitemap", import_sitemap, module_map);
   add_system_module("contentmap", import_contentmap, module_map);
+  add_system_module("search", import_search, module_map);
+}
+
+// Builtins environments are created once per module map and used as the read-only parent of other environments
+Env *get_builtins_env(void (*import_func)(Env *), ModuleMap *module_map, SymbolMap *symbol_map) {
+  for (BuiltinsEnv *builtins = module_map->builtins; builtins; builtins = builtins->next) {
+    if (builtins->import_func == import_func) {
+      return builtins->env;
+    }
+  }
+  if (!module_map->builtins_arena) {
+    module_map->builtins_arena = create_arena();
+  }
+  BuiltinsEnv *builtins = arena_allocate(sizeof(BuiltinsEnv), module_map->builtins_arena);
+  builtins->import_func = import_func;
+  builtins->env = create_env(module_map->builtins_arena, module_map, symbol_map);
+  builtins->next = module_map->builtins;
+  module_map->builtins = builtins;
+  import_func(builtins->env);
+  return builtins->env;
+}
+
+ManifestPage *track_dependencies(ManifestPage *page, ModuleMap *module_map) {
+  ManifestPage *previous = module_map->dependencies;
+  module_map->dependencies = page;
+  return previous;
+}
+
+void add_dependency(const Path *path, Env *env) {
+  if (env->modules->dependencies) {
+    manifest_page_add_dependency(env->modules->dependencies, path);
+  }
+}
+
+ModuleIterator iterate_modules(ModuleMap *module_map) {
+  return (ModuleIterator) { .it = generic_hash_map_iterate(&module_map->map) };
+}
+
+Module *module_iterator_next(ModuleIterator *iterator) {
+  ModuleEntry entry;
+  if (generic_hash_map_next(&iterator->it, &entry)) {
+    return entry.value;
+  }
+  return NULL;
 }
 
 Module *create_module(const Path *file_name, ModuleType type) {
@@ -111,17 +171,23 @@ Module *create_module(const Path *file_name, ModuleType type) {
   module->file_name = copy_path(file_name);
   module->mtime = get_mtime(file_name->path);
   module->dirty = 0;
+  module->arena = NULL;
   switch (type) {
     case M_SYSTEM:
       module->system_value.import_func = NULL;
       break;
     case M_USER:
+      module->arena = create_arena();
       module->user_value.root = NULL;
+      module->user_value.code = NULL;
       module->user_value.parse_error = 0;
       break;
     case M_DATA:
+      module->arena = create_arena();
       module->data_value.root = NULL;
       module->data_value.parse_error = 0;
+      module->data_value.value = NULL;
+      module->data_value.epoch = 0;
       break;
     case M_ASSET:
       module->asset_value.width = -1;
@@ -134,15 +200,18 @@ Module *create_module(const Path *file_name, ModuleType type) {
 void delete_module(Module *module) {
   switch (module->type) {
     case M_USER:
-      DELETE_NODE(module->user_value.root);
+      if (module->user_value.code) {
+        delete_bytecode(module->user_value.code);
+      }
       break;
     case M_DATA:
-      DELETE_NODE(module->data_value.root);
-      break;
     case M_SYSTEM:
     case M_ASSET:
       break;
   }
+  if (module->arena) {
+    delete_arena(module->arena);
+  }
   free(module->file_name);
   free(module);
 }
@@ -160,6 +229,7 @@ Path *get_src_path(const Path *path, Env *env) {
 }
 
 Module *load_user_module(const Path *name, Env *env) {
+  add_dependency(name, env);
   Module *m = get_module(name, env->modules);
   if (m && !m->dirty) {
     if (m->type != M_USER) {
@@ -167,30 +237,45 @@ Module *load_user_module(const Path *name, Env *env) {
     }
     return m;
   }
-  FILE *file = fopen(name->path, "r");
-  if (!file) {
+  m = read_parse_cache(name, PC_SCRIPT, env->symbol_map);
+  if (m) {
+    add_module(m, env->modules);
+    return m;
+  }
+  Reader *reader = open_file_reader(name, env->symbol_map);
+  if (!reader) {
     fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", name->path, strerror(errno));
     return NULL;
   }
-  Reader *reader = open_reader(file, name, env->symbol_map);
   if (reader_errors(reader)) {
     close_reader(reader);
-    fclose(file);
     return NULL;
   }
   TokenStream tokens = read_all(reader, 0);
   m = parse(tokens, name);
   close_reader(reader);
-  fclose(file);
   if (m->user_value.parse_error) {
     delete_module(m);
     return NULL;
   }
+  write_parse_cache(m, PC_SCRIPT);
   add_module(m, env->modules);
   return m;
 }
 
+static int read_data_file(const Path *name, SymbolMap *symbol_map, Arena *arena, Value *value) {
+  size_t size;
+  uint8_t *data = map_file(name->path, &size);
+  if (!data) {
+    return 0;
+  }
+  int result = parse_data(data, size, strcmp(path_get_extension(name), "json") == 0, symbol_map, arena, value);
+  unmap_file(data, size);
+  return result;
+}
+
 Module *load_data_module(const Path *name, Env *env) {
+  add_dependency(name, env);
   Module *m = get_module(name, env->modules);
   if (m && !m->dirty) {
     if (m->type != M_DATA) {
@@ -198,30 +283,45 @@ Module *load_data_module(const Path *name, Env *env) {
     }
     return m;
   }
-  FILE *file = fopen(name->path, "r");
-  if (!file) {
+  m = create_module(name, M_DATA);
+  Value value;
+  if (read_data_file(name, env->symbol_map, m->arena, &value)) {
+    m->data_value.value = arena_allocate(sizeof(Value), m->arena);
+    *m->data_value.value = value;
+    freeze_value(value);
+    m->data_value.epoch = get_freeze_epoch();
+    add_module(m, env->modules);
+    return m;
+  }
+  delete_module(m);
+  m = read_parse_cache(name, PC_DATA, env->symbol_map);
+  if (m) {
+    add_module(m, env->modules);
+    return m;
+  }
+  Reader *reader = open_file_reader(name, env->symbol_map);
+  if (!reader) {
     fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", name->path, strerror(errno));
     return NULL;
   }
-  Reader *reader = open_reader(file, name, env->symbol_map);
   if (reader_errors(reader)) {
     close_reader(reader);
-    fclose(file);
     return NULL;
   }
   TokenStream tokens = read_all(reader, 0);
   m = parse_object_notation(tokens, name, 1);
   close_reader(reader);
-  fclose(file);
   if (m->user_value.parse_error) {
     delete_module(m);
     return NULL;
   }
+  write_parse_cache(m, PC_DATA);
   add_module(m, env->modules);
   return m;
 }
 
 Module *load_asset_module(const Path *name, Env *env) {
+  add_dependency(name, env);
   Module *m = get_module(name, env->modules);
   if (m && !m->dirty) {
     return m;
@@ -232,6 +332,7 @@ Module *load_asset_module(const Path *name, Env *env) {
 }
 
 Value read_asset_module(const Path *name, Env *env) {
+  add_dependency(name, env);
   Module *m = get_module(name, env->modules);
   if (m && !m->dirty) {
     if (m->type != M_ASSET) {
@@ -289,17 +390,21 @@ Module *load_module(const Path *name, Env *env) {
   return m;
 }
 
-Env *create_user_env(Module *module, ModuleMap *modules, SymbolMap *symbol_map) {
-  Arena *arena = create_arena();
-  Env *env = create_env(arena, modules, symbol_map);
+static void import_user_builtins(Env *env) {
   import_core(env);
   import_strings(env);
   import_collections(env);
   import_datetime(env);
   import_exec(env);
-  env_def("FILE", path_to_string(module->file_name, env->arena), env);
+}
+
+Env *create_user_env(Module *module, ModuleMap *modules, SymbolMap *symbol_map) {
+  Arena *arena = create_arena();
+  Env *env = create_env(arena, modules, symbol_map);
+  env->parent_env = get_builtins_env(import_user_builtins, modules, symbol_map);
+  env_def_known(FILE, path_to_string(module->file_name, env->arena), env);
   Path *dir = path_get_parent(module->file_name);
-  env_def("DIR", path_to_string(dir, env->arena), env);
+  env_def_known(DIR, path_to_string(dir, env->arena), env);
   delete_path(dir);
   return env;
 }
@@ -312,7 +417,7 @@ Value import_module(Module *module, Env *env) {
     case M_USER: {
       Env *user_env = create_user_env(module, env->modules, env->symbol_map);
       Value result_value = nil_value;
-      InterpreterResult result = interpret(*module->user_value.root, user_env);
+      InterpreterResult result = eval_module(module, user_env);
       Env *export_env = create_env(env->arena, env->modules, env->symbol_map);
       if (result.type == IR_RETURN) {
         result_value = copy_value(result.value, export_env);
@@ -330,13 +435,56 @@ Value import_module(Module *module, Env *env) {
       return result_value;
     }
     case M_DATA:
-      return interpret(*module->data_value.root, env).value;
+      if (!module->data_value.value) {
+        return interpret(*module->data_value.root, env).value;
+      }
+      if (module->data_value.epoch == get_freeze_epoch()) {
+        // Only environments with a thaw log (templates) are short-lived enough to share the value, the module may be
+        // replaced while e.g. the index environment is still in use
+        if (thaw_log_is_open()) {
+          return *module->data_value.value;
+        }
+        return copy_value(*module->data_value.value, env);
+      }
+      // The shared value may have been modified after it was unfrozen, so the file is read again
+      Value value;
+      if (read_data_file(module->file_name, env->symbol_map, env->arena, &value)) {
+        return value;
+      }
+      env_error(env, -1, "unable to read data: %s", module->file_name->path);
+      return nil_value;
     case M_ASSET:
       return path_to_string(module->file_name, env->arena);
   }
   return nil_value;
 }
 
+void reset_changes(ModuleMap *modules) {
+  Module **stale = NULL;
+  size_t stale_size = 0;
+  ModuleEntry entry;
+  HashMapIterator it = generic_hash_map_iterate(&modules->map);
+  while (generic_hash_map_next(&it, &entry)) {
+    if (!entry.value->dirty) {
+      continue;
+    }
+    if (entry.value->type == M_ASSET) {
+      entry.value->mtime = get_mtime(entry.value->file_name->path);
+      entry.value->dirty = 0;
+    } else {
+      stale = reallocate(stale, (stale_size + 1) * sizeof(Module *));
+      stale[stale_size++] = entry.value;
+    }
+  }
+  for (size_t i = 0; i < stale_size; i++) {
+    generic_hash_map_remove(&modules->map, &(ModuleEntry) { .key = stale[i]->file_name }, NULL);
+    delete_module(stale[i]);
+  }
+  if (stale) {
+    free(stale);
+  }
+}
+
 int detect_changes(ModuleMap *modules) {
   int changed = 0;
   ModuleEntry entry;
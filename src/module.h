@@ -7,8 +7,13 @@
 #ifndef MODULE_H
 #define MODULE_H
 
+#include "manifest.h"
 #include "value.h"
 
+typedef struct {
+  HashMapIterator it;
+} ModuleIterator;
+
 Module *create_module(const Path *file_name, ModuleType type);
 void delete_module(Module *module);
 
@@ -18,6 +23,11 @@ Module *get_module(const Path *file_name, ModuleMap *module_map);
 void add_module(Module *module, ModuleMap *module_map);
 void add_system_module(const char *name, void (*import_func)(Env *), ModuleMap *module_map);
 void add_system_modules(ModuleMap *module_map);
+Env *get_builtins_env(void (*import_func)(Env *), ModuleMap *module_map, SymbolMap *symbol_map);
+ManifestPage *track_dependencies(ManifestPage *page, ModuleMap *module_map);
+void add_dependency(const Path *path, Env *env);
+ModuleIterator iterate_modules(ModuleMap *module_map);
+Module *module_iterator_next(ModuleIterator *iterator);
 
 Path *get_src_path(const Path *path, Env *env);
 Module *load_asset_module(const Path *name, Env *env);
@@ -29,6 +39,7 @@ Module *load_module(const Path *name, Env *env);
 Env *create_user_env(Module *module, ModuleMap *modules, SymbolMap *symbol_map);
 Value import_module(Module *module, Env *env);
 
+void reset_changes(ModuleMap *modules);
 int detect_changes(ModuleMap *modules);
 
 #endif
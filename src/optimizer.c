@@ -0,0 +1,256 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#include "optimizer.h"
+
+#include "interpreter.h"
+
+#include <string.h>
+
+static void optimize_node(Node *node, Arena *arena);
+
+static int is_number(const Node *node) {
+  return node->type == N_INT || node->type == N_FLOAT;
+}
+
+static int is_literal(const Node *node) {
+  return node->type == N_STRING || is_number(node);
+}
+
+static Value literal_to_value(const Node *node) {
+  if (node->type == N_INT) {
+    return create_int(node->int_value);
+  }
+  return create_float(node->float_value);
+}
+
+static void append_literal(const Node *node, Buffer *buffer) {
+  if (node->type == N_STRING) {
+    buffer_append_bytes(buffer, node->string_value.bytes, node->string_value.size);
+  } else {
+    value_to_string(literal_to_value(node), buffer);
+  }
+}
+
+static void set_string(Node *node, const Buffer *buffer, Arena *arena) {
+  node->type = N_STRING;
+  node->string_value.bytes = arena_allocate(buffer->size, arena);
+  node->string_value.size = buffer->size;
+  if (buffer->size) {
+    memcpy(node->string_value.bytes, buffer->data, buffer->size);
+  }
+}
+
+static void set_number(Node *node, Value value) {
+  if (value.type == V_INT) {
+    node->type = N_INT;
+    node->int_value = value.int_value;
+  } else {
+    node->type = N_FLOAT;
+    node->float_value = value.float_value;
+  }
+}
+
+static void fold_prefix(Node *node) {
+  Node *operand = node->prefix_value.operand;
+  if (node->prefix_value.operator == P_NEG && is_number(operand)) {
+    set_number(node, eval_prefix_operator(*node, literal_to_value(operand)));
+  }
+}
+
+static void fold_infix(Node *node, Arena *arena) {
+  Node *left = node->infix_value.left;
+  Node *right = node->infix_value.right;
+  if (!is_literal(left) || !is_literal(right)) {
+    return;
+  }
+  if (node->infix_value.operator == I_ADD && (left->type == N_STRING || right->type == N_STRING)) {
+    Buffer buffer = create_buffer(0);
+    append_literal(left, &buffer);
+    append_literal(right, &buffer);
+    set_string(node, &buffer, arena);
+    delete_buffer(buffer);
+    return;
+  }
+  if (!is_number(left) || !is_number(right)) {
+    return;
+  }
+  switch (node->infix_value.operator) {
+    case I_MOD:
+      if (left->type != N_INT || right->type != N_INT) {
+        return;
+      }
+      // fall through
+    case I_DIV:
+      // Division by zero is left to be reported (or not) when evaluated
+      if (right->type == N_INT && (right->int_value == 0 || right->int_value == -1)) {
+        return;
+      }
+      // fall through
+    case I_ADD:
+    case I_SUB:
+    case I_MUL:
+      // Arithmetic on numbers never touches the environment
+      set_number(node, eval_infix_operator(*node, literal_to_value(left), literal_to_value(right), NULL));
+      break;
+    default:
+      break;
+  }
+}
+
+/* Merges runs of adjacent literals in a block into single strings. Unless the
+ * block is the root of the template, a block that is reduced to a single
+ * string (or nothing) is replaced by that string. */
+static void optimize_block(Node *node, int is_root, Arena *arena) {
+  Buffer buffer = create_buffer(0);
+  NodeList *run = NULL;
+  size_t run_length = 0;
+  NodeList *last = NULL;
+  size_t size = 0;
+  NodeList *next;
+  for (NodeList *item = node->block_value; item; item = next) {
+    next = item->tail;
+    optimize_node(&item->head, arena);
+    if (is_literal(&item->head)) {
+      if (run) {
+        append_literal(&item->head, &buffer);
+        run->head.end = item->head.end;
+        run_length++;
+        last->tail = next;
+        continue;
+      }
+      run = item;
+      run_length = 1;
+      buffer.size = 0;
+      append_literal(&item->head, &buffer);
+    } else if (run) {
+      if (run_length > 1 || run->head.type != N_STRING) {
+        set_string(&run->head, &buffer, arena);
+      }
+      run = NULL;
+    }
+    last = item;
+    size++;
+  }
+  if (run && (run_length > 1 || run->head.type != N_STRING)) {
+    set_string(&run->head, &buffer, arena);
+  }
+  if (node->block_value) {
+    node->block_value->size = size;
+  }
+  if (!is_root && !node->block_value) {
+    buffer.size = 0;
+    set_string(node, &buffer, arena);
+  } else if (!is_root && size == 1 && node->block_value->head.type == N_STRING) {
+    Pos start = node->start;
+    Pos end = node->end;
+    *node = node->block_value->head;
+    node->start = start;
+    node->end = end;
+  }
+  delete_buffer(buffer);
+}
+
+static void optimize_node(Node *node, Arena *arena) {
+  switch (node->type) {
+    case N_NAME:
+    case N_INT:
+    case N_FLOAT:
+    case N_STRING:
+    case N_TUPLE:
+    case N_BREAK:
+    case N_CONTINUE:
+      break;
+    case N_LIST:
+      for (NodeList *item = node->list_value; item; item = item->tail) {
+        optimize_node(&item->head, arena);
+      }
+      break;
+    case N_OBJECT:
+      for (PropertyList *property = node->object_value; property; property = property->tail) {
+        optimize_node(&property->key, arena);
+        optimize_node(&property->value, arena);
+      }
+      break;
+    case N_APPLY:
+      optimize_node(node->apply_value.callee, arena);
+      for (NodeList *arg = node->apply_value.args; arg; arg = arg->tail) {
+        optimize_node(&arg->head, arena);
+      }
+      break;
+    case N_SUBSCRIPT:
+      optimize_node(node->subscript_value.list, arena);
+      optimize_node(node->subscript_value.index, arena);
+      break;
+    case N_DOT:
+      optimize_node(node->dot_value.object, arena);
+      break;
+    case N_PREFIX:
+      optimize_node(node->prefix_value.operand, arena);
+      fold_prefix(node);
+      break;
+    case N_INFIX:
+      optimize_node(node->infix_value.left, arena);
+      optimize_node(node->infix_value.right, arena);
+      fold_infix(node, arena);
+      break;
+    case N_FN:
+      optimize_node(node->fn_value.body, arena);
+      break;
+    case N_IF:
+      optimize_node(node->if_value.cond, arena);
+      optimize_node(node->if_value.cons, arena);
+      if (node->if_value.alt) {
+        optimize_node(node->if_value.alt, arena);
+      }
+      break;
+    case N_FOR:
+      optimize_node(node->for_value.collection, arena);
+      optimize_node(node->for_value.body, arena);
+      if (node->for_value.alt) {
+        optimize_node(node->for_value.alt, arena);
+      }
+      break;
+    case N_SWITCH:
+      optimize_node(node->switch_value.expr, arena);
+      for (PropertyList *c = node->switch_value.cases; c; c = c->tail) {
+        optimize_node(&c->key, arena);
+        optimize_node(&c->value, arena);
+      }
+      if (node->switch_value.default_case) {
+        optimize_node(node->switch_value.default_case, arena);
+      }
+      break;
+    case N_EXPORT:
+      if (node->export_value.right) {
+        optimize_node(node->export_value.right, arena);
+      }
+      break;
+    case N_ASSIGN:
+      optimize_node(node->assign_value.left, arena);
+      optimize_node(node->assign_value.right, arena);
+      break;
+    case N_BLOCK:
+      optimize_block(node, 0, arena);
+      break;
+    case N_SUPPRESS:
+      optimize_node(node->suppress_value, arena);
+      break;
+    case N_RETURN:
+      if (node->return_value) {
+        optimize_node(node->return_value, arena);
+      }
+      break;
+  }
+}
+
+void optimize_template(Node *root, Arena *arena) {
+  if (root->type == N_BLOCK) {
+    optimize_block(root, 1, arena);
+  } else {
+    optimize_node(root, arena);
+  }
+}
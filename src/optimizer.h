@@ -0,0 +1,15 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "ast.h"
+
+// Folds constant expressions and merges adjacent literal text in a parsed template
+void optimize_template(Node *root, Arena *arena);
+
+#endif
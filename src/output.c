@@ -0,0 +1,432 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#define _GNU_SOURCE
+#include "output.h"
+
+#include "hashmap.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#if !defined(O_BINARY)
+#define O_BINARY 0
+#endif
+
+static GenericHashMap known_dirs;
+static int known_dirs_initialized = 0;
+
+static Path **failed_writes = NULL;
+static size_t failed_writes_size = 0;
+
+static Hash path_entry_hash(const void *p) {
+  const Path *path = *(const Path **) p;
+  return hash_bytes(path->path, path->size, INIT_HASH);
+}
+
+static int path_entry_equals(const void *a, const void *b) {
+  return strcmp((*(const Path **) a)->path, (*(const Path **) b)->path) == 0;
+}
+
+void forget_output_dirs(void) {
+  if (!known_dirs_initialized) {
+    return;
+  }
+  Path *dir;
+  HashMapIterator it = generic_hash_map_iterate(&known_dirs);
+  while (generic_hash_map_next(&it, &dir)) {
+    delete_path(dir);
+  }
+  generic_hash_map_clear(&known_dirs);
+}
+
+static int make_dir(const char *path) {
+#if defined(_WIN32)
+  return _mkdir(path);
+#else
+  return mkdir(path, 0777);
+#endif
+}
+
+// Most output directories are either known or only missing the last component, so the directory is created first
+// and its parents only when that fails
+int create_output_dir(const Path *dir) {
+  if (!known_dirs_initialized) {
+    init_generic_hash_map(&known_dirs, sizeof(Path *), 0, path_entry_hash, path_entry_equals, NULL);
+    known_dirs_initialized = 1;
+  }
+  if (generic_hash_map_get(&known_dirs, &dir, NULL)) {
+    return 1;
+  }
+  int status = make_dir(dir->path) == 0;
+  if (!status && errno == ENOENT) {
+    Path *parent = path_get_parent(dir);
+    if (parent->size < dir->size && create_output_dir(parent)) {
+      status = make_dir(dir->path) == 0;
+    }
+    delete_path(parent);
+  }
+  if (!status) {
+    struct stat stat_buffer;
+    status = stat(dir->path, &stat_buffer) == 0 && S_ISDIR(stat_buffer.st_mode);
+  }
+  if (!status) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "directory creation failed: %s" SGR_RESET "\n", dir->path,
+        strerror(errno));
+    return 0;
+  }
+  Path *copy = copy_path(dir);
+  generic_hash_map_add(&known_dirs, &copy);
+  return 1;
+}
+
+static void add_failed_write(const Path *path) {
+  failed_writes = reallocate(failed_writes, (failed_writes_size + 1) * sizeof(Path *));
+  failed_writes[failed_writes_size++] = copy_path(path);
+}
+
+static WriteResult write_now(const Path *path, Buffer data) {
+  WriteResult result = replace_file(path->path, data.data, data.size) ? WRITE_CHANGED : WRITE_ERROR;
+  delete_buffer(data);
+  if (result == WRITE_ERROR) {
+    add_failed_write(path);
+  }
+  return result;
+}
+
+#if defined(__linux__)
+
+#define OUTPUT_RING_ENTRIES 64
+// Each write uses two submission queue entries, one for writing and one for closing the file
+#define MAX_QUEUED_WRITES (OUTPUT_RING_ENTRIES / 2)
+
+typedef struct {
+  Path *path;
+  Buffer temp;
+  Buffer data;
+  int fd;
+  int pending;
+  int error;
+} QueuedWrite;
+
+typedef enum {
+  RING_UNINITIALIZED,
+  RING_READY,
+  RING_UNAVAILABLE
+} RingState;
+
+static struct {
+  RingState state;
+  pid_t pid;
+  int fd;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  QueuedWrite writes[MAX_QUEUED_WRITES];
+  size_t queued;
+} ring;
+
+static int io_uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void close_ring(void) {
+  if (ring.sqes) {
+    munmap(ring.sqes, ring.sqes_size);
+  }
+  if (ring.cq_ring && ring.cq_ring != ring.sq_ring) {
+    munmap(ring.cq_ring, ring.cq_ring_size);
+  }
+  if (ring.sq_ring) {
+    munmap(ring.sq_ring, ring.sq_ring_size);
+  }
+  if (ring.fd >= 0) {
+    close(ring.fd);
+  }
+  ring.sqes = NULL;
+  ring.cq_ring = NULL;
+  ring.sq_ring = NULL;
+  ring.fd = -1;
+}
+
+static int open_ring(void) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring.fd = syscall(__NR_io_uring_setup, OUTPUT_RING_ENTRIES, &params);
+  if (ring.fd < 0) {
+    return 0;
+  }
+  ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring.cq_ring_size > ring.sq_ring_size) {
+      ring.sq_ring_size = ring.cq_ring_size;
+    }
+    ring.cq_ring_size = ring.sq_ring_size;
+  }
+  ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+      IORING_OFF_SQ_RING);
+  if (ring.sq_ring == MAP_FAILED) {
+    ring.sq_ring = NULL;
+    close_ring();
+    return 0;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring.cq_ring = ring.sq_ring;
+  } else {
+    ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+        IORING_OFF_CQ_RING);
+    if (ring.cq_ring == MAP_FAILED) {
+      ring.cq_ring = NULL;
+      close_ring();
+      return 0;
+    }
+  }
+  ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+      IORING_OFF_SQES);
+  if (ring.sqes == MAP_FAILED) {
+    ring.sqes = NULL;
+    close_ring();
+    return 0;
+  }
+  uint8_t *sq = ring.sq_ring;
+  ring.sq_head = (unsigned *) (sq + params.sq_off.head);
+  ring.sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  ring.sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  ring.sq_array = (unsigned *) (sq + params.sq_off.array);
+  uint8_t *cq = ring.cq_ring;
+  ring.cq_head = (unsigned *) (cq + params.cq_off.head);
+  ring.cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  ring.cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  return 1;
+}
+
+static int ring_is_ready(void) {
+  if (ring.state == RING_READY && ring.pid != getpid()) {
+    // Inherited from the parent process, whose queued writes are not ours to finish
+    for (size_t i = 0; i < MAX_QUEUED_WRITES; i++) {
+      QueuedWrite *entry = &ring.writes[i];
+      if (entry->path) {
+        delete_path(entry->path);
+        delete_buffer(entry->temp);
+        delete_buffer(entry->data);
+        entry->path = NULL;
+      }
+    }
+    ring.queued = 0;
+    close_ring();
+    ring.state = RING_UNINITIALIZED;
+  }
+  if (ring.state == RING_UNINITIALIZED) {
+    ring.fd = -1;
+    ring.state = open_ring() ? RING_READY : RING_UNAVAILABLE;
+    ring.pid = getpid();
+  }
+  return ring.state == RING_READY;
+}
+
+static void complete_write(QueuedWrite *entry) {
+  if (!entry->error && rename((char *) entry->temp.data, entry->path->path) != 0) {
+    entry->error = errno;
+  }
+  if (entry->error) {
+    remove((char *) entry->temp.data);
+    if (entry->error == EINVAL || entry->error == EOPNOTSUPP) {
+      // The kernel doesn't support the operations, so the remaining writes are performed directly
+      ring.state = RING_UNAVAILABLE;
+    }
+    // Also reports the error if it happens again
+    write_now(entry->path, entry->data);
+  } else {
+    delete_buffer(entry->data);
+  }
+  delete_path(entry->path);
+  delete_buffer(entry->temp);
+  entry->path = NULL;
+  ring.queued--;
+}
+
+static void reap_completions(int wait) {
+  if (wait) {
+    while (io_uring_enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno == EINTR) {
+    }
+  }
+  unsigned head = *ring.cq_head;
+  unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+    QueuedWrite *entry = &ring.writes[cqe->user_data >> 1];
+    if (cqe->res < 0 && !entry->error) {
+      entry->error = -cqe->res;
+    } else if (!(cqe->user_data & 1) && (size_t) cqe->res != entry->data.size && !entry->error) {
+      entry->error = EIO;
+    }
+    head++;
+    if (--entry->pending == 0) {
+      complete_write(entry);
+    }
+  }
+  __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void wait_for_writes(void) {
+  while (ring.queued) {
+    reap_completions(1);
+  }
+}
+
+static struct io_uring_sqe *get_sqe(unsigned tail) {
+  unsigned index = tail & *ring.sq_mask;
+  struct io_uring_sqe *sqe = &ring.sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring.sq_array[index] = index;
+  return sqe;
+}
+
+// Returns 0 if the write couldn't be queued, in which case it must be performed directly
+static int queue_write(const Path *path, Buffer *data) {
+  if (data->size > INT32_MAX) {
+    return 0;
+  }
+  while (ring.queued >= MAX_QUEUED_WRITES) {
+    reap_completions(1);
+  }
+  size_t slot = 0;
+  while (ring.writes[slot].path) {
+    slot++;
+  }
+  QueuedWrite *entry = &ring.writes[slot];
+  entry->temp = create_buffer(0);
+  buffer_printf(&entry->temp, "%s.%ld.tmp", path->path, (long) getpid());
+  buffer_put(&entry->temp, '\0');
+  entry->fd = open((char *) entry->temp.data, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+  if (entry->fd < 0) {
+    delete_buffer(entry->temp);
+    return 0;
+  }
+  unsigned tail = *ring.sq_tail;
+  struct io_uring_sqe *sqe = get_sqe(tail);
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = entry->fd;
+  sqe->addr = (uintptr_t) data->data;
+  sqe->len = data->size;
+  sqe->off = 0;
+  // The file is closed even if the write fails
+  sqe->flags = IOSQE_IO_HARDLINK;
+  sqe->user_data = slot << 1;
+  sqe = get_sqe(tail + 1);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = entry->fd;
+  sqe->user_data = (slot << 1) | 1;
+  __atomic_store_n(ring.sq_tail, tail + 2, __ATOMIC_RELEASE);
+  int submitted;
+  while ((submitted = io_uring_enter(2, 0, 0)) < 0 && errno == EINTR) {
+  }
+  if (submitted != 2) {
+    if (submitted <= 0) {
+      // Nothing was submitted, so the entries can be taken back
+      __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+      close(entry->fd);
+      remove((char *) entry->temp.data);
+      delete_buffer(entry->temp);
+      wait_for_writes();
+      ring.state = RING_UNAVAILABLE;
+      return 0;
+    }
+    // The close can't be taken back once the write has been submitted
+    while ((submitted = io_uring_enter(1, 0, 0)) < 0 && errno == EINTR) {
+    }
+  }
+  entry->path = copy_path(path);
+  entry->data = *data;
+  entry->pending = 2;
+  entry->error = 0;
+  ring.queued++;
+  *data = (Buffer) { .data = NULL, .capacity = 0, .size = 0 };
+  // Completed writes are collected without waiting, which frees their buffers early
+  reap_completions(0);
+  return 1;
+}
+
+static void wait_for_path(const Path *path) {
+  for (size_t i = 0; i < MAX_QUEUED_WRITES; i++) {
+    if (ring.writes[i].path && strcmp(ring.writes[i].path->path, path->path) == 0) {
+      wait_for_writes();
+      return;
+    }
+  }
+}
+
+#endif
+
+WriteResult write_output(const Path *path, Buffer *data) {
+  Buffer owned = *data;
+  *data = (Buffer) { .data = NULL, .capacity = 0, .size = 0 };
+#if defined(__linux__)
+  int use_ring = ring_is_ready();
+  if (use_ring) {
+    wait_for_path(path);
+  }
+#endif
+  if (file_has_contents(path->path, owned.data, owned.size)) {
+    delete_buffer(owned);
+    return WRITE_UNCHANGED;
+  }
+#if defined(__linux__)
+  if (use_ring && ring.state == RING_READY && queue_write(path, &owned)) {
+    return WRITE_CHANGED;
+  }
+#endif
+  return write_now(path, owned);
+}
+
+void finish_output_writes(void (*error_handler)(const Path *path, void *context), void *context) {
+#if defined(__linux__)
+  if (ring.state == RING_READY && ring.pid == getpid()) {
+    wait_for_writes();
+  }
+#endif
+  if (!error_handler) {
+    return;
+  }
+  for (size_t i = 0; i < failed_writes_size; i++) {
+    error_handler(failed_writes[i], context);
+    delete_path(failed_writes[i]);
+  }
+  if (failed_writes) {
+    free(failed_writes);
+    failed_writes = NULL;
+  }
+  failed_writes_size = 0;
+}
@@ -0,0 +1,26 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include "util.h"
+
+// Like mkdir_rec(), but remembers the directories that exist so that pages written to the same directory don't
+// check it again
+int create_output_dir(const Path *dir);
+// Output directories may be deleted between builds
+void forget_output_dirs(void);
+
+// Like write_file_if_changed(), but takes ownership of the data. On Linux the write is queued in an io_uring, so
+// that it is performed while the next page is compiled, in which case WRITE_CHANGED is returned before the file has
+// been written. Call finish_output_writes() before reading the file.
+WriteResult write_output(const Path *path, Buffer *data);
+
+// Waits for all queued writes. The error handler is called with the path of every write that failed.
+void finish_output_writes(void (*error_handler)(const Path *path, void *context), void *context);
+
+#endif
@@ -0,0 +1,152 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#include "pagecache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct CachedPage CachedPage;
+
+struct CachedPage {
+  ManifestPage *page;
+  uint8_t *output;
+  size_t size;
+  CachedPage *prev;
+  CachedPage *next;
+};
+
+struct PageCache {
+  GenericHashMap map;
+  CachedPage *first;
+  CachedPage *last;
+  size_t size;
+  size_t max_size;
+};
+
+static Hash cached_page_hash(const void *p) {
+  const Path *dest = (*(CachedPage **) p)->page->dest;
+  return hash_bytes(dest->path, dest->size, INIT_HASH);
+}
+
+static int cached_page_equals(const void *a, const void *b) {
+  return strcmp((*(CachedPage **) a)->page->dest->path, (*(CachedPage **) b)->page->dest->path) == 0;
+}
+
+static size_t get_entry_size(CachedPage *entry) {
+  return sizeof(CachedPage) + sizeof(ManifestPage) + entry->page->dest->size + entry->size;
+}
+
+PageCache *create_page_cache(size_t max_size) {
+  PageCache *cache = allocate(sizeof(PageCache));
+  init_generic_hash_map(&cache->map, sizeof(CachedPage *), 0, cached_page_hash, cached_page_equals, NULL);
+  cache->first = NULL;
+  cache->last = NULL;
+  cache->size = 0;
+  cache->max_size = max_size;
+  return cache;
+}
+
+static void unlink_entry(PageCache *cache, CachedPage *entry) {
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    cache->first = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    cache->last = entry->prev;
+  }
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+static void link_first(PageCache *cache, CachedPage *entry) {
+  entry->prev = NULL;
+  entry->next = cache->first;
+  if (cache->first) {
+    cache->first->prev = entry;
+  } else {
+    cache->last = entry;
+  }
+  cache->first = entry;
+}
+
+static void delete_entry(PageCache *cache, CachedPage *entry) {
+  unlink_entry(cache, entry);
+  generic_hash_map_remove(&cache->map, &entry, NULL);
+  cache->size -= get_entry_size(entry);
+  delete_manifest_page(entry->page);
+  free(entry->output);
+  free(entry);
+}
+
+void delete_page_cache(PageCache *cache) {
+  while (cache->first) {
+    delete_entry(cache, cache->first);
+  }
+  delete_generic_hash_map(&cache->map);
+  free(cache);
+}
+
+static CachedPage *find_entry(PageCache *cache, const Path *dest) {
+  ManifestPage query = { .dest = (Path *) dest };
+  CachedPage query_entry = { .page = &query };
+  CachedPage *entry;
+  if (generic_hash_map_get(&cache->map, &(CachedPage *) { &query_entry }, &entry)) {
+    return entry;
+  }
+  return NULL;
+}
+
+int page_cache_get(PageCache *cache, const Path *dest, const uint8_t **output, size_t *size) {
+  CachedPage *entry = find_entry(cache, dest);
+  if (!entry) {
+    return 0;
+  }
+  unlink_entry(cache, entry);
+  link_first(cache, entry);
+  *output = entry->output;
+  *size = entry->size;
+  return 1;
+}
+
+void page_cache_put(PageCache *cache, ManifestPage *page, const uint8_t *output, size_t size) {
+  CachedPage *existing = find_entry(cache, page->dest);
+  if (existing) {
+    delete_entry(cache, existing);
+  }
+  CachedPage *entry = allocate(sizeof(CachedPage));
+  entry->page = page;
+  entry->output = allocate(size + 1);
+  memcpy(entry->output, output, size);
+  entry->size = size;
+  size_t entry_size = get_entry_size(entry);
+  if (entry_size > cache->max_size) {
+    delete_manifest_page(page);
+    free(entry->output);
+    free(entry);
+    return;
+  }
+  while (cache->last && cache->size + entry_size > cache->max_size) {
+    delete_entry(cache, cache->last);
+  }
+  link_first(cache, entry);
+  generic_hash_map_add(&cache->map, &entry);
+  cache->size += entry_size;
+}
+
+void page_cache_retain(PageCache *cache, PageCacheFilter filter, void *context) {
+  CachedPage *entry = cache->first;
+  while (entry) {
+    CachedPage *next = entry->next;
+    if (!filter(entry->page, context)) {
+      delete_entry(cache, entry);
+    }
+    entry = next;
+  }
+}
@@ -0,0 +1,22 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include "manifest.h"
+
+typedef struct PageCache PageCache;
+
+typedef int (* PageCacheFilter)(ManifestPage *page, void *context);
+
+PageCache *create_page_cache(size_t max_size);
+void delete_page_cache(PageCache *cache);
+int page_cache_get(PageCache *cache, const Path *dest, const uint8_t **output, size_t *size);
+void page_cache_put(PageCache *cache, ManifestPage *page, const uint8_t *output, size_t size);
+void page_cache_retain(PageCache *cache, PageCacheFilter filter, void *context);
+
+#endif
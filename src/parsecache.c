@@ -0,0 +1,885 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#define _GNU_SOURCE
+#include "parsecache.h"
+
+#include "module.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PARSE_CACHE_MAGIC "plet-ast 1\n"
+#define OPTIONAL_NODE 0xff
+
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+  size_t offset;
+  int error;
+  Path *file_name;
+  SymbolMap *symbol_map;
+  Arena *arena;
+  Symbol *symbols;
+  size_t symbols_size;
+  size_t symbols_capacity;
+} CacheReader;
+
+typedef struct {
+  Symbol symbol;
+  uint64_t index;
+} SymbolEntry;
+
+typedef struct {
+  Buffer *buffer;
+  GenericHashMap symbols;
+} ValueWriter;
+
+static Path *parse_cache_dir = NULL;
+
+void set_parse_cache_dir(const Path *dir) {
+  if (parse_cache_dir) {
+    delete_path(parse_cache_dir);
+    parse_cache_dir = NULL;
+  }
+  if (dir) {
+    if (!mkdir_rec(dir->path)) {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "unable to create cache directory" SGR_RESET "\n", dir->path);
+      return;
+    }
+    parse_cache_dir = copy_path(dir);
+  }
+}
+
+int parse_cache_is_enabled(void) {
+  return parse_cache_dir != NULL;
+}
+
+static Path *get_cache_path(const Path *file_name, ParseCacheKind kind) {
+  Hash h = HASH_ADD_BYTE(kind, INIT_HASH);
+  for (int32_t i = 0; i < file_name->size; i++) {
+    h = HASH_ADD_BYTE(file_name->path[i], h);
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "%016" PRIx64 ".ast", (uint64_t) h);
+  return path_append(parse_cache_dir, name);
+}
+
+static int hash_file(const Path *path, Hash *hash, uint64_t *size) {
+  FILE *file = fopen(path->path, "rb");
+  if (!file) {
+    return 0;
+  }
+  uint8_t buffer[8192];
+  size_t n;
+  Hash h = INIT_HASH;
+  *size = 0;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      h = HASH_ADD_BYTE(buffer[i], h);
+    }
+    *size += n;
+  }
+  int status = !ferror(file);
+  fclose(file);
+  *hash = h;
+  return status;
+}
+
+static void write_u8(uint8_t value, Buffer *buffer) {
+  buffer_put(buffer, value);
+}
+
+static void write_u64(uint64_t value, Buffer *buffer) {
+  for (int i = 0; i < 8; i++) {
+    buffer_put(buffer, (value >> (i * 8)) & 0xff);
+  }
+}
+
+static void write_bytes(const uint8_t *bytes, size_t size, Buffer *buffer) {
+  write_u64(size, buffer);
+  buffer_append_bytes(buffer, bytes, size);
+}
+
+static void write_symbol(Symbol symbol, Buffer *buffer) {
+  if (!symbol) {
+    write_u64(UINT64_MAX, buffer);
+  } else {
+    write_bytes((const uint8_t *) symbol, strlen(symbol), buffer);
+  }
+}
+
+static void write_pos(Pos pos, Buffer *buffer) {
+  write_u64((uint32_t) pos.line, buffer);
+  write_u64((uint32_t) pos.column, buffer);
+}
+
+static void write_name_list(NameList *list, Buffer *buffer) {
+  size_t size = 0;
+  for (NameList *name = list; name; name = name->tail) {
+    size++;
+  }
+  write_u64(size, buffer);
+  for (NameList *name = list; name; name = name->tail) {
+    write_symbol(name->head, buffer);
+  }
+}
+
+static void write_node(Node *node, Buffer *buffer);
+
+static void write_optional_node(Node *node, Buffer *buffer) {
+  if (!node) {
+    write_u8(OPTIONAL_NODE, buffer);
+  } else {
+    write_node(node, buffer);
+  }
+}
+
+static void write_node_list(NodeList *list, Buffer *buffer) {
+  size_t size = 0;
+  for (NodeList *item = list; item; item = item->tail) {
+    size++;
+  }
+  write_u64(size, buffer);
+  for (NodeList *item = list; item; item = item->tail) {
+    write_node(&item->head, buffer);
+  }
+}
+
+static void write_property_list(PropertyList *list, Buffer *buffer) {
+  size_t size = 0;
+  for (PropertyList *item = list; item; item = item->tail) {
+    size++;
+  }
+  write_u64(size, buffer);
+  for (PropertyList *item = list; item; item = item->tail) {
+    write_node(&item->key, buffer);
+    write_node(&item->value, buffer);
+  }
+}
+
+static void write_node(Node *node, Buffer *buffer) {
+  write_u8(node->type, buffer);
+  write_pos(node->start, buffer);
+  write_pos(node->end, buffer);
+  switch (node->type) {
+    case N_NAME:
+      write_symbol(node->name_value, buffer);
+      break;
+    case N_INT:
+      write_u64(node->int_value, buffer);
+      break;
+    case N_FLOAT: {
+      uint64_t bits;
+      memcpy(&bits, &node->float_value, sizeof(bits));
+      write_u64(bits, buffer);
+      break;
+    }
+    case N_STRING:
+      write_bytes(node->string_value.bytes, node->string_value.size, buffer);
+      break;
+    case N_LIST:
+      write_node_list(node->list_value, buffer);
+      break;
+    case N_OBJECT:
+      write_property_list(node->object_value, buffer);
+      break;
+    case N_APPLY:
+      write_optional_node(node->apply_value.callee, buffer);
+      write_node_list(node->apply_value.args, buffer);
+      break;
+    case N_SUBSCRIPT:
+      write_optional_node(node->subscript_value.list, buffer);
+      write_optional_node(node->subscript_value.index, buffer);
+      break;
+    case N_DOT:
+      write_optional_node(node->dot_value.object, buffer);
+      write_symbol(node->dot_value.name, buffer);
+      break;
+    case N_PREFIX:
+      write_optional_node(node->prefix_value.operand, buffer);
+      write_u8(node->prefix_value.operator, buffer);
+      break;
+    case N_INFIX:
+      write_optional_node(node->infix_value.left, buffer);
+      write_optional_node(node->infix_value.right, buffer);
+      write_u8(node->infix_value.operator, buffer);
+      break;
+    case N_TUPLE:
+      write_name_list(node->tuple_value, buffer);
+      break;
+    case N_FN:
+      write_name_list(node->fn_value.params, buffer);
+      write_name_list(node->fn_value.free_variables, buffer);
+      write_optional_node(node->fn_value.body, buffer);
+      break;
+    case N_IF:
+      write_optional_node(node->if_value.cond, buffer);
+      write_optional_node(node->if_value.cons, buffer);
+      write_optional_node(node->if_value.alt, buffer);
+      break;
+    case N_FOR:
+      write_symbol(node->for_value.key, buffer);
+      write_symbol(node->for_value.value, buffer);
+      write_optional_node(node->for_value.collection, buffer);
+      write_optional_node(node->for_value.body, buffer);
+      write_optional_node(node->for_value.alt, buffer);
+      break;
+    case N_SWITCH:
+      write_optional_node(node->switch_value.expr, buffer);
+      write_property_list(node->switch_value.cases, buffer);
+      write_optional_node(node->switch_value.default_case, buffer);
+      break;
+    case N_EXPORT:
+      write_symbol(node->export_value.left, buffer);
+      write_optional_node(node->export_value.right, buffer);
+      break;
+    case N_ASSIGN:
+      write_optional_node(node->assign_value.left, buffer);
+      write_optional_node(node->assign_value.right, buffer);
+      write_u8(node->assign_value.operator, buffer);
+      break;
+    case N_BLOCK:
+      write_node_list(node->block_value, buffer);
+      break;
+    case N_SUPPRESS:
+      write_optional_node(node->suppress_value, buffer);
+      break;
+    case N_RETURN:
+      write_optional_node(node->return_value, buffer);
+      break;
+    case N_BREAK:
+      write_u64(node->break_value, buffer);
+      break;
+    case N_CONTINUE:
+      write_u64(node->continue_value, buffer);
+      break;
+  }
+}
+
+static Hash symbol_entry_hash(const void *p) {
+  return SYMBOL_HASH(((const SymbolEntry *) p)->symbol);
+}
+
+static int symbol_entry_equals(const void *a, const void *b) {
+  return ((const SymbolEntry *) a)->symbol == ((const SymbolEntry *) b)->symbol;
+}
+
+/* Cached values are mostly small HTML nodes, so integers are written as
+ * variable length integers and each distinct symbol is only written once,
+ * later occurrences refer to it by number. */
+static void write_varint(uint64_t value, Buffer *buffer) {
+  while (value >= 0x80) {
+    buffer_put(buffer, (value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  buffer_put(buffer, value);
+}
+
+static void write_signed_varint(int64_t value, Buffer *buffer) {
+  write_varint(((uint64_t) value << 1) ^ (uint64_t) (value >> 63), buffer);
+}
+
+static void write_value_symbol(Symbol symbol, ValueWriter *writer) {
+  SymbolEntry entry = { .symbol = symbol };
+  if (generic_hash_map_get(&writer->symbols, &entry, &entry)) {
+    write_varint(entry.index + 1, writer->buffer);
+  } else {
+    entry.index = writer->symbols.size;
+    generic_hash_map_add(&writer->symbols, &entry);
+    size_t length = strlen(symbol);
+    write_varint(0, writer->buffer);
+    write_varint(length, writer->buffer);
+    buffer_append_bytes(writer->buffer, (const uint8_t *) symbol, length);
+  }
+}
+
+/* Only plain data can be cached, functions and closures (and very deeply
+ * nested values) make the whole value uncacheable. */
+static int write_value(Value value, ValueWriter *writer, int depth) {
+  if (depth > 64) {
+    return 0;
+  }
+  Buffer *buffer = writer->buffer;
+  write_u8(value.type, buffer);
+  switch (value.type) {
+    case V_NIL:
+      return 1;
+    case V_BOOL:
+    case V_INT:
+      write_signed_varint(value.int_value, buffer);
+      return 1;
+    case V_FLOAT: {
+      uint64_t bits;
+      memcpy(&bits, &value.float_value, sizeof(bits));
+      write_u64(bits, buffer);
+      return 1;
+    }
+    case V_SYMBOL:
+      write_value_symbol(value.symbol_value, writer);
+      return 1;
+    case V_STRING:
+      write_varint(value.string_value->size, buffer);
+      buffer_append_bytes(buffer, value.string_value->bytes, value.string_value->size);
+      return 1;
+    case V_ARRAY:
+      write_varint(value.array_value->size, buffer);
+      for (size_t i = 0; i < value.array_value->size; i++) {
+        if (!write_value(value.array_value->cells[i], writer, depth + 1)) {
+          return 0;
+        }
+      }
+      return 1;
+    case V_OBJECT: {
+      write_varint(object_size(value.object_value), buffer);
+      ObjectIterator it = iterate_object(value.object_value);
+      Value entry_key, entry_value;
+      while (object_iterator_next(&it, &entry_key, &entry_value)) {
+        if (!write_value(entry_key, writer, depth + 1) || !write_value(entry_value, writer, depth + 1)) {
+          return 0;
+        }
+      }
+      return 1;
+    }
+    case V_TIME:
+      write_signed_varint(value.time_value, buffer);
+      return 1;
+    case V_FUNCTION:
+    case V_CLOSURE:
+    case V_LAZY:
+      return 0;
+  }
+  return 0;
+}
+
+static uint8_t read_u8(CacheReader *reader) {
+  if (reader->offset >= reader->size) {
+    reader->error = 1;
+    return 0;
+  }
+  return reader->data[reader->offset++];
+}
+
+static uint64_t read_u64(CacheReader *reader) {
+  if (reader->size - reader->offset < 8) {
+    reader->error = 1;
+    reader->offset = reader->size;
+    return 0;
+  }
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value |= (uint64_t) reader->data[reader->offset++] << (i * 8);
+  }
+  return value;
+}
+
+static const uint8_t *read_bytes(CacheReader *reader, size_t *size) {
+  *size = read_u64(reader);
+  if (reader->error || *size > reader->size - reader->offset) {
+    reader->error = 1;
+    return NULL;
+  }
+  const uint8_t *bytes = reader->data + reader->offset;
+  reader->offset += *size;
+  return bytes;
+}
+
+static Symbol read_symbol(CacheReader *reader) {
+  uint64_t size = read_u64(reader);
+  if (size == UINT64_MAX || reader->error) {
+    return NULL;
+  }
+  if (size > reader->size - reader->offset) {
+    reader->error = 1;
+    return NULL;
+  }
+  char *name = allocate(size + 1);
+  memcpy(name, reader->data + reader->offset, size);
+  name[size] = '\0';
+  reader->offset += size;
+  Symbol symbol = get_symbol(name, reader->symbol_map);
+  free(name);
+  return symbol;
+}
+
+static Pos read_pos(CacheReader *reader) {
+  Pos pos;
+  pos.line = (int) read_u64(reader);
+  pos.column = (int) read_u64(reader);
+  return pos;
+}
+
+/* Sizes are checked against the remaining input so a corrupt cache file can't
+ * cause huge allocations. */
+static size_t read_size(CacheReader *reader) {
+  uint64_t size = read_u64(reader);
+  if (size > reader->size - reader->offset) {
+    reader->error = 1;
+    return 0;
+  }
+  return size;
+}
+
+static NameList *read_name_list(CacheReader *reader) {
+  size_t size = read_size(reader);
+  NameList *head = NULL;
+  NameList *last = NULL;
+  for (size_t i = 0; i < size && !reader->error; i++) {
+    LL_APPEND(NameList, head, last, read_symbol(reader), reader->arena);
+  }
+  return head;
+}
+
+static void read_node(Node *node, CacheReader *reader);
+
+static Node *read_optional_node(CacheReader *reader) {
+  if (reader->offset < reader->size && reader->data[reader->offset] == OPTIONAL_NODE) {
+    reader->offset++;
+    return NULL;
+  }
+  Node *node = arena_allocate(sizeof(Node), reader->arena);
+  read_node(node, reader);
+  return node;
+}
+
+static NodeList *read_node_list(CacheReader *reader) {
+  size_t size = read_size(reader);
+  NodeList *head = NULL;
+  NodeList *last = NULL;
+  for (size_t i = 0; i < size && !reader->error; i++) {
+    Node node;
+    read_node(&node, reader);
+    LL_APPEND(NodeList, head, last, node, reader->arena);
+  }
+  return head;
+}
+
+static PropertyList *read_property_list(CacheReader *reader) {
+  size_t size = read_size(reader);
+  PropertyList *head = NULL;
+  PropertyList *last = NULL;
+  for (size_t i = 0; i < size && !reader->error; i++) {
+    PropertyList *item = arena_allocate(sizeof(PropertyList), reader->arena);
+    item->tail = NULL;
+    read_node(&item->key, reader);
+    read_node(&item->value, reader);
+    if (last) {
+      last->tail = item;
+      head->size++;
+    } else {
+      head = item;
+      head->size = 1;
+    }
+    last = item;
+  }
+  return head;
+}
+
+static void read_node(Node *node, CacheReader *reader) {
+  memset(node, 0, sizeof(Node));
+  node->module.file_name = reader->file_name;
+  uint8_t type = read_u8(reader);
+  if (reader->error || type > N_CONTINUE) {
+    reader->error = 1;
+    node->type = N_NAME;
+    return;
+  }
+  node->type = type;
+  node->start = read_pos(reader);
+  node->end = read_pos(reader);
+  switch (node->type) {
+    case N_NAME:
+      node->name_value = read_symbol(reader);
+      break;
+    case N_INT:
+      node->int_value = (int64_t) read_u64(reader);
+      break;
+    case N_FLOAT: {
+      uint64_t bits = read_u64(reader);
+      memcpy(&node->float_value, &bits, sizeof(bits));
+      break;
+    }
+    case N_STRING: {
+      size_t size;
+      const uint8_t *bytes = read_bytes(reader, &size);
+      if (bytes) {
+        node->string_value.bytes = arena_allocate(size, reader->arena);
+        memcpy(node->string_value.bytes, bytes, size);
+        node->string_value.size = size;
+      }
+      break;
+    }
+    case N_LIST:
+      node->list_value = read_node_list(reader);
+      break;
+    case N_OBJECT:
+      node->object_value = read_property_list(reader);
+      break;
+    case N_APPLY:
+      node->apply_value.callee = read_optional_node(reader);
+      node->apply_value.args = read_node_list(reader);
+      break;
+    case N_SUBSCRIPT:
+      node->subscript_value.list = read_optional_node(reader);
+      node->subscript_value.index = read_optional_node(reader);
+      break;
+    case N_DOT:
+      node->dot_value.object = read_optional_node(reader);
+      node->dot_value.name = read_symbol(reader);
+      break;
+    case N_PREFIX:
+      node->prefix_value.operand = read_optional_node(reader);
+      node->prefix_value.operator = read_u8(reader);
+      break;
+    case N_INFIX:
+      node->infix_value.left = read_optional_node(reader);
+      node->infix_value.right = read_optional_node(reader);
+      node->infix_value.operator = read_u8(reader);
+      break;
+    case N_TUPLE:
+      node->tuple_value = read_name_list(reader);
+      break;
+    case N_FN:
+      node->fn_value.params = read_name_list(reader);
+      node->fn_value.free_variables = read_name_list(reader);
+      node->fn_value.body = read_optional_node(reader);
+      break;
+    case N_IF:
+      node->if_value.cond = read_optional_node(reader);
+      node->if_value.cons = read_optional_node(reader);
+      node->if_value.alt = read_optional_node(reader);
+      break;
+    case N_FOR:
+      node->for_value.key = read_symbol(reader);
+      node->for_value.value = read_symbol(reader);
+      node->for_value.collection = read_optional_node(reader);
+      node->for_value.body = read_optional_node(reader);
+      node->for_value.alt = read_optional_node(reader);
+      break;
+    case N_SWITCH:
+      node->switch_value.expr = read_optional_node(reader);
+      node->switch_value.cases = read_property_list(reader);
+      node->switch_value.default_case = read_optional_node(reader);
+      break;
+    case N_EXPORT:
+      node->export_value.left = read_symbol(reader);
+      node->export_value.right = read_optional_node(reader);
+      break;
+    case N_ASSIGN:
+      node->assign_value.left = read_optional_node(reader);
+      node->assign_value.right = read_optional_node(reader);
+      node->assign_value.operator = read_u8(reader);
+      break;
+    case N_BLOCK:
+      node->block_value = read_node_list(reader);
+      break;
+    case N_SUPPRESS:
+      node->suppress_value = read_optional_node(reader);
+      break;
+    case N_RETURN:
+      node->return_value = read_optional_node(reader);
+      break;
+    case N_BREAK:
+      node->break_value = (int64_t) read_u64(reader);
+      break;
+    case N_CONTINUE:
+      node->continue_value = (int64_t) read_u64(reader);
+      break;
+  }
+}
+
+static uint64_t read_varint(CacheReader *reader) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t byte = read_u8(reader);
+    value |= (uint64_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+  reader->error = 1;
+  return 0;
+}
+
+static int64_t read_signed_varint(CacheReader *reader) {
+  uint64_t value = read_varint(reader);
+  return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+static size_t read_varint_size(CacheReader *reader) {
+  uint64_t size = read_varint(reader);
+  if (size > reader->size - reader->offset) {
+    reader->error = 1;
+    return 0;
+  }
+  return size;
+}
+
+static Symbol read_value_symbol(CacheReader *reader) {
+  uint64_t index = read_varint(reader);
+  if (reader->error) {
+    return NULL;
+  }
+  if (index) {
+    if (index > reader->symbols_size) {
+      reader->error = 1;
+      return NULL;
+    }
+    return reader->symbols[index - 1];
+  }
+  size_t length = read_varint_size(reader);
+  if (reader->error) {
+    return NULL;
+  }
+  char *name = allocate(length + 1);
+  memcpy(name, reader->data + reader->offset, length);
+  name[length] = '\0';
+  reader->offset += length;
+  Symbol symbol = get_symbol(name, reader->symbol_map);
+  free(name);
+  if (reader->symbols_size >= reader->symbols_capacity) {
+    reader->symbols_capacity = reader->symbols_capacity ? reader->symbols_capacity << 1 : 32;
+    reader->symbols = reallocate(reader->symbols, reader->symbols_capacity * sizeof(Symbol));
+  }
+  reader->symbols[reader->symbols_size++] = symbol;
+  return symbol;
+}
+
+static Value read_value(CacheReader *reader, int depth) {
+  if (depth > 64) {
+    reader->error = 1;
+    return nil_value;
+  }
+  uint8_t type = read_u8(reader);
+  switch (type) {
+    case V_NIL:
+      return nil_value;
+    case V_BOOL:
+      return read_signed_varint(reader) ? true_value : false_value;
+    case V_INT:
+      return create_int(read_signed_varint(reader));
+    case V_FLOAT: {
+      uint64_t bits = read_u64(reader);
+      double f;
+      memcpy(&f, &bits, sizeof(f));
+      return create_float(f);
+    }
+    case V_SYMBOL: {
+      Symbol symbol = read_value_symbol(reader);
+      if (!symbol) {
+        return nil_value;
+      }
+      return create_symbol(symbol);
+    }
+    case V_STRING: {
+      size_t size = read_varint_size(reader);
+      Value string = create_string(reader->data + reader->offset, size, reader->arena);
+      reader->offset += size;
+      return string;
+    }
+    case V_ARRAY: {
+      size_t size = read_varint_size(reader);
+      Value array = create_array(size ? size : 1, reader->arena);
+      for (size_t i = 0; i < size && !reader->error; i++) {
+        array_push(array.array_value, read_value(reader, depth + 1), reader->arena);
+      }
+      return array;
+    }
+    case V_OBJECT: {
+      size_t size = read_varint_size(reader);
+      Value object = create_object(size ? size : 1, reader->arena);
+      for (size_t i = 0; i < size && !reader->error; i++) {
+        Value key = read_value(reader, depth + 1);
+        Value value = read_value(reader, depth + 1);
+        object_put(object.object_value, key, value, reader->arena);
+      }
+      return object;
+    }
+    case V_TIME:
+      return create_time((time_t) read_signed_varint(reader));
+    default:
+      reader->error = 1;
+      return nil_value;
+  }
+}
+
+static int read_header(CacheReader *reader, const Path *file_name, ParseCacheKind kind) {
+  size_t magic_size = sizeof(PARSE_CACHE_MAGIC) - 1;
+  if (reader->size < magic_size || memcmp(reader->data, PARSE_CACHE_MAGIC, magic_size) != 0) {
+    return 0;
+  }
+  reader->offset = magic_size;
+  if (read_u8(reader) != kind) {
+    return 0;
+  }
+  size_t path_size;
+  const uint8_t *path = read_bytes(reader, &path_size);
+  if (!path || path_size != file_name->size || memcmp(path, file_name->path, path_size) != 0) {
+    return 0;
+  }
+  time_t mtime = (time_t) read_u64(reader);
+  uint64_t size = read_u64(reader);
+  Hash hash = read_u64(reader);
+  if (reader->error) {
+    return 0;
+  }
+  struct stat stat_buffer;
+  if (stat(file_name->path, &stat_buffer) != 0) {
+    return 0;
+  }
+  if (stat_buffer.st_mtime == mtime && (uint64_t) stat_buffer.st_size == size) {
+    return 1;
+  }
+  Hash current_hash;
+  uint64_t current_size;
+  return hash_file(file_name, &current_hash, &current_size) && current_size == size && current_hash == hash;
+}
+
+static uint8_t *map_cache_file(const Path *file_name, ParseCacheKind kind, size_t *size) {
+  Path *cache_path = get_cache_path(file_name, kind);
+  uint8_t *data = map_file(cache_path->path, size);
+  delete_path(cache_path);
+  return data;
+}
+
+Module *read_parse_cache(const Path *file_name, ParseCacheKind kind, SymbolMap *symbol_map) {
+  if (!parse_cache_dir) {
+    return NULL;
+  }
+  size_t size;
+  uint8_t *data = map_cache_file(file_name, kind, &size);
+  if (!data) {
+    return NULL;
+  }
+  Module *module = NULL;
+  CacheReader reader = { .data = data, .size = size, .offset = 0, .error = 0, .symbol_map = symbol_map };
+  if (read_header(&reader, file_name, kind)) {
+    module = create_module(file_name, kind == PC_DATA ? M_DATA : M_USER);
+    reader.file_name = module->file_name;
+    reader.arena = module->arena;
+    Node *root = arena_allocate(sizeof(Node), module->arena);
+    read_node(root, &reader);
+    if (kind == PC_DATA) {
+      module->data_value.root = root;
+    } else {
+      module->user_value.root = root;
+    }
+    if (reader.error || reader.offset != reader.size) {
+      delete_module(module);
+      module = NULL;
+    }
+  }
+  unmap_file(data, size);
+  return module;
+}
+
+Value read_content_cache(const Path *file_name, Hash key, SymbolMap *symbol_map, Arena *arena) {
+  if (!parse_cache_dir) {
+    return nil_value;
+  }
+  size_t size;
+  uint8_t *data = map_cache_file(file_name, PC_CONTENT, &size);
+  if (!data) {
+    return nil_value;
+  }
+  Value value = nil_value;
+  CacheReader reader = { .data = data, .size = size, .offset = 0, .error = 0 };
+  if (read_header(&reader, file_name, PC_CONTENT) && read_u64(&reader) == key && !reader.error) {
+    value = deserialize_value(data + reader.offset, size - reader.offset, symbol_map, arena);
+  }
+  unmap_file(data, size);
+  return value;
+}
+
+static int write_cache_header(const Path *file_name, ParseCacheKind kind, Buffer *buffer) {
+  Hash hash;
+  uint64_t size;
+  struct stat stat_buffer;
+  if (stat(file_name->path, &stat_buffer) != 0 || !hash_file(file_name, &hash, &size)) {
+    return 0;
+  }
+  buffer_append_bytes(buffer, (const uint8_t *) PARSE_CACHE_MAGIC, sizeof(PARSE_CACHE_MAGIC) - 1);
+  write_u8(kind, buffer);
+  write_bytes((const uint8_t *) file_name->path, file_name->size, buffer);
+  write_u64(stat_buffer.st_mtime, buffer);
+  write_u64(size, buffer);
+  write_u64(hash, buffer);
+  return 1;
+}
+
+static void write_cache_file(const Path *file_name, ParseCacheKind kind, Buffer buffer) {
+  Path *cache_path = get_cache_path(file_name, kind);
+  char *temp_path = allocate(cache_path->size + 32);
+  snprintf(temp_path, cache_path->size + 32, "%s.%ld.tmp", cache_path->path, (long) getpid());
+  FILE *file = fopen(temp_path, "wb");
+  if (!file) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", temp_path, strerror(errno));
+  } else {
+    int status = fwrite(buffer.data, 1, buffer.size, file) == buffer.size;
+    if (fclose(file) != 0) {
+      status = 0;
+    }
+    if (!status || rename(temp_path, cache_path->path) != 0) {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "write error: %s" SGR_RESET "\n", cache_path->path,
+          strerror(errno));
+      remove(temp_path);
+    }
+  }
+  free(temp_path);
+  delete_path(cache_path);
+}
+
+void write_parse_cache(Module *module, ParseCacheKind kind) {
+  if (!parse_cache_dir) {
+    return;
+  }
+  Buffer buffer = create_buffer(0);
+  if (write_cache_header(module->file_name, kind, &buffer)) {
+    write_node(kind == PC_DATA ? module->data_value.root : module->user_value.root, &buffer);
+    write_cache_file(module->file_name, kind, buffer);
+  }
+  delete_buffer(buffer);
+}
+
+void write_content_cache(const Path *file_name, Hash key, Value value) {
+  if (!parse_cache_dir) {
+    return;
+  }
+  Buffer buffer = create_buffer(0);
+  if (write_cache_header(file_name, PC_CONTENT, &buffer)) {
+    write_u64(key, &buffer);
+    if (serialize_value(value, &buffer)) {
+      write_cache_file(file_name, PC_CONTENT, buffer);
+    }
+  }
+  delete_buffer(buffer);
+}
+
+int serialize_value(Value value, Buffer *buffer) {
+  ValueWriter writer = { .buffer = buffer };
+  init_generic_hash_map(&writer.symbols, sizeof(SymbolEntry), 0, symbol_entry_hash, symbol_entry_equals, NULL);
+  int status = write_value(value, &writer, 0);
+  delete_generic_hash_map(&writer.symbols);
+  return status;
+}
+
+Value deserialize_value(const uint8_t *data, size_t size, SymbolMap *symbol_map, Arena *arena) {
+  CacheReader reader = { .data = data, .size = size, .offset = 0, .error = 0, .symbol_map = symbol_map,
+    .arena = arena };
+  Value value = read_value(&reader, 0);
+  if (reader.error || reader.offset != reader.size) {
+    value = nil_value;
+  }
+  if (reader.symbols) {
+    free(reader.symbols);
+  }
+  return value;
+}
@@ -0,0 +1,28 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef PARSECACHE_H
+#define PARSECACHE_H
+
+#include "value.h"
+
+typedef enum {
+  PC_SCRIPT,
+  PC_TEMPLATE,
+  PC_DATA,
+  PC_CONTENT
+} ParseCacheKind;
+
+void set_parse_cache_dir(const Path *dir);
+int parse_cache_is_enabled(void);
+Module *read_parse_cache(const Path *file_name, ParseCacheKind kind, SymbolMap *symbol_map);
+void write_parse_cache(Module *module, ParseCacheKind kind);
+Value read_content_cache(const Path *file_name, Hash key, SymbolMap *symbol_map, Arena *arena);
+void write_content_cache(const Path *file_name, Hash key, Value value);
+int serialize_value(Value value, Buffer *buffer);
+Value deserialize_value(const uint8_t *data, size_t size, SymbolMap *symbol_map, Arena *arena);
+
+#endif
@@ -6,6 +6,7 @@
 
 #include "parser.h"
 
+#include "optimizer.h"
 #include "util.h"
 
 #include <string.h>
@@ -14,7 +15,7 @@
 
 #define ASSIGN_NODE(DEST, SRC) \
   assert(!(DEST));\
-  (DEST) = allocate(sizeof(Node));\
+  (DEST) = arena_allocate(sizeof(Node), parser->module->arena);\
   *(DEST) = (SRC);
 
 typedef struct {
@@ -276,7 +277,8 @@ static Node parse_string(Parser *parser) {
   Node node = create_node(N_STRING, parser);
   Token *token = pop(parser);
   node.string_value.size = token->size;
-  node.string_value.bytes = copy_string_token(token);
+  node.string_value.bytes = arena_allocate(token->size, parser->module->arena);
+  memcpy(node.string_value.bytes, token->string_value, token->size);
   node.end = parser->end;
   return node;
 }
@@ -302,10 +304,10 @@ static Node parse_atom(Parser *parser) {
       tuple.start = node.start;
       tuple.end = node.end;
       NameList *last_param = NULL;
-      LL_APPEND(NameList, tuple.tuple_value, last_param, node.name_value);
+      LL_APPEND(NameList, tuple.tuple_value, last_param, node.name_value, parser->module->arena);
       return tuple;
     }
-    parser->free_variables = name_list_put(node.name_value, parser->free_variables);
+    parser->free_variables = name_list_put(node.name_value, parser->free_variables, parser->module->arena);
     node.end = parser->end;
     if (peek_operator("?", parser)) {
       Node suppress = create_node(N_SUPPRESS, parser);
@@ -334,7 +336,7 @@ static Node parse_delimited(Parser *parser) {
       NodeList *last_item = NULL;
       while (1) {
         Node item = parse_expression(parser);
-        LL_APPEND(NodeList, list.list_value, last_item, item);
+        LL_APPEND(NodeList, list.list_value, last_item, item, parser->module->arena);
         if (!peek_operator(",", parser)) {
           break;
         }
@@ -369,7 +371,7 @@ static Node parse_delimited(Parser *parser) {
       Node tuple = create_node(N_TUPLE, parser);
       tuple.start = start_paren->start;
       NameList *last_param = NULL;
-      LL_APPEND(NameList, tuple.tuple_value, last_param, expr.name_value);
+      LL_APPEND(NameList, tuple.tuple_value, last_param, expr.name_value, parser->module->arena);
       parser->free_variables = name_list_remove(expr.name_value, parser->free_variables);
       if (!peek_punct(')', parser)) {
         while (peek_operator(",", parser)) {
@@ -377,7 +379,7 @@ static Node parse_delimited(Parser *parser) {
           if (peek_punct(')', parser)) {
             break;
           }
-          LL_APPEND(NameList, tuple.tuple_value, last_param, parse_name(parser));
+          LL_APPEND(NameList, tuple.tuple_value, last_param, parse_name(parser), parser->module->arena);
         }
       }
       expect_punct(')', parser);
@@ -396,7 +398,7 @@ static Node parse_delimited(Parser *parser) {
       tuple.start = expr.start;
       tuple.end = expr.end;
       NameList *last_param = NULL;
-      LL_APPEND(NameList, tuple.tuple_value, last_param, expr.name_value);
+      LL_APPEND(NameList, tuple.tuple_value, last_param, expr.name_value, parser->module->arena);
       return tuple;
     }
     return expr;
@@ -411,7 +413,7 @@ static Node parse_delimited(Parser *parser) {
         Node key = parse_atom(parser);
         expect_operator(":", parser);
         Node value = parse_expression(parser);
-        PropertyList *property = allocate(sizeof(PropertyList));
+        PropertyList *property = arena_allocate(sizeof(PropertyList), parser->module->arena);
         property->tail = NULL;
         property->key = key;
         property->value = value;
@@ -471,7 +473,7 @@ static Node parse_apply_dot(Parser *parser) {
         NodeList *last_arg = NULL;
         while (1) {
           Node arg = parse_expression(parser);
-          LL_APPEND(NodeList, apply.apply_value.args, last_arg, arg);
+          LL_APPEND(NodeList, apply.apply_value.args, last_arg, arg, parser->module->arena);
           if (!peek_operator(",", parser)) {
             break;
           }
@@ -661,15 +663,15 @@ static Node parse_pipe_line(Parser *parser) {
     name.name_value = parse_name(parser);
     name.end = parser->end;
     ASSIGN_NODE(apply.apply_value.callee, name);
-    parser->free_variables = name_list_put(name.name_value, parser->free_variables);
+    parser->free_variables = name_list_put(name.name_value, parser->free_variables, parser->module->arena);
     NodeList *last_arg = NULL;
-    LL_APPEND(NodeList, apply.apply_value.args, last_arg, expr);
+    LL_APPEND(NodeList, apply.apply_value.args, last_arg, expr, parser->module->arena);
     if (peek_punct('(', parser)) {
       pop(parser);
       if (!peek_punct(')', parser)) {
         while (1) {
           Node arg = parse_expression(parser);
-          LL_APPEND(NodeList, apply.apply_value.args, last_arg, arg);
+          LL_APPEND(NodeList, apply.apply_value.args, last_arg, arg, parser->module->arena);
           if (!peek_operator(",", parser)) {
             break;
           }
@@ -706,7 +708,7 @@ static Node parse_fat_arrow(Parser *parser) {
   fn.fn_value.free_variables = parser->free_variables;
   parser->free_variables = previous_name_list;
   for (NameList *name = fn.fn_value.free_variables; name; name = name->tail) {
-    parser->free_variables = name_list_put(name->head, parser->free_variables);
+    parser->free_variables = name_list_put(name->head, parser->free_variables, parser->module->arena);
   }
   fn.end = parser->end;
   return fn;
@@ -714,7 +716,7 @@ static Node parse_fat_arrow(Parser *parser) {
 
 static Node parse_partial_dot(Parser *parser) {
   Node fn = create_node(N_FN, parser);
-  fn.fn_value.params = allocate(sizeof(NameList));
+  fn.fn_value.params = arena_allocate(sizeof(NameList), parser->module->arena);
   fn.fn_value.params->tail = NULL;
   fn.fn_value.params->head = "o";
   Node expr = create_node(N_NAME, parser);
@@ -805,7 +807,7 @@ static Node parse_switch(Parser *parser) {
   PropertyList *last_case = NULL;
   while (peek_keyword("case", parser)) {
     pop(parser);
-    PropertyList *case_item = allocate(sizeof(PropertyList));
+    PropertyList *case_item = arena_allocate(sizeof(PropertyList), parser->module->arena);
     case_item->tail = NULL;
     case_item->key = parse_expression(parser);
     case_item->value = parse_block(parser);
@@ -924,7 +926,7 @@ static Node parse_block(Parser *parser) {
   Node block = create_node(N_BLOCK, parser);
   if (peek_type(T_TEXT, parser)) {
     Node string = parse_string(parser);
-    block.block_value = allocate(sizeof(NodeList));
+    block.block_value = arena_allocate(sizeof(NodeList), parser->module->arena);
     block.block_value->tail = NULL;
     block.block_value->head = string;
   } else {
@@ -945,14 +947,14 @@ static Node parse_template(Parser *parser) {
   NodeList *last_item = NULL;
   while (1) {
     if (peek_type(T_TEXT, parser)) {
-      LL_APPEND(NodeList, block.block_value, last_item, parse_string(parser));
+      LL_APPEND(NodeList, block.block_value, last_item, parse_string(parser), parser->module->arena);
     } else if (peek_keyword("end", parser) || peek_keyword("else", parser) || peek_keyword("case", parser)
         || peek_keyword("default", parser)) {
       break;
     } else if (peek_type(T_EOF, parser) || peek_type(T_END_QUOTE, parser)) {
       break;
     } else if (!peek_type(T_LF, parser)) {
-      LL_APPEND(NodeList, block.block_value, last_item, parse_statement(parser));
+      LL_APPEND(NodeList, block.block_value, last_item, parse_statement(parser), parser->module->arena);
       if (!peek_type(T_TEXT, parser) && !peek_type(T_EOF, parser)) {
         expect_type(T_LF, parser);
       }
@@ -967,10 +969,13 @@ Module *parse(TokenStream tokens, const Path *file_name) {
   Module *m = create_module(file_name, M_USER);
   Parser parser = (Parser) { .tokens = tokens, .module = m, .free_variables = NULL, .errors = 0,
     .end.line = 1, .end.column = 1, .ignore_lf = 0, .object_notation = 0 };
-  ASSIGN_NODE(m->user_value.root, parse_template(&parser));
+  m->user_value.root = arena_allocate(sizeof(Node), m->arena);
+  *m->user_value.root = parse_template(&parser);
   expect_type(T_EOF, &parser);
-  delete_name_list(parser.free_variables);
   m->user_value.parse_error = parser.errors;
+  if (!parser.errors) {
+    optimize_template(m->user_value.root, m->arena);
+  }
   return m;
 }
 
@@ -978,12 +983,12 @@ Module *parse_object_notation(TokenStream tokens, const Path *file_name, int exp
   Module *m = create_module(file_name, M_DATA);
   Parser parser = (Parser) { .tokens = tokens, .module = m, .free_variables = NULL, .errors = 0,
     .end.line = 1, .end.column = 1, .ignore_lf = 0, .object_notation = 1 };
-  ASSIGN_NODE(m->data_value.root, parse_delimited(&parser));
+  m->data_value.root = arena_allocate(sizeof(Node), m->arena);
+  *m->data_value.root = parse_delimited(&parser);
   if (expect_eof) {
     skip_lf(&parser);
     expect_type(T_EOF, &parser);
   }
-  delete_name_list(parser.free_variables);
   m->data_value.parse_error = parser.errors;
   return m;
 }
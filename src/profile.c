@@ -0,0 +1,335 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#define _GNU_SOURCE
+#include "profile.h"
+
+#include "hashmap.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Upper bound on the number of events kept for the trace file, each event takes up 40 bytes
+#define MAX_TRACE_EVENTS (1 << 20)
+
+typedef struct {
+  ProfileCategory category;
+  char *name;
+  int64_t count;
+  int64_t total;
+  int64_t max;
+  int64_t allocated;
+} ProfileEntry;
+
+typedef struct {
+  ProfileEntry *entry;
+  int64_t pid;
+  int64_t start;
+  int64_t duration;
+  int64_t allocated;
+} ProfileEvent;
+
+static const char *category_names[] = {
+  [PROFILE_PAGE] = "pages",
+  [PROFILE_TEMPLATE] = "templates",
+  [PROFILE_CONTENT] = "content",
+  [PROFILE_FUNCTION] = "functions",
+};
+
+static int profiling = 0;
+static char *trace_path = NULL;
+static Path *profile_root = NULL;
+static int64_t origin = 0;
+static GenericHashMap entries;
+static ProfileEvent *events = NULL;
+static size_t events_size = 0;
+static size_t events_capacity = 0;
+static size_t events_dropped = 0;
+
+static int64_t get_time(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static Hash profile_entry_hash(const void *p) {
+  const ProfileEntry *entry = *(ProfileEntry **) p;
+  return hash_bytes(entry->name, strlen(entry->name), HASH_ADD_BYTE(entry->category, INIT_HASH));
+}
+
+static int profile_entry_equals(const void *a, const void *b) {
+  const ProfileEntry *entry_a = *(ProfileEntry **) a;
+  const ProfileEntry *entry_b = *(ProfileEntry **) b;
+  return entry_a->category == entry_b->category && strcmp(entry_a->name, entry_b->name) == 0;
+}
+
+void enable_profiling(const char *path) {
+  if (profiling) {
+    return;
+  }
+  profiling = 1;
+  trace_path = path ? copy_string(path) : NULL;
+  origin = get_time();
+  init_generic_hash_map(&entries, sizeof(ProfileEntry *), 0, profile_entry_hash, profile_entry_equals, NULL);
+}
+
+int is_profiling(void) {
+  return profiling;
+}
+
+void set_profile_root(const Path *root) {
+  if (profile_root) {
+    delete_path(profile_root);
+  }
+  profile_root = copy_path(root);
+}
+
+ProfileTimer profile_start(void) {
+  if (!profiling) {
+    return (ProfileTimer) {0, 0};
+  }
+  return (ProfileTimer) {get_time(), get_arena_stats().allocated};
+}
+
+const char *get_profile_name(const char *name) {
+  if (profile_root && strncmp(name, profile_root->path, profile_root->size) == 0
+      && name[profile_root->size] == PATH_SEP) {
+    return name + profile_root->size + 1;
+  }
+  return name;
+}
+
+static ProfileEntry *get_entry(ProfileCategory category, const char *name) {
+  ProfileEntry key = {.category = category, .name = (char *) name};
+  ProfileEntry *key_ptr = &key;
+  ProfileEntry *entry;
+  if (generic_hash_map_get(&entries, &key_ptr, &entry)) {
+    return entry;
+  }
+  entry = allocate(sizeof(ProfileEntry));
+  entry->category = category;
+  entry->name = copy_string(name);
+  entry->count = 0;
+  entry->total = 0;
+  entry->max = 0;
+  entry->allocated = 0;
+  generic_hash_map_add(&entries, &entry);
+  return entry;
+}
+
+static void add_event(ProfileEntry *entry, int64_t pid, int64_t start, int64_t duration, int64_t allocated) {
+  if (events_size >= MAX_TRACE_EVENTS) {
+    events_dropped++;
+    return;
+  }
+  if (events_size >= events_capacity) {
+    events_capacity = events_capacity ? events_capacity << 1 : 1024;
+    events = reallocate(events, events_capacity * sizeof(ProfileEvent));
+  }
+  events[events_size++] = (ProfileEvent) {entry, pid, start, duration, allocated};
+}
+
+void profile_end(ProfileTimer timer, ProfileCategory category, const char *name) {
+  if (!profiling) {
+    return;
+  }
+  int64_t duration = get_time() - timer.start;
+  int64_t allocated = get_arena_stats().allocated - timer.allocated;
+  ProfileEntry *entry = get_entry(category, get_profile_name(name));
+  entry->count++;
+  entry->total += duration;
+  entry->allocated += allocated;
+  if (duration > entry->max) {
+    entry->max = duration;
+  }
+  if (trace_path) {
+    add_event(entry, getpid(), timer.start - origin, duration, allocated);
+  }
+}
+
+void clear_profile(void) {
+  if (!profiling) {
+    return;
+  }
+  ProfileEntry *entry;
+  HashMapIterator it = generic_hash_map_iterate(&entries);
+  while (generic_hash_map_next(&it, &entry)) {
+    free(entry->name);
+    free(entry);
+  }
+  generic_hash_map_clear(&entries);
+  events_size = 0;
+  events_dropped = 0;
+}
+
+void write_profile(FILE *out) {
+  if (!profiling) {
+    fputc(0, out);
+    return;
+  }
+  ProfileEntry *entry;
+  HashMapIterator it = generic_hash_map_iterate(&entries);
+  while (generic_hash_map_next(&it, &entry)) {
+    fputc(1, out);
+    fputc(entry->category, out);
+    fwrite(entry->name, 1, strlen(entry->name) + 1, out);
+    int64_t counters[4] = {entry->count, entry->total, entry->max, entry->allocated};
+    fwrite(counters, sizeof(int64_t), 4, out);
+  }
+  for (size_t i = 0; i < events_size; i++) {
+    fputc(2, out);
+    fputc(events[i].entry->category, out);
+    fwrite(events[i].entry->name, 1, strlen(events[i].entry->name) + 1, out);
+    int64_t fields[4] = {events[i].pid, events[i].start, events[i].duration, events[i].allocated};
+    fwrite(fields, sizeof(int64_t), 4, out);
+  }
+  fputc(0, out);
+}
+
+int read_profile(FILE *in) {
+  Buffer name = create_buffer(0);
+  int status = 1;
+  int tag;
+  while ((tag = fgetc(in)) == 1 || tag == 2) {
+    int category = fgetc(in);
+    int c;
+    name.size = 0;
+    while ((c = fgetc(in)) != EOF && c) {
+      buffer_put(&name, c);
+    }
+    buffer_put(&name, '\0');
+    int64_t fields[4];
+    if (category < PROFILE_PAGE || category > PROFILE_FUNCTION || c == EOF
+        || fread(fields, sizeof(int64_t), 4, in) != 4) {
+      status = 0;
+      break;
+    }
+    if (!profiling) {
+      continue;
+    }
+    ProfileEntry *entry = get_entry(category, (char *) name.data);
+    if (tag == 1) {
+      entry->count += fields[0];
+      entry->total += fields[1];
+      if (fields[2] > entry->max) {
+        entry->max = fields[2];
+      }
+      entry->allocated += fields[3];
+    } else if (trace_path) {
+      add_event(entry, fields[0], fields[1], fields[2], fields[3]);
+    }
+  }
+  if (tag != 0) {
+    status = 0;
+  }
+  delete_buffer(name);
+  return status;
+}
+
+static int compare_entries(const void *a, const void *b) {
+  const ProfileEntry *entry_a = *(ProfileEntry **) a;
+  const ProfileEntry *entry_b = *(ProfileEntry **) b;
+  if (entry_a->total == entry_b->total) {
+    return strcmp(entry_a->name, entry_b->name);
+  }
+  return entry_a->total < entry_b->total ? 1 : -1;
+}
+
+static void print_category(ProfileCategory category, ProfileEntry **sorted, size_t size) {
+  size_t shown = 0;
+  size_t total = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (sorted[i]->category == category) {
+      total++;
+    }
+  }
+  if (!total) {
+    return;
+  }
+  fprintf(stderr, SGR_BOLD "%s (top %zd of %zd):" SGR_RESET "\n", category_names[category],
+      total < PROFILE_TOP_N ? total : PROFILE_TOP_N, total);
+  fprintf(stderr, "  %10s %8s %10s %12s  %s\n", "total ms", "calls", "max ms", "alloc KiB", "name");
+  for (size_t i = 0; i < size && shown < PROFILE_TOP_N; i++) {
+    ProfileEntry *entry = sorted[i];
+    if (entry->category != category) {
+      continue;
+    }
+    fprintf(stderr, "  %10.2f %8" PRId64 " %10.2f %12.1f  %s\n", entry->total / 1e6, entry->count,
+        entry->max / 1e6, entry->allocated / 1024.0, entry->name);
+    shown++;
+  }
+}
+
+static void write_json_string(const char *string, FILE *out) {
+  fputc('"', out);
+  for (const char *c = string; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fputc('\\', out);
+      fputc(*c, out);
+    } else if ((unsigned char) *c < 0x20) {
+      fprintf(out, "\\u%04x", (unsigned char) *c);
+    } else {
+      fputc(*c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static int write_trace(void) {
+  FILE *out = fopen(trace_path, "w");
+  if (!out) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", trace_path, strerror(errno));
+    return 0;
+  }
+  fputs("{\"traceEvents\":[", out);
+  for (size_t i = 0; i < events_size; i++) {
+    ProfileEvent *event = &events[i];
+    fputs(i ? ",\n{\"name\":" : "\n{\"name\":", out);
+    write_json_string(event->entry->name, out);
+    fprintf(out, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%" PRId64 ",\"tid\":%" PRId64
+        ",\"args\":{\"allocated\":%" PRId64 "}}", category_names[event->entry->category], event->start / 1e3,
+        event->duration / 1e3, event->pid, event->pid, event->allocated);
+  }
+  fputs("\n],\"displayTimeUnit\":\"ms\"}\n", out);
+  int status = !ferror(out);
+  if (fclose(out) != 0) {
+    status = 0;
+  }
+  if (!status) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "unable to write trace" SGR_RESET "\n", trace_path);
+  }
+  return status;
+}
+
+void print_profile(void) {
+  if (!profiling) {
+    return;
+  }
+  ProfileEntry **sorted = allocate((entries.size ? entries.size : 1) * sizeof(ProfileEntry *));
+  size_t size = 0;
+  HashMapIterator it = generic_hash_map_iterate(&entries);
+  while (generic_hash_map_next(&it, &sorted[size])) {
+    size++;
+  }
+  qsort(sorted, size, sizeof(ProfileEntry *), compare_entries);
+  fprintf(stderr, INFO_LABEL "profile (inclusive wall time and arena allocations):" SGR_RESET "\n");
+  print_category(PROFILE_PAGE, sorted, size);
+  print_category(PROFILE_TEMPLATE, sorted, size);
+  print_category(PROFILE_CONTENT, sorted, size);
+  print_category(PROFILE_FUNCTION, sorted, size);
+  free(sorted);
+  if (trace_path && write_trace()) {
+    fprintf(stderr, INFO_LABEL "wrote %zd trace events to %s" SGR_RESET "\n", events_size, trace_path);
+    if (events_dropped) {
+      fprintf(stderr, WARN_LABEL "%zd events were dropped from the trace" SGR_RESET "\n", events_dropped);
+    }
+  }
+  clear_profile();
+}
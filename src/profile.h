@@ -0,0 +1,48 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define PROFILE_TOP_N 10
+
+typedef enum {
+  PROFILE_PAGE,
+  PROFILE_TEMPLATE,
+  PROFILE_CONTENT,
+  PROFILE_FUNCTION
+} ProfileCategory;
+
+typedef struct {
+  int64_t start;
+  size_t allocated;
+} ProfileTimer;
+
+// Enables profiling for the rest of the process. If trace_path is not NULL, every timed event is also recorded and
+// written to that file as Chrome trace-event JSON by print_profile().
+void enable_profiling(const char *trace_path);
+int is_profiling(void);
+// Names starting with the root are shortened to be relative to it
+void set_profile_root(const Path *root);
+const char *get_profile_name(const char *name);
+
+ProfileTimer profile_start(void);
+// Records the wall time and the number of arena bytes allocated since profile_start(). The name is copied.
+void profile_end(ProfileTimer timer, ProfileCategory category, const char *name);
+
+// Forget everything recorded so far, used by forked workers so that they only send their own events to the parent
+void clear_profile(void);
+void write_profile(FILE *out);
+int read_profile(FILE *in);
+
+void print_profile(void);
+
+#endif
@@ -9,26 +9,57 @@
 #include "util.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+
+#define TOKEN_BLOCK_SIZE 256
 
 typedef struct ParenStack ParenStack;
+typedef struct TokenBlock TokenBlock;
 
 struct ParenStack {
   ParenStack *next;
   uint8_t paren;
 };
 
+struct TokenBlock {
+  TokenBlock *next;
+  size_t size;
+  Token tokens[TOKEN_BLOCK_SIZE];
+};
+
+typedef enum {
+  INPUT_FILE,
+  INPUT_MAPPED,
+  INPUT_ALLOCATED
+} InputType;
+
 struct Reader {
+  InputType input_type;
   FILE *file;
+  const uint8_t *input;
+  const uint8_t *input_end;
+  const uint8_t *cursor;
+  size_t input_size;
+  TokenBlock *token_blocks;
+  Buffer name_buffer;
   Path *file_name;
   SymbolMap *symbol_map;
   ParenStack *parens;
   Token *tokens;
   Token *last;
   Pos pos;
+  size_t offset;
   int errors;
   int silent;
   int la;
@@ -42,7 +73,12 @@ const char *keywords[] = {
 
 Reader *open_reader(FILE *file, const Path *file_name, SymbolMap *symbol_map) {
   Reader *r = allocate(sizeof(Reader));
+  r->input_type = INPUT_FILE;
   r->file = file;
+  r->input = r->input_end = r->cursor = NULL;
+  r->input_size = 0;
+  r->token_blocks = NULL;
+  r->name_buffer = create_buffer(0);
   r->file_name = copy_path(file_name);
   r->symbol_map = symbol_map;
   r->parens = NULL;
@@ -50,12 +86,71 @@ Reader *open_reader(FILE *file, const Path *file_name, SymbolMap *symbol_map) {
   r->last = NULL;
   r->pos.line = 1;
   r->pos.column = 1;
+  r->offset = 0;
   r->la = 0;
   r->errors = 0;
   r->silent = 0;
   return r;
 }
 
+/* Reads the whole file into memory, using mmap when possible, so the lexer
+ * can scan it with pointer arithmetic instead of a call per byte. */
+Reader *open_file_reader(const Path *file_name, SymbolMap *symbol_map) {
+  int fd = open(file_name->path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat stat_buffer;
+  if (fstat(fd, &stat_buffer) != 0) {
+    close(fd);
+    return NULL;
+  }
+  Reader *r = open_reader(NULL, file_name, symbol_map);
+  size_t size = stat_buffer.st_size;
+  uint8_t *input = NULL;
+#if !defined(_WIN32)
+  if (size > 0 && S_ISREG(stat_buffer.st_mode)) {
+    input = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (input == MAP_FAILED) {
+      input = NULL;
+    } else {
+      r->input_type = INPUT_MAPPED;
+    }
+  }
+#endif
+  if (!input) {
+    Buffer buffer = create_buffer(8192);
+    ssize_t n;
+    while ((n = read(fd, buffer.data + buffer.size, buffer.capacity - buffer.size)) > 0) {
+      buffer.size += n;
+      if (buffer.size == buffer.capacity) {
+        buffer.capacity *= 2;
+        buffer.data = reallocate(buffer.data, buffer.capacity);
+      }
+    }
+    if (n < 0) {
+      int error = errno;
+      delete_buffer(buffer);
+      close(fd);
+      close_reader(r);
+      errno = error;
+      return NULL;
+    }
+    input = buffer.data;
+    size = buffer.size;
+    r->input_type = INPUT_ALLOCATED;
+  }
+  close(fd);
+  r->input = r->cursor = input;
+  r->input_end = input + size;
+  r->input_size = size;
+  return r;
+}
+
+size_t get_reader_offset(Reader *r) {
+  return r->offset;
+}
+
 int reader_errors(Reader *r) {
   return r->errors;
 }
@@ -95,9 +190,36 @@ static void clear_parens(Reader *r) {
   }
 }
 
+static void release_tokens(Reader *r) {
+  for (Token *t = r->tokens; t; t = t->next) {
+    if ((t->type == T_STRING || t->type == T_TEXT) && t->string_value) {
+      free(t->string_value);
+    }
+  }
+  r->tokens = r->last = NULL;
+  while (r->token_blocks) {
+    TokenBlock *block = r->token_blocks;
+    r->token_blocks = block->next;
+    free(block);
+  }
+}
+
 void close_reader(Reader *r) {
   clear_parens(r);
-  delete_tokens(r->tokens);
+  release_tokens(r);
+  delete_buffer(r->name_buffer);
+  switch (r->input_type) {
+    case INPUT_FILE:
+      break;
+    case INPUT_MAPPED:
+#if !defined(_WIN32)
+      munmap((void *) r->input, r->input_size);
+#endif
+      break;
+    case INPUT_ALLOCATED:
+      free((void *) r->input);
+      break;
+  }
   delete_path(r->file_name);
   free(r);
 }
@@ -116,6 +238,12 @@ static void reader_error(Reader *r, const char *format, ...) {
 }
 
 static int peek_n(uint8_t n, Reader *r) {
+  if (r->input_type != INPUT_FILE) {
+    if (r->input_end - r->cursor < n) {
+      return EOF;
+    }
+    return r->cursor[n - 1];
+  }
   while (r->la < n) {
     int c = fgetc(r->file);
     if (c == EOF) {
@@ -133,7 +261,12 @@ static int peek(Reader *r) {
 
 static int pop(Reader *r) {
   int c;
-  if (r->la > 0) {
+  if (r->input_type != INPUT_FILE) {
+    if (r->cursor >= r->input_end) {
+      return EOF;
+    }
+    c = *(r->cursor++);
+  } else if (r->la > 0) {
     c = r->buffer[0];
     r->la--;
     for (int i = 0; i < r->la; i++) {
@@ -151,8 +284,40 @@ static int pop(Reader *r) {
   return c;
 }
 
+/* Appends bytes to the buffer until one of the stop characters or the end of
+ * input is reached. */
+static void read_run(Reader *r, Buffer *buffer, const char *stop) {
+  if (r->input_type == INPUT_FILE) {
+    int c = peek(r);
+    while (c != EOF && (!c || !strchr(stop, c))) {
+      buffer_put(buffer, pop(r));
+      c = peek(r);
+    }
+    return;
+  }
+  const uint8_t *start = r->cursor;
+  const uint8_t *p = start;
+  while (p < r->input_end && (!*p || !strchr(stop, *p))) {
+    if (*p == '\n') {
+      r->pos.line++;
+      r->pos.column = 1;
+    } else {
+      r->pos.column++;
+    }
+    p++;
+  }
+  buffer_append_bytes(buffer, start, p - start);
+  r->cursor = p;
+}
+
 static Token *create_token(TokenType type, Reader *r) {
-  Token *t = allocate(sizeof(Token));
+  if (!r->token_blocks || r->token_blocks->size >= TOKEN_BLOCK_SIZE) {
+    TokenBlock *block = allocate(sizeof(TokenBlock));
+    block->next = r->token_blocks;
+    block->size = 0;
+    r->token_blocks = block;
+  }
+  Token *t = &r->token_blocks->tokens[r->token_blocks->size++];
   t->string_value = NULL;
   t->next = NULL;
   t->start = r->pos;
@@ -175,24 +340,24 @@ static int is_valid_name_char(int c) {
 
 static Token *read_name(Reader *r) {
   Token *token = create_token(T_NAME, r);
-  Buffer buffer = create_buffer(0);
+  Buffer *buffer = &r->name_buffer;
+  buffer->size = 0;
   while (1) {
     int c = peek(r);
     if (c == EOF || !is_valid_name_char(c)) {
-      if (!buffer.size) {
+      if (!buffer->size) {
         pop(r);
         reader_error(r, "unexpected '%c'", c);
         token->error = 1;
       }
       break;
     }
-    buffer_put(&buffer, c);
+    buffer_put(buffer, c);
     pop(r);
   }
-  token->size = buffer.size;
-  buffer_put(&buffer, '\0');
-  token->name_value = get_symbol((char *) buffer.data, r->symbol_map);
-  delete_buffer(buffer);
+  token->size = buffer->size;
+  buffer_put(buffer, '\0');
+  token->name_value = get_symbol((char *) buffer->data, r->symbol_map);
   for (const char **keyword = keywords; *keyword; keyword++) {
     if (strcmp(*keyword, token->name_value) == 0) {
       token->type = T_KEYWORD;
@@ -371,7 +536,7 @@ static Token *read_string(Reader *r) {
         token->error = 1;
       }
     } else {
-      buffer_put(&buffer, pop(r));
+      read_run(r, &buffer, "'\\");
     }
   }
   token->size = buffer.size;
@@ -504,7 +669,7 @@ static Token *read_next_token(Reader *r) {
         push_paren(r, '$'); // end quote
         break;
       } else {
-        buffer_put(&buffer, pop(r));
+        read_run(r, &buffer, top_paren == '"' ? "{\\\"" : "{");
       }
     }
     token->size = buffer.size;
@@ -557,7 +722,7 @@ static Token *read_next_token(Reader *r) {
             }
           }
         }
-        delete_token(token);
+        r->token_blocks->size--;
         return read_next_token(r);
       }
       push_paren(r, token->punct_value);
@@ -613,6 +778,9 @@ static Token *reader_peek_token(Reader *reader) {
 static Token *reader_pop_token(Reader *reader) {
   Token *t = reader_peek_token(reader);
   if (t->type != T_EOF) {
+    if (reader->input_type != INPUT_FILE) {
+      reader->offset = reader->cursor - reader->input;
+    }
     Token *next = read_next_token(reader);
     if (next->error) {
       reader->errors++;
@@ -624,9 +792,8 @@ static Token *reader_pop_token(Reader *reader) {
 }
 
 TokenStream read_all(Reader *r, int template) {
-  delete_tokens(r->tokens);
+  release_tokens(r);
   r->errors = 0;
-  r->tokens = r->last = NULL;
   clear_parens(r);
   if (!template) {
     push_paren(r, '{');
@@ -15,7 +15,10 @@
 typedef struct Reader Reader;
 
 Reader *open_reader(FILE *file, const Path *file_name, SymbolMap *symbol_map);
+Reader *open_file_reader(const Path *file_name, SymbolMap *symbol_map);
 void close_reader(Reader *r);
+// Byte offset of the end of the last popped token, only tracked for files opened with open_file_reader()
+size_t get_reader_offset(Reader *r);
 int reader_errors(Reader *r);
 void set_reader_silent(int silent, Reader *r);
 
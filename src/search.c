@@ -0,0 +1,458 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#include "search.h"
+
+#include "hashmap.h"
+#include "interpreter.h"
+#include "strings.h"
+
+#include <alloca.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_TERM_LENGTH 64
+
+typedef struct {
+  size_t length;
+  size_t last_doc;
+  uint32_t *postings;
+  size_t size;
+  size_t capacity;
+  uint8_t bytes[];
+} SearchTerm;
+
+typedef struct {
+  const uint8_t *bytes;
+  size_t length;
+  SearchTerm *term;
+} TermEntry;
+
+typedef struct {
+  GenericHashMap terms;
+  GenericHashMap stop_words;
+  int stem;
+  size_t min_length;
+  size_t doc;
+  uint8_t token[MAX_TERM_LENGTH];
+  size_t token_length;
+  int overflow;
+} SearchIndex;
+
+static const char *default_fields[] = { "title", "html", NULL };
+static const char *default_store[] = { "title", NULL };
+
+static const char *inline_tags[] = {
+  "a", "abbr", "b", "bdi", "bdo", "cite", "code", "data", "del", "dfn", "em", "i", "ins", "kbd", "mark",
+  "q", "s", "samp", "small", "span", "strong", "sub", "sup", "time", "u", "var", NULL
+};
+
+static Hash term_hash(const void *p) {
+  const TermEntry *entry = p;
+  return hash_bytes(entry->bytes, entry->length, INIT_HASH);
+}
+
+static int term_equals(const void *a, const void *b) {
+  const TermEntry *entry_a = a;
+  const TermEntry *entry_b = b;
+  return entry_a->length == entry_b->length && memcmp(entry_a->bytes, entry_b->bytes, entry_a->length) == 0;
+}
+
+static int compare_terms(const void *a, const void *b) {
+  const TermEntry *entry_a = a;
+  const TermEntry *entry_b = b;
+  size_t length = entry_a->length < entry_b->length ? entry_a->length : entry_b->length;
+  int result = memcmp(entry_a->bytes, entry_b->bytes, length);
+  if (result) {
+    return result;
+  }
+  return (entry_a->length > entry_b->length) - (entry_a->length < entry_b->length);
+}
+
+static int is_inline_tag(Symbol tag) {
+  for (const char **inline_tag = inline_tags; *inline_tag; inline_tag++) {
+    if (strcmp(tag, *inline_tag) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Harman's S-stemmer: only removes plural endings, which makes it simple to
+// apply the same stemming to search queries on the client.
+static size_t stem_plural(uint8_t *token, size_t length) {
+  if (length <= 3 || token[length - 1] != 's') {
+    return length;
+  }
+  if (token[length - 3] == 'i' && token[length - 2] == 'e' && token[length - 4] != 'e' && token[length - 4] != 'a') {
+    token[length - 3] = 'y';
+    return length - 2;
+  }
+  if (token[length - 2] == 'u' || token[length - 2] == 's') {
+    return length;
+  }
+  return length - 1;
+}
+
+static void add_term(SearchIndex *index, const uint8_t *bytes, size_t length) {
+  TermEntry entry = { .bytes = bytes, .length = length, .term = NULL };
+  if (!generic_hash_map_get(&index->terms, &entry, &entry)) {
+    SearchTerm *term = allocate(sizeof(SearchTerm) + length);
+    term->length = length;
+    term->last_doc = SIZE_MAX;
+    term->postings = NULL;
+    term->size = 0;
+    term->capacity = 0;
+    memcpy(term->bytes, bytes, length);
+    entry.bytes = term->bytes;
+    entry.term = term;
+    generic_hash_map_add(&index->terms, &entry);
+  }
+  SearchTerm *term = entry.term;
+  if (term->last_doc == index->doc) {
+    term->postings[term->size - 1]++;
+    return;
+  }
+  if (term->size + 2 > term->capacity) {
+    term->capacity = term->capacity ? term->capacity << 1 : 4;
+    term->postings = reallocate(term->postings, term->capacity * sizeof(uint32_t));
+  }
+  term->postings[term->size++] = index->doc;
+  term->postings[term->size++] = 1;
+  term->last_doc = index->doc;
+}
+
+static void end_token(SearchIndex *index) {
+  size_t length = index->token_length;
+  index->token_length = 0;
+  if (index->overflow) {
+    index->overflow = 0;
+    return;
+  }
+  if (length < index->min_length) {
+    return;
+  }
+  TermEntry entry = { .bytes = index->token, .length = length, .term = NULL };
+  if (generic_hash_map_get(&index->stop_words, &entry, &entry)) {
+    return;
+  }
+  if (index->stem) {
+    length = stem_plural(index->token, length);
+  }
+  add_term(index, index->token, length);
+}
+
+// Returns the number of bytes in the separator at the start of bytes, or 0 if
+// bytes starts with a word character. All non-ASCII characters except some
+// common punctuation are treated as word characters.
+static size_t separator_length(const uint8_t *bytes, size_t size) {
+  uint8_t byte = bytes[0];
+  if (byte < 0x80) {
+    return (byte >= 'a' && byte <= 'z') || (byte >= 'A' && byte <= 'Z') || (byte >= '0' && byte <= '9') ? 0 : 1;
+  }
+  if (byte == 0xc2 && size >= 2) {
+    // U+00A0, U+00A1, U+00AB, U+00BB, U+00BF
+    uint8_t next = bytes[1];
+    if (next == 0xa0 || next == 0xa1 || next == 0xab || next == 0xbb || next == 0xbf) {
+      return 2;
+    }
+  } else if (byte == 0xe2 && size >= 3) {
+    // U+2000 - U+206F
+    if (bytes[1] == 0x80 || (bytes[1] == 0x81 && bytes[2] < 0xb0)) {
+      return 3;
+    }
+  } else if (byte == 0xe3 && size >= 3) {
+    // U+3000 - U+303F
+    if (bytes[1] == 0x80) {
+      return 3;
+    }
+  }
+  return 0;
+}
+
+static void index_bytes(SearchIndex *index, const uint8_t *bytes, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    size_t separator = separator_length(bytes + i, size - i);
+    if (separator) {
+      end_token(index);
+      i += separator - 1;
+      continue;
+    }
+    uint8_t byte = bytes[i];
+    if (byte >= 'A' && byte <= 'Z') {
+      byte += 'a' - 'A';
+    }
+    if (index->token_length < MAX_TERM_LENGTH) {
+      index->token[index->token_length++] = byte;
+    } else {
+      index->overflow = 1;
+    }
+  }
+}
+
+static void index_value(SearchIndex *index, Value value) {
+  switch (value.type) {
+    case V_STRING:
+      index_bytes(index, value.string_value->bytes, value.string_value->size);
+      break;
+    case V_SYMBOL:
+      index_bytes(index, (const uint8_t *) value.symbol_value, strlen(value.symbol_value));
+      break;
+    case V_ARRAY:
+      for (size_t i = 0; i < value.array_value->size; i++) {
+        index_value(index, value.array_value->cells[i]);
+        end_token(index);
+      }
+      break;
+    case V_OBJECT: {
+      // HTML nodes: words are only joined across inline elements
+      int is_inline = 0;
+      Value tag;
+      if (object_get_known(value.object_value, tag, &tag) && tag.type == V_SYMBOL) {
+        if (strcmp(tag.symbol_value, "script") == 0 || strcmp(tag.symbol_value, "style") == 0) {
+          break;
+        }
+        is_inline = is_inline_tag(tag.symbol_value);
+      }
+      if (!is_inline) {
+        end_token(index);
+      }
+      Value children;
+      if (object_get_known(value.object_value, children, &children) && children.type == V_ARRAY) {
+        for (size_t i = 0; i < children.array_value->size; i++) {
+          index_value(index, children.array_value->cells[i]);
+        }
+      }
+      if (!is_inline) {
+        end_token(index);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+static Value get_field_key(Value name, Env *env) {
+  if (name.type == V_SYMBOL) {
+    return name;
+  } else if (name.type == V_STRING) {
+    char *c_name = alloca(name.string_value->size + 1);
+    memcpy(c_name, name.string_value->bytes, name.string_value->size);
+    c_name[name.string_value->size] = '\0';
+    return create_symbol(get_symbol(c_name, env->symbol_map));
+  }
+  return nil_value;
+}
+
+static int get_field_keys(Object *options, const char *option, const char **default_keys, Value *keys, Env *env) {
+  Value names;
+  if (!object_get_symbol(options, option, &names)) {
+    *keys = create_array(0, env->arena);
+    for (const char **key = default_keys; *key; key++) {
+      array_push(keys->array_value, create_symbol(get_symbol(*key, env->symbol_map)), env->arena);
+    }
+    return 1;
+  }
+  if (names.type != V_ARRAY) {
+    env_error(env, 1, "search index %s must be an array of strings", option);
+    return 0;
+  }
+  *keys = create_array(names.array_value->size, env->arena);
+  for (size_t i = 0; i < names.array_value->size; i++) {
+    Value key = get_field_key(names.array_value->cells[i], env);
+    if (key.type == V_NIL) {
+      env_error(env, 1, "search index %s must be an array of strings", option);
+      return 0;
+    }
+    array_push(keys->array_value, key, env->arena);
+  }
+  return 1;
+}
+
+static int add_stop_words(SearchIndex *index, Value words, Env *env) {
+  if (words.type != V_ARRAY) {
+    env_error(env, 1, "search index stop_words must be an array of strings");
+    return 0;
+  }
+  for (size_t i = 0; i < words.array_value->size; i++) {
+    Value word = words.array_value->cells[i];
+    if (word.type != V_STRING) {
+      env_error(env, 1, "search index stop_words must be an array of strings");
+      return 0;
+    }
+    // Stop words are matched after case folding
+    String *lower = allocate_string(word.string_value->size, env->arena).string_value;
+    for (size_t j = 0; j < lower->size; j++) {
+      uint8_t byte = word.string_value->bytes[j];
+      lower->bytes[j] = byte >= 'A' && byte <= 'Z' ? byte + 'a' - 'A' : byte;
+    }
+    TermEntry entry = { .bytes = lower->bytes, .length = lower->size, .term = NULL };
+    generic_hash_map_set(&index->stop_words, &entry, NULL, NULL);
+  }
+  return 1;
+}
+
+static void delete_search_index(SearchIndex *index) {
+  HashMapIterator it = generic_hash_map_iterate(&index->terms);
+  TermEntry entry;
+  while (generic_hash_map_next(&it, &entry)) {
+    free(entry.term->postings);
+    free(entry.term);
+  }
+  delete_generic_hash_map(&index->terms);
+  delete_generic_hash_map(&index->stop_words);
+}
+
+static void write_terms(SearchIndex *index, Buffer *buffer) {
+  size_t num_terms = index->terms.size;
+  TermEntry *terms = allocate(num_terms * sizeof(TermEntry) + 1);
+  HashMapIterator it = generic_hash_map_iterate(&index->terms);
+  size_t i = 0;
+  while (i < num_terms && generic_hash_map_next(&it, &terms[i])) {
+    i++;
+  }
+  qsort(terms, i, sizeof(TermEntry), compare_terms);
+  buffer_printf(buffer, "{");
+  for (size_t j = 0; j < i; j++) {
+    SearchTerm *term = terms[j].term;
+    if (j > 0) {
+      buffer_put(buffer, ',');
+    }
+    // Terms only contain alphanumeric and non-ASCII bytes, so they don't need escaping
+    buffer_put(buffer, '"');
+    buffer_append_bytes(buffer, term->bytes, term->length);
+    buffer_printf(buffer, "\":[");
+    uint32_t prev_doc = 0;
+    for (size_t k = 0; k < term->size; k += 2) {
+      if (k > 0) {
+        buffer_put(buffer, ',');
+      }
+      buffer_printf(buffer, "%" PRIu32 ",%" PRIu32, term->postings[k] - prev_doc, term->postings[k + 1]);
+      prev_doc = term->postings[k];
+    }
+    buffer_put(buffer, ']');
+  }
+  buffer_printf(buffer, "}");
+  free(terms);
+}
+
+static Value search_index(const Tuple *args, Env *env) {
+  check_args_between(1, 2, args, env);
+  Value items = args->values[0];
+  if (items.type != V_ARRAY) {
+    arg_type_error(0, V_ARRAY, args, env);
+    return nil_value;
+  }
+  Object *options = create_object(0, env->arena).object_value;
+  if (args->size > 1) {
+    if (args->values[1].type != V_OBJECT) {
+      arg_type_error(1, V_OBJECT, args, env);
+      return nil_value;
+    }
+    options = args->values[1].object_value;
+  }
+  Value ref = nil_value;
+  if (object_get_symbol(options, "ref", &ref) && ref.type != V_FUNCTION && ref.type != V_CLOSURE) {
+    env_error(env, 1, "search index ref must be a function");
+    return nil_value;
+  }
+  Value fields, store;
+  if (!get_field_keys(options, "fields", default_fields, &fields, env)) {
+    return nil_value;
+  }
+  if (!get_field_keys(options, "store", default_store, &store, env)) {
+    return nil_value;
+  }
+  SearchIndex index;
+  init_generic_hash_map(&index.terms, sizeof(TermEntry), 0, term_hash, term_equals, NULL);
+  init_generic_hash_map(&index.stop_words, sizeof(TermEntry), 0, term_hash, term_equals, NULL);
+  index.stem = 1;
+  index.min_length = 2;
+  index.token_length = 0;
+  index.overflow = 0;
+  Value option;
+  if (object_get_symbol(options, "stem", &option)) {
+    index.stem = is_truthy(option);
+  }
+  if (object_get_symbol(options, "min_length", &option)) {
+    if (option.type != V_INT || option.int_value < 1) {
+      env_error(env, 1, "search index min_length must be a positive integer");
+      delete_search_index(&index);
+      return nil_value;
+    }
+    index.min_length = option.int_value;
+  }
+  if (object_get_symbol(options, "stop_words", &option) && !add_stop_words(&index, option, env)) {
+    delete_search_index(&index);
+    return nil_value;
+  }
+  Buffer buffer = create_buffer(0);
+  buffer_printf(&buffer, "{\"version\":1,\"stem\":%s,\"fields\":[", index.stem ? "true" : "false");
+  for (size_t i = 0; i < store.array_value->size; i++) {
+    if (i > 0) {
+      buffer_put(&buffer, ',');
+    }
+    json_encode_value(store.array_value->cells[i], &buffer);
+  }
+  buffer_printf(&buffer, "],\"docs\":[");
+  Tuple *func_args = alloca(sizeof(Tuple) + sizeof(Value));
+  func_args->size = 1;
+  for (size_t i = 0; i < items.array_value->size; i++) {
+    Value item = items.array_value->cells[i];
+    if (item.type != V_OBJECT) {
+      env_error(env, 0, "search index item must be an object");
+      delete_search_index(&index);
+      delete_buffer(buffer);
+      return nil_value;
+    }
+    index.doc = i;
+    for (size_t j = 0; j < fields.array_value->size; j++) {
+      Value value;
+      if (object_get(item.object_value, fields.array_value->cells[j], &value)) {
+        index_value(&index, value);
+        end_token(&index);
+      }
+    }
+    Value doc_ref = nil_value;
+    if (ref.type != V_NIL) {
+      func_args->values[0] = item;
+      if (!apply(ref, func_args, &doc_ref, env)) {
+        env->error_arg = 1;
+        delete_search_index(&index);
+        delete_buffer(buffer);
+        return nil_value;
+      }
+    } else {
+      object_get_known(item.object_value, name, &doc_ref);
+    }
+    if (i > 0) {
+      buffer_put(&buffer, ',');
+    }
+    buffer_put(&buffer, '[');
+    json_encode_value(doc_ref, &buffer);
+    for (size_t j = 0; j < store.array_value->size; j++) {
+      Value value = nil_value;
+      object_get(item.object_value, store.array_value->cells[j], &value);
+      buffer_put(&buffer, ',');
+      json_encode_value(value, &buffer);
+    }
+    buffer_put(&buffer, ']');
+  }
+  buffer_printf(&buffer, "],\"terms\":");
+  write_terms(&index, &buffer);
+  buffer_put(&buffer, '}');
+  Value result = create_string(buffer.data, buffer.size, env->arena);
+  delete_search_index(&index);
+  delete_buffer(buffer);
+  return result;
+}
+
+void import_search(Env *env) {
+  env_def_fn("search_index", search_index, env);
+}
@@ -0,0 +1,14 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include "value.h"
+
+void import_search(Env *env);
+
+#endif
@@ -7,61 +7,246 @@
 #define _GNU_SOURCE
 #include "server.h"
 
+#include "compress.h"
 #include "datetime.h"
 #include "module.h"
+#include "pagecache.h"
 #include "sitemap.h"
+#include "template.h"
+#include "watcher.h"
 
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#define WITH_EPOLL
+#define WITH_SENDFILE
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#else
+#include <poll.h>
+#endif
+
+#define SSE_KEEP_ALIVE_MS 1000
+#define POLL_INTERVAL_MS 100
+#define IDLE_TIMEOUT_MS 60000
+#define MAX_REQUEST_SIZE 65536
+#define MAX_EVENTS 64
+#define CHUNK_SIZE 65536
+
+#define EV_READ 1
+#define EV_WRITE 2
+
+typedef struct {
+  int fd;
+  int sse;
+  int keep_alive;
+  int head_request;
+  int closing;
+  long last_active;
+  Buffer in;
+  Buffer out;
+  size_t out_offset;
+  int file;
+  off_t file_offset;
+  off_t file_end;
+} Connection;
+
+typedef struct {
+  const char *uri;
+  const char *if_none_match;
+  const char *if_modified_since;
+  const char *range;
+  const char *accept_encoding;
+} Request;
+
+typedef struct {
+  int fd;
+  int events;
+} Event;
+
+typedef struct {
+  const uint8_t *dest;
+  size_t size;
+  Object *page;
+} PageEntry;
+
 typedef struct {
   SymbolMap *symbol_map;
   ModuleMap *modules;
   Path *src_root;
   Path *dist_root;
   Env *env;
+  GenericHashMap pages;
+  PageCache *page_cache;
+  Hash globals_hash;
+  int listen_fd;
+  Watcher *watcher;
+#if defined(WITH_EPOLL)
+  int epoll_fd;
+#endif
+  int *interests;
+  Connection **connections;
+  size_t capacity;
 } ServerInfo;
 
-static ssize_t write_buffer(int fd, Buffer buffer) {
-  return write(fd, buffer.data, buffer.size);
+static long get_time_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+static void ensure_capacity(ServerInfo *info, int fd) {
+  if (fd < info->capacity) {
+    return;
+  }
+  size_t capacity = info->capacity ? info->capacity : 64;
+  while (capacity <= fd) {
+    capacity <<= 1;
+  }
+  info->interests = reallocate(info->interests, capacity * sizeof(int));
+  info->connections = reallocate(info->connections, capacity * sizeof(Connection *));
+  memset(info->interests + info->capacity, 0, (capacity - info->capacity) * sizeof(int));
+  memset(info->connections + info->capacity, 0, (capacity - info->capacity) * sizeof(Connection *));
+  info->capacity = capacity;
+}
+
+static int init_event_loop(ServerInfo *info) {
+  info->interests = NULL;
+  info->connections = NULL;
+  info->capacity = 0;
+#if defined(WITH_EPOLL)
+  info->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (info->epoll_fd < 0) {
+    fprintf(stderr, ERROR_LABEL "could not create event loop: %s" SGR_RESET "\n", strerror(errno));
+    return 0;
+  }
+#endif
+  return 1;
+}
+
+static void delete_event_loop(ServerInfo *info) {
+#if defined(WITH_EPOLL)
+  close(info->epoll_fd);
+#endif
+  if (info->interests) {
+    free(info->interests);
+  }
+  if (info->connections) {
+    free(info->connections);
+  }
+}
+
+static void set_interest(ServerInfo *info, int fd, int events) {
+  ensure_capacity(info, fd);
+  if (info->interests[fd] == events) {
+    return;
+  }
+#if defined(WITH_EPOLL)
+  struct epoll_event event;
+  event.events = ((events & EV_READ) ? EPOLLIN : 0) | ((events & EV_WRITE) ? EPOLLOUT : 0);
+  event.data.fd = fd;
+  if (!events) {
+    epoll_ctl(info->epoll_fd, EPOLL_CTL_DEL, fd, &event);
+  } else if (!info->interests[fd]) {
+    epoll_ctl(info->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  } else {
+    epoll_ctl(info->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+  }
+#endif
+  info->interests[fd] = events;
+}
+
+static int wait_for_events(ServerInfo *info, Event *events, int timeout_ms) {
+#if defined(WITH_EPOLL)
+  struct epoll_event epoll_events[MAX_EVENTS];
+  int n = epoll_wait(info->epoll_fd, epoll_events, MAX_EVENTS, timeout_ms);
+  for (int i = 0; i < n; i++) {
+    events[i].fd = epoll_events[i].data.fd;
+    events[i].events = 0;
+    if (epoll_events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+      events[i].events |= EV_READ;
+    }
+    if (epoll_events[i].events & EPOLLOUT) {
+      events[i].events |= EV_WRITE;
+    }
+  }
+  return n;
+#else
+  struct pollfd *fds = allocate(info->capacity * sizeof(struct pollfd) + 1);
+  nfds_t nfds = 0;
+  for (int fd = 0; fd < info->capacity; fd++) {
+    if (info->interests[fd]) {
+      fds[nfds].fd = fd;
+      fds[nfds].events = ((info->interests[fd] & EV_READ) ? POLLIN : 0)
+        | ((info->interests[fd] & EV_WRITE) ? POLLOUT : 0);
+      fds[nfds].revents = 0;
+      nfds++;
+    }
+  }
+  int n = 0;
+  if (poll(fds, nfds, timeout_ms) > 0) {
+    for (nfds_t i = 0; i < nfds && n < MAX_EVENTS; i++) {
+      if (fds[i].revents) {
+        events[n].fd = fds[i].fd;
+        events[n].events = 0;
+        if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+          events[n].events |= EV_READ;
+        }
+        if (fds[i].revents & POLLOUT) {
+          events[n].events |= EV_WRITE;
+        }
+        n++;
+      }
+    }
+  }
+  free(fds);
+  return n;
+#endif
+}
+
+static void write_server_headers(Connection *c, int status_code, const char *status) {
+  buffer_printf(&c->out, "HTTP/1.1 %d %s\r\nConnection: %s\r\nAllow: GET, HEAD\r\nCache-Control: no-cache\r\n",
+      status_code, status, c->keep_alive ? "keep-alive" : "close");
+  size_t start = c->out.size;
+  buffer_printf(&c->out, "Date: ");
+  if (http_date(time(NULL), &c->out)) {
+    buffer_printf(&c->out, "\r\n");
+  } else {
+    c->out.size = start;
+  }
 }
 
-static void write_server_headers(int cfd, int status_code, const char *status) {
-  Buffer buffer = create_buffer(32);
-  buffer_printf(&buffer, "HTTP/1.1 %d %s\r\nConnection: close\r\nAllow: GET\r\nCache-Control: no-cache\r\n",
-      status_code, status);
-  write_buffer(cfd, buffer);
-  buffer.size = 0;
-  buffer_printf(&buffer, "Date: ");
-  if (rfc2822_date(time(NULL), &buffer)) {
-    buffer_printf(&buffer, "\r\n");
-    write_buffer(cfd, buffer);
+static void write_body(Connection *c, const uint8_t *bytes, size_t size) {
+  if (!c->head_request) {
+    buffer_append_bytes(&c->out, bytes, size);
   }
-  delete_buffer(buffer);
 }
 
-static void not_found_response(int cfd) {
-  write_server_headers(cfd, 404, "Not Found");
-  Buffer response = create_buffer(32);
-  buffer_printf(&response, "Content-Type: text/plain\r\n\r\nNot Found");
-  write_buffer(cfd, response);
-  delete_buffer(response);
+static void text_response(Connection *c, int status_code, const char *status, const char *text) {
+  write_server_headers(c, status_code, status);
+  size_t length = strlen(text);
+  buffer_printf(&c->out, "Content-Type: text/plain\r\nContent-Length: %zd\r\n\r\n", length);
+  write_body(c, (const uint8_t *) text, length);
 }
 
-static void internal_server_error_response(int cfd, const char *error) {
-  write_server_headers(cfd, 500, "Internal Server Error");
-  Buffer response = create_buffer(32);
-  buffer_printf(&response, "Content-Type: text/plain\r\n\r\n%s", error);
-  write_buffer(cfd, response);
-  delete_buffer(response);
+static void not_found_response(Connection *c) {
+  text_response(c, 404, "Not Found", "Not Found");
+}
+
+static void internal_server_error_response(Connection *c, const char *error) {
+  text_response(c, 500, "Internal Server Error", error);
 }
 
 static const char *get_mime_type(const char *file_extension) {
@@ -99,198 +284,704 @@ static const char *get_mime_type(const char *file_extension) {
   return "text/plain";
 }
 
-static void inject_sse_client(int cfd) {
-  Buffer js = create_buffer(256);
-  buffer_printf(&js, "<script>");
-  buffer_printf(&js, "(function() {");
-  buffer_printf(&js, "var eventSource = new EventSource('/.plet-hot-reload-event-source');");
-  buffer_printf(&js, "eventSource.addEventListener('changes_detected', function (e) {");
-  buffer_printf(&js, "console.log('Changes detected, reloading...');");
-  buffer_printf(&js, "eventSource.close();");
-  buffer_printf(&js, "location.reload();");
-  buffer_printf(&js, "});");
-  buffer_printf(&js, "})();");
-  buffer_printf(&js, "</script>");
-  write_buffer(cfd, js);
-  delete_buffer(js);
-}
-
-static void ok_response(int cfd, const char *file_extension, String *content) {
-  write_server_headers(cfd, 200, "OK");
-  Buffer response = create_buffer(32);
-  buffer_printf(&response, "Content-Type: %s\r\n\r\n", get_mime_type(file_extension));
-  write_buffer(cfd, response);
-  delete_buffer(response);
-  if (strcmp(file_extension, "html") == 0) {
-    for (size_t i = 0; i < content->size - (sizeof("</body>") - 1); i++) {
-      if (memcmp(content->bytes + i, "</body>", sizeof("</body>") - 1) == 0) {
-        write(cfd, content->bytes, i);
-        inject_sse_client(cfd);
-        write(cfd, content->bytes + i, content->size - i);
-        return;
+static const char sse_client[] =
+  "<script>"
+  "(function() {"
+  "var eventSource = new EventSource('/.plet-hot-reload-event-source');"
+  "eventSource.addEventListener('changes_detected', function (e) {"
+  "console.log('Changes detected, reloading...');"
+  "eventSource.close();"
+  "location.reload();"
+  "});"
+  "})();"
+  "</script>";
+
+static void ok_response(Connection *c, const char *file_extension, const uint8_t *content, size_t size) {
+  size_t body_end = size;
+  if (strcmp(file_extension, "html") == 0 && size >= sizeof("</body>") - 1) {
+    for (size_t i = 0; i <= size - (sizeof("</body>") - 1); i++) {
+      if (memcmp(content + i, "</body>", sizeof("</body>") - 1) == 0) {
+        body_end = i;
+        break;
       }
     }
   }
-  write(cfd, content->bytes, content->size);
+  size_t length = size;
+  if (body_end < size) {
+    length += sizeof(sse_client) - 1;
+  }
+  write_server_headers(c, 200, "OK");
+  buffer_printf(&c->out, "Content-Type: %s\r\nContent-Length: %zd\r\n\r\n", get_mime_type(file_extension),
+      length);
+  write_body(c, content, body_end);
+  if (body_end < size) {
+    write_body(c, (const uint8_t *) sse_client, sizeof(sse_client) - 1);
+    write_body(c, content + body_end, size - body_end);
+  }
 }
 
-static void event_source_response(int cfd, ModuleMap *modules) {
-  write_server_headers(cfd, 200, "OK");
-  Buffer response = create_buffer(32);
-  buffer_printf(&response, "Content-Type: text/event-stream\r\n\r\n");
-  write_buffer(cfd, response);
-  int counter = 0;
-  while (1) {
-    struct timespec delay;
-    delay.tv_sec = 0;
-    delay.tv_nsec = 100000000L;
-    nanosleep(&delay, NULL);
-    response.size = 0;
-    if (detect_changes(modules)) {
-      buffer_printf(&response, "event: changes_detected\ndata:\n\n", counter++);
-    } else {
-      buffer_printf(&response, "event: no_changes\ndata:\n\n", counter++);
+static void event_source_response(Connection *c) {
+  buffer_printf(&c->out, "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nCache-Control: no-cache\r\n"
+      "Content-Type: text/event-stream\r\n\r\n");
+  c->sse = 1;
+}
+
+static int etag_matches(const char *header, const char *etag) {
+  if (strcmp(header, "*") == 0) {
+    return 1;
+  }
+  size_t length = strlen(etag);
+  const char *match = header;
+  while ((match = strstr(match, etag))) {
+    if ((match == header || match[-1] == ' ' || match[-1] == ',' || match[-1] == '/')
+        && (!match[length] || match[length] == ',' || match[length] == ' ')) {
+      return 1;
     }
-    if (write_buffer(cfd, response) < 0) {
-      break;
+    match += length;
+  }
+  return 0;
+}
+
+// Parses a single byte range. Returns -1 if the header should be ignored and 0 if the range is unsatisfiable.
+static int parse_range(const char *header, off_t size, off_t *start, off_t *end) {
+  if (strncmp(header, "bytes=", 6) != 0 || strchr(header, ',')) {
+    return -1;
+  }
+  const char *p = header + 6;
+  char *rest;
+  if (*p == '-') {
+    long long suffix = strtoll(p + 1, &rest, 10);
+    if (rest == p + 1 || *rest || suffix < 0) {
+      return -1;
+    }
+    if (!suffix || !size) {
+      return 0;
+    }
+    *start = suffix < size ? size - suffix : 0;
+    *end = size;
+    return 1;
+  }
+  long long first = strtoll(p, &rest, 10);
+  if (rest == p || *rest != '-' || first < 0) {
+    return -1;
+  }
+  p = rest + 1;
+  long long last = size - 1;
+  if (*p) {
+    last = strtoll(p, &rest, 10);
+    if (*rest || last < first) {
+      return -1;
     }
   }
-  delete_buffer(response);
+  if (first >= size) {
+    return 0;
+  }
+  *start = first;
+  *end = last < size ? last + 1 : size;
+  return 1;
 }
 
-static void file_response(int cfd, const Path *path) {
-  FILE *file = fopen(path->path, "r");
-  if (!file) {
-    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, strerror(errno));
-    not_found_response(cfd);
-    return;
+static int accepts_encoding(const char *header, const char *encoding) {
+  size_t length = strlen(encoding);
+  while (*header) {
+    header += strspn(header, " \t,");
+    size_t token_length = strcspn(header, " \t,;");
+    const char *parameters = header + token_length;
+    header = parameters + strcspn(parameters, ",");
+    if (token_length == length && strncasecmp(parameters - token_length, encoding, length) == 0) {
+      const char *q = strstr(parameters, "q=");
+      return !q || q > header || strtod(q + 2, NULL) > 0;
+    }
+  }
+  return 0;
+}
+
+// Serves a precompressed file written by COMPRESS_OUTPUT instead of the original if the client accepts it
+static int open_compressed_variant(const Path *path, const Request *request, const char **encoding) {
+  if (!request->accept_encoding || request->range) {
+    return -1;
   }
-  write_server_headers(cfd, 200, "OK");
-  Buffer response = create_buffer(32);
-  buffer_printf(&response, "Content-Type: %s\r\n\r\n", get_mime_type(path_get_extension(path)));
-  write_buffer(cfd, response);
-  delete_buffer(response);
-  char *buffer = allocate(4096);
-  size_t n;
-  do {
-    n = fread(buffer, 1, 4096, file);
-    write(cfd, buffer, n);
-  } while (n == 4096);
-  if (!feof(file)) {
-    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "read error: %s" SGR_RESET "\n", path->path, strerror(errno));
+  for (int i = E_BROTLI; i >= E_GZIP; i--) {
+    if (!accepts_encoding(request->accept_encoding, encoding_names[i])) {
+      continue;
+    }
+    Path *compressed_path = get_compressed_path(path, i);
+    int fd = -1;
+    if (compressed_is_current(path, compressed_path)) {
+      fd = open(compressed_path->path, O_RDONLY | O_CLOEXEC);
+    }
+    delete_path(compressed_path);
+    if (fd >= 0) {
+      *encoding = encoding_names[i];
+      return fd;
+    }
   }
-  free(buffer);
+  return -1;
 }
 
-static char *get_next_token(char *buffer, ssize_t n, ssize_t *offset) {
-  while (*offset < n && isspace(buffer[*offset])) {
-      (*offset)++;
+static void file_response(Connection *c, const Path *path, const Request *request) {
+  int compressible = is_compressible(path);
+  const char *encoding = NULL;
+  int fd = compressible ? open_compressed_variant(path, request, &encoding) : -1;
+  if (fd < 0) {
+    fd = open(path->path, O_RDONLY | O_CLOEXEC);
   }
-  char *token = buffer + *offset;
-  while (*offset < n && !isspace(buffer[*offset])) {
-      (*offset)++;
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    if (fd < 0) {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", path->path, strerror(errno));
+    } else {
+      close(fd);
+    }
+    not_found_response(c);
+    return;
   }
-  if (*offset >= n) {
-    return NULL;
+  char etag[48];
+  snprintf(etag, sizeof(etag), "\"%jx-%jx\"", (uintmax_t) st.st_mtime, (uintmax_t) st.st_size);
+  Buffer last_modified = create_buffer(32);
+  http_date(st.st_mtime, &last_modified);
+  buffer_put(&last_modified, '\0');
+  int not_modified;
+  if (request->if_none_match) {
+    not_modified = etag_matches(request->if_none_match, etag);
+  } else {
+    not_modified = request->if_modified_since
+      && strcmp(request->if_modified_since, (char *) last_modified.data) == 0;
   }
-  buffer[*offset] = '\0';
-  (*offset)++;
-  return token;
+  off_t start = 0, end = st.st_size;
+  int range = not_modified || !request->range ? -1 : parse_range(request->range, st.st_size, &start, &end);
+  if (not_modified) {
+    write_server_headers(c, 304, "Not Modified");
+  } else if (range == 0) {
+    write_server_headers(c, 416, "Range Not Satisfiable");
+  } else if (range > 0) {
+    write_server_headers(c, 206, "Partial Content");
+  } else {
+    write_server_headers(c, 200, "OK");
+  }
+  buffer_printf(&c->out, "ETag: %s\r\nLast-Modified: %s\r\nAccept-Ranges: bytes\r\n", etag, last_modified.data);
+  delete_buffer(last_modified);
+  if (compressible) {
+    buffer_printf(&c->out, "Vary: Accept-Encoding\r\n");
+  }
+  if (encoding) {
+    buffer_printf(&c->out, "Content-Encoding: %s\r\n", encoding);
+  }
+  if (not_modified) {
+    buffer_printf(&c->out, "\r\n");
+    close(fd);
+    return;
+  }
+  if (range == 0) {
+    buffer_printf(&c->out, "Content-Range: bytes */%jd\r\nContent-Length: 0\r\n\r\n", (intmax_t) st.st_size);
+    close(fd);
+    return;
+  }
+  if (range > 0) {
+    buffer_printf(&c->out, "Content-Range: bytes %jd-%jd/%jd\r\n", (intmax_t) start, (intmax_t) end - 1,
+        (intmax_t) st.st_size);
+  }
+  buffer_printf(&c->out, "Content-Type: %s\r\nContent-Length: %jd\r\n\r\n", get_mime_type(path_get_extension(path)),
+      (intmax_t) (end - start));
+  if (c->head_request || start == end) {
+    close(fd);
+    return;
+  }
+  c->file = fd;
+  c->file_offset = start;
+  c->file_end = end;
+}
+
+static Hash page_entry_hash(const void *p) {
+  const PageEntry *entry = p;
+  return hash_bytes(entry->dest, entry->size, INIT_HASH);
 }
 
-static Object *find_in_site_map(const Path *dist_path, Env *env) {
+static int page_entry_equals(const void *a, const void *b) {
+  const PageEntry *entry_a = a;
+  const PageEntry *entry_b = b;
+  return entry_a->size == entry_b->size && memcmp(entry_a->dest, entry_b->dest, entry_a->size) == 0;
+}
+
+static void index_site_map(ServerInfo *info) {
+  generic_hash_map_clear(&info->pages);
   Value site_map;
-  if (!env_get_symbol("SITE_MAP", &site_map, env) || site_map.type != V_ARRAY) {
+  if (!env_get_known(SITE_MAP, &site_map, info->env) || site_map.type != V_ARRAY) {
     fprintf(stderr, ERROR_LABEL "SITE_MAP is missign or not an object" SGR_RESET "\n");
-    return NULL;
+    return;
   }
-  Path *index_path = path_append(dist_path, "index.html");
-  Value dist = path_to_string(dist_path, env->arena);
-  Value index = path_to_string(index_path, env->arena);
-  delete_path(index_path);
   for (size_t i = 0; i < site_map.array_value->size; i++) {
     Value page = site_map.array_value->cells[i];
     Value dest;
-    if (page.type == V_OBJECT && object_get_symbol(page.object_value, "dest", &dest)) {
-      if (equals(dest, dist) || equals(dest, index)) {
-        return page.object_value;
+    if (page.type == V_OBJECT && object_get_known(page.object_value, dest, &dest) && dest.type == V_STRING) {
+      PageEntry entry = { dest.string_value->bytes, dest.string_value->size, page.object_value };
+      if (!generic_hash_map_get(&info->pages, &entry, NULL)) {
+        generic_hash_map_add(&info->pages, &entry);
       }
     }
   }
-  return NULL;
 }
 
-static void handle_request(int cfd, ServerInfo *info) {
-  char *buffer = allocate(4096);
-  ssize_t n = recv(cfd, buffer, 4096, 0);
-  if (n == -1) {
-    fprintf(stderr, ERROR_LABEL "request failed: %s" SGR_RESET "\n", strerror(errno));
-  } else if (n == 0) {
-    fprintf(stderr, ERROR_LABEL "client closed connection" SGR_RESET "\n");
+static Object *find_in_site_map(const Path *dist_path, ServerInfo *info) {
+  PageEntry entry = { (const uint8_t *) dist_path->path, dist_path->size, NULL };
+  if (generic_hash_map_get(&info->pages, &entry, &entry)) {
+    return entry.page;
+  }
+  Path *index_path = path_append(dist_path, "index.html");
+  entry = (PageEntry) { (const uint8_t *) index_path->path, index_path->size, NULL };
+  generic_hash_map_get(&info->pages, &entry, &entry);
+  delete_path(index_path);
+  return entry.page;
+}
+
+static void handle_request(Connection *c, const Request *request, ServerInfo *info) {
+  const char *uri = request->uri;
+  if (strcmp(uri, "/.plet-hot-reload-event-source") == 0) {
+    event_source_response(c);
+    return;
+  }
+  Path *path = create_path(uri, strcspn(uri, "?#"));
+  Path *dist_path = get_dist_path(path, info->env);
+  delete_path(path);
+  if (!dist_path) {
+    not_found_response(c);
+    return;
+  }
+  Object *page = find_in_site_map(dist_path, info);
+  if (page) {
+    Path *dest_path = NULL;
+    Value dest_path_value;
+    if (object_get_known(page, dest, &dest_path_value) && dest_path_value.type == V_STRING) {
+      dest_path = string_to_path(dest_path_value.string_value);
+    }
+    const Path *key = dest_path ? dest_path : dist_path;
+    const char *file_extension = path_get_extension(key);
+    const uint8_t *cached;
+    size_t cached_size;
+    if (page_cache_get(info->page_cache, key, &cached, &cached_size)) {
+      ok_response(c, file_extension, cached, cached_size);
+    } else {
+      fprintf(stderr, "Compiling %s\n", key->path);
+      Hash input_hash = stable_value_hash(info->globals_hash, (Value) { .type = V_OBJECT, .object_value = page });
+      ManifestPage *dependencies = create_manifest_page(key, input_hash);
+      ManifestPage *previous = track_dependencies(dependencies, info->modules);
+      Env *template_env = NULL;
+      Value output = compile_page_object(page, info->env, &template_env);
+      track_dependencies(previous, info->modules);
+      if (output.type == V_STRING) {
+        ok_response(c, file_extension, output.string_value->bytes, output.string_value->size);
+        page_cache_put(info->page_cache, dependencies, output.string_value->bytes, output.string_value->size);
+      } else {
+        internal_server_error_response(c, "Invalid template output");
+        delete_manifest_page(dependencies);
+      }
+      if (template_env) {
+        delete_template_env(template_env);
+      }
+    }
+    if (dest_path) {
+      delete_path(dest_path);
+    }
   } else {
-    ssize_t i = 0;
-    char *method = get_next_token(buffer, n, &i);
-    if (!method) {
-      fprintf(stderr, ERROR_LABEL "invalid request" SGR_RESET "\n");
-    } else if (strcmp(method, "GET") == 0) {
-      char *uri = get_next_token(buffer, n, &i);
-      if (!uri) {
-        fprintf(stderr, ERROR_LABEL "invalid request" SGR_RESET "\n");
-      } else if (strcmp(uri, "/.plet-hot-reload-event-source") == 0) {
-        free(buffer);
-        if (fork() == 0) {
-          event_source_response(cfd, info->modules);
-          shutdown(cfd, SHUT_RDWR);
-          close(cfd);
-          exit(0);
+    file_response(c, dist_path, request);
+  }
+  delete_path(dist_path);
+}
+
+static char *find_header_end(Buffer *buffer) {
+  if (buffer->size < 4) {
+    return NULL;
+  }
+  return memmem(buffer->data, buffer->size, "\r\n\r\n", 4);
+}
+
+static char *get_next_token(char **line) {
+  char *token = *line;
+  while (*token == ' ') {
+    token++;
+  }
+  char *end = token;
+  while (*end && *end != ' ') {
+    end++;
+  }
+  if (end == token) {
+    return NULL;
+  }
+  if (*end) {
+    *end++ = '\0';
+  }
+  *line = end;
+  return token;
+}
+
+static void bad_request(Connection *c) {
+  fprintf(stderr, ERROR_LABEL "invalid request" SGR_RESET "\n");
+  c->keep_alive = 0;
+  text_response(c, 400, "Bad Request", "Bad Request");
+  c->closing = 1;
+}
+
+// Parses and answers the requests in the input buffer. Stops at the first incomplete request and while a file is
+// being sent, so pipelined responses are written in order.
+static void process_requests(Connection *c, ServerInfo *info) {
+  while (!c->sse && !c->closing && c->file < 0) {
+    char *header_end = find_header_end(&c->in);
+    if (!header_end) {
+      if (c->in.size > MAX_REQUEST_SIZE) {
+        bad_request(c);
+      }
+      return;
+    }
+    size_t header_size = header_end - (char *) c->in.data;
+    char *request = allocate(header_size + 1);
+    memcpy(request, c->in.data, header_size);
+    request[header_size] = '\0';
+    char *line = request;
+    char *header = strstr(line, "\r\n");
+    if (header) {
+      *header = '\0';
+      header += 2;
+    }
+    char *method = get_next_token(&line);
+    char *uri = get_next_token(&line);
+    char *version = get_next_token(&line);
+    if (!method || !uri || !version || strncmp(version, "HTTP/1.", 7) != 0) {
+      free(request);
+      bad_request(c);
+      return;
+    }
+    int keep_alive = strcmp(version, "HTTP/1.0") != 0;
+    size_t content_length = 0;
+    Request r = { .uri = uri };
+    while (header && *header) {
+      char *next = strstr(header, "\r\n");
+      if (next) {
+        *next = '\0';
+        next += 2;
+      }
+      char *value = strchr(header, ':');
+      if (value) {
+        *value++ = '\0';
+        while (*value == ' ' || *value == '\t') {
+          value++;
         }
-        return;
-      } else {
-        Path *path = create_path(uri, -1);
-        Path *dist_path = get_dist_path(path, info->env);
-        delete_path(path);
-        if (dist_path) {
-          Object *page = find_in_site_map(dist_path, info->env);
-          if (page) {
-            Path *dest_path = NULL;
-            Value dest_path_value;
-            if (object_get_symbol(page, "dest", &dest_path_value) && dest_path_value.type == V_STRING) {
-              dest_path = string_to_path(dest_path_value.string_value);
-            }
-            fprintf(stderr, "Compiling %s\n", dest_path ? dest_path->path : dist_path->path);
-            Env *template_env = NULL;
-            Value output = compile_page_object(page, info->env, &template_env);
-            if (output.type == V_STRING) {
-              ok_response(cfd, dest_path ? path_get_extension(dest_path) : path_get_extension(dist_path),
-                  output.string_value);
-            } else {
-              internal_server_error_response(cfd, "Invalid template output");
-            }
-            if (template_env) {
-              delete_template_env(template_env);
-            }
-            if (dest_path) {
-              delete_path(dest_path);
-            }
-          } else {
-            file_response(cfd, dist_path);
+        if (strcasecmp(header, "Connection") == 0) {
+          if (strcasestr(value, "close")) {
+            keep_alive = 0;
+          } else if (strcasestr(value, "keep-alive")) {
+            keep_alive = 1;
           }
-          delete_path(dist_path);
-        } else {
-          not_found_response(cfd);
+        } else if (strcasecmp(header, "Content-Length") == 0) {
+          content_length = strtoul(value, NULL, 10);
+        } else if (strcasecmp(header, "If-None-Match") == 0) {
+          r.if_none_match = value;
+        } else if (strcasecmp(header, "If-Modified-Since") == 0) {
+          r.if_modified_since = value;
+        } else if (strcasecmp(header, "Range") == 0) {
+          r.range = value;
+        } else if (strcasecmp(header, "Accept-Encoding") == 0) {
+          r.accept_encoding = value;
         }
       }
+      header = next;
+    }
+    size_t request_size = header_size + 4 + content_length;
+    if (content_length > MAX_REQUEST_SIZE) {
+      free(request);
+      bad_request(c);
+      return;
+    }
+    if (c->in.size < request_size) {
+      free(request);
+      return;
+    }
+    c->keep_alive = keep_alive;
+    c->head_request = strcmp(method, "HEAD") == 0;
+    if (c->head_request || strcmp(method, "GET") == 0) {
+      handle_request(c, &r, info);
     } else {
-      write_server_headers(cfd, 405, "Method Not Allowed");
-      Buffer response = create_buffer(32);
-      buffer_printf(&response, "Content-Type: text/plain\r\n\r\nMethod Not Allowed");
-      write_buffer(cfd, response);
-      delete_buffer(response);
+      text_response(c, 405, "Method Not Allowed", "Method Not Allowed");
+    }
+    free(request);
+    if (!c->keep_alive) {
+      c->closing = 1;
+    }
+    memmove(c->in.data, c->in.data + request_size, c->in.size - request_size);
+    c->in.size -= request_size;
+  }
+}
+
+static void create_connection(int fd, ServerInfo *info) {
+  ensure_capacity(info, fd);
+  Connection *c = allocate(sizeof(Connection));
+  c->fd = fd;
+  c->sse = 0;
+  c->keep_alive = 1;
+  c->head_request = 0;
+  c->closing = 0;
+  c->last_active = get_time_ms();
+  c->in = create_buffer(0);
+  c->out = create_buffer(0);
+  c->out_offset = 0;
+  c->file = -1;
+  c->file_offset = 0;
+  c->file_end = 0;
+  info->connections[fd] = c;
+  set_interest(info, fd, EV_READ);
+}
+
+static void close_connection(Connection *c, ServerInfo *info) {
+  set_interest(info, c->fd, 0);
+  info->connections[c->fd] = NULL;
+  shutdown(c->fd, SHUT_RDWR);
+  close(c->fd);
+  if (c->file >= 0) {
+    close(c->file);
+  }
+  delete_buffer(c->in);
+  delete_buffer(c->out);
+  free(c);
+}
+
+static int read_file_chunk(Connection *c) {
+  size_t size = c->file_end - c->file_offset < CHUNK_SIZE ? c->file_end - c->file_offset : CHUNK_SIZE;
+  if (c->out.capacity < size) {
+    c->out.data = reallocate(c->out.data, size);
+    c->out.capacity = size;
+  }
+  ssize_t n = pread(c->file, c->out.data, size, c->file_offset);
+  if (n <= 0) {
+    return -1;
+  }
+  c->out.size = n;
+  c->file_offset += n;
+  return 1;
+}
+
+// Sends the next part of the file. Returns 1 on progress, 0 if the socket is full and -1 on failure.
+static int send_file_chunk(Connection *c) {
+#if defined(WITH_SENDFILE)
+  ssize_t n = sendfile(c->fd, c->file, &c->file_offset, c->file_end - c->file_offset);
+  if (n > 0) {
+    return 1;
+  }
+  if (n < 0 && errno == EINTR) {
+    return 1;
+  }
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;
+  }
+  if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+    return read_file_chunk(c);
+  }
+  return -1;
+#else
+  return read_file_chunk(c);
+#endif
+}
+
+// Writes as much pending output as the socket accepts. Returns 0 if the connection should be closed.
+static int flush_connection(Connection *c) {
+  while (1) {
+    if (c->out_offset < c->out.size) {
+      ssize_t n = write(c->fd, c->out.data + c->out_offset, c->out.size - c->out_offset);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      c->out_offset += n;
+      continue;
+    }
+    c->out.size = 0;
+    c->out_offset = 0;
+    if (c->file < 0) {
+      return !c->closing;
+    }
+    if (c->file_offset >= c->file_end) {
+      close(c->file);
+      c->file = -1;
+      continue;
+    }
+    int status = send_file_chunk(c);
+    if (status <= 0) {
+      return !status;
+    }
+  }
+}
+
+static void update_connection(Connection *c, ServerInfo *info) {
+  while (1) {
+    if (!flush_connection(c)) {
+      close_connection(c, info);
+      return;
+    }
+    if (c->out.size || c->file >= 0) {
+      set_interest(info, c->fd, EV_READ | EV_WRITE);
+      return;
+    }
+    size_t pending = c->in.size;
+    process_requests(c, info);
+    if (!c->out.size && !c->closing && c->in.size == pending) {
+      set_interest(info, c->fd, EV_READ);
+      return;
+    }
+  }
+}
+
+static void read_connection(Connection *c, ServerInfo *info) {
+  uint8_t buffer[4096];
+  while (1) {
+    ssize_t n = read(c->fd, buffer, sizeof(buffer));
+    if (n > 0) {
+      if (!c->sse) {
+        buffer_append_bytes(&c->in, buffer, n);
+      }
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    close_connection(c, info);
+    return;
+  }
+  c->last_active = get_time_ms();
+  update_connection(c, info);
+}
+
+static void set_nonblocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+static void accept_connections(ServerInfo *info) {
+  while (1) {
+    int cfd = accept(info->listen_fd, NULL, NULL);
+    if (cfd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        fprintf(stderr, ERROR_LABEL "accept failed: %s" SGR_RESET "\n", strerror(errno));
+      }
+      return;
+    }
+    set_nonblocking(cfd);
+    create_connection(cfd, info);
+  }
+}
+
+static void send_event(ServerInfo *info, const char *event) {
+  for (int fd = 0; fd < info->capacity; fd++) {
+    Connection *c = info->connections[fd];
+    if (c && c->sse) {
+      buffer_printf(&c->out, "event: %s\ndata:\n\n", event);
+      update_connection(c, info);
+    }
+  }
+}
+
+static void close_idle_connections(ServerInfo *info, long now) {
+  for (int fd = 0; fd < info->capacity; fd++) {
+    Connection *c = info->connections[fd];
+    if (c && !c->sse && !c->out.size && c->file < 0 && now - c->last_active > IDLE_TIMEOUT_MS) {
+      close_connection(c, info);
+    }
+  }
+}
+
+static int dependencies_are_current(ManifestPage *page, void *context) {
+  ModuleMap *modules = context;
+  Dependency dependency;
+  HashMapIterator it = generic_hash_map_iterate(&page->dependencies);
+  while (generic_hash_map_next(&it, &dependency)) {
+    Module *module = get_module(dependency.path, modules);
+    if ((module && module->dirty) || get_mtime(dependency.path->path) != dependency.mtime) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int page_is_current(ManifestPage *cached, void *context) {
+  ServerInfo *info = context;
+  PageEntry entry = { (const uint8_t *) cached->dest->path, cached->dest->size, NULL };
+  if (!generic_hash_map_get(&info->pages, &entry, &entry)) {
+    return 0;
+  }
+  Hash input_hash = stable_value_hash(info->globals_hash, (Value) { .type = V_OBJECT, .object_value = entry.page });
+  return input_hash == cached->input_hash;
+}
+
+static int reload_index(ServerInfo *info) {
+  fprintf(stderr, INFO_LABEL "changes detected" SGR_RESET "\n");
+  // Must happen before eval_index() reloads the changed modules
+  page_cache_retain(info->page_cache, dependencies_are_current, info->modules);
+  clear_embed_cache();
+  delete_arena(info->env->arena);
+  info->env = eval_index(info->src_root, info->modules, info->symbol_map);
+  if (!info->env) {
+    return 0;
+  }
+  reset_changes(info->modules);
+  index_site_map(info);
+  info->globals_hash = get_globals_hash(info->env);
+  page_cache_retain(info->page_cache, page_is_current, info);
+  send_event(info, "changes_detected");
+  return 1;
+}
+
+static int run_event_loop(ServerInfo *info) {
+  Event events[MAX_EVENTS];
+  int watcher_fd = get_watcher_fd(info->watcher);
+  if (watcher_fd >= 0) {
+    set_interest(info, watcher_fd, EV_READ);
+  }
+  set_interest(info, info->listen_fd, EV_READ);
+  long now = get_time_ms();
+  long next_keep_alive = now + SSE_KEEP_ALIVE_MS;
+  long next_poll = now;
+  while (1) {
+    int timeout = next_keep_alive - now;
+    if (watcher_fd < 0 && next_poll - now < timeout) {
+      timeout = next_poll - now;
+    }
+    int n = wait_for_events(info, events, timeout < 0 ? 0 : timeout);
+    if (n < 0 && errno != EINTR) {
+      fprintf(stderr, ERROR_LABEL "event loop failed: %s" SGR_RESET "\n", strerror(errno));
+      return 0;
+    }
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].fd;
+      if (fd == info->listen_fd) {
+        accept_connections(info);
+      } else if (fd != watcher_fd && fd < info->capacity && info->connections[fd]) {
+        if (events[i].events & EV_READ) {
+          read_connection(info->connections[fd], info);
+        } else if (events[i].events & EV_WRITE) {
+          update_connection(info->connections[fd], info);
+        }
+      }
+    }
+    now = get_time_ms();
+    // With inotify this only adds watches for newly loaded modules and reads pending events
+    if (watcher_fd >= 0 || now >= next_poll) {
+      if (wait_for_changes(info->watcher, &info->modules, 1, 0) && !reload_index(info)) {
+        return 0;
+      }
+      now = get_time_ms();
+      next_poll = now + POLL_INTERVAL_MS;
+    }
+    if (now >= next_keep_alive) {
+      send_event(info, "no_changes");
+      close_idle_connections(info, now);
+      next_keep_alive = now + SSE_KEEP_ALIVE_MS;
     }
   }
-  free(buffer);
-  shutdown(cfd, SHUT_RDWR);
-  close(cfd);
 }
 
 int serve(GlobalArgs args) {
@@ -336,23 +1027,30 @@ int serve(GlobalArgs args) {
         if (listen (sfd, 1000000) != 0) {
           fprintf(stderr, ERROR_LABEL "could not listen to port %s: %s" SGR_RESET "\n", args.port, strerror(errno));
           status = 1;
-        } else {
+        } else if (init_event_loop(&info)) {
           signal(SIGPIPE, SIG_IGN);
+          set_nonblocking(sfd);
+          info.listen_fd = sfd;
+          info.watcher = create_watcher();
+          init_generic_hash_map(&info.pages, sizeof(PageEntry), 0, page_entry_hash, page_entry_equals, NULL);
+          index_site_map(&info);
+          info.page_cache = create_page_cache(args.page_cache_size);
+          info.globals_hash = get_globals_hash(info.env);
           fprintf(stderr, INFO_LABEL "server listening on http://localhost:%s/" SGR_RESET "\n", args.port);
-          while (1) {
-            struct sockaddr_in client_addr;
-            socklen_t client_addr_len = sizeof(client_addr);
-            int cfd = accept(sfd, (struct sockaddr *) &client_addr, &client_addr_len);
-            if (detect_changes(info.modules)) {
-              fprintf(stderr, INFO_LABEL "changes detected" SGR_RESET "\n");
-              delete_arena(info.env->arena);
-              info.env = eval_index(info.src_root, info.modules, info.symbol_map);
-              if (!info.env) {
-                break;
-              }
+          if (!run_event_loop(&info)) {
+            status = 1;
+          }
+          for (int fd = 0; fd < info.capacity; fd++) {
+            if (info.connections[fd]) {
+              close_connection(info.connections[fd], &info);
             }
-            handle_request(cfd, &info);
           }
+          delete_page_cache(info.page_cache);
+          delete_generic_hash_map(&info.pages);
+          delete_watcher(info.watcher);
+          delete_event_loop(&info);
+        } else {
+          status = 1;
         }
       }
     }
@@ -4,13 +4,22 @@
  * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
  */
 
+#define _GNU_SOURCE
 #include "sitemap.h"
 
 #include "alloca.h"
 #include "build.h"
+#include "buildcache.h"
+#include "compress.h"
+#include "contentmap.h"
+#include "exec.h"
+#include "images.h"
 #include "interpreter.h"
 #include "module.h"
+#include "output.h"
+#include "profile.h"
 #include "strings.h"
+#include "template.h"
 
 #include <dirent.h>
 #include <errno.h>
@@ -18,6 +27,8 @@
 #include <libgen.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 typedef enum {
   P_COPY,
@@ -25,6 +36,14 @@ typedef enum {
   P_TASK
 } PageType;
 
+typedef enum {
+  PR_ERROR,
+  PR_WRITTEN,
+  // The page was compiled, but the output was identical to the existing file, so it was left untouched
+  PR_UNCHANGED,
+  PR_SKIPPED
+} PageResult;
+
 typedef struct {
   PageType type;
   Path *src;
@@ -32,6 +51,8 @@ typedef struct {
   Value web_path;
   Value data;
   Value handler;
+  Value inputs;
+  int hardlink;
 } PageInfo;
 
 typedef struct {
@@ -41,28 +62,36 @@ typedef struct {
   Value web_path;
   Value data;
   Value handler;
+  Value inputs;
+  int hardlink;
 } ConstPageInfo;
 
 static Value encode_page_info(ConstPageInfo page, Env *env) {
   Value object = create_object(0, env->arena);
   switch (page.type) {
     case P_COPY:
-      object_def(object.object_value, "type", create_symbol(get_symbol("copy", env->symbol_map)), env);
-      object_def(object.object_value, "src", path_to_string(page.src, env->arena), env);
-      object_def(object.object_value, "dest", path_to_string(page.dest, env->arena), env);
+      object_def_known(object.object_value, type, create_symbol(known_symbols.copy), env);
+      object_def_known(object.object_value, src, path_to_string(page.src, env->arena), env);
+      object_def_known(object.object_value, dest, path_to_string(page.dest, env->arena), env);
+      if (page.hardlink) {
+        object_def_known(object.object_value, hardlink, true_value, env);
+      }
       break;
     case P_TEMPLATE:
-      object_def(object.object_value, "type", create_symbol(get_symbol("template", env->symbol_map)), env);
-      object_def(object.object_value, "src", path_to_string(page.src, env->arena), env);
-      object_def(object.object_value, "dest", path_to_string(page.dest, env->arena), env);
-      object_def(object.object_value, "web_path", page.web_path, env);
-      object_def(object.object_value, "data", page.data, env);
+      object_def_known(object.object_value, type, create_symbol(known_symbols.template), env);
+      object_def_known(object.object_value, src, path_to_string(page.src, env->arena), env);
+      object_def_known(object.object_value, dest, path_to_string(page.dest, env->arena), env);
+      object_def_known(object.object_value, web_path, page.web_path, env);
+      object_def_known(object.object_value, data, page.data, env);
       break;
     case P_TASK:
-      object_def(object.object_value, "type", create_symbol(get_symbol("task", env->symbol_map)), env);
-      object_def(object.object_value, "src", path_to_string(page.src, env->arena), env);
-      object_def(object.object_value, "dest", path_to_string(page.dest, env->arena), env);
-      object_def(object.object_value, "handler", page.handler, env);
+      object_def_known(object.object_value, type, create_symbol(known_symbols.task), env);
+      object_def_known(object.object_value, src, path_to_string(page.src, env->arena), env);
+      object_def_known(object.object_value, dest, path_to_string(page.dest, env->arena), env);
+      object_def_known(object.object_value, handler, page.handler, env);
+      if (page.inputs.type == V_ARRAY) {
+        object_def_known(object.object_value, inputs, page.inputs, env);
+      }
       break;
   }
   return object;
@@ -73,26 +102,28 @@ static int decode_page_info(Value value, PageInfo *page) {
     return 0;
   }
   Value type, src, dest;
-  if (!object_get_symbol(value.object_value, "type", &type) || type.type != V_SYMBOL) {
+  if (!object_get_known(value.object_value, type, &type) || type.type != V_SYMBOL) {
     return 0;
   }
-  if (!object_get_symbol(value.object_value, "src", &src) || src.type != V_STRING) {
+  if (!object_get_known(value.object_value, src, &src) || src.type != V_STRING) {
     return 0;
   }
-  if (!object_get_symbol(value.object_value, "dest", &dest) || dest.type != V_STRING) {
+  if (!object_get_known(value.object_value, dest, &dest) || dest.type != V_STRING) {
     return 0;
   }
   if (strcmp(type.symbol_value, "copy") == 0) {
+    Value hardlink;
     page->type = P_COPY;
     page->src = string_to_path(src.string_value);
     page->dest = string_to_path(dest.string_value);
+    page->hardlink = object_get_known(value.object_value, hardlink, &hardlink) && is_truthy(hardlink);
     return 1;
   } else if (strcmp(type.symbol_value, "template") == 0) {
     Value web_path, data;
-    if (!object_get_symbol(value.object_value, "web_path", &web_path) || web_path.type != V_STRING) {
+    if (!object_get_known(value.object_value, web_path, &web_path) || web_path.type != V_STRING) {
       return 0;
     }
-    if (!object_get_symbol(value.object_value, "data", &data)) {
+    if (!object_get_known(value.object_value, data, &data)) {
       data = nil_value;
     }
     page->type = P_TEMPLATE;
@@ -103,22 +134,36 @@ static int decode_page_info(Value value, PageInfo *page) {
     return 1;
   } else if (strcmp(type.symbol_value, "task") == 0) {
     Value handler;
-    if (!object_get_symbol(value.object_value, "handler", &handler)
+    if (!object_get_known(value.object_value, handler, &handler)
         || (handler.type != V_FUNCTION && handler.type != V_CLOSURE)) {
       return 0;
     }
+    Value inputs;
+    if (!object_get_known(value.object_value, inputs, &inputs) || inputs.type != V_ARRAY) {
+      inputs = nil_value;
+    }
     page->type = P_TASK;
     page->src = string_to_path(src.string_value);
     page->dest = string_to_path(dest.string_value);
     page->handler = handler;
+    page->inputs = inputs;
     return 1;
   }
   return 0;
 }
 
-static int copy_static_files(const Path *src_path, const Path *dest_path, Array *site_map, Env *env) {
+typedef struct {
+  int hardlink;
+  // Fingerprinted files are copied to names containing a hash of their contents, which are added to REVERSE_PATHS
+  int fingerprint;
+  const Path *dist_root;
+  Object *reverse_paths;
+} StaticOptions;
+
+static int copy_static_files(const Path *src_path, const Path *dest_path, StaticOptions *options, Array *site_map,
+    Env *env) {
   if (is_dir(src_path->path)) {
-    if (!mkdir_rec(dest_path->path)) {
+    if (!create_output_dir(dest_path)) {
       return 0;
     }
     DIR *dir = opendir(src_path->path);
@@ -129,7 +174,7 @@ static int copy_static_files(const Path *src_path, const Path *dest_path, Array
         if (file->d_name[0] != '.') {
           Path *child_src_path = path_append(src_path, file->d_name);
           Path *child_dest_path = path_append(dest_path, file->d_name);
-          status = status && copy_static_files(child_src_path, child_dest_path, site_map, env);
+          status = status && copy_static_files(child_src_path, child_dest_path, options, site_map, env);
           delete_path(child_dest_path);
           delete_path(child_src_path);
         }
@@ -138,18 +183,59 @@ static int copy_static_files(const Path *src_path, const Path *dest_path, Array
     }
     return status;
   }
-  ConstPageInfo page_info = { P_COPY, src_path, dest_path };
+  if (options->fingerprint) {
+    // The file name depends on the contents, so index.plet must be evaluated again when they change
+    load_asset_module(src_path, env);
+    Path *fingerprinted_path = get_fingerprinted_path(src_path, dest_path);
+    if (!fingerprinted_path) {
+      return 0;
+    }
+    Path *web_path = path_get_relative(options->dist_root, fingerprinted_path);
+    if (web_path) {
+      object_put(options->reverse_paths, path_to_string(src_path, env->arena), path_to_string(web_path, env->arena),
+          env->arena);
+      delete_path(web_path);
+    }
+    ConstPageInfo page_info = { P_COPY, src_path, fingerprinted_path, .hardlink = options->hardlink };
+    array_push(site_map, encode_page_info(page_info, env), env->arena);
+    delete_path(fingerprinted_path);
+    return 1;
+  }
+  ConstPageInfo page_info = { P_COPY, src_path, dest_path, .hardlink = options->hardlink };
   array_push(site_map, encode_page_info(page_info, env), env->arena);
   return 1;
 }
 
 static Value add_static(const Tuple *args, Env *env) {
-  check_args(1, args, env);
+  check_args_between(1, 2, args, env);
   Value src_value = args->values[0];
   if (src_value.type != V_STRING) {
     arg_type_error(0, V_STRING, args, env);
     return nil_value;
   }
+  StaticOptions options = { .hardlink = 0, .fingerprint = asset_fingerprinting_enabled(env) };
+  if (args->size > 1) {
+    Value options_value = args->values[1];
+    if (options_value.type != V_OBJECT) {
+      arg_type_error(1, V_OBJECT, args, env);
+      return nil_value;
+    }
+    Value value;
+    if (object_get_known(options_value.object_value, hardlink, &value)) {
+      options.hardlink = is_truthy(value);
+    }
+    if (object_get_known(options_value.object_value, fingerprint, &value)) {
+      options.fingerprint = is_truthy(value);
+    }
+  }
+  Value reverse_paths;
+  if (options.fingerprint) {
+    if (!env_get_known(REVERSE_PATHS, &reverse_paths, env) || reverse_paths.type != V_OBJECT) {
+      env_error(env, -1, "REVERSE_PATHS is missing or not an object");
+      return nil_value;
+    }
+    options.reverse_paths = reverse_paths.object_value;
+  }
   Path *src_path = string_to_src_path(src_value.string_value, env);
   if (!src_path) {
     return nil_value;
@@ -159,14 +245,19 @@ static Value add_static(const Tuple *args, Env *env) {
     delete_path(src_path);
     return nil_value;
   }
+  Path *dist_root = options.fingerprint ? get_dist_root(env) : NULL;
+  options.dist_root = dist_root;
   Value site_map;
-  if (!env_get_symbol("SITE_MAP", &site_map, env) || site_map.type != V_ARRAY) {
+  if (options.fingerprint && !dist_root) {
+    env_error(env, -1, "DIST_ROOT missing or not a string");
+  } else if (!env_get_known(SITE_MAP, &site_map, env) || site_map.type != V_ARRAY) {
     env_error(env, -1, "SITE_MAP is missign or not an object");
-    return nil_value;
-  }
-  if (!copy_static_files(src_path, dest_path, site_map.array_value, env)) {
+  } else if (!copy_static_files(src_path, dest_path, &options, site_map.array_value, env)) {
     env_error(env, -1, "failed copying one or more files to dist");
   }
+  if (dist_root) {
+    delete_path(dist_root);
+  }
   delete_path(dest_path);
   delete_path(src_path);
   return nil_value;
@@ -185,7 +276,7 @@ static Value add_reverse(const Tuple *args, Env *env) {
     return nil_value;
   }
   Value reverse_paths;
-  if (!env_get_symbol("REVERSE_PATHS", &reverse_paths, env) || reverse_paths.type != V_OBJECT) {
+  if (!env_get_known(REVERSE_PATHS, &reverse_paths, env) || reverse_paths.type != V_OBJECT) {
     env_error(env, -1, "REVERSE_PATHS is missing or not an object");
     return nil_value;
   }
@@ -195,7 +286,7 @@ static Value add_reverse(const Tuple *args, Env *env) {
 
 static void create_site_node(String *site_path, String *template_path, Value data, Env *env) {
   Value site_map;
-  if (!env_get_symbol("SITE_MAP", &site_map, env) || site_map.type != V_ARRAY) {
+  if (!env_get_known(SITE_MAP, &site_map, env) || site_map.type != V_ARRAY) {
     env_error(env, -1, "SITE_MAP is missign or not an object");
     return;
   }
@@ -209,7 +300,10 @@ static void create_site_node(String *site_path, String *template_path, Value dat
     delete_path(src_path);
     return;
   }
+  // The template is only loaded to validate it, so it's a dependency of the page rather than the caller
+  ManifestPage *dependencies = track_dependencies(NULL, env->modules);
   Module *module = get_template(src_path, env);
+  track_dependencies(dependencies, env->modules);
   if (!module) {
     env_error(env, -1, "unable to load template");
   } else {
@@ -245,7 +339,7 @@ static Value add_page(const Tuple *args, Env *env) {
 }
 
 static Value add_task(const Tuple *args, Env *env) {
-  check_args(3, args, env);
+  check_args_between(3, 4, args, env);
   Value dest = args->values[0];
   if (dest.type != V_STRING) {
     arg_type_error(0, V_STRING, args, env);
@@ -261,8 +355,31 @@ static Value add_task(const Tuple *args, Env *env) {
     arg_type_error(2, V_FUNCTION, args, env);
     return nil_value;
   }
+  // Tasks that declare their inputs are only run again when the source, one of the inputs, or the file that
+  // defines the handler has changed
+  Value inputs = nil_value;
+  if (args->size > 3) {
+    if (args->values[3].type != V_ARRAY) {
+      arg_type_error(3, V_ARRAY, args, env);
+      return nil_value;
+    }
+    Array *input_names = args->values[3].array_value;
+    inputs = create_array(input_names->size, env->arena);
+    for (size_t i = 0; i < input_names->size; i++) {
+      if (input_names->cells[i].type != V_STRING) {
+        env_error(env, 3, "inputs must be an array of strings");
+        return nil_value;
+      }
+      Path *input_path = string_to_src_path(input_names->cells[i].string_value, env);
+      if (!input_path) {
+        return nil_value;
+      }
+      array_push(inputs.array_value, path_to_string(input_path, env->arena), env->arena);
+      delete_path(input_path);
+    }
+  }
   Value site_map;
-  if (!env_get_symbol("SITE_MAP", &site_map, env) || site_map.type != V_ARRAY) {
+  if (!env_get_known(SITE_MAP, &site_map, env) || site_map.type != V_ARRAY) {
     env_error(env, -1, "SITE_MAP is missign or not an object");
     return nil_value;
   }
@@ -278,17 +395,20 @@ static Value add_task(const Tuple *args, Env *env) {
     return nil_value;
   }
   array_push(site_map.array_value, encode_page_info((ConstPageInfo) { P_TASK, src_path, dest_path,
-        nil_value, nil_value, handler }, env), env->arena);
+        nil_value, nil_value, handler, inputs }, env), env->arena);
   delete_path(dest_path);
   delete_path(src_path);
   return nil_value;
 }
 
-static Value create_page(int64_t total, int64_t per_page, int64_t page, int64_t pages, int64_t offset,
+// The items of a page are a slice of the paginated array
+static Value create_page(Array *items, int64_t per_page, int64_t page, int64_t pages, int64_t offset,
     Value path_template, Env *env) {
   Value obj = create_object(6, env->arena);
-  object_def(obj.object_value, "items", create_array(per_page, env->arena), env);
-  object_def(obj.object_value, "total", create_int(total), env);
+  int64_t remaining = items->size - offset;
+  object_def(obj.object_value, "items", create_array_slice(items, offset, remaining < per_page ? remaining : per_page,
+        env->arena), env);
+  object_def(obj.object_value, "total", create_int(items->size), env);
   object_def(obj.object_value, "page", create_int(page), env);
   object_def(obj.object_value, "pages", create_int(pages), env);
   object_def(obj.object_value, "offset", create_int(offset), env);
@@ -296,17 +416,6 @@ static Value create_page(int64_t total, int64_t per_page, int64_t page, int64_t
   return obj;
 }
 
-static void add_item_to_page(Value item, Value page, Env *env) {
-  if (page.type != V_OBJECT) {
-    return;
-  }
-  Value items;
-  if (object_get(page.object_value, create_symbol(get_symbol("items", env->symbol_map)), &items)
-      && items.type == V_ARRAY) {
-    array_push(items.array_value, item, env->arena);
-  }
-}
-
 static void add_page_to_site(Value page, String *src, String *path_template, Value data, Env *env) {
   if (page.type != V_OBJECT) {
     return;
@@ -331,7 +440,7 @@ static void add_page_to_site(Value page, String *src, String *path_template, Val
   } else {
     data = copy_value(data, env);
   }
-  object_def(data.object_value, "PAGE", page, env);
+  object_def_known(data.object_value, PAGE, page, env);
   create_site_node(path.string_value, src, data, env);
 }
 
@@ -368,20 +477,12 @@ static Value paginate(const Tuple *args, Env *env) {
   int64_t page_count = items.array_value->size
     ?  (items.array_value->size - 1) / per_page.int_value + 1
     : 1;
-  int64_t page_number = 1;
-  Value page = create_page(items.array_value->size, per_page.int_value, page_number, page_count, 0,
-      path_template, env);
-  for (int64_t i = 0, counter = 0; i < items.array_value->size; i++, counter++) {
-    if (counter >= per_page.int_value) {
-      add_page_to_site(page, src.string_value, path_template.string_value, data, env);
-      page_number++;
-      page = create_page(items.array_value->size, per_page.int_value, page_number, page_count, i,
-          path_template, env);
-      counter = 0;
-    }
-    add_item_to_page(items.array_value->cells[i], page, env);
-  }
-  add_page_to_site(page, src.string_value, path_template.string_value, data, env);
+  for (int64_t page_number = 1; page_number <= page_count; page_number++) {
+    int64_t offset = (page_number - 1) * per_page.int_value;
+    Value page = create_page(items.array_value, per_page.int_value, page_number, page_count, offset, path_template,
+        env);
+    add_page_to_site(page, src.string_value, path_template.string_value, data, env);
+  }
   return nil_value;
 }
 
@@ -396,20 +497,24 @@ static Value default_handler(const Tuple *args, Env *env) {
 }
 
 void import_sitemap(Env *env) {
-  env_def("SITE_MAP", create_array(0, env->arena), env);
-  env_def("REVERSE_PATHS", create_object(0, env->arena), env);
+  env_def_known(SITE_MAP, create_array(0, env->arena), env);
+  env_def_known(REVERSE_PATHS, create_object(0, env->arena), env);
   env_export("REVERSE_PATHS", env);
-  env_def("OUTPUT_OBSERVERS", create_array(0, env->arena), env);
+  env_def_known(OUTPUT_OBSERVERS, create_array(0, env->arena), env);
   env_export("OUTPUT_OBSERVERS", env);
+  env_def("COMPRESS_OUTPUT", false_value, env);
+  env_export("COMPRESS_OUTPUT", env);
+  env_def("FINGERPRINT_ASSETS", false_value, env);
+  env_export("FINGERPRINT_ASSETS", env);
   env_def_fn("add_static", add_static, env);
   env_def_fn("add_reverse", add_reverse, env);
   env_def_fn("add_page", add_page, env);
   env_def_fn("add_task", add_task, env);
   env_def_fn("paginate", paginate, env);
   Value content_handlers;
-  if (!env_get(get_symbol("CONTENT_HANDLERS", env->symbol_map), &content_handlers, env)) {
+  if (!env_get_known(CONTENT_HANDLERS, &content_handlers, env)) {
     content_handlers = create_object(0, env->arena);
-    env_def("CONTENT_HANDLERS", content_handlers, env);
+    env_def_known(CONTENT_HANDLERS, content_handlers, env);
   }
   env_export("CONTENT_HANDLERS", env);
   if (content_handlers.type == V_OBJECT) {
@@ -422,60 +527,70 @@ void import_sitemap(Env *env) {
   }
 }
 
-static int compile_page(PageInfo page, Env *env) {
+static PageResult compile_page(PageInfo page, Env *env) {
   switch (page.type) {
     case P_COPY:
       load_asset_module(page.src, env);
-      return copy_file(page.src->path, page.dest->path);
+      if (page.hardlink) {
+        return link_file(page.src->path, page.dest->path) ? PR_WRITTEN : PR_ERROR;
+      }
+      return copy_file(page.src->path, page.dest->path) ? PR_WRITTEN : PR_ERROR;
     case P_TEMPLATE: {
-      int status = 0;
+      PageResult result = PR_ERROR;
       Module *module = get_template(page.src, env);
       if (module) {
         Env *template_env = create_template_env(page.data, env);
-        env_def("PATH", copy_value(page.web_path, template_env), template_env);
-        Value output = eval_template(module, template_env);
-        if (output.type == V_STRING) {
+        env_def_known(PATH, copy_value(page.web_path, template_env), template_env);
+        Buffer buffer = create_buffer(0);
+        Value output;
+        int streamed = eval_template_to_buffer(module, template_env, &buffer, &output);
+        if (!streamed && output.type == V_STRING) {
+          buffer_append_bytes(&buffer, output.string_value->bytes, output.string_value->size);
+          streamed = 1;
+        }
+        if (streamed) {
           Path *dir = path_get_parent(page.dest);
-          if (mkdir_rec(dir->path)) {
-            FILE *dest = fopen(page.dest->path, "w");
-            if (!dest) {
-              fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", page.dest->path, strerror(errno));
-            } else {
-              if (fwrite(output.string_value->bytes, 1, output.string_value->size, dest) != output.string_value->size) {
-                fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "write error: %s" SGR_RESET "\n", page.dest->path,
-                    strerror(errno));
-              } else {
-                status = 1;
-              }
-              fclose(dest);
+          if (create_output_dir(dir)) {
+            switch (write_output(page.dest, &buffer)) {
+              case WRITE_ERROR:
+                break;
+              case WRITE_CHANGED:
+                result = PR_WRITTEN;
+                break;
+              case WRITE_UNCHANGED:
+                result = PR_UNCHANGED;
+                break;
             }
           } else {
             fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "unable to create output directory", page.dest->path);
           }
           delete_path(dir);
         }
+        delete_buffer(buffer);
         delete_template_env(template_env);
       }
-      return status;
+      return result;
     }
     case P_TASK: {
-      int status = 0;
+      PageResult result = PR_ERROR;
+      // Tasks may read the pages written before them
+      finish_output_writes(NULL, NULL);
       Path *dir = path_get_parent(page.dest);
-      if (mkdir_rec(dir->path)) {
+      if (create_output_dir(dir)) {
         Tuple *func_args = alloca(sizeof(Tuple) + 2 * sizeof(Value));
         func_args->size = 2;
         func_args->values[0] = path_to_string(page.dest, env->arena);
         func_args->values[1] = path_to_string(page.src, env->arena);
         Value value;
         if (apply(page.handler, func_args, &value, env)) {
-          status = 1;
+          result = PR_WRITTEN;
         }
       }
       delete_path(dir);
-      return status;
+      return result;
     }
   }
-  return 0;
+  return PR_ERROR;
 }
 
 Value compile_page_object(Object *object, Env *env, Env **template_env) {
@@ -493,7 +608,7 @@ Value compile_page_object(Object *object, Env *env, Env **template_env) {
       Module *module = get_template(page.src, env);
       if (module) {
         *template_env = create_template_env(page.data, env);
-        env_def("PATH", copy_value(page.web_path, *template_env), *template_env);
+        env_def_known(PATH, copy_value(page.web_path, *template_env), *template_env);
         output = eval_template(module, *template_env);
       }
       break;
@@ -521,9 +636,12 @@ Value compile_page_object(Object *object, Env *env, Env **template_env) {
 
 void notify_output_observers(const Path *path, Env *env) {
   Value observers;
-  if (!env_get_symbol("OUTPUT_OBSERVERS", &observers, env) || observers.type != V_ARRAY) {
+  if (!env_get_known(OUTPUT_OBSERVERS, &observers, env) || observers.type != V_ARRAY) {
     return;
   }
+  if (observers.array_value->size) {
+    finish_output_writes(NULL, NULL);
+  }
   Tuple *args = alloca(sizeof(Tuple) + sizeof(Value));
   args->size = 1;
   args->values[0] = path_to_string(path, env->arena);
@@ -536,35 +654,624 @@ void notify_output_observers(const Path *path, Env *env) {
   }
 }
 
-int compile_pages(Env *env) {
-  Value site_map;
-  if (!env_get_symbol("SITE_MAP", &site_map, env) || site_map.type != V_ARRAY) {
-    fprintf(stderr, ERROR_LABEL "SITE_MAP undefined or not an array" SGR_RESET "\n");
-    return 0;
+static Hash get_page_input_hash(PageInfo page) {
+  Hash h = INIT_HASH;
+  h = HASH_ADD_BYTE(page.type, h);
+  for (int32_t i = 0; i < page.src->size; i++) {
+    h = HASH_ADD_BYTE(page.src->path[i], h);
   }
-  Path *dist_root = get_dist_root(env);
-  if (!dist_root) {
-    fprintf(stderr, ERROR_LABEL "DIST_ROOT undefined or not a string" SGR_RESET "\n");
+  if (page.type == P_TASK) {
+    return stable_value_hash(h, page.inputs);
+  }
+  h = stable_value_hash(h, page.web_path);
+  return stable_value_hash(h, page.data);
+}
+
+static int is_cacheable_page(PageInfo page) {
+  return page.type == P_TEMPLATE || (page.type == P_TASK && page.inputs.type == V_ARRAY);
+}
+
+static void add_input_dependencies(ManifestPage *page, const Path *path) {
+  if (!is_dir(path->path)) {
+    if (file_exists(path->path)) {
+      manifest_page_add_dependency(page, path);
+    }
+    return;
+  }
+  DIR *dir = opendir(path->path);
+  if (!dir) {
+    return;
+  }
+  struct dirent *file;
+  while ((file = readdir(dir))) {
+    if (file->d_name[0] != '.') {
+      Path *child_path = path_append(path, file->d_name);
+      add_input_dependencies(page, child_path);
+      delete_path(child_path);
+    }
+  }
+  closedir(dir);
+}
+
+static void add_task_dependencies(ManifestPage *record, PageInfo page) {
+  add_input_dependencies(record, page.src);
+  for (size_t i = 0; i < page.inputs.array_value->size; i++) {
+    Path *input = string_to_path(page.inputs.array_value->cells[i].string_value);
+    add_input_dependencies(record, input);
+    delete_path(input);
+  }
+  if (page.handler.type == V_CLOSURE) {
+    manifest_page_add_dependency(record, page.handler.closure_value->body.module.file_name);
+  }
+}
+
+Hash get_globals_hash(Env *env) {
+  Hash h = INIT_HASH;
+  for (size_t i = 0; i < env->exports->size; i++) {
+    if (env->exports->cells[i].type == V_SYMBOL) {
+      Value value;
+      if (env_get(env->exports->cells[i].symbol_value, &value, env)) {
+        h = stable_value_hash(h, env->exports->cells[i]);
+        h = stable_value_hash(h, value);
+      }
+    }
+  }
+  return h;
+}
+
+static int dependency_has_changed(const Path *path, Env *env, ModuleMap *watched_modules) {
+  Module *module = get_module(path, env->modules);
+  if (!module && watched_modules) {
+    module = get_module(path, watched_modules);
+  }
+  return !module || module->dirty;
+}
+
+static int page_has_changed(PageInfo page, Manifest *manifest, Env *env, ModuleMap *watched_modules) {
+  if (dependency_has_changed(page.src, env, watched_modules)) {
+    return 1;
+  }
+  if (!is_cacheable_page(page)) {
     return 0;
   }
-  for (size_t i = 0; i < site_map.array_value->size; i++) {
-    Value page_value = site_map.array_value->cells[i];
+  ManifestPage *previous = manifest_get_page(manifest, page.dest);
+  if (!previous) {
+    return 1;
+  }
+  Dependency dependency;
+  HashMapIterator it = generic_hash_map_iterate(&previous->dependencies);
+  while (generic_hash_map_next(&it, &dependency)) {
+    if (dependency_has_changed(dependency.path, env, watched_modules)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Changed pages are found before compiling anything since compiling a page reloads its changed dependencies
+static char *find_changed_pages(Array *site_map, Manifest *manifest, ModuleMap *watched_modules, Env *env) {
+  char *changed = allocate(site_map->size + 1);
+  for (size_t i = 0; i < site_map->size; i++) {
+    PageInfo page;
+    changed[i] = 1;
+    if (decode_page_info(site_map->cells[i], &page)) {
+      changed[i] = page_has_changed(page, manifest, env, watched_modules);
+      delete_path(page.src);
+      delete_path(page.dest);
+    }
+  }
+  return changed;
+}
+
+static int output_compression_enabled(Env *env) {
+  Value compress_output;
+  return env_get_symbol("COMPRESS_OUTPUT", &compress_output, env) && is_truthy(compress_output);
+}
+
+static CacheKey get_page_cache_key(PageInfo page, Hash globals_hash, Hash input_hash) {
+  CacheKey key = create_cache_key("page");
+  cache_key_add_int(&key, globals_hash);
+  cache_key_add_int(&key, input_hash);
+  cache_key_add_path(&key, page.dest);
+  return key;
+}
+
+static int compare_dependency_paths(const void *a, const void *b) {
+  return strcmp((*(const Path **) a)->path, (*(const Path **) b)->path);
+}
+
+// The null-terminated paths of the dependencies in sorted order
+static Buffer get_sorted_dependencies(ManifestPage *record) {
+  Path **paths = allocate((record->dependencies.size + 1) * sizeof(Path *));
+  size_t size = 0;
+  Dependency dependency;
+  HashMapIterator it = generic_hash_map_iterate(&record->dependencies);
+  while (generic_hash_map_next(&it, &dependency)) {
+    paths[size++] = dependency.path;
+  }
+  qsort(paths, size, sizeof(Path *), compare_dependency_paths);
+  Buffer buffer = create_buffer(0);
+  for (size_t i = 0; i < size; i++) {
+    buffer_append_bytes(&buffer, (const uint8_t *) paths[i]->path, paths[i]->size + 1);
+  }
+  free(paths);
+  return buffer;
+}
+
+// The page key maps to the list of dependencies, the output is stored under a key that also covers their contents
+static int get_output_cache_key(CacheKey page_key, const Buffer *dependencies, CacheKey *key) {
+  *key = page_key;
+  size_t offset = 0;
+  while (offset < dependencies->size) {
+    const char *path_bytes = (const char *) dependencies->data + offset;
+    size_t length = strnlen(path_bytes, dependencies->size - offset);
+    if (offset + length >= dependencies->size) {
+      return 0;
+    }
+    Path *path = create_path(path_bytes, length);
+    cache_key_add_path(key, path);
+    int exists = cache_key_add_file(key, path);
+    delete_path(path);
+    if (!exists) {
+      return 0;
+    }
+    offset += length + 1;
+  }
+  return 1;
+}
+
+static int restore_cached_page(PageInfo page, CacheKey page_key, ManifestPage *record, PageResult *result) {
+  Buffer dependencies = create_buffer(0);
+  Buffer output = create_buffer(0);
+  CacheKey output_key;
+  int restored = 0;
+  if (build_cache_get(page_key, &dependencies) && get_output_cache_key(page_key, &dependencies, &output_key)
+      && build_cache_get(output_key, &output)) {
+    Path *dir = path_get_parent(page.dest);
+    if (create_output_dir(dir)) {
+      switch (write_output(page.dest, &output)) {
+        case WRITE_ERROR:
+          break;
+        case WRITE_CHANGED:
+          *result = PR_WRITTEN;
+          restored = 1;
+          break;
+        case WRITE_UNCHANGED:
+          *result = PR_UNCHANGED;
+          restored = 1;
+          break;
+      }
+    }
+    delete_path(dir);
+  }
+  if (restored) {
+    size_t offset = 0;
+    while (offset < dependencies.size) {
+      const char *path_bytes = (const char *) dependencies.data + offset;
+      size_t length = strlen(path_bytes);
+      Path *path = create_path(path_bytes, length);
+      manifest_page_add_dependency(record, path);
+      delete_path(path);
+      offset += length + 1;
+    }
+  }
+  delete_buffer(dependencies);
+  delete_buffer(output);
+  return restored;
+}
+
+static void store_cached_page(PageInfo page, CacheKey page_key, ManifestPage *record) {
+  finish_output_writes(NULL, NULL);
+  Buffer dependencies = get_sorted_dependencies(record);
+  CacheKey output_key;
+  if (get_output_cache_key(page_key, &dependencies, &output_key)) {
+    build_cache_put_file(output_key, page.dest);
+    build_cache_put(page_key, dependencies.data, dependencies.size);
+  }
+  delete_buffer(dependencies);
+}
+
+static PageResult build_page_output(PageInfo page, Manifest *manifest, ManifestPage **record, Env *env) {
+  *record = NULL;
+  if (page.type == P_COPY && !asset_has_changed(page.src, page.dest)) {
+    load_asset_module(page.src, env);
+    return PR_SKIPPED;
+  }
+  if (!is_cacheable_page(page)) {
+    return compile_page(page, env);
+  }
+  Hash input_hash = get_page_input_hash(page);
+  if (manifest_page_is_current(manifest, page.dest, input_hash)) {
+    return PR_SKIPPED;
+  }
+  ManifestPage *dependencies = create_manifest_page(page.dest, input_hash);
+  int use_build_cache = page.type == P_TEMPLATE && build_cache_is_enabled();
+  CacheKey page_key;
+  PageResult result;
+  if (use_build_cache) {
+    page_key = get_page_cache_key(page, manifest->globals_hash, input_hash);
+    if (restore_cached_page(page, page_key, dependencies, &result)) {
+      *record = dependencies;
+      return result;
+    }
+  }
+  if (page.type == P_TASK) {
+    add_task_dependencies(dependencies, page);
+  }
+  size_t images = get_handled_image_count();
+  size_t errors = get_displayed_error_count();
+  track_dependencies(dependencies, env->modules);
+  result = compile_page(page, env);
+  track_dependencies(NULL, env->modules);
+  if (result == PR_ERROR) {
+    delete_manifest_page(dependencies);
+    return PR_ERROR;
+  }
+  // Pages that wrote images or displayed errors must be compiled again to do so
+  if (use_build_cache && images == get_handled_image_count() && errors == get_displayed_error_count()) {
+    store_cached_page(page, page_key, dependencies);
+  }
+  *record = dependencies;
+  return result;
+}
+
+static PageResult build_page(PageInfo page, Manifest *manifest, ManifestPage **record, Env *env) {
+  ProfileTimer timer = profile_start();
+  PageResult result = build_page_output(page, manifest, record, env);
+  // Also checked for skipped pages since the compressed files may be missing or outdated
+  if (result != PR_ERROR && output_compression_enabled(env)) {
+    finish_output_writes(NULL, NULL);
+    write_compressed_outputs(page.dest);
+  }
+  profile_end(timer, PROFILE_PAGE, page.dest->path);
+  // Nothing refers to content converted for the page once it has been written
+  release_content();
+  return result;
+}
+
+static void watch_dependencies(ManifestPage *page, Env *env, ModuleMap *watched_modules) {
+  if (!watched_modules) {
+    return;
+  }
+  Dependency dependency;
+  HashMapIterator it = generic_hash_map_iterate(&page->dependencies);
+  while (generic_hash_map_next(&it, &dependency)) {
+    if (!get_module(dependency.path, env->modules) && !get_module(dependency.path, watched_modules)) {
+      add_module(create_module(dependency.path, M_ASSET), watched_modules);
+    }
+  }
+}
+
+static void update_manifest(Manifest *previous, Manifest *next, const Path *dest, PageResult result,
+    ManifestPage *record, Env *env, ModuleMap *watched_modules) {
+  switch (result) {
+    case PR_ERROR:
+      break;
+    case PR_WRITTEN:
+    case PR_UNCHANGED:
+      if (record) {
+        watch_dependencies(record, env, watched_modules);
+        manifest_put_page(next, record);
+      }
+      if (result == PR_WRITTEN) {
+        notify_output_observers(dest, env);
+      }
+      break;
+    case PR_SKIPPED: {
+      ManifestPage *page = manifest_take_page(previous, dest);
+      if (!page) {
+        break;
+      }
+      watch_dependencies(page, env, watched_modules);
+      manifest_put_page(next, page);
+      break;
+    }
+  }
+}
+
+static void print_progress(size_t i, size_t n, const Path *dest, const Path *dist_root) {
+  Path *site_path = path_get_relative(dist_root, dest);
+  fprintf(stderr, "[%zd/%zd] Processing %-50.*s\r", i + 1, n,
+      site_path->size > 50 ? 50 : (int) site_path->size, site_path->path);
+  fflush(stderr);
+  delete_path(site_path);
+}
+
+static void mark_page_failed(const Path *path, void *context) {
+  *(PageResult *) context = PR_ERROR;
+}
+
+static void remove_failed_page(const Path *path, void *context) {
+  ManifestPage *page = manifest_take_page(context, path);
+  if (page) {
+    delete_manifest_page(page);
+  }
+}
+
+static void compile_pages_worker(Array *site_map, size_t offset, int jobs, Manifest *manifest, FILE *out,
+    const char *changed, ModuleMap *watched_modules, Env *env) {
+  for (size_t i = offset; i < site_map->size; i += jobs) {
+    PageInfo page;
+    if (!decode_page_info(site_map->cells[i], &page)) {
+      fputc(PR_ERROR, out);
+    } else {
+      ManifestPage *record = NULL;
+      PageResult result = PR_SKIPPED;
+      if (!changed || changed[i]) {
+        result = build_page(page, manifest, &record, env);
+        // The parent may read the page as soon as it's reported
+        finish_output_writes(mark_page_failed, &result);
+      }
+      if ((result == PR_WRITTEN || result == PR_UNCHANGED) && record) {
+        fputc(result, out);
+        fputc(1, out);
+        write_manifest_page(record, out);
+        delete_manifest_page(record);
+      } else if (result == PR_WRITTEN || result == PR_UNCHANGED) {
+        fputc(result, out);
+        fputc(0, out);
+      } else {
+        fputc(result, out);
+      }
+      delete_path(page.src);
+      delete_path(page.dest);
+    }
+    fflush(out);
+  }
+  write_image_jobs(out);
+  write_profile(out);
+  if (watched_modules) {
+    ModuleIterator it = iterate_modules(env->modules);
+    Module *module;
+    while ((module = module_iterator_next(&it))) {
+      if (module->type != M_SYSTEM) {
+        fwrite(module->file_name->path, 1, module->file_name->size + 1, out);
+      }
+    }
+  }
+}
+
+static void read_worker_modules(FILE *in, Env *env, ModuleMap *watched_modules) {
+  Buffer name = create_buffer(0);
+  int c;
+  while ((c = fgetc(in)) != EOF) {
+    if (c) {
+      buffer_put(&name, c);
+      continue;
+    }
+    Path *path = create_path((char *) name.data, name.size);
+    if (!get_module(path, env->modules) && !get_module(path, watched_modules)) {
+      add_module(create_module(path, M_ASSET), watched_modules);
+    }
+    delete_path(path);
+    name.size = 0;
+  }
+  delete_buffer(name);
+}
+
+static void compile_pages_parallel(Array *site_map, const Path *dist_root, int jobs, Manifest *manifest,
+    Manifest *next_manifest, const char *changed, ModuleMap *watched_modules, Env *env) {
+  pid_t *pids = allocate(jobs * sizeof(pid_t));
+  FILE **results = allocate(jobs * sizeof(FILE *));
+  int workers = 0;
+  fflush(NULL);
+  for (int k = 0; k < jobs; k++) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+      fprintf(stderr, ERROR_LABEL "unable to create pipe: %s" SGR_RESET "\n", strerror(errno));
+      break;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+      fprintf(stderr, ERROR_LABEL "unable to fork: %s" SGR_RESET "\n", strerror(errno));
+      close(fds[0]);
+      close(fds[1]);
+      break;
+    }
+    if (pid == 0) {
+      for (int j = 0; j < workers; j++) {
+        fclose(results[j]);
+      }
+      close(fds[0]);
+      FILE *out = fdopen(fds[1], "w");
+      // Pages are already compiled in parallel, so content is loaded and commands are run sequentially by each worker
+      set_content_jobs(1);
+      set_exec_jobs(1);
+      clear_profile();
+      if (out) {
+        compile_pages_worker(site_map, k, jobs, manifest, out, changed, watched_modules, env);
+        fclose(out);
+      }
+      fflush(NULL);
+      _exit(0);
+    }
+    close(fds[1]);
+    pids[workers] = pid;
+    results[workers] = fdopen(fds[0], "r");
+    workers++;
+  }
+  if (workers < jobs) {
+    for (int k = 0; k < workers; k++) {
+      fclose(results[k]);
+      waitpid(pids[k], NULL, 0);
+    }
+    free(pids);
+    free(results);
+    if (workers) {
+      fprintf(stderr, ERROR_LABEL "unable to start %d workers" SGR_RESET "\n", jobs);
+    }
+    return;
+  }
+  for (size_t i = 0; i < site_map->size; i++) {
+    FILE *in = results[i % jobs];
+    int status = fgetc(in);
+    ManifestPage *record = NULL;
+    if ((status == PR_WRITTEN || status == PR_UNCHANGED) && fgetc(in) == 1) {
+      record = read_manifest_page(in);
+    }
     PageInfo page;
-    if (!decode_page_info(page_value, &page)) {
+    if (!decode_page_info(site_map->cells[i], &page)) {
       fprintf(stderr, ERROR_LABEL "invalid page object at index %zd of SITE_MAP" SGR_RESET "\n", i);
       continue;
     }
-    Path *site_path = path_get_relative(dist_root, page.dest);
-    fprintf(stderr, "[%zd/%zd] Processing %-50.*s\r", i + 1, site_map.array_value->size,
-        site_path->size > 50 ? 50 : (int) site_path->size, site_path->path);
-    fflush(stderr);
-    delete_path(site_path);
-    if (compile_page(page, env)) {
-      notify_output_observers(page.dest, env);
+    print_progress(i, site_map->size, page.dest, dist_root);
+    if (status == EOF) {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "worker terminated before page was compiled" SGR_RESET "\n",
+          page.dest->path);
+      status = PR_ERROR;
     }
+    update_manifest(manifest, next_manifest, page.dest, status, record, env, watched_modules);
     delete_path(page.src);
     delete_path(page.dest);
   }
+  for (int k = 0; k < jobs; k++) {
+    if (!read_image_jobs(results[k])) {
+      fprintf(stderr, ERROR_LABEL "invalid image jobs from build worker %d" SGR_RESET "\n", k + 1);
+    }
+    if (!read_profile(results[k])) {
+      fprintf(stderr, ERROR_LABEL "invalid profile from build worker %d" SGR_RESET "\n", k + 1);
+    }
+    if (watched_modules) {
+      read_worker_modules(results[k], env, watched_modules);
+    }
+    fclose(results[k]);
+    int status;
+    if (waitpid(pids[k], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, ERROR_LABEL "build worker %d failed" SGR_RESET "\n", k + 1);
+    }
+  }
+  free(pids);
+  free(results);
+}
+
+static int shard = 0;
+static int shards = 1;
+
+void set_shard(int index, int count) {
+  shard = index;
+  shards = count;
+}
+
+// Pages are assigned to shards by the hash of their destination relative to DIST_ROOT, so that every machine
+// agrees on the assignment regardless of where the project is checked out
+static int page_is_in_shard(Value page_value, const Path *dist_root) {
+  PageInfo page;
+  if (!decode_page_info(page_value, &page)) {
+    // Reported by the first shard
+    return shard == 0;
+  }
+  Path *relative = path_get_relative(dist_root, page.dest);
+  int in_shard = hash_bytes(relative->path, relative->size, INIT_HASH) % shards == (Hash) shard;
+  delete_path(relative);
+  delete_path(page.src);
+  delete_path(page.dest);
+  return in_shard;
+}
+
+static Array *get_shard_pages(Array *site_map, const Path *dist_root, Env *env) {
+  Array *pages = create_array(site_map->size / shards + 1, env->arena).array_value;
+  for (size_t i = 0; i < site_map->size; i++) {
+    if (page_is_in_shard(site_map->cells[i], dist_root)) {
+      array_push(pages, site_map->cells[i], env->arena);
+    }
+  }
+  fprintf(stderr, INFO_LABEL "shard %d/%d: %zd of %zd pages" SGR_RESET "\n", shard + 1, shards, pages->size,
+      site_map->size);
+  return pages;
+}
+
+static Path *get_manifest_path(const Path *dist_root) {
+  if (shards > 1) {
+    char name[64];
+    snprintf(name, sizeof(name), ".plet-cache.%d-%d", shard + 1, shards);
+    return path_append(dist_root, name);
+  }
+  return path_append(dist_root, ".plet-cache");
+}
+
+static int compile_site_map(Env *env, int jobs, int only_changed, ModuleMap *watched_modules) {
+  Value site_map;
+  if (!env_get_known(SITE_MAP, &site_map, env) || site_map.type != V_ARRAY) {
+    fprintf(stderr, ERROR_LABEL "SITE_MAP undefined or not an array" SGR_RESET "\n");
+    return 0;
+  }
+  Path *dist_root = get_dist_root(env);
+  if (!dist_root) {
+    fprintf(stderr, ERROR_LABEL "DIST_ROOT undefined or not a string" SGR_RESET "\n");
+    return 0;
+  }
+  Array *pages = site_map.array_value;
+  if (shards > 1) {
+    pages = get_shard_pages(pages, dist_root, env);
+  }
+  Path *manifest_path = get_manifest_path(dist_root);
+  Hash globals_hash = get_globals_hash(env);
+  Manifest *manifest = read_manifest(manifest_path, globals_hash);
+  Manifest *next_manifest = create_manifest(globals_hash);
+  Path *image_info_path = path_append(dist_root, ".plet-images");
+  read_image_info_cache(image_info_path);
+  char *changed = NULL;
+  if (only_changed) {
+    changed = find_changed_pages(pages, manifest, watched_modules, env);
+  }
+  int image_jobs = jobs;
+  if (jobs > pages->size) {
+    jobs = pages->size;
+  }
+  if (output_compression_enabled(env) && !encoding_is_supported(E_GZIP) && !encoding_is_supported(E_BROTLI)) {
+    fprintf(stderr, WARN_LABEL "COMPRESS_OUTPUT is enabled, but plet was built without zlib and brotli"
+        SGR_RESET "\n");
+  }
+  clear_embed_cache();
+  // Images are resized after all pages have been compiled so that identical targets are only resized once
+  defer_image_jobs(1);
+  set_releasable_content(1);
+  if (jobs > 1) {
+    compile_pages_parallel(pages, dist_root, jobs, manifest, next_manifest, changed,
+        watched_modules, env);
+  } else {
+    for (size_t i = 0; i < pages->size; i++) {
+      Value page_value = pages->cells[i];
+      PageInfo page;
+      if (!decode_page_info(page_value, &page)) {
+        fprintf(stderr, ERROR_LABEL "invalid page object at index %zd of SITE_MAP" SGR_RESET "\n", i);
+        continue;
+      }
+      print_progress(i, pages->size, page.dest, dist_root);
+      ManifestPage *record = NULL;
+      PageResult result = PR_SKIPPED;
+      if (!changed || changed[i]) {
+        result = build_page(page, manifest, &record, env);
+      }
+      update_manifest(manifest, next_manifest, page.dest, result, record, env, watched_modules);
+      delete_path(page.src);
+      delete_path(page.dest);
+    }
+    // Pages whose writes failed are compiled again by the next build
+    finish_output_writes(remove_failed_page, next_manifest);
+  }
+  set_releasable_content(0);
+  run_image_jobs(image_jobs, env);
+  defer_image_jobs(0);
+  clear_embed_cache();
+  if (changed) {
+    free(changed);
+  }
+  write_manifest(next_manifest, manifest_path);
+  write_image_info_cache(image_info_path);
+  forget_output_dirs();
+  delete_path(image_info_path);
+  delete_manifest(next_manifest);
+  delete_manifest(manifest);
+  delete_path(manifest_path);
   delete_path(dist_root);
   return 0;
 }
+
+int compile_pages(Env *env, int jobs, ModuleMap *watched_modules) {
+  return compile_site_map(env, jobs, 0, watched_modules);
+}
+
+int compile_changed_pages(Env *env, int jobs, ModuleMap *watched_modules) {
+  return compile_site_map(env, jobs, 1, watched_modules);
+}
@@ -10,10 +10,14 @@
 #include "value.h"
 
 void import_sitemap(Env *env);
+// Only compiles the pages of SITE_MAP assigned to the given shard (0-based) out of count shards
+void set_shard(int index, int count);
 
 void notify_output_observers(const Path *path, Env *env);
 Value compile_page_object(Object *object, Env *env, Env **template_env);
-int compile_pages(Env *env);
+Hash get_globals_hash(Env *env);
+int compile_pages(Env *env, int jobs, ModuleMap *watched_modules);
+int compile_changed_pages(Env *env, int jobs, ModuleMap *watched_modules);
 
 #endif
 
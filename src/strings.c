@@ -6,10 +6,14 @@
 
 #include "strings.h"
 
+#include "build.h"
+#include "datetime.h"
+
 #include <alloca.h>
 #include <ctype.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -17,95 +21,103 @@
 #include <unicode/ucasemap.h>
 #endif
 
-static Value lower(const Tuple *args, Env *env) {
-  check_args(1, args, env);
-  Value arg = args->values[0];
-  if (arg.type != V_STRING) {
-    arg_type_error(0, V_STRING, args, env);
-    return nil_value;
+typedef enum {
+  CASE_LOWER,
+  CASE_UPPER,
+  CASE_TITLE
+} CaseMapping;
+
+// Branchless so that the compiler can vectorize the loops
+static void ascii_to_lower(const uint8_t *src, uint8_t *dest, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    dest[i] = src[i] | ((uint8_t) (src[i] - 'A') < 26) << 5;
   }
-  if (!arg.string_value->size) {
-    return arg;
+}
+
+static void ascii_to_upper(const uint8_t *src, uint8_t *dest, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    dest[i] = src[i] & ~(((uint8_t) (src[i] - 'a') < 26) << 5);
   }
-  Value result = allocate_string(arg.string_value->size, env->arena);
-  result.string_value->size = arg.string_value->size;
+}
+
 #ifdef WITH_UNICODE
-  UErrorCode status = U_ZERO_ERROR;
-  char *locale = NULL; // TODO
-  UCaseMap *case_map = ucasemap_open(locale, U_FOLD_CASE_DEFAULT, &status);
-  if (U_SUCCESS(status)) {
-    int32_t result_len = ucasemap_utf8ToLower(case_map, (char *) result.string_value->bytes,
-        result.string_value->size, (char *) arg.string_value->bytes, arg.string_value->size, &status);
-    if (status == U_BUFFER_OVERFLOW_ERROR) {
-      result = reallocate_string(result.string_value, result_len, env->arena);
-      status = U_ZERO_ERROR;
-      result_len = ucasemap_utf8ToLower(case_map, (char *) result.string_value->bytes, result.string_value->size,
-          (char *) arg.string_value->bytes, arg.string_value->size, &status);
-    }
-    result.string_value->size = result_len;
-  }
-  ucasemap_close(case_map);
-  if (U_FAILURE(status)) {
-    env_error(env, -1, "case map error: %s", u_errorName(status));
-    return nil_value;
+// Checks eight bytes at a time
+static int is_ascii(const uint8_t *bytes, size_t size) {
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, 8);
+    if (word & 0x8080808080808080ULL) {
+      return 0;
+    }
   }
-#else
-  for (size_t i = 0; i < result.string_value->size; i++) {
-    uint8_t byte = arg.string_value->bytes[i];
-    if (byte >= 'A' && byte <= 'Z') {
-      byte += 32;
+  for (; i < size; i++) {
+    if (bytes[i] & 0x80) {
+      return 0;
     }
-    result.string_value->bytes[i] = byte;
   }
-#endif
-  return result;
+  return 1;
 }
 
-static Value upper(const Tuple *args, Env *env) {
-  check_args(1, args, env);
-  Value arg = args->values[0];
-  if (arg.type != V_STRING) {
-    arg_type_error(0, V_STRING, args, env);
+// Opened on first use and kept open, since opening a case map, and the break iterator it creates for title case, costs
+// far more than mapping a typical string
+static UCaseMap *case_map = NULL;
+// Strings are mapped here first so that the result can be allocated with the right size in one go
+static uint8_t *case_map_output = NULL;
+static int32_t case_map_output_capacity = 0;
+
+static Value icu_case_map(String *string, CaseMapping mapping, Env *env) {
+  UErrorCode status = U_ZERO_ERROR;
+  if (!case_map) {
+    char *locale = NULL; // TODO
+    case_map = ucasemap_open(locale, U_FOLD_CASE_DEFAULT, &status);
+    if (U_FAILURE(status)) {
+      case_map = NULL;
+      env_error(env, -1, "case map error: %s", u_errorName(status));
+      return nil_value;
+    }
+  }
+  if (string->size > INT32_MAX / 2) {
+    env_error(env, -1, "case map error: string too long");
     return nil_value;
   }
-  if (!arg.string_value->size) {
-    return arg;
+  int32_t capacity = string->size + string->size / 2 + 16;
+  if (capacity > case_map_output_capacity) {
+    case_map_output = reallocate(case_map_output, capacity);
+    case_map_output_capacity = capacity;
+  }
+  int32_t result_len = 0;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    status = U_ZERO_ERROR;
+    switch (mapping) {
+      case CASE_LOWER:
+        result_len = ucasemap_utf8ToLower(case_map, (char *) case_map_output, case_map_output_capacity,
+            (char *) string->bytes, string->size, &status);
+        break;
+      case CASE_UPPER:
+        result_len = ucasemap_utf8ToUpper(case_map, (char *) case_map_output, case_map_output_capacity,
+            (char *) string->bytes, string->size, &status);
+        break;
+      case CASE_TITLE:
+        result_len = ucasemap_utf8ToTitle(case_map, (char *) case_map_output, case_map_output_capacity,
+            (char *) string->bytes, string->size, &status);
+        break;
+    }
+    if (status != U_BUFFER_OVERFLOW_ERROR) {
+      break;
+    }
+    case_map_output = reallocate(case_map_output, result_len);
+    case_map_output_capacity = result_len;
   }
-  Value result = allocate_string(arg.string_value->size, env->arena);
-  result.string_value->size = arg.string_value->size;
-#ifdef WITH_UNICODE
-  UErrorCode status = U_ZERO_ERROR;
-  char *locale = NULL; // TODO
-  UCaseMap *case_map = ucasemap_open(locale, U_FOLD_CASE_DEFAULT, &status);
-  if (U_SUCCESS(status)) {
-    int32_t result_len = ucasemap_utf8ToUpper(case_map, (char *) result.string_value->bytes,
-        result.string_value->size, (char *) arg.string_value->bytes, arg.string_value->size, &status);
-    if (status == U_BUFFER_OVERFLOW_ERROR) {
-      result = reallocate_string(result.string_value, result_len, env->arena);
-      status = U_ZERO_ERROR;
-      result_len = ucasemap_utf8ToUpper(case_map, (char *) result.string_value->bytes, result.string_value->size,
-          (char *) arg.string_value->bytes, arg.string_value->size, &status);
-    }
-    result.string_value->size = result_len;
-  }
-  ucasemap_close(case_map);
   if (U_FAILURE(status)) {
     env_error(env, -1, "case map error: %s", u_errorName(status));
     return nil_value;
   }
-#else
-  for (size_t i = 0; i < result.string_value->size; i++) {
-    uint8_t byte = arg.string_value->bytes[i];
-    if (byte >= 'a' && byte <= 'z') {
-      byte -= 32;
-    }
-    result.string_value->bytes[i] = byte;
-  }
-#endif
-  return result;
+  return create_string(case_map_output, result_len, env->arena);
 }
+#endif
 
-static Value title(const Tuple *args, Env *env) {
+static Value map_case(const Tuple *args, CaseMapping mapping, Env *env) {
   check_args(1, args, env);
   Value arg = args->values[0];
   if (arg.type != V_STRING) {
@@ -115,44 +127,49 @@ static Value title(const Tuple *args, Env *env) {
   if (!arg.string_value->size) {
     return arg;
   }
-  Value result = allocate_string(arg.string_value->size, env->arena);
-  result.string_value->size = arg.string_value->size;
+  const uint8_t *bytes = arg.string_value->bytes;
+  size_t size = arg.string_value->size;
 #ifdef WITH_UNICODE
-  UErrorCode status = U_ZERO_ERROR;
-  char *locale = NULL; // TODO
-  UCaseMap *case_map = ucasemap_open(locale, U_FOLD_CASE_DEFAULT, &status);
-  if (U_SUCCESS(status)) {
-    int32_t result_len = ucasemap_utf8ToTitle(case_map, (char *) result.string_value->bytes,
-        result.string_value->size, (char *) arg.string_value->bytes, arg.string_value->size, &status);
-    if (status == U_BUFFER_OVERFLOW_ERROR) {
-      result = reallocate_string(result.string_value, result_len, env->arena);
-      status = U_ZERO_ERROR;
-      result_len = ucasemap_utf8ToTitle(case_map, (char *) result.string_value->bytes, result.string_value->size,
-          (char *) arg.string_value->bytes, arg.string_value->size, &status);
-    }
-    result.string_value->size = result_len;
-  }
-  ucasemap_close(case_map);
-  if (U_FAILURE(status)) {
-    env_error(env, -1, "case map error: %s", u_errorName(status));
-    return nil_value;
+  // Title case depends on word boundaries, which are left to ICU even for ASCII
+  if (mapping == CASE_TITLE || !is_ascii(bytes, size)) {
+    return icu_case_map(arg.string_value, mapping, env);
   }
-#else
-  for (size_t i = 0; i < result.string_value->size; i++) {
-    uint8_t byte = arg.string_value->bytes[i];
-    if (i == 0 || isspace(arg.string_value->bytes[i - 1])) {
-      if (byte >= 'a' && byte <= 'z') {
-        byte -= 32;
+#endif
+  Value result = allocate_string(size, env->arena);
+  result.string_value->size = size;
+  uint8_t *dest = result.string_value->bytes;
+  switch (mapping) {
+    case CASE_LOWER:
+      ascii_to_lower(bytes, dest, size);
+      break;
+    case CASE_UPPER:
+      ascii_to_upper(bytes, dest, size);
+      break;
+    case CASE_TITLE:
+      for (size_t i = 0; i < size; i++) {
+        if (i == 0 || isspace(bytes[i - 1])) {
+          ascii_to_upper(bytes + i, dest + i, 1);
+        } else {
+          ascii_to_lower(bytes + i, dest + i, 1);
+        }
       }
-    } else if (byte >= 'A' && byte <= 'Z') {
-      byte += 32;
-    }
-    result.string_value->bytes[i] = byte;
+      break;
   }
-#endif
   return result;
 }
 
+static Value lower(const Tuple *args, Env *env) {
+  return map_case(args, CASE_LOWER, env);
+}
+
+static Value upper(const Tuple *args, Env *env) {
+  return map_case(args, CASE_UPPER, env);
+}
+
+static Value title(const Tuple *args, Env *env) {
+  return map_case(args, CASE_TITLE, env);
+}
+
 static Value starts_with(const Tuple *args, Env *env) {
   check_args(2, args, env);
   Value obj = args->values[0];
@@ -225,6 +242,44 @@ static Value replace(const Tuple *args, Env *env) {
   return string_replace(needle.string_value, replacement.string_value, haystack.string_value, env->arena);
 }
 
+static Value replace_all(const Tuple *args, Env *env) {
+  check_args(2, args, env);
+  Value haystack = args->values[0];
+  if (haystack.type != V_STRING) {
+    arg_type_error(0, V_STRING, args, env);
+    return nil_value;
+  }
+  Value replacements = args->values[1];
+  if (replacements.type != V_OBJECT) {
+    arg_type_error(1, V_OBJECT, args, env);
+    return nil_value;
+  }
+  size_t n = object_size(replacements.object_value);
+  const String **needles = allocate(n * sizeof(String *) + 1);
+  const String **values = allocate(n * sizeof(String *) + 1);
+  ObjectIterator it = iterate_object(replacements.object_value);
+  Value key, value;
+  size_t i = 0;
+  while (object_iterator_next(&it, &key, &value)) {
+    if (key.type == V_SYMBOL) {
+      key = copy_c_string(key.symbol_value, env->arena);
+    }
+    if (key.type != V_STRING || value.type != V_STRING) {
+      arg_error(1, "object of strings", args, env);
+      free(needles);
+      free(values);
+      return nil_value;
+    }
+    needles[i] = key.string_value;
+    values[i] = value.string_value;
+    i++;
+  }
+  Value result = string_replace_all(needles, values, i, haystack.string_value, env->arena);
+  free(needles);
+  free(values);
+  return result;
+}
+
 static Value symbol(const Tuple *args, Env *env) {
   check_args(1, args, env);
   Value arg = args->values[0];
@@ -238,76 +293,165 @@ static Value symbol(const Tuple *args, Env *env) {
   return create_symbol(get_symbol(name, env->symbol_map));
 }
 
-static void json_encode_value(Value value, Buffer *buffer) {
+#define JSON_FLUSH_SIZE 65536
+
+typedef struct {
+  Buffer buffer;
+  FILE *file;
+  int error;
+} JsonWriter;
+
+// 0: copied as is, 1: short escape sequence, 2: \u00XX
+static const uint8_t json_escape_class[256] = {
+  2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 2, 1, 1, 2, 2,
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  ['"'] = 1, ['\\'] = 1, [127] = 2
+};
+
+static size_t json_estimate_size(Value value) {
+  switch (value.type) {
+    case V_NIL:
+    case V_BOOL:
+      return 5;
+    case V_INT:
+      return 11;
+    case V_FLOAT:
+      return 24;
+    case V_SYMBOL:
+      return strlen(value.symbol_value) + 2;
+    case V_STRING:
+      return value.string_value->size + 2;
+    case V_ARRAY: {
+      size_t size = 2;
+      for (size_t i = 0; i < value.array_value->size; i++) {
+        size += json_estimate_size(value.array_value->cells[i]) + 1;
+      }
+      return size;
+    }
+    case V_OBJECT: {
+      size_t size = 2;
+      ObjectIterator it = iterate_object(value.object_value);
+      Value entry_key, entry_value;
+      while (object_iterator_next(&it, &entry_key, &entry_value)) {
+        size += json_estimate_size(entry_key) + json_estimate_size(entry_value) + 2;
+      }
+      return size;
+    }
+    case V_TIME:
+      return 22;
+    case V_FUNCTION:
+    case V_CLOSURE:
+    case V_LAZY:
+      return 12;
+  }
+  return 0;
+}
+
+static void json_flush(JsonWriter *writer) {
+  if (writer->file && writer->buffer.size >= JSON_FLUSH_SIZE) {
+    if (!writer->error && fwrite(writer->buffer.data, 1, writer->buffer.size, writer->file) != writer->buffer.size) {
+      writer->error = 1;
+    }
+    writer->buffer.size = 0;
+  }
+}
+
+static void json_encode_int(int64_t value, Buffer *buffer) {
+  uint8_t digits[20];
+  size_t i = sizeof(digits);
+  uint64_t magnitude = value < 0 ? -(uint64_t) value : (uint64_t) value;
+  do {
+    digits[--i] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
+  if (value < 0) {
+    buffer_put(buffer, '-');
+  }
+  buffer_append_bytes(buffer, digits + i, sizeof(digits) - i);
+}
+
+static void json_encode_bytes(const uint8_t *bytes, size_t size, Buffer *buffer) {
+  static const char hex[] = "0123456789abcdef";
+  size_t start = 0;
+  buffer_put(buffer, '"');
+  for (size_t i = 0; i < size; i++) {
+    uint8_t byte = bytes[i];
+    if (!json_escape_class[byte]) {
+      continue;
+    }
+    buffer_append_bytes(buffer, bytes + start, i - start);
+    start = i + 1;
+    switch (byte) {
+      case '"':
+        buffer_append_bytes(buffer, (const uint8_t *) "\\\"", 2);
+        break;
+      case '\\':
+        buffer_append_bytes(buffer, (const uint8_t *) "\\\\", 2);
+        break;
+      case '\b':
+        buffer_append_bytes(buffer, (const uint8_t *) "\\b", 2);
+        break;
+      case '\f':
+        buffer_append_bytes(buffer, (const uint8_t *) "\\f", 2);
+        break;
+      case '\n':
+        buffer_append_bytes(buffer, (const uint8_t *) "\\n", 2);
+        break;
+      case '\r':
+        buffer_append_bytes(buffer, (const uint8_t *) "\\r", 2);
+        break;
+      case '\t':
+        buffer_append_bytes(buffer, (const uint8_t *) "\\t", 2);
+        break;
+      default: {
+        uint8_t escape[6] = { '\\', 'u', '0', '0', hex[byte >> 4], hex[byte & 0xf] };
+        buffer_append_bytes(buffer, escape, sizeof(escape));
+        break;
+      }
+    }
+  }
+  buffer_append_bytes(buffer, bytes + start, size - start);
+  buffer_put(buffer, '"');
+}
+
+static void json_write_value(Value value, JsonWriter *writer) {
+  Buffer *buffer = &writer->buffer;
   switch (value.type) {
     case V_NIL:
-      buffer_printf(buffer, "null");
+      buffer_append_bytes(buffer, (const uint8_t *) "null", 4);
       break;
     case V_BOOL:
       if (value.int_value) {
-        buffer_printf(buffer, "true");
+        buffer_append_bytes(buffer, (const uint8_t *) "true", 4);
       } else {
-        buffer_printf(buffer, "false");
+        buffer_append_bytes(buffer, (const uint8_t *) "false", 5);
       }
       break;
     case V_INT:
-      buffer_printf(buffer, "%" PRId64, value.int_value);
+      json_encode_int(value.int_value, buffer);
       break;
     case V_FLOAT:
       buffer_printf(buffer, "%lg", value.float_value);
       break;
     case V_SYMBOL:
-      buffer_printf(buffer, "\"%s\"", value.symbol_value);
+      json_encode_bytes((const uint8_t *) value.symbol_value, strlen(value.symbol_value), buffer);
       break;
     case V_STRING:
-      buffer_printf(buffer, "\"");
-      for (size_t i = 0; i < value.string_value->size; i++) {
-        uint8_t byte = value.string_value->bytes[i];
-        switch (byte) {
-          case '"':
-            buffer_printf(buffer, "\\\"");
-            break;
-          case '\\':
-            buffer_printf(buffer, "\\\\");
-            break;
-          case '\b':
-            buffer_printf(buffer, "\\b");
-            break;
-          case '\f':
-            buffer_printf(buffer, "\\f");
-            break;
-          case '\n':
-            buffer_printf(buffer, "\\n");
-            break;
-          case '\r':
-            buffer_printf(buffer, "\\r");
-            break;
-          case '\t':
-            buffer_printf(buffer, "\\t");
-            break;
-          default:
-            if (byte < 32 || byte == 127) {
-              buffer_printf(buffer, "\\x%02x", byte); // not valid json, use \uXXXX for valid unicode codepoints
-            } else {
-              buffer_put(buffer, byte);
-            }
-            break;
-        }
-      }
-      buffer_printf(buffer, "\"");
+      json_encode_bytes(value.string_value->bytes, value.string_value->size, buffer);
       break;
     case V_ARRAY:
-      buffer_printf(buffer, "[");
+      buffer_put(buffer, '[');
       for (size_t i = 0; i < value.array_value->size; i++) {
         if (i > 0) {
-          buffer_printf(buffer, ",");
+          buffer_put(buffer, ',');
         }
-        json_encode_value(value.array_value->cells[i], buffer);
+        json_write_value(value.array_value->cells[i], writer);
+        json_flush(writer);
       }
-      buffer_printf(buffer, "]");
+      buffer_put(buffer, ']');
       break;
-    case V_OBJECT:
-      buffer_printf(buffer, "{");
+    case V_OBJECT: {
+      buffer_put(buffer, '{');
       ObjectIterator it = iterate_object(value.object_value);
       Value entry_key, entry_value;
       int first = 1;
@@ -315,25 +459,23 @@ static void json_encode_value(Value value, Buffer *buffer) {
         if (first) {
           first = 0;
         } else {
-          buffer_printf(buffer, ",");
+          buffer_put(buffer, ',');
         }
         if (entry_key.type == V_STRING || entry_key.type == V_SYMBOL) {
-          json_encode_value(entry_key, buffer);
+          json_write_value(entry_key, writer);
         } else {
-          Buffer buffer2 = create_buffer(0);
-          json_encode_value(entry_key, &buffer2);
-          String *string = allocate(sizeof(String) + buffer2.size);
-          string->size = buffer2.size;
-          memcpy(string->bytes, buffer2.data, buffer2.size);
-          json_encode_value((Value) { .type = V_STRING, .string_value = string }, buffer);
-          free(string);
-          delete_buffer(buffer2);
+          Buffer key_buffer = create_buffer(0);
+          json_encode_value(entry_key, &key_buffer);
+          json_encode_bytes(key_buffer.data, key_buffer.size, buffer);
+          delete_buffer(key_buffer);
         }
-        buffer_printf(buffer, ":");
-        json_encode_value(entry_value, buffer);
+        buffer_put(buffer, ':');
+        json_write_value(entry_value, writer);
+        json_flush(writer);
       }
-      buffer_printf(buffer, "}");
+      buffer_put(buffer, '}');
       break;
+    }
     case V_TIME: {
       struct tm *utc = gmtime(&value.time_value);
       if (utc) {
@@ -350,20 +492,65 @@ static void json_encode_value(Value value, Buffer *buffer) {
     }
     case V_FUNCTION:
     case V_CLOSURE:
+    case V_LAZY:
       buffer_printf(buffer, "\"(function)\"");
       break;
   }
 }
 
+void json_encode_value(Value value, Buffer *buffer) {
+  JsonWriter writer = { .buffer = *buffer, .file = NULL, .error = 0 };
+  json_write_value(value, &writer);
+  *buffer = writer.buffer;
+}
+
 static Value json(const Tuple *args, Env *env) {
   check_args(1, args, env);
-  Buffer buffer = create_buffer(0);
+  Buffer buffer = create_buffer(json_estimate_size(args->values[0]));
   json_encode_value(args->values[0], &buffer);
   Value result = create_string(buffer.data, buffer.size, env->arena);
   delete_buffer(buffer);
   return result;
 }
 
+static Value write_json(const Tuple *args, Env *env) {
+  check_args(2, args, env);
+  if (args->values[0].type != V_STRING) {
+    arg_type_error(0, V_STRING, args, env);
+    return nil_value;
+  }
+  Path *path = string_to_path(args->values[0].string_value);
+  if (!path_is_absolute(path)) {
+    Path *dist_path = get_dist_path(path, env);
+    delete_path(path);
+    if (!dist_path) {
+      return nil_value;
+    }
+    path = dist_path;
+  }
+  FILE *file = fopen(path->path, "wb");
+  if (!file) {
+    env_error(env, 0, "unable to open file '%s' for writing: %s", path->path, strerror(errno));
+    delete_path(path);
+    return nil_value;
+  }
+  JsonWriter writer = { .buffer = create_buffer(JSON_FLUSH_SIZE), .file = file, .error = 0 };
+  json_write_value(args->values[1], &writer);
+  if (!writer.error && writer.buffer.size
+      && fwrite(writer.buffer.data, 1, writer.buffer.size, file) != writer.buffer.size) {
+    writer.error = 1;
+  }
+  if (fclose(file) != 0) {
+    writer.error = 1;
+  }
+  if (writer.error) {
+    env_error(env, 0, "unable to write file '%s': %s", path->path, strerror(errno));
+  }
+  delete_buffer(writer.buffer);
+  delete_path(path);
+  return nil_value;
+}
+
 void import_strings(Env *env) {
   env_def_fn("lower", lower, env);
   env_def_fn("upper", upper, env);
@@ -371,8 +558,10 @@ void import_strings(Env *env) {
   env_def_fn("starts_with", starts_with, env);
   env_def_fn("ends_with", ends_with, env);
   env_def_fn("replace", replace, env);
+  env_def_fn("replace_all", replace_all, env);
   env_def_fn("symbol", symbol, env);
   env_def_fn("json", json, env);
+  env_def_fn("write_json", write_json, env);
 }
 
 int string_equals(const char *c_string, const String *string) {
@@ -399,25 +588,203 @@ int string_ends_with(const char *prefix, const String *string) {
   return memcmp(prefix, string->bytes + string->size - prefix_length, prefix_length) == 0;
 }
 
+static const uint8_t *find_bytes(const uint8_t *haystack, size_t haystack_size, const uint8_t *needle,
+    size_t needle_size) {
+  if (needle_size > haystack_size) {
+    return NULL;
+  }
+  const uint8_t *end = haystack + haystack_size - needle_size + 1;
+  while (haystack < end) {
+    haystack = memchr(haystack, needle[0], end - haystack);
+    if (!haystack) {
+      return NULL;
+    }
+    if (memcmp(haystack + 1, needle + 1, needle_size - 1) == 0) {
+      return haystack;
+    }
+    haystack++;
+  }
+  return NULL;
+}
+
 Value string_replace(const String *needle, const String *replacement, String *haystack, Arena *arena) {
-  if (needle->size > 0 && needle->size <= haystack->size) {
-    for (size_t i = 0; i <= haystack->size - needle->size; i++) {
-      if (memcmp(needle->bytes, haystack->bytes + i, needle->size) == 0) {
-        Value result = allocate_string(haystack->size - needle->size + replacement->size, arena);
-        if (i > 0) {
-          memcpy(result.string_value->bytes, haystack->bytes, i);
-        }
-        if (replacement->size > 0) {
-          memcpy(result.string_value->bytes + i, replacement->bytes, replacement->size);
-        }
-        if (i < haystack->size - needle->size) {
-          memcpy(result.string_value->bytes + i + replacement->size, haystack->bytes + i + needle->size, haystack->size - i - needle->size);
-        }
-        return result;
+  if (!needle->size) {
+    return (Value) { .type = V_STRING, .string_value = haystack };
+  }
+  const uint8_t *end = haystack->bytes + haystack->size;
+  size_t matches = 0;
+  for (const uint8_t *match = find_bytes(haystack->bytes, haystack->size, needle->bytes, needle->size); match;
+      match = find_bytes(match + needle->size, end - match - needle->size, needle->bytes, needle->size)) {
+    matches++;
+  }
+  if (!matches) {
+    return (Value) { .type = V_STRING, .string_value = haystack };
+  }
+  Value result = allocate_string(haystack->size - matches * needle->size + matches * replacement->size, arena);
+  uint8_t *dest = result.string_value->bytes;
+  const uint8_t *src = haystack->bytes;
+  while (matches--) {
+    const uint8_t *match = find_bytes(src, end - src, needle->bytes, needle->size);
+    memcpy(dest, src, match - src);
+    dest += match - src;
+    memcpy(dest, replacement->bytes, replacement->size);
+    dest += replacement->size;
+    src = match + needle->size;
+  }
+  memcpy(dest, src, end - src);
+  return result;
+}
+
+typedef struct {
+  size_t start;
+  size_t needle;
+} ReplaceMatch;
+
+// Aho-Corasick automaton with a complete transition table, i.e. failure
+// transitions are resolved when the automaton is built.
+typedef struct {
+  int32_t *transitions;
+  int32_t *depth;
+  int32_t *match;
+} ReplaceAutomaton;
+
+static ReplaceAutomaton create_replace_automaton(const String **needles, size_t n) {
+  size_t max_states = 1;
+  for (size_t i = 0; i < n; i++) {
+    max_states += needles[i]->size;
+  }
+  ReplaceAutomaton automaton;
+  automaton.transitions = allocate(max_states * 256 * sizeof(int32_t));
+  automaton.depth = allocate(max_states * sizeof(int32_t));
+  automaton.match = allocate(max_states * sizeof(int32_t));
+  int32_t *fail = allocate(max_states * sizeof(int32_t));
+  int32_t *queue = allocate(max_states * sizeof(int32_t));
+  memset(automaton.transitions, 0xff, 256 * sizeof(int32_t));
+  automaton.depth[0] = 0;
+  automaton.match[0] = -1;
+  int32_t num_states = 1;
+  for (size_t i = 0; i < n; i++) {
+    int32_t state = 0;
+    for (size_t j = 0; j < needles[i]->size; j++) {
+      int32_t *next = &automaton.transitions[state * 256 + needles[i]->bytes[j]];
+      if (*next < 0) {
+        *next = num_states;
+        memset(automaton.transitions + num_states * 256, 0xff, 256 * sizeof(int32_t));
+        automaton.depth[num_states] = automaton.depth[state] + 1;
+        automaton.match[num_states] = -1;
+        num_states++;
+      }
+      state = *next;
+    }
+    if (state && automaton.match[state] < 0) {
+      automaton.match[state] = i;
+    }
+  }
+  size_t head = 0, tail = 0;
+  for (int c = 0; c < 256; c++) {
+    int32_t next = automaton.transitions[c];
+    if (next < 0) {
+      automaton.transitions[c] = 0;
+    } else {
+      fail[next] = 0;
+      queue[tail++] = next;
+    }
+  }
+  while (head < tail) {
+    int32_t state = queue[head++];
+    // Only the longest needle ending in a state is needed since it is also the leftmost
+    if (automaton.match[state] < 0) {
+      automaton.match[state] = automaton.match[fail[state]];
+    }
+    for (int c = 0; c < 256; c++) {
+      int32_t *next = &automaton.transitions[state * 256 + c];
+      int32_t fallback = automaton.transitions[fail[state] * 256 + c];
+      if (*next < 0) {
+        *next = fallback;
+      } else {
+        fail[*next] = fallback;
+        queue[tail++] = *next;
+      }
+    }
+  }
+  free(fail);
+  free(queue);
+  return automaton;
+}
+
+static void delete_replace_automaton(ReplaceAutomaton automaton) {
+  free(automaton.transitions);
+  free(automaton.depth);
+  free(automaton.match);
+}
+
+Value string_replace_all(const String **needles, const String **replacements, size_t n, String *haystack,
+    Arena *arena) {
+  size_t num_needles = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (needles[i]->size) {
+      num_needles++;
+    }
+  }
+  if (!num_needles || !haystack->size) {
+    return (Value) { .type = V_STRING, .string_value = haystack };
+  }
+  ReplaceAutomaton automaton = create_replace_automaton(needles, n);
+  ReplaceMatch *matches = NULL;
+  size_t num_matches = 0, matches_capacity = 0;
+  size_t result_size = haystack->size;
+  size_t best_start = 0;
+  int32_t best = -1;
+  int32_t state = 0;
+  for (size_t i = 0; i < haystack->size; i++) {
+    state = automaton.transitions[state * 256 + haystack->bytes[i]];
+    int32_t match = automaton.match[state];
+    if (match >= 0) {
+      size_t start = i + 1 - needles[match]->size;
+      if (best < 0 || start < best_start || (start == best_start && needles[match]->size > needles[best]->size)) {
+        best = match;
+        best_start = start;
       }
     }
+    // The best match is final once no longer match can start at or before it
+    if (best >= 0 && i + 1 - automaton.depth[state] > best_start) {
+      if (num_matches >= matches_capacity) {
+        matches_capacity = matches_capacity ? matches_capacity << 1 : 16;
+        matches = reallocate(matches, matches_capacity * sizeof(ReplaceMatch));
+      }
+      matches[num_matches++] = (ReplaceMatch) { .start = best_start, .needle = best };
+      result_size = result_size - needles[best]->size + replacements[best]->size;
+      i = best_start + needles[best]->size - 1;
+      state = 0;
+      best = -1;
+    }
   }
-  return (Value) { .type = V_STRING, .string_value = haystack };
+  if (best >= 0) {
+    if (num_matches >= matches_capacity) {
+      matches_capacity = matches_capacity ? matches_capacity << 1 : 16;
+      matches = reallocate(matches, matches_capacity * sizeof(ReplaceMatch));
+    }
+    matches[num_matches++] = (ReplaceMatch) { .start = best_start, .needle = best };
+    result_size = result_size - needles[best]->size + replacements[best]->size;
+  }
+  delete_replace_automaton(automaton);
+  if (!num_matches) {
+    return (Value) { .type = V_STRING, .string_value = haystack };
+  }
+  Value result = allocate_string(result_size, arena);
+  uint8_t *dest = result.string_value->bytes;
+  size_t src = 0;
+  for (size_t i = 0; i < num_matches; i++) {
+    const String *replacement = replacements[matches[i].needle];
+    memcpy(dest, haystack->bytes + src, matches[i].start - src);
+    dest += matches[i].start - src;
+    memcpy(dest, replacement->bytes, replacement->size);
+    dest += replacement->size;
+    src = matches[i].start + needles[matches[i].needle]->size;
+  }
+  memcpy(dest, haystack->bytes + src, haystack->size - src);
+  free(matches);
+  return result;
 }
 
 StringBuffer create_string_buffer(size_t capacity, Arena *arena) {
@@ -489,11 +856,10 @@ void string_buffer_append_value(StringBuffer *buffer, Value value) {
     case V_OBJECT:
       break;
     case V_TIME: {
-      struct tm *t;
+      struct tm t;
       char date[26];
-      t = localtime(&value.time_value);
-      if (t) {
-        if (strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", t)) {
+      if (local_time(value.time_value, &t)) {
+        if (strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", &t)) {
           string_buffer_printf(buffer, "%s", date);
         } else {
           string_buffer_printf(buffer, "(invalid time: %s)", strerror(errno));
@@ -505,14 +871,12 @@ void string_buffer_append_value(StringBuffer *buffer, Value value) {
     }
     case V_FUNCTION:
     case V_CLOSURE:
+    case V_LAZY:
       break;
   }
 }
 
-void string_buffer_append_bytes(StringBuffer *buffer, const uint8_t *bytes, size_t size) {
-  if (!size) {
-    return;
-  }
+void string_buffer_reserve(StringBuffer *buffer, size_t size) {
   size_t new_size = buffer->string->size + size;
   if (new_size > buffer->capacity) {
     while (new_size > buffer->capacity) {
@@ -523,8 +887,15 @@ void string_buffer_append_bytes(StringBuffer *buffer, const uint8_t *bytes, size
     string.string_value->size = existing_size;
     buffer->string = string.string_value;
   }
+}
+
+void string_buffer_append_bytes(StringBuffer *buffer, const uint8_t *bytes, size_t size) {
+  if (!size) {
+    return;
+  }
+  string_buffer_reserve(buffer, size);
   memcpy(buffer->string->bytes + buffer->string->size, bytes, size);
-  buffer->string->size = new_size;
+  buffer->string->size += size;
 }
 
 void string_buffer_vprintf(StringBuffer *buffer, const char *format, va_list va) {
@@ -16,7 +16,11 @@ void import_strings(Env *env);
 int string_equals(const char *c_string, const String *string);
 int string_starts_with(const char *prefix, const String *string);
 int string_ends_with(const char *prefix, const String *string);
+void json_encode_value(Value value, Buffer *buffer);
+
 Value string_replace(const String *needle, const String *replacement, String *haystack, Arena *arena);
+Value string_replace_all(const String **needles, const String **replacements, size_t n, String *haystack,
+    Arena *arena);
 
 typedef struct {
   Arena *arena;
@@ -29,6 +33,8 @@ Value finalize_string_buffer(StringBuffer buffer);
 void string_buffer_put(StringBuffer *buffer, uint8_t byte);
 void string_buffer_append(StringBuffer *buffer, String *string);
 void string_buffer_append_value(StringBuffer *buffer, Value value);
+// Makes room for at least size more bytes after the end of the string
+void string_buffer_reserve(StringBuffer *buffer, size_t size);
 void string_buffer_append_bytes(StringBuffer *buffer, const uint8_t *bytes, size_t size);
 void string_buffer_vprintf(StringBuffer *buffer, const char *format, va_list va);
 void string_buffer_printf(StringBuffer *buffer, const char *format, ...);
@@ -40,13 +40,124 @@ static Value embed(const Tuple *args, Env *env) {
     env_error(env, -1, "unable to load template");
   } else {
     Env *template_env = create_child_env(env);
-    env_def("LAYOUT", nil_value, template_env);
+    env_def_known(LAYOUT, nil_value, template_env);
     output = eval_template(module, template_env);
   }
   delete_path(src_path);
   return output;
 }
 
+typedef struct {
+  Path *path;
+  Hash data_hash;
+  uint8_t *output;
+  size_t size;
+  ManifestPage *dependencies;
+} EmbedCacheEntry;
+
+static GenericHashMap embed_cache = { .ctrl = NULL };
+
+static Hash embed_cache_hash(const void *p) {
+  const EmbedCacheEntry *entry = p;
+  return hash_bytes(entry->path->path, entry->path->size, entry->data_hash);
+}
+
+static int embed_cache_equals(const void *a, const void *b) {
+  const EmbedCacheEntry *entry_a = a;
+  const EmbedCacheEntry *entry_b = b;
+  return entry_a->data_hash == entry_b->data_hash && strcmp(entry_a->path->path, entry_b->path->path) == 0;
+}
+
+void clear_embed_cache(void) {
+  if (!embed_cache.ctrl) {
+    return;
+  }
+  EmbedCacheEntry entry;
+  HashMapIterator it = generic_hash_map_iterate(&embed_cache);
+  while (generic_hash_map_next(&it, &entry)) {
+    delete_path(entry.path);
+    free(entry.output);
+    delete_manifest_page(entry.dependencies);
+  }
+  delete_generic_hash_map(&embed_cache);
+  embed_cache.ctrl = NULL;
+}
+
+static void add_cached_dependencies(ManifestPage *dependencies, Env *env) {
+  Dependency dependency;
+  HashMapIterator it = generic_hash_map_iterate(&dependencies->dependencies);
+  while (generic_hash_map_next(&it, &dependency)) {
+    add_dependency(dependency.path, env);
+  }
+}
+
+static Value cached_embed(const Tuple *args, Env *env) {
+  check_args_between(1, 2, args, env);
+  Value src_value = args->values[0];
+  if (src_value.type != V_STRING) {
+    arg_type_error(0, V_STRING, args, env);
+    return nil_value;
+  }
+  Value data = nil_value;
+  if (args->size > 1) {
+    data = args->values[1];
+    if (data.type != V_OBJECT) {
+      arg_type_error(1, V_OBJECT, args, env);
+      return nil_value;
+    }
+  }
+  Path *src_path = string_to_src_path(src_value.string_value, env);
+  if (!src_path) {
+    return nil_value;
+  }
+  if (!embed_cache.ctrl) {
+    init_generic_hash_map(&embed_cache, sizeof(EmbedCacheEntry), 0, embed_cache_hash, embed_cache_equals, NULL);
+  }
+  EmbedCacheEntry entry = { .path = src_path, .data_hash = stable_value_hash(INIT_HASH, data) };
+  if (generic_hash_map_get(&embed_cache, &entry, &entry)) {
+    delete_path(src_path);
+    add_cached_dependencies(entry.dependencies, env);
+    return create_string(entry.output, entry.size, env->arena);
+  }
+  Module *module = get_template(src_path, env);
+  Value output = nil_value;
+  if (!module) {
+    env_error(env, -1, "unable to load template");
+    delete_path(src_path);
+    return output;
+  }
+  ManifestPage *dependencies = create_manifest_page(src_path, entry.data_hash);
+  ManifestPage *previous = track_dependencies(dependencies, env->modules);
+  manifest_page_add_dependency(dependencies, src_path);
+  Env *template_env = create_child_env(env);
+  env_def_known(LAYOUT, nil_value, template_env);
+  if (data.type == V_OBJECT) {
+    ObjectIterator it = iterate_object(data.object_value);
+    Value key, value;
+    while (object_iterator_next(&it, &key, &value)) {
+      if (key.type == V_SYMBOL) {
+        env_put(key.symbol_value, value, template_env);
+      }
+    }
+  }
+  output = eval_template(module, template_env);
+  track_dependencies(previous, env->modules);
+  if (previous) {
+    add_cached_dependencies(dependencies, env);
+  }
+  if (output.type == V_STRING) {
+    entry.output = allocate(output.string_value->size + 1);
+    memcpy(entry.output, output.string_value->bytes, output.string_value->size);
+    entry.size = output.string_value->size;
+    entry.dependencies = dependencies;
+    generic_hash_map_add(&embed_cache, &entry);
+  } else {
+    delete_manifest_page(dependencies);
+    delete_path(src_path);
+  }
+  return output;
+}
+
 static Value link(const Tuple *args, Env *env) {
   check_args_between(0, 1, args, env);
   Value path;
@@ -56,7 +167,7 @@ static Value link(const Tuple *args, Env *env) {
       arg_type_error(0, V_STRING, args, env);
       return nil_value;
     }
-  } else if (!env_get(get_symbol("PATH", env->symbol_map), &path, env) || path.type != V_STRING) {
+  } else if (!env_get_known(PATH, &path, env) || path.type != V_STRING) {
     env_error(env, -1, "PATH is not set or not a string");
     return nil_value;
   }
@@ -66,7 +177,7 @@ static Value link(const Tuple *args, Env *env) {
     path = create_string(path.string_value->bytes, path.string_value->size - 11, env->arena);
   }
   Value root_path;
-  if (env_get(get_symbol("ROOT_PATH", env->symbol_map), &root_path, env) && root_path.type == V_STRING) {
+  if (env_get_known(ROOT_PATH, &root_path, env) && root_path.type == V_STRING) {
     return combine_string_paths(root_path.string_value, path.string_value, env);
   }
   return path;
@@ -81,7 +192,7 @@ static Value url(const Tuple *args, Env *env) {
       arg_type_error(0, V_STRING, args, env);
       return nil_value;
     }
-  } else if (!env_get(get_symbol("PATH", env->symbol_map), &path, env) || path.type != V_STRING) {
+  } else if (!env_get_known(PATH, &path, env) || path.type != V_STRING) {
     env_error(env, -1, "PATH is not set or not a string");
     return nil_value;
   }
@@ -91,7 +202,7 @@ static Value url(const Tuple *args, Env *env) {
     path = create_string(path.string_value->bytes, path.string_value->size - 11, env->arena);
   }
   Value root_url;
-  if (env_get(get_symbol("ROOT_URL", env->symbol_map), &root_url, env) && root_url.type == V_STRING) {
+  if (env_get_known(ROOT_URL, &root_url, env) && root_url.type == V_STRING) {
     return combine_string_paths(root_url.string_value, path.string_value, env);
   }
   return path;
@@ -129,6 +240,36 @@ static Value read(const Tuple *args, Env *env) {
   return content;
 }
 
+// Files added with add_static() are already in REVERSE_PATHS, other files are copied to their fingerprinted path
+static Value get_fingerprinted_link(const Path *src_path, const Path *dest_path, Env *env) {
+  Value src_path_string = path_to_string(src_path, env->arena);
+  Value reverse_paths, link;
+  if (env_get_known(REVERSE_PATHS, &reverse_paths, env) && reverse_paths.type == V_OBJECT
+      && object_get(reverse_paths.object_value, src_path_string, &link) && link.type == V_STRING) {
+    return link;
+  }
+  Path *dist_root = get_dist_root(env);
+  if (!dist_root) {
+    env_error(env, -1, "DIST_ROOT missing or not a string");
+    return nil_value;
+  }
+  link = nil_value;
+  Path *fingerprinted_path = get_fingerprinted_path(src_path, dest_path);
+  if (!fingerprinted_path) {
+    env_error(env, -1, "error reading file");
+  } else {
+    copy_asset(src_path, fingerprinted_path);
+    Path *web_path = path_get_relative(dist_root, fingerprinted_path);
+    if (web_path) {
+      link = path_to_string(web_path, env->arena);
+      delete_path(web_path);
+    }
+    delete_path(fingerprinted_path);
+  }
+  delete_path(dist_root);
+  return link;
+}
+
 static Value asset_link(const Tuple *args, Env *env) {
   check_args(1, args, env);
   Value src_value = args->values[0];
@@ -146,16 +287,26 @@ static Value asset_link(const Tuple *args, Env *env) {
     return nil_value;
   }
   load_asset_module(src_path, env);
-  copy_file(src_path->path, dest_path->path);
-  delete_path(src_path);
-  delete_path(dest_path);
+  if (asset_fingerprinting_enabled(env)) {
+    Value link = get_fingerprinted_link(src_path, dest_path, env);
+    delete_path(src_path);
+    delete_path(dest_path);
+    if (link.type != V_STRING) {
+      return nil_value;
+    }
+    src_value = link;
+  } else {
+    copy_file(src_path->path, dest_path->path);
+    delete_path(src_path);
+    delete_path(dest_path);
+  }
   if (string_equals("index.html", src_value.string_value)) {
     src_value = copy_c_string("", env->arena);
   } else if (string_ends_with("/index.html", src_value.string_value)) {
     src_value = create_string(src_value.string_value->bytes, src_value.string_value->size - 11, env->arena);
   }
   Value root_path;
-  if (env_get(get_symbol("ROOT_PATH", env->symbol_map), &root_path, env) && root_path.type == V_STRING) {
+  if (env_get_known(ROOT_PATH, &root_path, env) && root_path.type == V_STRING) {
     return combine_string_paths(root_path.string_value, src_value.string_value, env);
   }
   return src_value;
@@ -170,7 +321,7 @@ static Value page_list(const Tuple *args, Env *env) {
   }
   Value page_obj;
   if (args->size < 3) {
-    if (!env_get(get_symbol("PAGE", env->symbol_map), &page_obj, env) || page_obj.type != V_OBJECT) {
+    if (!env_get_known(PAGE, &page_obj, env) || page_obj.type != V_OBJECT) {
       env_error(env, -1, "PAGE is not set or not an object");
       return nil_value;
     }
@@ -226,7 +377,7 @@ static Value page_link(const Tuple *args, Env *env) {
       arg_type_error(1, V_STRING, args, env);
       return nil_value;
     }
-  } else if (!env_get_symbol("PAGE", &page_obj, env) || page_obj.type != V_OBJECT) {
+  } else if (!env_get_known(PAGE, &page_obj, env) || page_obj.type != V_OBJECT) {
       env_error(env, -1, "PAGE is not set or not an object");
       return nil_value;
   } else if (!object_get_symbol(page_obj.object_value, "path_template", &path) || path.type != V_STRING) {
@@ -249,7 +400,7 @@ static Value page_link(const Tuple *args, Env *env) {
     path = create_string(path.string_value->bytes, path.string_value->size - 11, env->arena);
   }
   Value root_path;
-  if (env_get(get_symbol("ROOT_PATH", env->symbol_map), &root_path, env) && root_path.type == V_STRING) {
+  if (env_get_known(ROOT_PATH, &root_path, env) && root_path.type == V_STRING) {
     return combine_string_paths(root_path.string_value, path.string_value, env);
   }
   return path;
@@ -258,6 +409,7 @@ static Value page_link(const Tuple *args, Env *env) {
 
 void import_template(Env *env) {
   env_def_fn("embed", embed, env);
+  env_def_fn("cached_embed", cached_embed, env);
   env_def_fn("link", link, env);
   env_def_fn("url", url, env);
   env_def_fn("is_current", is_current, env);
@@ -269,7 +421,7 @@ void import_template(Env *env) {
 
 int path_is_current(String *path, Env *env) {
   Value current_path;
-  if (!env_get(get_symbol("PATH", env->symbol_map), &current_path, env) || current_path.type != V_STRING) {
+  if (!env_get_known(PATH, &current_path, env) || current_path.type != V_STRING) {
     return 0;
   }
   if (string_equals("index.html", current_path.string_value)) {
@@ -10,6 +10,7 @@
 #include "value.h"
 
 void import_template(Env *env);
+void clear_embed_cache(void);
 
 int path_is_current(String *path, Env *env);
 
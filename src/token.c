@@ -15,14 +15,25 @@ struct SymbolMap {
   GenericHashMap map;
 };
 
+#define DEFINE_KNOWN_SYMBOL(NAME) \
+  static struct { Hash hash; char name[sizeof(#NAME)]; } known_symbol_##NAME = { 0, #NAME };
+WELL_KNOWN_SYMBOLS(DEFINE_KNOWN_SYMBOL)
+#undef DEFINE_KNOWN_SYMBOL
+
+const KnownSymbols known_symbols = {
+#define REFERENCE_KNOWN_SYMBOL(NAME) .NAME = known_symbol_##NAME.name,
+  WELL_KNOWN_SYMBOLS(REFERENCE_KNOWN_SYMBOL)
+#undef REFERENCE_KNOWN_SYMBOL
+};
+
+#define KNOWN_SYMBOLS_SIZE (sizeof(KnownSymbols) / sizeof(Symbol))
+
+static Hash name_hash(const char *name) {
+  return hash_bytes(name, strlen(name), INIT_HASH);
+}
+
 static Hash symbol_hash(const void *p) {
-  Symbol name = *(Symbol *) p;
-  Hash h = INIT_HASH;
-  while (*name) {
-    h = HASH_ADD_BYTE(*name, h);
-    name++;
-  }
-  return h;
+  return name_hash(*(Symbol *) p);
 }
 
 static int symbol_equals(const void *a, const void *b) {
@@ -32,14 +43,26 @@ static int symbol_equals(const void *a, const void *b) {
 SymbolMap *create_symbol_map(void) {
   SymbolMap *symbol_map = allocate(sizeof(SymbolMap));
   init_generic_hash_map(&symbol_map->map, sizeof(Symbol), 0, symbol_hash, symbol_equals, NULL);
+  const Symbol *known = (const Symbol *) &known_symbols;
+  for (size_t i = 0; i < KNOWN_SYMBOLS_SIZE; i++) {
+    InternedSymbol *entry = (InternedSymbol *) (known[i] - offsetof(InternedSymbol, name));
+    if (!entry->hash) {
+      entry->hash = name_hash(known[i]);
+    }
+    generic_hash_map_add(&symbol_map->map, &known[i]);
+  }
   return symbol_map;
 }
 
 void delete_symbol_map(SymbolMap *symbol_map) {
-  char *symbol;
+  const Symbol *known = (const Symbol *) &known_symbols;
+  for (size_t i = 0; i < KNOWN_SYMBOLS_SIZE; i++) {
+    generic_hash_map_remove(&symbol_map->map, &known[i], NULL);
+  }
+  Symbol symbol;
   HashMapIterator it = generic_hash_map_iterate(&symbol_map->map);
   while (generic_hash_map_next(&it, &symbol)) {
-    free(symbol);
+    free((char *) symbol - offsetof(InternedSymbol, name));
   }
   delete_generic_hash_map(&symbol_map->map);
   free(symbol_map);
@@ -50,7 +73,11 @@ Symbol get_symbol(const char *name, SymbolMap *symbol_map) {
   if (generic_hash_map_get(&symbol_map->map, &name, &symbol)) {
     return symbol;
   }
-  symbol = copy_string(name);
+  size_t length = strlen(name) + 1;
+  InternedSymbol *entry = allocate(sizeof(InternedSymbol) + length);
+  entry->hash = name_hash(name);
+  memcpy(entry->name, name, length);
+  symbol = entry->name;
   generic_hash_map_add(&symbol_map->map, &symbol);
   return symbol;
 }
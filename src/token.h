@@ -7,6 +7,7 @@
 #ifndef TOKEN_H
 #define TOKEN_H
 
+#include "hashmap.h"
 #include "util.h"
 
 #include <stddef.h>
@@ -14,6 +15,71 @@
 
 typedef const char *Symbol;
 
+// Symbols are stored after their hash so that hashing an interned symbol doesn't require reading the name
+typedef struct {
+  Hash hash;
+  char name[];
+} InternedSymbol;
+
+#define SYMBOL_HASH(SYMBOL) (((const InternedSymbol *) ((SYMBOL) - offsetof(InternedSymbol, name)))->hash)
+
+// Symbols used by the C modules. They are added to every symbol map by create_symbol_map, so the same
+// pointers can be used with any symbol map.
+#define WELL_KNOWN_SYMBOLS(X) \
+  X(type) \
+  X(tag) \
+  X(attributes) \
+  X(children) \
+  X(self_closing) \
+  X(line) \
+  X(comment) \
+  X(document) \
+  X(element) \
+  X(fragment) \
+  X(path) \
+  X(src) \
+  X(dest) \
+  X(data) \
+  X(web_path) \
+  X(handler) \
+  X(copy) \
+  X(template) \
+  X(task) \
+  X(name) \
+  X(title) \
+  X(content) \
+  X(html) \
+  X(read_more) \
+  X(toc) \
+  X(includes) \
+  X(inputs) \
+  X(hardlink) \
+  X(fingerprint) \
+  X(modified) \
+  X(relative_path) \
+  X(SRC_ROOT) \
+  X(DIST_ROOT) \
+  X(ROOT_PATH) \
+  X(ROOT_URL) \
+  X(PATH) \
+  X(FILE) \
+  X(DIR) \
+  X(LAYOUT) \
+  X(CONTENT) \
+  X(PAGE) \
+  X(SITE_MAP) \
+  X(REVERSE_PATHS) \
+  X(CONTENT_HANDLERS) \
+  X(OUTPUT_OBSERVERS)
+
+typedef struct {
+#define DECLARE_KNOWN_SYMBOL(NAME) Symbol NAME;
+  WELL_KNOWN_SYMBOLS(DECLARE_KNOWN_SYMBOL)
+#undef DECLARE_KNOWN_SYMBOL
+} KnownSymbols;
+
+extern const KnownSymbols known_symbols;
+
 typedef struct SymbolMap SymbolMap;
 
 typedef struct Token Token;
@@ -4,11 +4,15 @@
  * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
 #include "util.h"
 
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +23,18 @@
 
 #if defined(_WIN32)
 #include <io.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
+#if !defined(O_BINARY)
+#define O_BINARY 0
 #endif
 
 void *allocate(size_t size) {
@@ -39,37 +55,102 @@ void *reallocate(void *old, size_t size) {
   return new;
 }
 
+#define ARENA_SIZE_CLASSES 9
+
+// Chunks released by delete_arena are kept in a pool, one list per power-of-two size class, so that arenas
+// created and deleted for every page don't allocate and free the same memory over and over.
+static Arena *arena_pool[ARENA_SIZE_CLASSES] = {NULL};
+static ArenaStats arena_stats = {0};
+
+static int get_size_class(size_t capacity) {
+  int size_class = 0;
+  size_t class_size = MIN_ARENA_SIZE;
+  while (class_size < capacity) {
+    class_size <<= 1;
+    size_class++;
+  }
+  if (class_size != capacity || size_class >= ARENA_SIZE_CLASSES) {
+    return -1;
+  }
+  return size_class;
+}
+
+static Arena *create_chunk(size_t capacity) {
+  Arena *chunk = NULL;
+  int size_class = get_size_class(capacity);
+  if (size_class >= 0 && arena_pool[size_class]) {
+    chunk = arena_pool[size_class];
+    arena_pool[size_class] = chunk->next;
+    arena_stats.pooled_chunks--;
+    arena_stats.pooled_bytes -= capacity;
+  } else {
+    chunk = allocate(sizeof(Arena) + capacity);
+    arena_stats.mallocs++;
+  }
+  chunk->next = NULL;
+  chunk->last = chunk;
+  chunk->capacity = capacity;
+  chunk->size = 0;
+  arena_stats.chunks++;
+  arena_stats.bytes += capacity;
+  if (arena_stats.bytes > arena_stats.peak_bytes) {
+    arena_stats.peak_bytes = arena_stats.bytes;
+  }
+  return chunk;
+}
+
+static void release_chunk(Arena *chunk) {
+  arena_stats.chunks--;
+  arena_stats.bytes -= chunk->capacity;
+  int size_class = get_size_class(chunk->capacity);
+  if (size_class >= 0 && arena_stats.pooled_bytes + chunk->capacity <= MAX_ARENA_POOL_SIZE) {
+    chunk->next = arena_pool[size_class];
+    arena_pool[size_class] = chunk;
+    arena_stats.pooled_chunks++;
+    arena_stats.pooled_bytes += chunk->capacity;
+  } else {
+    free(chunk);
+  }
+}
+
 Arena *create_arena(void) {
-  Arena *arena = allocate(sizeof(Arena) + MIN_ARENA_SIZE);
-  arena->next = NULL;
-  arena->last = arena;
-  arena->capacity = MIN_ARENA_SIZE;
-  arena->size = 0;
-  return arena;
+  return create_chunk(MIN_ARENA_SIZE);
 }
 
 void delete_arena(Arena *arena) {
-  if (arena->next) {
-    delete_arena(arena->next);
+  while (arena) {
+    Arena *next = arena->next;
+    release_chunk(arena);
+    arena = next;
   }
-  free(arena);
+}
+
+void arena_adopt(Arena *arena, Arena *child) {
+  arena->last->next = child;
+  arena->last = child->last;
 }
 
 void *arena_allocate(size_t size, Arena *arena) {
   if (!arena) {
     return allocate(size);
   }
+  arena_stats.allocated += size;
   Arena *last = arena->last;
   if (size <= last->capacity - last->size) {
     void *p = last->data + last->size;
     last->size += size;
     return p;
   } else {
-    size_t new_size = size > MIN_ARENA_SIZE ? size : MIN_ARENA_SIZE;
-    Arena *new = allocate(sizeof(Arena) + new_size);
-    new->next = NULL;
-    new->last = new;
-    new->capacity = new_size;
+    // Chunks double in size up to MAX_ARENA_CHUNK_SIZE, allocations that are larger than that get a chunk of
+    // their own
+    size_t new_size = last->capacity < MAX_ARENA_CHUNK_SIZE ? last->capacity << 1 : MAX_ARENA_CHUNK_SIZE;
+    while (new_size < size && new_size < MAX_ARENA_CHUNK_SIZE) {
+      new_size <<= 1;
+    }
+    if (new_size < size) {
+      new_size = size;
+    }
+    Arena *new = create_chunk(new_size);
     new->size = size;
     last->next = new;
     last->last = new;
@@ -89,9 +170,34 @@ void *arena_reallocate(void *old, size_t old_size, size_t size, Arena *arena) {
     return new;
   }
   last->size += size - old_size;
+  arena_stats.allocated += size - old_size;
   return old;
 }
 
+size_t get_arena_size(const Arena *arena) {
+  size_t size = 0;
+  for (; arena; arena = arena->next) {
+    size += arena->capacity;
+  }
+  return size;
+}
+
+ArenaStats get_arena_stats(void) {
+  return arena_stats;
+}
+
+void clear_arena_pool(void) {
+  for (int i = 0; i < ARENA_SIZE_CLASSES; i++) {
+    while (arena_pool[i]) {
+      Arena *next = arena_pool[i]->next;
+      free(arena_pool[i]);
+      arena_pool[i] = next;
+    }
+  }
+  arena_stats.pooled_chunks = 0;
+  arena_stats.pooled_bytes = 0;
+}
+
 char *copy_string(const char *src) {
   size_t l = strlen(src) + 1;
   char *dest = allocate(l);
@@ -281,45 +387,241 @@ int is_dir(const char *path) {
   return stat(path, &stat_buffer) == 0 && S_ISDIR(stat_buffer.st_mode);
 }
 
-int copy_file(const char *src_path, const char *dest_path) {
-  FILE *src = fopen(src_path, "r");
-  if (!src) {
-    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "copy error: %s" SGR_RESET "\n", src_path, strerror(errno));
+static int copy_error(const char *path) {
+  fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "copy error: %s" SGR_RESET "\n", path, strerror(errno));
+  return 0;
+}
+
+// Copies the contents of one open file to another, preferring a reflink, then an in-kernel copy and finally a plain
+// read/write loop. Returns 0 and leaves errno set on failure.
+static int copy_file_contents(int src, int dest, off_t size) {
+#if defined(__linux__)
+#if defined(FICLONE)
+  if (ioctl(dest, FICLONE, src) == 0) {
+    return 1;
+  }
+#endif
+  off_t remaining = size;
+  while (remaining > 0) {
+    ssize_t n = copy_file_range(src, NULL, dest, NULL, remaining, 0);
+    if (n <= 0) {
+      break;
+    }
+    remaining -= n;
+  }
+  while (remaining > 0) {
+    ssize_t n = sendfile(dest, src, NULL, remaining);
+    if (n <= 0) {
+      break;
+    }
+    remaining -= n;
+  }
+  if (remaining == 0) {
+    return 1;
+  }
+  // Something went wrong partway through, so start over with the read/write loop
+  if (lseek(src, 0, SEEK_SET) < 0 || lseek(dest, 0, SEEK_SET) < 0 || ftruncate(dest, 0) != 0) {
     return 0;
   }
-  FILE *dest = fopen(dest_path, "w");
+#else
+  (void) size;
+#endif
+  char *buffer = allocate(65536);
   int status = 1;
-  if (!dest) {
-    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "copy error: %s" SGR_RESET "\n", dest_path, strerror(errno));
-    status = 0;
-  } else {
-    char *buffer = allocate(8192);
-    size_t n;
-    do {
-      n = fread(buffer, 1, 8192, src);
-      if (fwrite(buffer, 1, n, dest) != n) {
-        fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "copy error: %s" SGR_RESET "\n", dest_path, strerror(errno));
+  ssize_t n;
+  while ((n = read(src, buffer, 65536)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      status = 0;
+      break;
+    }
+    char *p = buffer;
+    while (n > 0) {
+      ssize_t written = write(dest, p, n);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
         status = 0;
         break;
       }
-    } while (n == 8192);
-    if (status && !feof(src)) {
-      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "copy error: %s" SGR_RESET "\n", src_path, strerror(errno));
-      status = 0;
+      p += written;
+      n -= written;
     }
-    free(buffer);
-    fclose(dest);
+    if (!status) {
+      break;
+    }
+  }
+  free(buffer);
+  return status;
+}
+
+int copy_file(const char *src_path, const char *dest_path) {
+  int src = open(src_path, O_RDONLY | O_BINARY);
+  if (src < 0) {
+    return copy_error(src_path);
   }
-  fclose(src);
+  struct stat stat_buffer;
+  if (fstat(src, &stat_buffer) != 0) {
+    copy_error(src_path);
+    close(src);
+    return 0;
+  }
+  // The destination may be a hard link to the source (see link_file()), so it is replaced rather than truncated
+  unlink(dest_path);
+  int dest = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+  if (dest < 0) {
+    copy_error(dest_path);
+    close(src);
+    return 0;
+  }
+  int status = copy_file_contents(src, dest, stat_buffer.st_size);
+  if (!status) {
+    copy_error(dest_path);
+  }
+  if (close(dest) != 0 && status) {
+    status = copy_error(dest_path);
+  }
+  close(src);
   if (status) {
-    struct stat stat_buffer;
-    if (stat(src_path, &stat_buffer) == 0) {
-      struct utimbuf utime_buffer;
-      utime_buffer.actime = stat_buffer.st_atime;
-      utime_buffer.modtime = stat_buffer.st_mtime;
-      utime(dest_path, &utime_buffer);
+    struct utimbuf utime_buffer;
+    utime_buffer.actime = stat_buffer.st_atime;
+    utime_buffer.modtime = stat_buffer.st_mtime;
+    utime(dest_path, &utime_buffer);
+  }
+  return status;
+}
+
+int link_file(const char *src_path, const char *dest_path) {
+#if !defined(_WIN32)
+  unlink(dest_path);
+  if (link(src_path, dest_path) == 0) {
+    return 1;
+  }
+#endif
+  // Hard links can't cross file systems, so fall back to a copy
+  return copy_file(src_path, dest_path);
+}
+
+int file_has_contents(const char *path, const void *data, size_t size) {
+  struct stat stat_buffer;
+  if (stat(path, &stat_buffer) != 0 || !S_ISREG(stat_buffer.st_mode) || stat_buffer.st_size != size) {
+    return 0;
+  }
+  int fd = open(path, O_RDONLY | O_BINARY);
+  if (fd < 0) {
+    return 0;
+  }
+  char *buffer = allocate(65536);
+  const char *expected = data;
+  size_t offset = 0;
+  int equal = 1;
+  while (equal && offset < size) {
+    ssize_t n = read(fd, buffer, 65536);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0 || offset + n > size || memcmp(buffer, expected + offset, n) != 0) {
+      equal = 0;
+      break;
+    }
+    offset += n;
+  }
+  free(buffer);
+  close(fd);
+  return equal;
+}
+
+uint8_t *map_file(const char *path, size_t *size) {
+  int fd = open(path, O_RDONLY | O_BINARY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat stat_buffer;
+  if (fstat(fd, &stat_buffer) != 0 || stat_buffer.st_size <= 0) {
+    close(fd);
+    return NULL;
+  }
+  *size = stat_buffer.st_size;
+#if defined(_WIN32)
+  uint8_t *data = allocate(*size);
+  if (read(fd, data, *size) != (ssize_t) *size) {
+    free(data);
+    close(fd);
+    return NULL;
+  }
+#else
+  uint8_t *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+#endif
+  close(fd);
+  return data;
+}
+
+void unmap_file(uint8_t *data, size_t size) {
+#if defined(_WIN32)
+  free(data);
+#else
+  munmap(data, size);
+#endif
+}
+
+WriteResult write_file_if_changed(const char *path, const void *data, size_t size) {
+  if (file_has_contents(path, data, size)) {
+    return WRITE_UNCHANGED;
+  }
+  return replace_file(path, data, size) ? WRITE_CHANGED : WRITE_ERROR;
+}
+
+int replace_file(const char *path, const void *data, size_t size) {
+  // The temporary file is in the same directory so that it can be renamed into place
+  Buffer temp_path = create_buffer(0);
+  buffer_printf(&temp_path, "%s.%ld.tmp", path, (long) getpid());
+  buffer_put(&temp_path, '\0');
+  char *temp = (char *) temp_path.data;
+  int status = 1;
+  int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+  if (fd < 0) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "%s" SGR_RESET "\n", temp, strerror(errno));
+    delete_buffer(temp_path);
+    return 0;
+  }
+  const char *p = data;
+  size_t remaining = size;
+  while (remaining > 0) {
+    ssize_t n = write(fd, p, remaining);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      status = 0;
+      break;
+    }
+    p += n;
+    remaining -= n;
+  }
+  if (close(fd) != 0) {
+    status = 0;
+  }
+  if (!status) {
+    fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "write error: %s" SGR_RESET "\n", path, strerror(errno));
+    remove(temp);
+  } else {
+#if defined(_WIN32)
+    remove(path);
+#endif
+    if (rename(temp, path) != 0) {
+      fprintf(stderr, SGR_BOLD "%s: " ERROR_LABEL "write error: %s" SGR_RESET "\n", path, strerror(errno));
+      remove(temp);
+      status = 0;
     }
   }
+  delete_buffer(temp_path);
   return status;
 }
 
@@ -26,6 +26,8 @@
 #define INFO_LABEL SGR_BOLD_CYAN "info: " SGR_RESET SGR_BOLD
 
 #define MIN_ARENA_SIZE 4096
+#define MAX_ARENA_CHUNK_SIZE (1024 * 1024)
+#define MAX_ARENA_POOL_SIZE (64 * 1024 * 1024)
 #define INITIAL_BUFFER_SIZE 32
 
 #if defined(_WIN32)
@@ -51,6 +53,17 @@ struct Arena {
   uint8_t data[];
 };
 
+typedef struct {
+  size_t chunks;
+  size_t bytes;
+  size_t peak_bytes;
+  size_t pooled_chunks;
+  size_t pooled_bytes;
+  size_t mallocs;
+  // Total number of bytes handed out by arena_allocate() and arena_reallocate(), never decreases
+  size_t allocated;
+} ArenaStats;
+
 typedef struct {
   uint8_t *data;
   size_t capacity;
@@ -62,6 +75,12 @@ typedef struct {
   char path[];
 } Path;
 
+typedef enum {
+  WRITE_ERROR,
+  WRITE_CHANGED,
+  WRITE_UNCHANGED
+} WriteResult;
+
 void *allocate(size_t size);
 
 void *reallocate(void *old, size_t size);
@@ -69,9 +88,14 @@ void *reallocate(void *old, size_t size);
 Arena *create_arena(void);
 
 void delete_arena(Arena *arena);
+void arena_adopt(Arena *arena, Arena *child);
 
 void *arena_allocate(size_t size, Arena *arena);
 void *arena_reallocate(void *old, size_t old_size, size_t size, Arena *arena);
+// Total capacity of the chunks in an arena
+size_t get_arena_size(const Arena *arena);
+ArenaStats get_arena_stats(void);
+void clear_arena_pool(void);
 
 char *copy_string(const char *src);
 
@@ -90,6 +114,16 @@ int file_exists(const char *path);
 time_t get_mtime(const char *path);
 int is_dir(const char *path);
 int copy_file(const char *src_path, const char *dest_path);
+// Hard links the destination to the source, falls back to copy_file() if that is not possible
+int link_file(const char *src_path, const char *dest_path);
+// Maps a non-empty file into memory (or reads it where mmap isn't available), returns NULL on error
+uint8_t *map_file(const char *path, size_t *size);
+void unmap_file(uint8_t *data, size_t size);
+int file_has_contents(const char *path, const void *data, size_t size);
+// Writes the data to a temporary file which is then renamed to path, returns 0 on error
+int replace_file(const char *path, const void *data, size_t size);
+// Like replace_file(), unless the file already has that content
+WriteResult write_file_if_changed(const char *path, const void *data, size_t size);
 int mkdir_rec(const char *path);
 int delete_dir(const Path *path);
 
@@ -6,6 +6,7 @@
 
 #include "value.h"
 
+#include "datetime.h"
 #include "util.h"
 
 #include <errno.h>
@@ -14,15 +15,25 @@
 
 #define INITIAL_ARRAY_CAPACITY 16
 
-static NameList *arena_copy_name_list(NameList *list, Arena *arena);
-static Node copy_node(Node node, Arena *arena);
+
+#define OBJECT_INDEX_THRESHOLD 8
 
 struct Object {
   Entry *entries;
   size_t capacity;
   size_t size;
+  GenericHashMap *index;
+  unsigned frozen;
+  int thawed;
 };
 
+typedef struct {
+  Value key;
+  size_t position;
+} IndexEntry;
+
+static void build_object_index(Object *object, Arena *arena);
+
 typedef struct RefStack RefStack;
 struct RefStack {
   RefStack *next;
@@ -30,6 +41,31 @@ struct RefStack {
   void *new;
 };
 
+typedef struct ThawRecord ThawRecord;
+struct ThawRecord {
+  ValueType type;
+  union {
+    Array *array;
+    Object *object;
+  };
+  union {
+    Array array;
+    Object object;
+  } saved;
+  ThawRecord *next;
+};
+
+typedef struct ThawLog ThawLog;
+struct ThawLog {
+  Arena *arena;
+  ThawRecord *records;
+  ThawLog *parent;
+};
+
+// Values are frozen if their frozen field is equal to the current epoch
+static unsigned freeze_epoch = 1;
+static ThawLog *thaw_log = NULL;
+
 static Hash entry_hash(const void *entry) {
   return value_hash(INIT_HASH, ((Entry *) entry)->key);
 }
@@ -38,7 +74,9 @@ static int entry_equals(const void *a, const void *b) {
   return equals(((Entry *) a)->key, ((Entry *) b)->key);
 }
 
-String *empty_string = &(String) { .size = 0 };
+static uint8_t empty_bytes[1];
+
+String *empty_string = &(String) { .size = 0, .bytes = empty_bytes, .storage = NULL };
 
 Env *create_env(Arena *arena, ModuleMap *modules, SymbolMap *symbol_map) {
   Env *env = arena_allocate(sizeof(Env), arena);
@@ -47,12 +85,16 @@ Env *create_env(Arena *arena, ModuleMap *modules, SymbolMap *symbol_map) {
   env->symbol_map = symbol_map;
   env->parent_env = NULL;
   env->calling_node = NULL;
+  env->sequence_call = 0;
   env->error = NULL;
   env->error_arg = -1;
   env->error_level = ENV_ERROR;
   init_generic_hash_map(&env->global, sizeof(Entry), 0, entry_hash, entry_equals, arena);
   env->exports = create_array(0, arena).array_value;
   env->loops = 0;
+  env->function = NULL;
+  env->locals = NULL;
+  env->locals_size = 0;
   return env;
 }
 
@@ -63,10 +105,23 @@ Env *create_child_env(Env *parent) {
 }
 
 void env_put(Symbol symbol, Value value, Env *env) {
+  for (size_t i = 0; i < env->locals_size; i++) {
+    if (env->locals[i].name == symbol) {
+      env->locals[i].defined = 1;
+      env->locals[i].value = value;
+      return;
+    }
+  }
   generic_hash_map_set(&env->global, &(Entry) { .key = create_symbol(symbol), .value = value }, NULL, NULL);\
 }
 
 int env_get(Symbol name, Value *value, Env *env) {
+  for (size_t i = 0; i < env->locals_size; i++) {
+    if (env->locals[i].defined && env->locals[i].name == name) {
+      *value = env->locals[i].value;
+      return 1;
+    }
+  }
   Entry entry;
   if (generic_hash_map_get(&env->global, &(Entry) { .key = create_symbol(name) }, &entry)) {
     *value = entry.value;
@@ -90,8 +145,15 @@ const String *get_env_string(const char *name, Env *env) {
   return value.string_value;
 }
 
+static size_t displayed_errors = 0;
+
+size_t get_displayed_error_count(void) {
+  return displayed_errors;
+}
+
 static void display_env_error_va(Node node, EnvErrorLevel level, int show_line, const char *format, va_list va) {
   va_list va2;
+  displayed_errors++;
   const char *label;
   switch (level) {
     case ENV_INFO:
@@ -265,6 +327,8 @@ int equals(Value a, Value b) {
       return a.function_value == b.function_value;
     case V_CLOSURE:
       return a.closure_value == b.closure_value;
+    case V_LAZY:
+      return a.lazy_value == b.lazy_value;
   }
   return 0;
 }
@@ -289,6 +353,7 @@ int is_truthy(Value value) {
     case V_TIME:
     case V_FUNCTION:
     case V_CLOSURE:
+    case V_LAZY:
       return 1;
   }
   return 0;
@@ -303,22 +368,14 @@ Hash value_hash(Hash h, Value value) {
       h = HASH_ADD_BYTE(value.int_value, h);
       break;
     case V_INT:
-      for (int i = 0; i < sizeof(int64_t); i++) {
-        h = HASH_ADD_BYTE(GET_BYTE(i, value.int_value), h);
-      }
-      break;
     case V_FLOAT:
-      for (int i = 0; i < sizeof(double); i++) {
-        h = HASH_ADD_BYTE(GET_BYTE(i, value.int_value), h);
-      }
+      h = hash_word((uint64_t) value.int_value, h);
       break;
     case V_SYMBOL:
-      h = HASH_ADD_PTR(value.symbol_value, h);
+      h = hash_word(SYMBOL_HASH(value.symbol_value), h);
       break;
     case V_STRING:
-      for (size_t i = 0; i < value.string_value->size; i++) {
-        h = HASH_ADD_BYTE(value.string_value->bytes[i], h);
-      }
+      h = hash_bytes(value.string_value->bytes, value.string_value->size, h);
       break;
     case V_ARRAY:
       for (size_t i = 0; i < value.array_value->size; i++) {
@@ -335,20 +392,73 @@ Hash value_hash(Hash h, Value value) {
       break;
     }
     case V_TIME:
-      for (int i = 0; i < sizeof(time_t); i++) {
-        h = HASH_ADD_BYTE(GET_BYTE(i, value.int_value), h);
-      }
+      h = hash_word((uint64_t) value.int_value, h);
       break;
     case V_FUNCTION:
-      h = HASH_ADD_PTR(value.function_value, h);
+      h = hash_word((uintptr_t) value.function_value, h);
       break;
     case V_CLOSURE:
-      h = HASH_ADD_PTR(value.closure_value, h);
+      h = hash_word((uintptr_t) value.closure_value, h);
+      break;
+    case V_LAZY:
+      h = hash_word((uintptr_t) value.lazy_value, h);
       break;
   }
   return h;
 }
 
+static Hash stable_value_hash_rec(Hash h, Value value, int depth) {
+  if (depth > 64) {
+    return h;
+  }
+  switch (value.type) {
+    case V_SYMBOL:
+      h = HASH_ADD_BYTE(value.type, h);
+      for (const char *c = value.symbol_value; *c; c++) {
+        h = HASH_ADD_BYTE(*c, h);
+      }
+      return h;
+    case V_ARRAY:
+      h = HASH_ADD_BYTE(value.type, h);
+      for (size_t i = 0; i < value.array_value->size; i++) {
+        h = stable_value_hash_rec(h, value.array_value->cells[i], depth + 1);
+      }
+      return h;
+    case V_OBJECT: {
+      h = HASH_ADD_BYTE(value.type, h);
+      // Entries are read directly to avoid evaluating lazy values
+      for (size_t i = 0; i < value.object_value->size; i++) {
+        h = stable_value_hash_rec(h, value.object_value->entries[i].key, depth + 1);
+        h = stable_value_hash_rec(h, value.object_value->entries[i].value, depth + 1);
+      }
+      return h;
+    }
+    case V_LAZY:
+      return HASH_ADD_BYTE(value.type, h);
+    case V_FUNCTION:
+      return HASH_ADD_BYTE(value.type, h);
+    case V_CLOSURE: {
+      h = HASH_ADD_BYTE(value.type, h);
+      Node body = value.closure_value->body;
+      if (body.module.file_name) {
+        for (int32_t i = 0; i < body.module.file_name->size; i++) {
+          h = HASH_ADD_BYTE(body.module.file_name->path[i], h);
+        }
+      }
+      for (int i = 0; i < sizeof(Pos); i++) {
+        h = HASH_ADD_BYTE(GET_BYTE(i, body.start), h);
+      }
+      return h;
+    }
+    default:
+      return value_hash(h, value);
+  }
+}
+
+Hash stable_value_hash(Hash h, Value value) {
+  return stable_value_hash_rec(h, value, 0);
+}
+
 static void *get_existing_ref(RefStack *ref_stack, void *old) {
   while (ref_stack) {
     if (ref_stack->old == old) {
@@ -359,9 +469,9 @@ static void *get_existing_ref(RefStack *ref_stack, void *old) {
   return NULL;
 }
 
-static Value copy_value_detect_cycles(Value value, Env *env, RefStack *ref_stack);
+static Value copy_value_detect_cycles(Value value, Env *env, RefStack *ref_stack, int share);
 
-static Value copy_value_detect_cycles(Value value, Env *env, RefStack *ref_stack) {
+static Value copy_value_detect_cycles(Value value, Env *env, RefStack *ref_stack, int share) {
   switch (value.type) {
     case V_NIL:
     case V_BOOL:
@@ -370,8 +480,14 @@ static Value copy_value_detect_cycles(Value value, Env *env, RefStack *ref_stack
     case V_SYMBOL:
       return value;
     case V_STRING:
+      if (share) {
+        return value;
+      }
       return create_string(value.string_value->bytes, value.string_value->size, env->arena);
     case V_ARRAY: {
+      if (share && value.array_value->frozen == freeze_epoch) {
+        return value;
+      }
       Array *existing = get_existing_ref(ref_stack, value.array_value);
       if (existing) {
         return (Value) { .type = V_ARRAY, .array_value = existing };
@@ -379,30 +495,33 @@ static Value copy_value_detect_cycles(Value value, Env *env, RefStack *ref_stack
       Value copy = create_array(value.array_value->size, env->arena);
       RefStack nested = (RefStack) { .next = ref_stack, .old = value.array_value, .new = copy.array_value };
       for (size_t i = 0; i < value.array_value->size; i++) {
-        array_push(copy.array_value, copy_value_detect_cycles(value.array_value->cells[i], env, &nested), env->arena);
+        array_push(copy.array_value, copy_value_detect_cycles(value.array_value->cells[i], env, &nested, share), env->arena);
       }
       return copy;
     }
     case V_OBJECT: {
+      if (share && value.object_value->frozen == freeze_epoch) {
+        return value;
+      }
       Object *existing = get_existing_ref(ref_stack, value.object_value);
       if (existing) {
         return (Value) { .type = V_OBJECT, .object_value = existing };
       }
       Value copy = create_object(value.object_value->size, env->arena);
       RefStack nested = (RefStack) { .next = ref_stack, .old = value.object_value, .new = copy.object_value };
-      ObjectIterator it = iterate_object(value.object_value);
-      Value entry_key, entry_value;
-      while (object_iterator_next(&it, &entry_key, &entry_value)) {
+      for (size_t i = 0; i < value.object_value->size; i++) {
         copy.object_value->entries[copy.object_value->size] = (Entry) {
-          .key = copy_value_detect_cycles(entry_key, env, &nested),
-          .value = copy_value_detect_cycles(entry_value, env, &nested)
+          .key = copy_value_detect_cycles(value.object_value->entries[i].key, env, &nested, share),
+          .value = copy_value_detect_cycles(value.object_value->entries[i].value, env, &nested, share)
         };
         copy.object_value->size++;
       }
+      build_object_index(copy.object_value, env->arena);
       return copy;
     }
     case V_TIME:
     case V_FUNCTION:
+    case V_LAZY:
       return value;
     case V_CLOSURE: {
       Closure *existing = get_existing_ref(ref_stack, value.closure_value);
@@ -411,15 +530,16 @@ static Value copy_value_detect_cycles(Value value, Env *env, RefStack *ref_stack
       }
       Closure *copy = arena_allocate(sizeof(Closure), env->arena);
       copy->params = value.closure_value->params;
-      copy->body = copy_node(value.closure_value->body, env->arena);
-      copy->free_variables = arena_copy_name_list(value.closure_value->free_variables, env->arena);
+      copy->body = value.closure_value->body;
+      copy->code = value.closure_value->code;
+      copy->free_variables = value.closure_value->free_variables;
       RefStack nested = (RefStack) { .next = ref_stack, .old = value.closure_value, .new = copy };
       copy->env = env;
       for (NameList *name = value.closure_value->free_variables; name; name = name->tail) {
         Value env_value;
         if (!env_get(name->head, &env_value, env)) {
           if (env_get(name->head, &env_value, value.closure_value->env)) {
-            env_put(name->head, copy_value_detect_cycles(env_value, env, &nested), env);
+            env_put(name->head, copy_value_detect_cycles(env_value, env, &nested, share), env);
           }
         }
       }
@@ -430,7 +550,132 @@ static Value copy_value_detect_cycles(Value value, Env *env, RefStack *ref_stack
 }
 
 Value copy_value(Value value, Env *env) {
-  return copy_value_detect_cycles(value, env, NULL);
+  return copy_value_detect_cycles(value, env, NULL, 0);
+}
+
+// Closures are never frozen since they have to be copied into the environment they are called from
+int freeze_value(Value value) {
+  int frozen = 1;
+  switch (value.type) {
+    case V_ARRAY:
+      if (value.array_value->frozen == freeze_epoch) {
+        return 1;
+      }
+      // Marked before visiting the cells in case of cycles
+      value.array_value->frozen = freeze_epoch;
+      for (size_t i = 0; i < value.array_value->size; i++) {
+        frozen &= freeze_value(value.array_value->cells[i]);
+      }
+      if (!frozen) {
+        value.array_value->frozen = 0;
+      }
+      return frozen;
+    case V_OBJECT:
+      if (value.object_value->frozen == freeze_epoch) {
+        return 1;
+      }
+      value.object_value->frozen = freeze_epoch;
+      for (size_t i = 0; i < value.object_value->size; i++) {
+        frozen &= freeze_value(value.object_value->entries[i].key);
+        frozen &= freeze_value(value.object_value->entries[i].value);
+      }
+      if (!frozen) {
+        value.object_value->frozen = 0;
+      }
+      return frozen;
+    case V_CLOSURE:
+      return 0;
+    default:
+      return 1;
+  }
+}
+
+unsigned get_freeze_epoch(void) {
+  return freeze_epoch;
+}
+
+Value share_value(Value value, Env *env) {
+  return copy_value_detect_cycles(value, env, NULL, 1);
+}
+
+void open_thaw_log(Arena *arena) {
+  ThawLog *log = arena_allocate(sizeof(ThawLog), arena);
+  log->arena = arena;
+  log->records = NULL;
+  log->parent = thaw_log;
+  thaw_log = log;
+}
+
+int thaw_log_is_open(void) {
+  return thaw_log != NULL;
+}
+
+void close_thaw_log(Arena *arena) {
+  if (!thaw_log || thaw_log->arena != arena) {
+    return;
+  }
+  for (ThawRecord *record = thaw_log->records; record; record = record->next) {
+    if (record->type == V_ARRAY) {
+      *record->array = record->saved.array;
+    } else {
+      *record->object = record->saved.object;
+    }
+  }
+  thaw_log = thaw_log->parent;
+}
+
+static void unfreeze_all(void) {
+  freeze_epoch++;
+  if (!freeze_epoch) {
+    freeze_epoch = 1;
+  }
+}
+
+static ThawRecord *add_thaw_record(void) {
+  ThawRecord *record = arena_allocate(sizeof(ThawRecord), thaw_log->arena);
+  record->next = thaw_log->records;
+  thaw_log->records = record;
+  return record;
+}
+
+static void thaw_array(Array *array) {
+  if (array->frozen != freeze_epoch || array->thawed) {
+    return;
+  }
+  if (!thaw_log) {
+    unfreeze_all();
+    return;
+  }
+  ThawRecord *record = add_thaw_record();
+  record->type = V_ARRAY;
+  record->array = array;
+  record->saved.array = *array;
+  Value *cells = arena_allocate(array->capacity * sizeof(Value), thaw_log->arena);
+  memcpy(cells, array->cells, array->size * sizeof(Value));
+  array->cells = cells;
+  array->gap = 0;
+  array->shared = 0;
+  array->thawed = 1;
+}
+
+static void thaw_object(Object *object) {
+  if (object->frozen != freeze_epoch || object->thawed) {
+    return;
+  }
+  if (!thaw_log) {
+    unfreeze_all();
+    return;
+  }
+  ThawRecord *record = add_thaw_record();
+  record->type = V_OBJECT;
+  record->object = object;
+  record->saved.object = *object;
+  Entry *entries = arena_allocate(object->capacity * sizeof(Entry), thaw_log->arena);
+  memcpy(entries, object->entries, object->size * sizeof(Entry));
+  object->entries = entries;
+  object->index = NULL;
+  build_object_index(object, thaw_log->arena);
+  object->thawed = 1;
 }
 
 void value_to_string(Value value, Buffer *buffer) {
@@ -458,11 +703,10 @@ void value_to_string(Value value, Buffer *buffer) {
     case V_OBJECT:
       break;
     case V_TIME: {
-      struct tm *t;
+      struct tm t;
       char date[26];
-      t = localtime(&value.time_value);
-      if (t) {
-        if (strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", t)) {
+      if (local_time(value.time_value, &t)) {
+        if (strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", &t)) {
           buffer_printf(buffer, "%s", date);
         } else {
           buffer_printf(buffer, "(invalid time: %s)", strerror(errno));
@@ -474,6 +718,7 @@ void value_to_string(Value value, Buffer *buffer) {
     }
     case V_FUNCTION:
     case V_CLOSURE:
+    case V_LAZY:
       break;
   }
 }
@@ -501,6 +746,8 @@ const char *value_name(ValueType type) {
     case V_FUNCTION:
     case V_CLOSURE:
       return "function";
+    case V_LAZY:
+      return "lazy";
   }
   return "";
 }
@@ -511,6 +758,8 @@ Value create_string(const uint8_t *bytes, size_t size, Arena *arena) {
   }
   String *string = arena_allocate(sizeof(String) + size, arena);
   string->size = size;
+  string->bytes = (uint8_t *) (string + 1);
+  string->storage = NULL;
   memcpy(string->bytes, bytes, size);
   return (Value) { .type = V_STRING, .string_value = string };
 }
@@ -540,6 +789,8 @@ Value allocate_string(size_t size, Arena *arena) {
   }
   String *string = arena_allocate(sizeof(String) + size, arena);
   string->size = size;
+  string->bytes = (uint8_t *) (string + 1);
+  string->storage = NULL;
   return (Value) { .type = V_STRING, .string_value = string };
 }
 
@@ -547,26 +798,97 @@ Value reallocate_string(String *string, size_t size, Arena *arena) {
   if (!size) {
     return (Value) { .type = V_STRING, .string_value = empty_string };
   }
+  if (string->storage || !string->size) {
+    Value copy = allocate_string(size, arena);
+    memcpy(copy.string_value->bytes, string->bytes, string->size < size ? string->size : size);
+    return copy;
+  }
   string = arena_reallocate(string, sizeof(String) + string->size, sizeof(String) + size, arena);
   string->size = size;
+  string->bytes = (uint8_t *) (string + 1);
   return (Value) { .type = V_STRING, .string_value = string };
 }
 
+Value append_string(String *string, const uint8_t *bytes, size_t size, Arena *arena) {
+  if (!size) {
+    return (Value) { .type = V_STRING, .string_value = string };
+  }
+  size_t new_size = string->size + size;
+  StringStorage *storage = string->storage;
+  if (!storage || storage->size != string->size || storage->capacity < new_size) {
+    size_t capacity = new_size;
+    if (storage) {
+      // The string is itself the result of appending, so more is likely to follow
+      capacity = storage->capacity << 1;
+      if (capacity < new_size) {
+        capacity = new_size;
+      }
+    }
+    storage = arena_allocate(sizeof(StringStorage) + capacity, arena);
+    storage->size = string->size;
+    storage->capacity = capacity;
+    memcpy(storage->bytes, string->bytes, string->size);
+  }
+  memcpy(storage->bytes + storage->size, bytes, size);
+  storage->size = new_size;
+  String *result = arena_allocate(sizeof(String), arena);
+  result->size = new_size;
+  result->bytes = storage->bytes;
+  result->storage = storage;
+  return (Value) { .type = V_STRING, .string_value = result };
+}
+
 Value create_array(size_t capacity, Arena *arena) {
   Array *array = arena_allocate(sizeof(Array), arena);
-  array->capacity = capacity < INITIAL_ARRAY_CAPACITY ? INITIAL_ARRAY_CAPACITY : capacity;
+  array->capacity = capacity ? capacity : INITIAL_ARRAY_CAPACITY;
   array->size = 0;
   array->cells = arena_allocate(array->capacity * sizeof(Value), arena);
+  array->gap = 0;
+  array->shared = 0;
+  array->frozen = 0;
+  array->thawed = 0;
   return (Value) { .type = V_ARRAY, .array_value = array };
 }
 
+Value create_array_slice(Array *array, size_t offset, size_t size, Arena *arena) {
+  Array *slice = arena_allocate(sizeof(Array), arena);
+  slice->cells = array->cells + offset;
+  slice->capacity = size;
+  slice->size = size;
+  slice->gap = 0;
+  slice->shared = 1;
+  slice->frozen = 0;
+  slice->thawed = 0;
+  array->shared = 1;
+  return (Value) { .type = V_ARRAY, .array_value = slice };
+}
+
+// Must be called before the cells of an array are modified
+static void prepare_array_write(Array *array, Arena *arena) {
+  thaw_array(array);
+  if (array->shared) {
+    size_t capacity = array->size ? array->size : INITIAL_ARRAY_CAPACITY;
+    Value *cells = arena_allocate(capacity * sizeof(Value), arena);
+    memcpy(cells, array->cells, array->size * sizeof(Value));
+    array->cells = cells;
+    array->capacity = capacity;
+    array->gap = 0;
+    array->shared = 0;
+  }
+}
+
+// Slices never extend beyond the current size of the array they were taken from (see array_pop()), so pushing doesn't
+// require shared cells to be copied
 void array_push(Array *array, Value elem, Arena *arena) {
+  thaw_array(array);
   if (array->size >= array->capacity) {
-    size_t new_capacity = array->capacity << 1;
+    size_t new_capacity = array->capacity ? array->capacity << 1 : INITIAL_ARRAY_CAPACITY;
     Value *new_cells = arena_allocate(new_capacity * sizeof(Value), arena);
-    memcpy(new_cells, array->cells, array->capacity * sizeof(Value));
+    memcpy(new_cells, array->cells, array->size * sizeof(Value));
     array->cells = new_cells;
     array->capacity = new_capacity;
+    array->gap = 0;
+    array->shared = 0;
   }
   array->cells[array->size] = elem;
   array->size++;
@@ -574,31 +896,44 @@ void array_push(Array *array, Value elem, Arena *arena) {
 
 int array_pop(Array *array, Value *elem) {
   if (array->size) {
+    thaw_array(array);
     array->size--;
     *elem = array->cells[array->size];
+    if (array->shared) {
+      // The next push must not overwrite the popped cell since it may be part of a slice
+      array->capacity = array->size;
+    }
     return 1;
   }
   return 0;
 }
 
 void array_unshift(Array *array, Value elem, Arena *arena) {
-  if (array->size >= array->capacity) {
-    size_t new_capacity = array->capacity << 1;
-    Value *new_cells = arena_allocate(new_capacity * sizeof(Value), arena);
-    memcpy(new_cells + 1, array->cells, array->capacity * sizeof(Value));
-    array->cells = new_cells;
+  prepare_array_write(array, arena);
+  if (!array->gap) {
+    // Leaves a gap as large as the array so that repeated calls only copy the cells a logarithmic number of times
+    size_t gap = array->size ? array->size : INITIAL_ARRAY_CAPACITY;
+    size_t new_capacity = array->size < array->capacity ? array->capacity
+      : array->capacity ? array->capacity << 1 : INITIAL_ARRAY_CAPACITY;
+    Value *new_cells = arena_allocate((gap + new_capacity) * sizeof(Value), arena);
+    memcpy(new_cells + gap, array->cells, array->size * sizeof(Value));
+    array->cells = new_cells + gap;
     array->capacity = new_capacity;
-  } else {
-    memmove(array->cells + 1, array->cells, array->size * sizeof(Value));
+    array->gap = gap;
   }
+  array->cells--;
+  array->capacity++;
+  array->gap--;
   array->cells[0] = elem;
   array->size++;
 }
 
 int array_shift(Array *array, Value *elem) {
   if (array->size) {
+    thaw_array(array);
     array->size--;
     array->capacity--;
+    array->gap++;
     *elem = array->cells[0];
     array->cells++;
     return 1;
@@ -606,31 +941,121 @@ int array_shift(Array *array, Value *elem) {
   return 0;
 }
 
-int array_remove(Array *array, int index) {
+int array_remove(Array *array, int index, Arena *arena) {
   if (index >= 0 && index < array->size) {
-    array->size--;
     if (!index) {
+      thaw_array(array);
+      array->size--;
       array->capacity--;
+      array->gap++;
       array->cells++;
-    } else if (index < array->size) {
-      memcpy(array->cells + index, array->cells + index + 1, (array->size - index) * sizeof(Value));
+      return 1;
+    }
+    prepare_array_write(array, arena);
+    array->size--;
+    if (index < array->size) {
+      memmove(array->cells + index, array->cells + index + 1, (array->size - index) * sizeof(Value));
     }
     return 1;
   }
   return 0;
 }
 
+void array_set(Array *array, size_t index, Value elem, Arena *arena) {
+  prepare_array_write(array, arena);
+  array->cells[index] = elem;
+}
+
+static Hash object_key_hash(Hash h, Value key) {
+  switch (key.type) {
+    case V_BOOL:
+      return HASH_ADD_BYTE(!!key.int_value, HASH_ADD_BYTE(V_BOOL, h));
+    case V_FLOAT:
+      if (key.float_value == (int64_t) key.float_value) {
+        return value_hash(h, create_int((int64_t) key.float_value));
+      }
+      return value_hash(h, key);
+    case V_SYMBOL:
+      // Not SYMBOL_HASH since object_get_symbol looks up keys that haven't been interned
+      return hash_bytes(key.symbol_value, strlen(key.symbol_value), HASH_ADD_BYTE(V_SYMBOL, h));
+    case V_ARRAY:
+      h = HASH_ADD_BYTE(V_ARRAY, h);
+      for (size_t i = 0; i < key.array_value->size; i++) {
+        h = object_key_hash(h, key.array_value->cells[i]);
+      }
+      return h;
+    case V_OBJECT:
+      h = HASH_ADD_BYTE(V_OBJECT, h);
+      for (int i = 0; i < sizeof(size_t); i++) {
+        h = HASH_ADD_BYTE(GET_BYTE(i, key.object_value->size), h);
+      }
+      return h;
+    default:
+      return value_hash(h, key);
+  }
+}
+
+static Hash index_entry_hash(const void *entry) {
+  return object_key_hash(INIT_HASH, ((IndexEntry *) entry)->key);
+}
+
+static int index_entry_equals(const void *a, const void *b) {
+  Value key_a = ((IndexEntry *) a)->key;
+  Value key_b = ((IndexEntry *) b)->key;
+  if (key_a.type == V_SYMBOL && key_b.type == V_SYMBOL) {
+    return key_a.symbol_value == key_b.symbol_value || strcmp(key_a.symbol_value, key_b.symbol_value) == 0;
+  }
+  return equals(key_a, key_b);
+}
+
+static void build_object_index(Object *object, Arena *arena) {
+  if (object->index || object->size <= OBJECT_INDEX_THRESHOLD) {
+    return;
+  }
+  object->index = arena_allocate(sizeof(GenericHashMap), arena);
+  init_generic_hash_map(object->index, sizeof(IndexEntry), object->capacity, index_entry_hash, index_entry_equals,
+      arena);
+  for (size_t i = 0; i < object->size; i++) {
+    generic_hash_map_add(object->index, &(IndexEntry) { .key = object->entries[i].key, .position = i });
+  }
+}
+
+static int object_find(Object *object, Value key, size_t *position) {
+  if (object->index) {
+    IndexEntry entry;
+    if (generic_hash_map_get(object->index, &(IndexEntry) { .key = key }, &entry)) {
+      *position = entry.position;
+      return 1;
+    }
+    return 0;
+  }
+  for (size_t i = 0; i < object->size; i++) {
+    if (equals(key, object->entries[i].key)) {
+      *position = i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
 Value create_object(size_t capacity, Arena *arena) {
   Object *object = arena_allocate(sizeof(Object), arena);
-  object->capacity = capacity < INITIAL_ARRAY_CAPACITY ? INITIAL_ARRAY_CAPACITY : capacity;
+  object->capacity = capacity ? capacity : INITIAL_ARRAY_CAPACITY;
   object->size = 0;
   object->entries = arena_allocate(object->capacity * sizeof(Entry), arena);
+  object->index = NULL;
+  object->frozen = 0;
+  object->thawed = 0;
   return (Value) { .type = V_OBJECT, .object_value = object };
 }
 
 void object_put(Object *object, Value key, Value value, Arena *arena) {
-  Value old;
-  object_remove(object, key, &old);
+  thaw_object(object);
+  size_t position;
+  if (object_find(object, key, &position)) {
+    object->entries[position].value = value;
+    return;
+  }
   if (object->size >= object->capacity) {
     size_t new_capacity = object->capacity << 1;
     Entry *new_entries = arena_allocate(new_capacity * sizeof(Entry), arena);
@@ -639,47 +1064,68 @@ void object_put(Object *object, Value key, Value value, Arena *arena) {
     object->capacity = new_capacity;
   }
   object->entries[object->size] = (Entry) { .key = key, .value = value };
+  if (object->index) {
+    generic_hash_map_add(object->index, &(IndexEntry) { .key = key, .position = object->size });
+  }
   object->size++;
+  build_object_index(object, arena);
 }
 
-int object_get(Object *object, Value key, Value *value) {
-  for (size_t i = 0; i < object->size; i++) {
-    if (equals(key, object->entries[i].key)) {
-      if (value) {
-        *value = object->entries[i].value;
-      }
-      return 1;
+static int get_entry_value(Entry *entry, Value *value) {
+  if (entry->value.type == V_LAZY) {
+    Value forced;
+    if (!entry->value.lazy_value->func(entry->key, entry->value.lazy_value->context, &forced)) {
+      return 0;
+    }
+    if (value) {
+      *value = forced;
     }
+  } else if (value) {
+    *value = entry->value;
+  }
+  return 1;
+}
+
+int object_get(Object *object, Value key, Value *value) {
+  size_t position;
+  if (object_find(object, key, &position)) {
+    return get_entry_value(&object->entries[position], value);
   }
   return 0;
 }
 
 int object_get_symbol(Object *object, const char *key, Value *value) {
+  if (object->index) {
+    return object_get(object, (Value) { .type = V_SYMBOL, .symbol_value = key }, value);
+  }
   for (size_t i = 0; i < object->size; i++) {
     if (object->entries[i].key.type == V_SYMBOL && strcmp(object->entries[i].key.symbol_value, key) == 0) {
-      if (value) {
-        *value = object->entries[i].value;
-      }
-      return 1;
+      return get_entry_value(&object->entries[i], value);
     }
   }
   return 0;
 }
 
 int object_remove(Object *object, Value key, Value *value) {
-  for (size_t i = 0; i < object->size; i++) {
-    if (equals(key, object->entries[i].key)) {
-      if (value) {
-        *value = object->entries[i].value;
-      }
-      if (i < object->size - 1) {
-        memmove(&object->entries[i], &object->entries[i + 1], (object->size - i - 1) * sizeof(Entry));
-      }
-      object->size--;
-      return 1;
+  size_t i;
+  if (!object_find(object, key, &i)) {
+    return 0;
+  }
+  thaw_object(object);
+  if (value && !get_entry_value(&object->entries[i], value)) {
+    *value = nil_value;
+  }
+  if (i < object->size - 1) {
+    memmove(&object->entries[i], &object->entries[i + 1], (object->size - i - 1) * sizeof(Entry));
+  }
+  object->size--;
+  if (object->index) {
+    generic_hash_map_clear(object->index);
+    for (size_t j = 0; j < object->size; j++) {
+      generic_hash_map_add(object->index, &(IndexEntry) { .key = object->entries[j].key, .position = j });
     }
   }
-  return 0;
+  return 1;
 }
 
 size_t object_size(Object *object) {
@@ -691,149 +1137,32 @@ ObjectIterator iterate_object(Object *object) {
 }
 
 int object_iterator_next(ObjectIterator *it, Value *key, Value *value) {
-  if (it->next_index < it->object->size) {
-    if (key) {
-      *key = it->object->entries[it->next_index].key;
-    }
-    if (value) {
-      *value = it->object->entries[it->next_index].value;
+  while (it->next_index < it->object->size) {
+    Entry *entry = &it->object->entries[it->next_index++];
+    if (get_entry_value(entry, value)) {
+      if (key) {
+        *key = entry->key;
+      }
+      return 1;
     }
-    it->next_index++;
-    return 1;
   }
   return 0;
 }
 
+Value create_lazy(LazyFunc func, void *context, Arena *arena) {
+  Lazy *lazy = arena_allocate(sizeof(Lazy), arena);
+  lazy->func = func;
+  lazy->context = context;
+  return (Value) { .type = V_LAZY, .lazy_value = lazy };
+}
+
 Value create_closure(NameList *params, NameList *free_variables, Node body, Env *env, Arena *arena) {
   Closure *closure = arena_allocate(sizeof(Closure), arena);
   closure->params = params;
-  closure->body = copy_node(body, arena);
-  closure->free_variables = arena_copy_name_list(free_variables, arena);
+  closure->body = body;
+  closure->code = NULL;
+  closure->free_variables = free_variables;
   closure->env = env;
   return (Value) { .type = V_CLOSURE, .closure_value = closure };
 }
 
-static NodeList *copy_node_list(NodeList *list, Arena *arena) {
-  if (!list) {
-    return NULL;
-  }
-  NodeList *copy = arena_allocate(sizeof(NodeList), arena);
-  copy->size = list->size;
-  copy->tail = copy_node_list(list->tail, arena);
-  copy->head = copy_node(list->head, arena);
-  return copy;
-}
-
-static PropertyList *copy_property_list(PropertyList *list, Arena *arena) {
-  if (!list) {
-    return NULL;
-  }
-  PropertyList *copy = arena_allocate(sizeof(PropertyList), arena);
-  copy->size = list->size;
-  copy->tail = copy_property_list(list->tail, arena);
-  copy->key = copy_node(list->key, arena);
-  copy->value = copy_node(list->value, arena);
-  return copy;
-}
-
-static NameList *arena_copy_name_list(NameList *list, Arena *arena) {
-  if (!list) {
-    return NULL;
-  }
-  NameList *copy = arena_allocate(sizeof(NameList), arena);
-  copy->size = list->size;
-  copy->tail = arena_copy_name_list(list->tail, arena);
-  copy->head = list->head;
-  return copy;
-}
-
-static Node *copy_node_pointer(Node *node, Arena *arena) {
-  if (!node) {
-    return NULL;
-  }
-  Node *copy = arena_allocate(sizeof(Node), arena);
-  *copy = *node;
-  return copy;
-}
-
-static Node copy_node(Node node, Arena *arena) {
-  switch (node.type) {
-    case N_NAME:
-    case N_INT:
-    case N_FLOAT:
-      break;
-    case N_STRING: {
-      uint8_t *bytes = arena_allocate(node.string_value.size, arena);
-      memcpy(bytes, node.string_value.bytes, node.string_value.size);
-      node.string_value.bytes = bytes;
-      break;
-    }
-    case N_LIST:
-      node.list_value = copy_node_list(node.list_value, arena);
-      break;
-    case N_OBJECT:
-      node.object_value = copy_property_list(node.object_value, arena);
-      break;
-    case N_APPLY:
-      node.apply_value.callee = copy_node_pointer(node.apply_value.callee, arena);
-      node.apply_value.args = copy_node_list(node.apply_value.args, arena);
-      break;
-    case N_SUBSCRIPT:
-      node.subscript_value.list = copy_node_pointer(node.subscript_value.list, arena);
-      node.subscript_value.index = copy_node_pointer(node.subscript_value.index, arena);
-      break;
-    case N_DOT:
-      node.dot_value.object = copy_node_pointer(node.dot_value.object, arena);
-      break;
-    case N_PREFIX:
-      node.prefix_value.operand = copy_node_pointer(node.prefix_value.operand, arena);
-      break;
-    case N_INFIX:
-      node.infix_value.left = copy_node_pointer(node.infix_value.left, arena);
-      node.infix_value.right = copy_node_pointer(node.infix_value.right, arena);
-      break;
-    case N_TUPLE:
-      node.tuple_value = arena_copy_name_list(node.tuple_value, arena);
-      break;
-    case N_FN:
-      node.fn_value.params = arena_copy_name_list(node.fn_value.params, arena);
-      node.fn_value.free_variables = arena_copy_name_list(node.fn_value.free_variables, arena);
-      node.fn_value.body = copy_node_pointer(node.fn_value.body, arena);
-      break;
-    case N_IF:
-      node.if_value.cond = copy_node_pointer(node.if_value.cond, arena);
-      node.if_value.cons = copy_node_pointer(node.if_value.cons, arena);
-      node.if_value.alt = copy_node_pointer(node.if_value.alt, arena);
-      break;
-    case N_FOR:
-      node.for_value.collection = copy_node_pointer(node.for_value.collection, arena);
-      node.for_value.body = copy_node_pointer(node.for_value.body, arena);
-      node.for_value.alt = copy_node_pointer(node.for_value.alt, arena);
-      break;
-    case N_SWITCH:
-      node.switch_value.expr = copy_node_pointer(node.switch_value.expr, arena);
-      node.switch_value.default_case = copy_node_pointer(node.switch_value.default_case, arena);
-      node.switch_value.cases = copy_property_list(node.switch_value.cases, arena);
-      break;
-    case N_EXPORT:
-      node.export_value.right = copy_node_pointer(node.export_value.right, arena);
-      break;
-    case N_ASSIGN:
-      node.assign_value.left = copy_node_pointer(node.assign_value.left, arena);
-      node.assign_value.right = copy_node_pointer(node.assign_value.right, arena);
-      break;
-    case N_BLOCK:
-      node.block_value = copy_node_list(node.block_value, arena);
-      break;
-    case N_SUPPRESS:
-      node.suppress_value = copy_node_pointer(node.suppress_value, arena);
-      break;
-    case N_RETURN:
-      node.return_value = copy_node_pointer(node.return_value, arena);
-      break;
-    case N_BREAK:
-    case N_CONTINUE:
-      break;
-  }
-  return node;
-}
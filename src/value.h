@@ -16,16 +16,20 @@
 
 typedef struct Module Module;
 typedef struct ModuleMap ModuleMap;
+typedef struct Bytecode Bytecode;
 
 typedef struct Env Env;
 
 typedef struct Value Value;
 typedef struct String String;
+typedef struct StringStorage StringStorage;
 typedef struct Array Array;
 typedef struct Object Object;
 typedef struct ObjectIterator ObjectIterator;
 typedef struct Entry Entry;
+typedef struct Local Local;
 typedef struct Closure Closure;
+typedef struct Lazy Lazy;
 
 
 typedef struct Tuple Tuple;
@@ -45,12 +49,18 @@ struct Env {
   SymbolMap *symbol_map;
   Env *parent_env;
   Node *calling_node;
+  // Set while calling a collection function whose result is passed directly to another collection function, which
+  // allows it to return a lazy sequence instead of an array, see accepts_sequence()
+  int sequence_call;
   char *error;
   int error_arg;
   EnvErrorLevel error_level;
   GenericHashMap global;
   Array *exports;
   int64_t loops;
+  Bytecode *function;
+  Local *locals;
+  size_t locals_size;
 };
 
 typedef enum {
@@ -65,6 +75,7 @@ struct Module {
   Path *file_name;
   time_t mtime;
   int dirty;
+  Arena *arena;
   union {
     struct {
       void (*import_func)(Env *);
@@ -72,10 +83,14 @@ struct Module {
     struct {
       Node *root;
       int parse_error;
+      Bytecode *code;
     } user_value;
     struct {
       Node *root;
       int parse_error;
+      // Set instead of root if the file was read by parse_data(), frozen and shared by every import
+      Value *value;
+      unsigned epoch;
     } data_value;
     struct {
       int width;
@@ -95,7 +110,8 @@ typedef enum {
   V_OBJECT,
   V_TIME,
   V_FUNCTION,
-  V_CLOSURE
+  V_CLOSURE,
+  V_LAZY
 } ValueType;
 
 struct Value {
@@ -110,6 +126,7 @@ struct Value {
     time_t time_value;
     Value (*function_value)(const Tuple *, Env *);
     Closure *closure_value;
+    Lazy *lazy_value;
   };
 };
 
@@ -129,6 +146,15 @@ struct Value {
 
 struct String {
   size_t size;
+  uint8_t *bytes;
+  // Set for strings created by append_string(), the bytes of which may be followed by room for more bytes
+  StringStorage *storage;
+};
+
+struct StringStorage {
+  // Number of bytes used by the longest string sharing this storage
+  size_t size;
+  size_t capacity;
   uint8_t bytes[];
 };
 
@@ -136,6 +162,13 @@ struct Array {
   Value *cells;
   size_t capacity;
   size_t size;
+  // Number of unused cells before the first cell, which allows array_unshift() to reuse space freed by array_shift()
+  size_t gap;
+  // Set if the cells may be referenced by slices or the array the slice was taken from, in which case they are
+  // copied before they are modified
+  int shared;
+  unsigned frozen;
+  int thawed;
 };
 
 struct ObjectIterator {
@@ -148,13 +181,31 @@ struct Entry {
   Value value;
 };
 
+struct Local {
+  Symbol name;
+  int defined;
+  Value value;
+};
+
 struct Closure {
   NameList *params;
   Node body;
+  Bytecode *code;
   NameList *free_variables;
   Env *env;
 };
 
+typedef int (* LazyFunc)(Value key, void *context, Value *value);
+
+// Lazy values are only stored as object entries. They are evaluated by object_get() and object_iterator_next()
+// every time the entry is read, so the function is responsible for memoizing the result. An entry is treated as
+// missing if the function returns 0. The only other use is the lazy sequences passed between collection functions,
+// which are forced by call_value() before reaching any other function.
+struct Lazy {
+  LazyFunc func;
+  void *context;
+};
+
 struct Tuple {
   size_t size;
   Value values[];
@@ -168,6 +219,8 @@ void env_put(Symbol name, Value value, Env *env);
 
 #define env_def(name, value, env) env_put(get_symbol((name), (env)->symbol_map), (value), (env))
 
+#define env_def_known(name, value, env) env_put(known_symbols.name, (value), (env))
+
 #define env_def_fn(name, func, env) \
   env_put(get_symbol((name), (env)->symbol_map), (Value) { .type = V_FUNCTION, .function_value = (func) }, (env))
 
@@ -214,9 +267,13 @@ int env_get(Symbol name, Value *value, Env *env);
 
 int env_get_symbol(const char *name, Value *value, Env *env);
 
+#define env_get_known(name, value, env) env_get(known_symbols.name, (value), (env))
+
 const String *get_env_string(const char *name, Env *env);
 
 void display_env_error(Node node, EnvErrorLevel level, int show_line, const char *format, ...);
+// Number of errors, warnings and info messages displayed so far
+size_t get_displayed_error_count(void);
 
 void env_error(Env *env, int arg, const char *format, ...);
 
@@ -231,9 +288,21 @@ int equals(Value a, Value b);
 int is_truthy(Value value);
 
 Hash value_hash(Hash h, Value value);
+Hash stable_value_hash(Hash h, Value value);
 
 Value copy_value(Value value, Env *env);
 
+// Frozen arrays and objects can be shared between environments without copying. The first modification of a
+// frozen value while a thaw log is open copies its storage to the arena of the log, closing the log restores the
+// original. Modifications when no log is open unfreeze all values.
+int freeze_value(Value value);
+// Changes whenever all values are unfrozen, a value frozen before then may have been modified since
+unsigned get_freeze_epoch(void);
+Value share_value(Value value, Env *env);
+void open_thaw_log(Arena *arena);
+int thaw_log_is_open(void);
+void close_thaw_log(Arena *arena);
+
 void value_to_string(Value value, Buffer *buffer);
 
 const char *value_name(ValueType type);
@@ -251,8 +320,16 @@ Value allocate_string(size_t size, Arena *arena);
 
 Value reallocate_string(String *string, size_t size, Arena *arena);
 
+// Returns a new string consisting of the given string followed by the given bytes. Repeatedly appending to the
+// result only copies the accumulated bytes when its storage runs out of room, which makes building a string in a
+// loop linear.
+Value append_string(String *string, const uint8_t *bytes, size_t size, Arena *arena);
+
 Value create_array(size_t capacity, Arena *arena);
 
+// Creates an array that shares size cells starting at offset with the given array until either array is modified
+Value create_array_slice(Array *array, size_t offset, size_t size, Arena *arena);
+
 void array_push(Array *array, Value elem, Arena *arena);
 
 int array_pop(Array *array, Value *elem);
@@ -261,7 +338,9 @@ void array_unshift(Array *array, Value elem, Arena *arena);
 
 int array_shift(Array *array, Value *elem);
 
-int array_remove(Array *array, int index);
+int array_remove(Array *array, int index, Arena *arena);
+
+void array_set(Array *array, size_t index, Value elem, Arena *arena);
 
 Value create_object(size_t capacity, Arena *arena);
 
@@ -270,10 +349,15 @@ void object_put(Object *object, Value key, Value value, Arena *arena);
 #define object_def(object, name, value, env) \
   object_put((object), create_symbol(get_symbol((name), (env)->symbol_map)), (value), (env)->arena)
 
+#define object_def_known(object, name, value, env) \
+  object_put((object), create_symbol(known_symbols.name), (value), (env)->arena)
+
 int object_get(Object *object, Value key, Value *value);
 
 int object_get_symbol(Object *object, const char *key, Value *value);
 
+#define object_get_known(object, name, value) object_get((object), create_symbol(known_symbols.name), (value))
+
 int object_remove(Object *object, Value key, Value *value);
 
 size_t object_size(Object *object);
@@ -282,6 +366,8 @@ ObjectIterator iterate_object(Object *object);
 
 int object_iterator_next(ObjectIterator *it, Value *key, Value *value);
 
+Value create_lazy(LazyFunc func, void *context, Arena *arena);
+
 Value create_closure(NameList *params, NameList *free_variables, Node body, Env *env, Arena *arena);
 
 #endif
@@ -0,0 +1,282 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#define _GNU_SOURCE
+#include "watcher.h"
+
+#include "module.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__linux__)
+#define WITH_INOTIFY
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+#endif
+
+#define POLL_INTERVAL_MS 100
+#define SETTLE_MS 50
+
+typedef struct {
+  Path *path;
+  int wd;
+} WatchedPath;
+
+struct Watcher {
+  int fd;
+  GenericHashMap dirs;
+  GenericHashMap files;
+  Path **wd_paths;
+  size_t wd_paths_capacity;
+};
+
+static Hash watched_path_hash(const void *p) {
+  const Path *path = ((const WatchedPath *) p)->path;
+  Hash h = INIT_HASH;
+  for (int32_t i = 0; i < path->size; i++) {
+    h = HASH_ADD_BYTE(path->path[i], h);
+  }
+  return h;
+}
+
+static int watched_path_equals(const void *a, const void *b) {
+  return strcmp(((const WatchedPath *) a)->path->path, ((const WatchedPath *) b)->path->path) == 0;
+}
+
+Watcher *create_watcher(void) {
+  Watcher *watcher = allocate(sizeof(Watcher));
+  watcher->fd = -1;
+  watcher->wd_paths = NULL;
+  watcher->wd_paths_capacity = 0;
+  init_generic_hash_map(&watcher->dirs, sizeof(WatchedPath), 0, watched_path_hash, watched_path_equals, NULL);
+  init_generic_hash_map(&watcher->files, sizeof(WatchedPath), 0, watched_path_hash, watched_path_equals, NULL);
+#if defined(WITH_INOTIFY)
+  watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watcher->fd < 0) {
+    fprintf(stderr, WARN_LABEL "inotify unavailable, polling for changes: %s" SGR_RESET "\n", strerror(errno));
+  }
+#endif
+  return watcher;
+}
+
+void delete_watcher(Watcher *watcher) {
+  WatchedPath dir;
+  HashMapIterator it = generic_hash_map_iterate(&watcher->dirs);
+  while (generic_hash_map_next(&it, &dir)) {
+    delete_path(dir.path);
+  }
+  delete_generic_hash_map(&watcher->dirs);
+  it = generic_hash_map_iterate(&watcher->files);
+  while (generic_hash_map_next(&it, &dir)) {
+    delete_path(dir.path);
+  }
+  delete_generic_hash_map(&watcher->files);
+  if (watcher->wd_paths) {
+    free(watcher->wd_paths);
+  }
+#if defined(WITH_INOTIFY)
+  if (watcher->fd >= 0) {
+    close(watcher->fd);
+  }
+#endif
+  free(watcher);
+}
+
+int get_watcher_fd(Watcher *watcher) {
+  return watcher->fd;
+}
+
+static int poll_changes(ModuleMap **module_maps, size_t n, int timeout_ms) {
+  if (timeout_ms != 0) {
+    struct timespec delay;
+    delay.tv_sec = 0;
+    delay.tv_nsec = POLL_INTERVAL_MS * 1000000L;
+    nanosleep(&delay, NULL);
+  }
+  int changed = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (detect_changes(module_maps[i])) {
+      changed = 1;
+    }
+  }
+  return changed;
+}
+
+#if defined(WITH_INOTIFY)
+
+static void stop_watching(Watcher *watcher, const char *reason) {
+  fprintf(stderr, WARN_LABEL "%s, polling for changes" SGR_RESET "\n", reason);
+  close(watcher->fd);
+  watcher->fd = -1;
+}
+
+static void add_watch(Watcher *watcher, Path *dir_path) {
+  WatchedPath dir = { .path = dir_path };
+  if (generic_hash_map_get(&watcher->dirs, &dir, NULL)) {
+    return;
+  }
+  dir.path = copy_path(dir_path);
+  dir.wd = inotify_add_watch(watcher->fd, dir.path->path, WATCH_MASK | IN_ONLYDIR);
+  if (dir.wd < 0) {
+    if (errno == ENOSPC || errno == ENOMEM) {
+      delete_path(dir.path);
+      stop_watching(watcher, "inotify watch limit reached");
+      return;
+    }
+  } else {
+    if (dir.wd >= watcher->wd_paths_capacity) {
+      size_t capacity = watcher->wd_paths_capacity ? watcher->wd_paths_capacity : 64;
+      while (capacity <= dir.wd) {
+        capacity <<= 1;
+      }
+      watcher->wd_paths = reallocate(watcher->wd_paths, capacity * sizeof(Path *));
+      memset(watcher->wd_paths + watcher->wd_paths_capacity, 0,
+          (capacity - watcher->wd_paths_capacity) * sizeof(Path *));
+      watcher->wd_paths_capacity = capacity;
+    }
+    watcher->wd_paths[dir.wd] = dir.path;
+  }
+  generic_hash_map_add(&watcher->dirs, &dir);
+}
+
+static int add_watches(Watcher *watcher, ModuleMap *module_map) {
+  int added = 0;
+  ModuleIterator it = iterate_modules(module_map);
+  Module *module;
+  while (watcher->fd >= 0 && (module = module_iterator_next(&it))) {
+    if (module->type == M_SYSTEM
+        || generic_hash_map_get(&watcher->files, &(WatchedPath) { .path = module->file_name }, NULL)) {
+      continue;
+    }
+    generic_hash_map_add(&watcher->files, &(WatchedPath) { .path = copy_path(module->file_name), .wd = -1 });
+    added = 1;
+    Path *dir_path = path_get_parent(module->file_name);
+    add_watch(watcher, dir_path);
+    delete_path(dir_path);
+    if (watcher->fd >= 0 && is_dir(module->file_name->path)) {
+      // Directory dependencies (e.g. from list_content) change when entries are added or removed
+      add_watch(watcher, module->file_name);
+    }
+  }
+  return added;
+}
+
+static void remove_watch(Watcher *watcher, int wd) {
+  if (wd < 0 || wd >= watcher->wd_paths_capacity || !watcher->wd_paths[wd]) {
+    return;
+  }
+  WatchedPath dir;
+  if (generic_hash_map_remove(&watcher->dirs, &(WatchedPath) { .path = watcher->wd_paths[wd] }, &dir)) {
+    delete_path(dir.path);
+  }
+  watcher->wd_paths[wd] = NULL;
+}
+
+static int mark_dirty(const Path *path, ModuleMap **module_maps, size_t n) {
+  int changed = 0;
+  for (size_t i = 0; i < n; i++) {
+    Module *module = get_module(path, module_maps[i]);
+    if (module && module->type != M_SYSTEM) {
+      module->dirty = 1;
+      changed = 1;
+    }
+  }
+  return changed;
+}
+
+static int read_events(Watcher *watcher, ModuleMap **module_maps, size_t n) {
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int changed = 0;
+  int overflow = 0;
+  ssize_t length;
+  while ((length = read(watcher->fd, buffer, sizeof(buffer))) > 0) {
+    const struct inotify_event *event;
+    for (char *p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + event->len) {
+      event = (const struct inotify_event *) p;
+      if (event->mask & IN_Q_OVERFLOW) {
+        overflow = 1;
+      } else if (event->mask & IN_IGNORED) {
+        remove_watch(watcher, event->wd);
+      } else if (event->len && event->wd < watcher->wd_paths_capacity && watcher->wd_paths[event->wd]) {
+        Path *path = path_append(watcher->wd_paths[event->wd], event->name);
+        if (mark_dirty(path, module_maps, n)) {
+          changed = 1;
+        }
+        delete_path(path);
+        if ((event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+            && mark_dirty(watcher->wd_paths[event->wd], module_maps, n)) {
+          changed = 1;
+        }
+      }
+    }
+  }
+  if (overflow && poll_changes(module_maps, n, 0)) {
+    changed = 1;
+  }
+  return changed;
+}
+
+static long get_time_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+static int wait_for_events(Watcher *watcher, ModuleMap **module_maps, size_t n, int timeout_ms) {
+  long deadline = timeout_ms > 0 ? get_time_ms() + timeout_ms : 0;
+  struct pollfd pfd = { .fd = watcher->fd, .events = POLLIN };
+  while (1) {
+    int status = poll(&pfd, 1, timeout_ms);
+    if (status < 0 && errno == EINTR) {
+      continue;
+    }
+    if (status <= 0) {
+      return 0;
+    }
+    if (read_events(watcher, module_maps, n)) {
+      // A single save often produces several events, collect them before rebuilding
+      while (poll(&pfd, 1, SETTLE_MS) > 0) {
+        read_events(watcher, module_maps, n);
+      }
+      return 1;
+    }
+    if (timeout_ms > 0) {
+      timeout_ms = deadline - get_time_ms();
+      if (timeout_ms <= 0) {
+        return 0;
+      }
+    }
+  }
+}
+
+#endif
+
+int wait_for_changes(Watcher *watcher, ModuleMap **module_maps, size_t n, int timeout_ms) {
+#if defined(WITH_INOTIFY)
+  if (watcher->fd >= 0) {
+    int added = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (add_watches(watcher, module_maps[i])) {
+        added = 1;
+      }
+    }
+    if (watcher->fd >= 0) {
+      // Files in newly watched directories may have changed before the watch was added
+      if (added && poll_changes(module_maps, n, 0)) {
+        return 1;
+      }
+      return wait_for_events(watcher, module_maps, n, timeout_ms);
+    }
+  }
+#endif
+  return poll_changes(module_maps, n, timeout_ms);
+}
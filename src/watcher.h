@@ -0,0 +1,19 @@
+/* Plet
+ * Copyright (c) 2021 Niels Sonnich Poulsen (http://nielssp.dk)
+ * Licensed under the MIT license.
+ * See the LICENSE file or http://opensource.org/licenses/MIT for more information.
+ */
+
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include "value.h"
+
+typedef struct Watcher Watcher;
+
+Watcher *create_watcher(void);
+void delete_watcher(Watcher *watcher);
+int get_watcher_fd(Watcher *watcher);
+int wait_for_changes(Watcher *watcher, ModuleMap **module_maps, size_t n, int timeout_ms);
+
+#endif
@@ -8,7 +8,10 @@
 
 #include "test.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 typedef struct {
   char *key;
@@ -62,7 +65,111 @@ static void test_iterator(void) {
   delete_generic_hash_map(&dict);
 }
 
+typedef struct {
+  int key;
+  int value;
+} IntEntry;
+
+static Hash int_hash(const void *p) {
+  return hash_word(((IntEntry *) p)->key, INIT_HASH);
+}
+
+static int int_equals(const void *a, const void *b) {
+  return ((IntEntry *) a)->key == ((IntEntry *) b)->key;
+}
+
+static void test_add_remove(void) {
+  GenericHashMap map;
+  init_generic_hash_map(&map, sizeof(IntEntry), 0, int_hash, int_equals, NULL);
+  for (int i = 0; i < 10000; i++) {
+    assert(generic_hash_map_add(&map, &(IntEntry) { .key = i, .value = i * 2 }));
+  }
+  assert(map.size == 10000);
+  assert(!generic_hash_map_add(&map, &(IntEntry) { .key = 42, .value = 0 }));
+  IntEntry entry;
+  for (int i = 0; i < 10000; i++) {
+    assert(generic_hash_map_get(&map, &(IntEntry) { .key = i }, &entry));
+    assert(entry.value == i * 2);
+  }
+  assert(!generic_hash_map_get(&map, &(IntEntry) { .key = 10000 }, &entry));
+  for (int i = 0; i < 10000; i += 2) {
+    assert(generic_hash_map_remove(&map, &(IntEntry) { .key = i }, &entry));
+    assert(entry.value == i * 2);
+  }
+  assert(map.size == 5000);
+  assert(!generic_hash_map_remove(&map, &(IntEntry) { .key = 0 }, NULL));
+  int exists;
+  generic_hash_map_set(&map, &(IntEntry) { .key = 1, .value = 7 }, &exists, &entry);
+  assert(exists);
+  assert(entry.value == 2);
+  generic_hash_map_set(&map, &(IntEntry) { .key = 2, .value = 8 }, &exists, NULL);
+  assert(!exists);
+  assert(map.size == 5001);
+  size_t count = 0;
+  HashMapIterator it = generic_hash_map_iterate(&map);
+  while (generic_hash_map_next(&it, &entry)) {
+    assert(entry.key == 2 || entry.key % 2 == 1);
+    count++;
+  }
+  assert(count == 5001);
+  delete_generic_hash_map(&map);
+}
+
+static void test_tombstones(void) {
+  Arena *arena = create_arena();
+  GenericHashMap map;
+  init_generic_hash_map(&map, sizeof(IntEntry), 0, int_hash, int_equals, arena);
+  for (int i = 0; i < 100000; i++) {
+    assert(generic_hash_map_add(&map, &(IntEntry) { .key = i, .value = i }));
+    assert(generic_hash_map_remove(&map, &(IntEntry) { .key = i }, NULL));
+  }
+  assert(map.size == 0);
+  assert(map.capacity == HASH_MAP_GROUP_SIZE);
+  delete_arena(arena);
+}
+
+static void test_hash_bytes(void) {
+  const char *text = "the quick brown fox jumps over the lazy dog";
+  for (size_t i = 0; i < strlen(text); i++) {
+    assert(hash_bytes(text, i, INIT_HASH) == hash_bytes(text, i, INIT_HASH));
+    assert(hash_bytes(text, i, INIT_HASH) != hash_bytes(text, i + 1, INIT_HASH));
+    assert(hash_bytes(text, i, INIT_HASH) != hash_bytes(text + 1, i, INIT_HASH) || i == 0);
+  }
+  assert(hash_bytes(text, 10, 1) != hash_bytes(text, 10, 2));
+}
+
+static void benchmark_dict(void) {
+  const int n = 100000;
+  char *keys = allocate(n * 16);
+  for (int i = 0; i < n; i++) {
+    snprintf(keys + i * 16, 16, "key%d", i);
+  }
+  GenericHashMap dict;
+  init_generic_hash_map(&dict, sizeof(DictEntry), 0, dict_hash, dict_equals, NULL);
+  clock_t start = clock();
+  for (int i = 0; i < n; i++) {
+    generic_hash_map_add(&dict, &(DictEntry) { .key = keys + i * 16, .value = keys + i * 16 });
+  }
+  clock_t inserted = clock();
+  for (int j = 0; j < 10; j++) {
+    for (int i = 0; i < n; i++) {
+      DictEntry entry;
+      assert(generic_hash_map_get(&dict, &(DictEntry) { .key = keys + i * 16 }, &entry));
+    }
+  }
+  clock_t found = clock();
+  printf(" insert %.0f ns/op, get %.0f ns/op",
+      (double) (inserted - start) * 1e9 / CLOCKS_PER_SEC / n,
+      (double) (found - inserted) * 1e9 / CLOCKS_PER_SEC / n / 10);
+  delete_generic_hash_map(&dict);
+  free(keys);
+}
+
 void test_hashmap(void) {
   run_test(test_iterator);
+  run_test(test_add_remove);
+  run_test(test_tombstones);
+  run_test(test_hash_bytes);
+  run_test(benchmark_dict);
 }
 
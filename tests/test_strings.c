@@ -26,7 +26,67 @@ static void test_string_buffer_put(void) {
   delete_arena(arena);
 }
 
+static void test_json_encode_value(void) {
+  Arena *arena = create_arena();
+  Value array = create_array(0, arena);
+  array_push(array.array_value, nil_value, arena);
+  array_push(array.array_value, true_value, arena);
+  array_push(array.array_value, create_int(0), arena);
+  array_push(array.array_value, create_int(-1234567890123), arena);
+  array_push(array.array_value, create_int(INT64_MIN), arena);
+  array_push(array.array_value, copy_c_string("a\"b\\c\n\x01\x7f\xc3\xa6", arena), arena);
+  Buffer buffer = create_buffer(0);
+  json_encode_value(array, &buffer);
+  const char *expected = "[null,true,0,-1234567890123,-9223372036854775808,\"a\\\"b\\\\c\\n\\u0001\\u007f\xc3\xa6\"]";
+  assert(buffer.size == strlen(expected));
+  assert(memcmp(buffer.data, expected, buffer.size) == 0);
+  delete_buffer(buffer);
+  delete_arena(arena);
+}
+
+static void test_string_replace(void) {
+  Arena *arena = create_arena();
+  Value haystack = copy_c_string("foo bar foo baz fo", arena);
+  Value result = string_replace(copy_c_string("foo", arena).string_value, copy_c_string("x", arena).string_value,
+      haystack.string_value, arena);
+  assert(string_equals("x bar x baz fo", result.string_value));
+  result = string_replace(copy_c_string("qux", arena).string_value, copy_c_string("x", arena).string_value,
+      haystack.string_value, arena);
+  assert(result.string_value == haystack.string_value);
+  result = string_replace(copy_c_string("aa", arena).string_value, copy_c_string("b", arena).string_value,
+      copy_c_string("aaaaa", arena).string_value, arena);
+  assert(string_equals("bba", result.string_value));
+  delete_arena(arena);
+}
+
+static Value replace_all_c(const char **pairs, size_t n, const char *haystack, Arena *arena) {
+  const String *needles[8];
+  const String *replacements[8];
+  for (size_t i = 0; i < n; i++) {
+    needles[i] = copy_c_string(pairs[i * 2], arena).string_value;
+    replacements[i] = copy_c_string(pairs[i * 2 + 1], arena).string_value;
+  }
+  return string_replace_all(needles, replacements, n, copy_c_string(haystack, arena).string_value, arena);
+}
+
+static void test_string_replace_all(void) {
+  Arena *arena = create_arena();
+  const char *entities[] = { "&", "&amp;", "<", "&lt;", ">", "&gt;" };
+  assert(string_equals("&lt;a&gt; &amp;&amp; b", replace_all_c(entities, 3, "<a> && b", arena).string_value));
+  assert(string_equals("no match", replace_all_c(entities, 3, "no match", arena).string_value));
+  const char *prefixes[] = { "a", "1", "ab", "2", "abc", "3", "bcd", "4" };
+  assert(string_equals("x3d2", replace_all_c(prefixes, 4, "xabcdab", arena).string_value));
+  const char *suffixes[] = { "he", "1", "she", "2", "hers", "3" };
+  assert(string_equals("u2rs", replace_all_c(suffixes, 3, "ushers", arena).string_value));
+  const char *partial[] = { "b", "B", "d", "D", "abcdef", "!" };
+  assert(string_equals("aBcDeX", replace_all_c(partial, 3, "abcdeX", arena).string_value));
+  delete_arena(arena);
+}
+
 void test_strings(void) {
   run_test(test_string_buffer_put);
+  run_test(test_json_encode_value);
+  run_test(test_string_replace);
+  run_test(test_string_replace_all);
 }
 
@@ -8,6 +8,7 @@
 
 #include "test.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -50,6 +51,33 @@ static void test_arena_reallocate(void) {
   delete_arena(arena);
 }
 
+static void test_arena_pool(void) {
+  clear_arena_pool();
+  ArenaStats before = get_arena_stats();
+  Arena *arena = create_arena();
+  for (int i = 0; i < 100; i++) {
+    arena_allocate(1000, arena);
+  }
+  ArenaStats grown = get_arena_stats();
+  assert(grown.chunks - before.chunks < 10);
+  assert(grown.bytes - before.bytes >= 100000);
+  assert(grown.peak_bytes >= grown.bytes);
+  delete_arena(arena);
+  ArenaStats deleted = get_arena_stats();
+  assert(deleted.chunks == before.chunks);
+  assert(deleted.pooled_chunks == grown.chunks - before.chunks);
+  arena = create_arena();
+  for (int i = 0; i < 100; i++) {
+    arena_allocate(1000, arena);
+  }
+  assert(get_arena_stats().mallocs == grown.mallocs);
+  char *large = arena_allocate(MAX_ARENA_CHUNK_SIZE + 1, arena);
+  large[MAX_ARENA_CHUNK_SIZE] = 0;
+  delete_arena(arena);
+  clear_arena_pool();
+  assert(get_arena_stats().pooled_bytes == 0);
+}
+
 static void test_buffer_printf(void) {
   Buffer buffer1 = create_buffer(0);
   for (int i = 0; i < 1000; i++) {
@@ -530,9 +558,29 @@ static void test_path_get_relative(void) {
 #endif
 }
 
+static void test_write_file_if_changed(void) {
+  const char *path = "test_write_file_if_changed.tmp";
+  remove(path);
+  assert(write_file_if_changed(path, "foo", 3) == WRITE_CHANGED);
+  assert(write_file_if_changed(path, "foo", 3) == WRITE_UNCHANGED);
+  assert(write_file_if_changed(path, "bar", 3) == WRITE_CHANGED);
+  assert(write_file_if_changed(path, "barbaz", 6) == WRITE_CHANGED);
+  assert(write_file_if_changed(path, "barbaz", 6) == WRITE_UNCHANGED);
+  FILE *f = fopen(path, "r");
+  assert(f);
+  char buffer[16];
+  assert(fread(buffer, 1, sizeof(buffer), f) == 6);
+  assert(memcmp(buffer, "barbaz", 6) == 0);
+  fclose(f);
+  assert(write_file_if_changed(path, "", 0) == WRITE_CHANGED);
+  assert(write_file_if_changed(path, "", 0) == WRITE_UNCHANGED);
+  remove(path);
+}
+
 void test_util(void) {
   run_test(test_arena);
   run_test(test_arena_reallocate);
+  run_test(test_arena_pool);
   run_test(test_buffer_printf);
   run_test(test_create_path);
   run_test(test_copy_path);
@@ -543,5 +591,6 @@ void test_util(void) {
   run_test(test_path_join);
   run_test(test_path_append);
   run_test(test_path_get_relative);
+  run_test(test_write_file_if_changed);
 }
 
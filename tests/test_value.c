@@ -9,13 +9,15 @@
 
 #include "test.h"
 
+#include <string.h>
+
 static void test_env(void) {
   Arena *arena = create_arena();
   ModuleMap *modules = create_module_map();
   SymbolMap *symbol_map = create_symbol_map();
   Env *env = create_env(arena, modules, symbol_map);
   Value value;
-  Symbol sym1 = "foo";
+  Symbol sym1 = get_symbol("foo", symbol_map);
   assert(env_get(sym1, &value, env) == 0);
   Value value1 = create_int(42);
   env_put(sym1, value1, env);
@@ -26,6 +28,20 @@ static void test_env(void) {
   delete_symbol_map(symbol_map);
 }
 
+static void test_known_symbols(void) {
+  SymbolMap *symbol_map = create_symbol_map();
+  assert(get_symbol("tag", symbol_map) == known_symbols.tag);
+  assert(get_symbol("SITE_MAP", symbol_map) == known_symbols.SITE_MAP);
+  Symbol foo = get_symbol("foo", symbol_map);
+  assert(get_symbol("foo", symbol_map) == foo);
+  assert(SYMBOL_HASH(foo) != SYMBOL_HASH(known_symbols.tag));
+  SymbolMap *symbol_map2 = create_symbol_map();
+  assert(get_symbol("tag", symbol_map2) == known_symbols.tag);
+  assert(SYMBOL_HASH(get_symbol("foo", symbol_map2)) == SYMBOL_HASH(foo));
+  delete_symbol_map(symbol_map2);
+  delete_symbol_map(symbol_map);
+}
+
 static void test_array_push(void) {
   Arena *arena = create_arena();
   Value array = create_array(0, arena);
@@ -59,13 +75,13 @@ static void test_array_unshift(void) {
 static void test_array_remove(void) {
   Arena *arena = create_arena();
   Value array = create_array(0, arena);
-  assert(array_remove(array.array_value, 0) == 0);
+  assert(array_remove(array.array_value, 0, arena) == 0);
   for (size_t i = 0; i < 1000; i++) {
     array_push(array.array_value, create_int(i), arena);
   }
-  assert(array_remove(array.array_value, 0) == 1);
-  assert(array_remove(array.array_value, 998) == 1);
-  assert(array_remove(array.array_value, 998) == 0);
+  assert(array_remove(array.array_value, 0, arena) == 1);
+  assert(array_remove(array.array_value, 998, arena) == 1);
+  assert(array_remove(array.array_value, 998, arena) == 0);
   assert(array.array_value->size == 998);
   for (size_t i = 0; i < 998; i++) {
     Value elem = array.array_value->cells[i];
@@ -73,12 +89,70 @@ static void test_array_remove(void) {
     assert(elem.int_value == i + 1);
   }
   for (size_t i = 0; i < 998; i++) {
-    assert(array_remove(array.array_value, array.array_value->size - 1) == 1);
+    assert(array_remove(array.array_value, array.array_value->size - 1, arena) == 1);
   }
   assert(array.array_value->size == 0);
   delete_arena(arena);
 }
 
+static void test_array_shift_unshift(void) {
+  Arena *arena = create_arena();
+  Value array = create_array(0, arena);
+  for (size_t i = 0; i < 100; i++) {
+    array_push(array.array_value, create_int(i), arena);
+  }
+  Value elem;
+  for (size_t i = 0; i < 50; i++) {
+    assert(array_shift(array.array_value, &elem));
+    assert(elem.int_value == i);
+  }
+  Value *cells = array.array_value->cells;
+  for (size_t i = 0; i < 50; i++) {
+    array_unshift(array.array_value, create_int(49 - i), arena);
+  }
+  // The space freed by shifting is reused
+  assert(array.array_value->cells == cells - 50);
+  assert(array.array_value->size == 100);
+  for (size_t i = 0; i < 100; i++) {
+    assert(array.array_value->cells[i].int_value == i);
+  }
+  delete_arena(arena);
+}
+
+static void test_array_slice(void) {
+  Arena *arena = create_arena();
+  Value array = create_array(0, arena);
+  for (size_t i = 0; i < 10; i++) {
+    array_push(array.array_value, create_int(i), arena);
+  }
+  Value elem;
+  Value slice = create_array_slice(array.array_value, 2, 5, arena);
+  assert(slice.array_value->size == 5);
+  assert(slice.array_value->cells == array.array_value->cells + 2);
+  // Modifying the slice doesn't affect the original array
+  array_set(slice.array_value, 0, create_int(42), arena);
+  array_push(slice.array_value, create_int(43), arena);
+  assert(slice.array_value->size == 6);
+  assert(slice.array_value->cells[0].int_value == 42);
+  assert(slice.array_value->cells[5].int_value == 43);
+  assert(array.array_value->cells[2].int_value == 2);
+  assert(array.array_value->cells[7].int_value == 7);
+  // Modifying the original array doesn't affect other slices
+  Value slice2 = create_array_slice(array.array_value, 0, 3, arena);
+  Value slice3 = create_array_slice(array.array_value, 0, 10, arena);
+  assert(array_pop(array.array_value, &elem));
+  assert(array_pop(array.array_value, &elem));
+  array_push(array.array_value, create_int(46), arena);
+  assert(array.array_value->cells[8].int_value == 46);
+  assert(slice3.array_value->cells[8].int_value == 8);
+  array_set(array.array_value, 1, create_int(44), arena);
+  array_unshift(array.array_value, create_int(45), arena);
+  assert(slice2.array_value->cells[1].int_value == 1);
+  assert(array.array_value->cells[0].int_value == 45);
+  assert(array.array_value->cells[2].int_value == 44);
+  delete_arena(arena);
+}
+
 static void test_allocate_string(void) {
   Arena *arena = create_arena();
   Value string = allocate_string(1000, arena);
@@ -109,12 +183,168 @@ static void test_reallocate_string(void) {
   delete_arena(arena);
 }
 
+static void test_append_string(void) {
+  Arena *arena = create_arena();
+  Value a = copy_c_string("foo", arena);
+  Value b = append_string(a.string_value, (uint8_t *) "bar", 3, arena);
+  Value c = append_string(b.string_value, (uint8_t *) "baz", 3, arena);
+  Value d = append_string(c.string_value, (uint8_t *) "qux", 3, arena);
+  assert(d.string_value->size == 12);
+  assert(memcmp(d.string_value->bytes, "foobarbazqux", 12) == 0);
+  // The storage of c has room for d, so they share bytes
+  assert(d.string_value->bytes == c.string_value->bytes);
+  // Appending to c again doesn't overwrite the bytes of d
+  Value e = append_string(c.string_value, (uint8_t *) "!", 1, arena);
+  assert(e.string_value->bytes != c.string_value->bytes);
+  assert(memcmp(e.string_value->bytes, "foobarbaz!", 10) == 0);
+  assert(memcmp(d.string_value->bytes, "foobarbazqux", 12) == 0);
+  assert(c.string_value->size == 9);
+  assert(b.string_value->size == 6);
+  assert(a.string_value->size == 3);
+  for (size_t i = 0; i < 1000; i++) {
+    d = append_string(d.string_value, (uint8_t *) "x", 1, arena);
+  }
+  assert(d.string_value->size == 1012);
+  assert(d.string_value->bytes[1011] == 'x');
+  delete_arena(arena);
+}
+
+static void test_object_put(void) {
+  Arena *arena = create_arena();
+  Value object = create_object(0, arena);
+  for (size_t i = 0; i < 1000; i++) {
+    object_put(object.object_value, create_int(i), create_int(i * 2), arena);
+  }
+  object_put(object.object_value, create_float(10.0), create_int(-1), arena);
+  assert(object_size(object.object_value) == 1000);
+  Value value;
+  for (size_t i = 0; i < 1000; i++) {
+    assert(object_get(object.object_value, create_int(i), &value));
+    assert(value.int_value == (i == 10 ? -1 : i * 2));
+  }
+  assert(!object_get(object.object_value, create_int(1000), NULL));
+  ObjectIterator it = iterate_object(object.object_value);
+  Value key;
+  size_t i = 0;
+  while (object_iterator_next(&it, &key, NULL)) {
+    assert(key.int_value == i);
+    i++;
+  }
+  delete_arena(arena);
+}
+
+static void test_object_remove(void) {
+  Arena *arena = create_arena();
+  SymbolMap *symbol_map = create_symbol_map();
+  Value object = create_object(0, arena);
+  char name[16];
+  for (size_t i = 0; i < 100; i++) {
+    snprintf(name, sizeof(name), "key%zu", i);
+    object_put(object.object_value, create_symbol(get_symbol(name, symbol_map)), create_int(i), arena);
+  }
+  for (size_t i = 0; i < 100; i += 2) {
+    snprintf(name, sizeof(name), "key%zu", i);
+    assert(object_remove(object.object_value, create_symbol(get_symbol(name, symbol_map)), NULL));
+  }
+  assert(object_size(object.object_value) == 50);
+  Value value;
+  for (size_t i = 0; i < 100; i++) {
+    snprintf(name, sizeof(name), "key%zu", i);
+    assert(object_get_symbol(object.object_value, name, &value) == i % 2);
+    if (i % 2) {
+      assert(value.int_value == i);
+    }
+  }
+  delete_arena(arena);
+  delete_symbol_map(symbol_map);
+}
+
+static int get_lazy_int(Value key, void *context, Value *value) {
+  int *calls = context;
+  (*calls)++;
+  if (strcmp(key.symbol_value, "missing") == 0) {
+    return 0;
+  }
+  *value = create_int(42);
+  return 1;
+}
+
+static void test_object_lazy(void) {
+  Arena *arena = create_arena();
+  SymbolMap *symbol_map = create_symbol_map();
+  Value object = create_object(0, arena);
+  int calls = 0;
+  Value lazy = create_lazy(get_lazy_int, &calls, arena);
+  object_put(object.object_value, create_symbol(get_symbol("a", symbol_map)), create_int(1), arena);
+  object_put(object.object_value, create_symbol(get_symbol("lazy", symbol_map)), lazy, arena);
+  object_put(object.object_value, create_symbol(get_symbol("missing", symbol_map)), lazy, arena);
+  Hash hash = stable_value_hash(INIT_HASH, object);
+  assert(calls == 0);
+  Value value;
+  assert(object_get_symbol(object.object_value, "lazy", &value));
+  assert(value.type == V_INT && value.int_value == 42);
+  assert(!object_get_symbol(object.object_value, "missing", &value));
+  assert(calls == 2);
+  size_t entries = 0;
+  ObjectIterator it = iterate_object(object.object_value);
+  while (object_iterator_next(&it, NULL, &value)) {
+    assert(value.type == V_INT);
+    entries++;
+  }
+  assert(entries == 2);
+  assert(stable_value_hash(INIT_HASH, object) == hash);
+  delete_arena(arena);
+  delete_symbol_map(symbol_map);
+}
+
+static void test_frozen_values(void) {
+  Arena *arena = create_arena();
+  Value array = create_array(0, arena);
+  array_push(array.array_value, create_int(1), arena);
+  Value object = create_object(0, arena);
+  object_put(object.object_value, create_int(1), array, arena);
+  assert(freeze_value(object));
+  Arena *page_arena = create_arena();
+  Env *env = create_env(page_arena, NULL, NULL);
+  Value shared = share_value(object, env);
+  assert(shared.object_value == object.object_value);
+  open_thaw_log(page_arena);
+  array_push(array.array_value, create_int(2), page_arena);
+  array_set(array.array_value, 0, create_int(3), page_arena);
+  object_put(object.object_value, create_int(2), create_int(4), page_arena);
+  assert(array.array_value->size == 2);
+  assert(array.array_value->cells[0].int_value == 3);
+  assert(object_size(object.object_value) == 2);
+  close_thaw_log(page_arena);
+  delete_arena(page_arena);
+  assert(array.array_value->size == 1);
+  assert(array.array_value->cells[0].int_value == 1);
+  assert(object_size(object.object_value) == 1);
+  // Modifying a frozen value without a thaw log unfreezes it
+  array_push(array.array_value, create_int(2), arena);
+  assert(array.array_value->size == 2);
+  page_arena = create_arena();
+  env = create_env(page_arena, NULL, NULL);
+  shared = share_value(object, env);
+  assert(shared.object_value != object.object_value);
+  delete_arena(page_arena);
+  delete_arena(arena);
+}
+
 void test_value(void) {
   run_test(test_env);
+  run_test(test_known_symbols);
   run_test(test_array_push);
   run_test(test_array_unshift);
   run_test(test_array_remove);
+  run_test(test_array_shift_unshift);
+  run_test(test_array_slice);
   run_test(test_allocate_string);
   run_test(test_reallocate_string);
+  run_test(test_append_string);
+  run_test(test_object_put);
+  run_test(test_object_remove);
+  run_test(test_object_lazy);
+  run_test(test_frozen_values);
 }
 